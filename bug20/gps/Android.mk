@@ -14,7 +14,9 @@ LOCAL_SHARED_LIBRARIES := \
 # include any shared library dependencies
 
 LOCAL_SRC_FILES += \
-	gps_bug20.c 
+	gps_bug20.c \
+	nmea_parser.c \
+	ubx_parser.c
 
 LOCAL_CFLAGS += \
 # include any needed compile flags
@@ -23,3 +25,75 @@ LOCAL_C_INCLUDES:= \
 # include any needed local header files
 
 include $(BUILD_SHARED_LIBRARY)
+
+# The NMEA and UBX parsers on their own, for replaying and profiling recorded
+# logs on the host.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libnmea_parser
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	nmea_parser.c \
+	ubx_parser.c
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := nmea_replay
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	nmea_replay.c
+
+LOCAL_STATIC_LIBRARIES := \
+	libnmea_parser
+
+LOCAL_LDLIBS += -lm -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# libFuzzer target for the framers, build with a clang that supports
+# -fsanitize=fuzzer and run as "nmea_fuzz <corpus dir>".
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := nmea_fuzz
+LOCAL_MODULE_TAGS := optional
+LOCAL_CLANG := true
+
+# the parsers are built in rather than taken from libnmea_parser, so that
+# they are instrumented for coverage too
+LOCAL_SRC_FILES := \
+	nmea_fuzz.c \
+	nmea_parser.c \
+	ubx_parser.c
+
+LOCAL_CFLAGS += -g -fsanitize=fuzzer,address,undefined
+LOCAL_LDFLAGS += -fsanitize=fuzzer,address,undefined
+LOCAL_LDLIBS += -lm -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# The HAL against a simulated receiver on a pty: checks what it sends through
+# start, stop and fix interval changes. Run as "gps_sim", it exits non-zero
+# on a failed check. Properties are answered by the test itself.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := gps_sim
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	gps_sim.c \
+	gps_bug20.c
+
+LOCAL_C_INCLUDES := \
+	hardware/libhardware_legacy/include
+
+LOCAL_STATIC_LIBRARIES := \
+	libnmea_parser \
+	liblog
+
+LOCAL_LDLIBS += -lpthread -lm -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
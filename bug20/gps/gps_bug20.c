@@ -24,6 +24,7 @@
 #include <pthread.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <math.h>
 #include <time.h>
@@ -38,6 +39,9 @@
 #include <cutils/properties.h>
 #include <hardware_legacy/gps.h>
 
+#include "nmea_parser.h"
+#include "ubx_parser.h"
+
 #define  GPS_DEBUG  0
 
 #define  DFR(...)   LOGD(__VA_ARGS__)
@@ -56,28 +60,12 @@
     DFR("gps status callback: 0x%x", _s); \
   }
 
-/* Nmea Parser stuff */
-#define  NMEA_MAX_SIZE  83
-
 enum {
   STATE_QUIT  = 0,
   STATE_INIT  = 1,
   STATE_START = 2
 };
 
-typedef struct {
-    int     pos;
-    int     overflow;
-    int     utc_year;
-    int     utc_mon;
-    int     utc_day;
-    int     utc_diff;
-    GpsLocation  fix;
-    GpsSvStatus  sv_status;
-    int     sv_status_changed;
-    char    in[ NMEA_MAX_SIZE+1 ];
-} NmeaReader;
-
 /* Since NMEA parser requires lcoks */
 #define GPS_STATE_LOCK_FIX(_s)         \
 {                                      \
@@ -95,11 +83,14 @@ typedef struct {
     int                     fd;
     GpsCallbacks            callbacks;
     pthread_t               thread;
-    pthread_t               tmr_thread;
     int                     control[2];
-    int                     fix_freq;
+    int                     fix_interval;   /* ms, 0 single shot, -1 none */
+    int                     ubx;            /* UBX binary output, not NMEA */
     sem_t                   fix_sem;
     int                     first_fix;
+    int                     epochs;         /* reader epochs seen */
+    int                     fix_pending;    /* held back by fix_interval */
+    long long               next_fix;       /* ms, CLOCK_MONOTONIC */
     NmeaReader              reader;
 
 } GpsState;
@@ -114,726 +105,131 @@ static GpsState *gps_state = _gps_state;
 
 static void gps_dev_init(int fd);
 static void gps_dev_deinit(int fd);
-static void gps_dev_start(int fd);
+static void gps_dev_start(int fd, int interval, int ubx);
+static void gps_dev_set_rate(int fd, int interval, int ubx);
 static void gps_dev_stop(int fd);
-static void *gps_timer_thread( void*  arg );
 
 /*****************************************************************/
 /*****************************************************************/
 /*****                                                       *****/
-/*****       N M E A   T O K E N I Z E R                     *****/
+/*****       F I X   R E P O R T I N G                       *****/
 /*****                                                       *****/
 /*****************************************************************/
 /*****************************************************************/
 
-typedef struct {
-    const char*  p;
-    const char*  end;
-} Token;
-
-#define  MAX_NMEA_TOKENS  32
-
-typedef struct {
-    int     count;
-    Token   tokens[ MAX_NMEA_TOKENS ];
-} NmeaTokenizer;
-
-static int
-nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
-{
-    int    count = 0;
-    char*  q;
-
-    // the initial '$' is optional
-    if (p < end && p[0] == '$')
-        p += 1;
-
-    // remove trailing newline
-    if (end > p && end[-1] == '\n') {
-        end -= 1;
-        if (end > p && end[-1] == '\r')
-            end -= 1;
-    }
-
-    // get rid of checksum at the end of the sentecne
-    if (end >= p+3 && end[-3] == '*') {
-        end -= 3;
-    }
-
-    while (p < end) {
-        const char*  q = p;
-
-        q = memchr(p, ',', end-p);
-        if (q == NULL)
-            q = end;
-
-        if (count < MAX_NMEA_TOKENS) {
-            t->tokens[count].p   = p;
-            t->tokens[count].end = q;
-            count += 1;
-        }
-
-        if (q < end)
-            q += 1;
-
-        p = q;
-    }
-
-    t->count = count;
-    return count;
-}
-
-static Token
-nmea_tokenizer_get( NmeaTokenizer*  t, int  index )
-{
-    Token  tok;
-    static const char*  dummy = "";
-
-    if (index < 0 || index >= t->count) {
-        tok.p = tok.end = dummy;
-    } else
-        tok = t->tokens[index];
-
-    return tok;
-}
-
-
-static int
-str2int( const char*  p, const char*  end )
-{
-    int   result = 0;
-    int   len    = end - p;
-
-    if (len == 0) {
-      return -1;
-    }
-
-    for ( ; len > 0; len--, p++ )
-    {
-        int  c;
-
-        if (p >= end)
-            goto Fail;
-
-        c = *p - '0';
-        if ((unsigned)c >= 10)
-            goto Fail;
-
-        result = result*10 + c;
-    }
-    return  result;
-
-Fail:
-    return -1;
-}
-
-static double
-str2float( const char*  p, const char*  end )
-{
-    int   result = 0;
-    int   len    = end - p;
-    char  temp[16];
-
-    if (len == 0) {
-      return -1.0;
-    }
-
-    if (len >= (int)sizeof(temp))
-        return 0.;
-
-    memcpy( temp, p, len );
-    temp[len] = 0;
-    return strtod( temp, NULL );
-}
-
-/** @desc Convert struct tm to time_t (time zone neutral).
- *
- * The one missing function in libc: It works basically like mktime, with the main difference that
- * it does no time zone-related processing but interprets the members of the struct tm as UTC.
- * Unlike mktime, it will not modify any fields of the tm structure; if you need this behavior, call
- * mktime before this function.
- *
- * @param t Pointer to a struct tm containing date and time. Only the tm_year, tm_mon, tm_mday,
- * tm_hour, tm_min and tm_sec members will be evaluated, all others will be ignored.
- *
- * @return The epoch time (seconds since 1970-01-01 00:00:00 UTC) which corresponds to t.
- *
- * @author Originally written by Philippe De Muyter <phdm@macqel.be> for Lynx.
- * http://lynx.isc.org/current/lynx2-8-8/src/mktime.c
+/* the parser has its own fix types so that it builds without the HAL
+ * headers, copy them over before calling up. Called with the fix lock held.
  */
-
-static time_t
-mkgmtime(struct tm *t)
-{
-    short month, year;
-    time_t result;
-    static int m_to_d[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
-
-    month = t->tm_mon;
-    year = t->tm_year + month / 12 + 1900;
-    month %= 12;
-    if (month < 0) {
-	    year -= 1;
-	    month += 12;
-    }
-    result = (year - 1970) * 365 + m_to_d[month];
-    if (month <= 1)
-	    year -= 1;
-    result += (year - 1968) / 4;
-    result -= (year - 1900) / 100;
-    result += (year - 1600) / 400;
-    result += t->tm_mday;
-    result -= 1;
-    result *= 24;
-    result += t->tm_hour;
-    result *= 60;
-    result += t->tm_min;
-    result *= 60;
-    result += t->tm_sec;
-    return (result);
-}
-
-/*****************************************************************/
-/*****************************************************************/
-/*****                                                       *****/
-/*****       N M E A   P A R S E R                           *****/
-/*****                                                       *****/
-/*****************************************************************/
-/*****************************************************************/
-
 static void
-nmea_reader_update_utc_diff( NmeaReader*  r )
+gps_state_report_fix( GpsState*  s )
 {
-    time_t         now = time(NULL);
-    struct tm      tm_local;
-    struct tm      tm_utc;
-    long           time_local, time_utc;
-
-    gmtime_r( &now, &tm_utc );
-    localtime_r( &now, &tm_local );
-
-    time_local = mktime(&tm_local);
-    time_utc = mktime(&tm_utc);
-
-    r->utc_diff = time_local - time_utc;
+    NmeaFix*     f = &s->reader.fix;
+    GpsLocation  loc;
+
+    memset(&loc, 0, sizeof(loc));
+    loc.flags     = f->flags;
+    loc.latitude  = f->latitude;
+    loc.longitude = f->longitude;
+    loc.altitude  = f->altitude;
+    loc.speed     = f->speed;
+    loc.bearing   = f->bearing;
+    loc.accuracy  = f->accuracy;
+    loc.timestamp = f->timestamp;
+
+    s->callbacks.location_cb( &loc );
+    f->flags = 0;
 }
 
-
 static void
-nmea_reader_init( NmeaReader*  r )
-{
-    memset( r, 0, sizeof(*r) );
-
-    r->pos      = 0;
-    r->overflow = 0;
-    r->utc_year = -1;
-    r->utc_mon  = -1;
-    r->utc_day  = -1;
-
-    // not sure if we still need this (this module doesn't use utc_diff)
-    nmea_reader_update_utc_diff( r );
-}
-
-static int
-nmea_reader_update_time( NmeaReader*  r, Token  tok )
+gps_state_report_sv_status( GpsState*  s )
 {
-    int        hour, minute, seconds, milliseconds;
-    struct tm  tm;
-    time_t     fix_time;
-
-    if (tok.p + 6 > tok.end)
-        return -1;
-
-    if (r->utc_year < 0) {
-        // no date, can't return valid timestamp (never ever make up a date, this could wreak havoc)
-        return -1;
+    NmeaSvStatus*  sv = &s->reader.sv_status;
+    GpsSvStatus    status;
+    int            i;
+
+    memset(&status, 0, sizeof(status));
+    status.num_svs = sv->num_svs;
+    for (i = 0; i < sv->num_svs && i < GPS_MAX_SVS; i++) {
+        status.sv_list[i].prn       = sv->sv_list[i].prn;
+        status.sv_list[i].snr       = sv->sv_list[i].snr;
+        status.sv_list[i].elevation = sv->sv_list[i].elevation;
+        status.sv_list[i].azimuth   = sv->sv_list[i].azimuth;
     }
-    else
-    {
-        tm.tm_year = r->utc_year - 1900;
-        tm.tm_mon  = r->utc_mon - 1;
-        tm.tm_mday = r->utc_day;
-    }
-
-    hour    = str2int(tok.p,   tok.p+2);
-    minute  = str2int(tok.p+2, tok.p+4);
-    seconds = str2int(tok.p+4, tok.p+6);
+    status.used_in_fix_mask = sv->used_in_fix_mask;
 
-    // parse also milliseconds (if present) for better precision
-    milliseconds = 0;
-    if (tok.end - (tok.p+7) == 2) {
-        milliseconds = str2int(tok.p+7, tok.end) * 10;
-    }
-    else if (tok.end - (tok.p+7) == 1) {
-        milliseconds = str2int(tok.p+7, tok.end) * 100;
-    }
-    else if (tok.end - (tok.p+7) >= 3) {
-        milliseconds = str2int(tok.p+7, tok.p+10);
-    }
-
-    // the following is only guaranteed to work if we have previously set a correct date, so be sure
-    // to always do that before
-
-    tm.tm_hour = hour;
-    tm.tm_min  = minute;
-    tm.tm_sec  = seconds;
-
-    fix_time = mkgmtime( &tm );
-
-    r->fix.timestamp = (long long)fix_time * 1000 + milliseconds;
-    return 0;
+    s->callbacks.sv_status_cb( &status );
+    s->reader.sv_status_changed = 0;
 }
 
-static int
-nmea_reader_update_cdate( NmeaReader*  r, Token  tok_d, Token tok_m, Token tok_y )
+static long long
+gps_now_ms( void )
 {
+    struct timespec  ts;
 
-    if ( (tok_d.p + 2 > tok_d.end) ||
-         (tok_m.p + 2 > tok_m.end) ||
-         (tok_y.p + 4 > tok_y.end) )
-        return -1;
-
-    r->utc_day = str2int(tok_d.p,   tok_d.p+2);
-    r->utc_mon = str2int(tok_m.p, tok_m.p+2);
-    r->utc_year = str2int(tok_y.p, tok_y.p+4);
-
-    return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static int
-nmea_reader_update_date( NmeaReader*  r, Token  date, Token  time )
-{
-    Token  tok = date;
-    int    day, mon, year;
-
-    if (tok.p + 6 != tok.end) {
-        D("date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
-        return -1;
-    }
-    day  = str2int(tok.p, tok.p+2);
-    mon  = str2int(tok.p+2, tok.p+4);
-    year = str2int(tok.p+4, tok.p+6) + 2000;
-
-    if ((day|mon|year) < 0) {
-        D("date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
-        return -1;
-    }
-
-    r->utc_year  = year;
-    r->utc_mon   = mon;
-    r->utc_day   = day;
-
-    return nmea_reader_update_time( r, time );
-}
-
-
-static double
-convert_from_hhmm( Token  tok )
-{
-    double  val     = str2float(tok.p, tok.end);
-    int     degrees = (int)(floor(val) / 100);
-    double  minutes = val - degrees*100.;
-    double  dcoord  = degrees + minutes / 60.0;
-    return dcoord;
-}
-
-
-static int
-nmea_reader_update_latlong( NmeaReader*  r,
-                            Token        latitude,
-                            char         latitudeHemi,
-                            Token        longitude,
-                            char         longitudeHemi )
-{
-    double   lat, lon;
-    Token    tok;
-
-    tok = latitude;
-    if (tok.p + 6 > tok.end) {
-        D("latitude is too short: '%.*s'", tok.end-tok.p, tok.p);
-        return -1;
-    }
-    lat = convert_from_hhmm(tok);
-    if (latitudeHemi == 'S')
-        lat = -lat;
-
-    tok = longitude;
-    if (tok.p + 6 > tok.end) {
-        D("longitude is too short: '%.*s'", tok.end-tok.p, tok.p);
-        return -1;
-    }
-    lon = convert_from_hhmm(tok);
-    if (longitudeHemi == 'W')
-        lon = -lon;
-
-    r->fix.flags    |= GPS_LOCATION_HAS_LAT_LONG;
-    r->fix.latitude  = lat;
-    r->fix.longitude = lon;
-    return 0;
-}
-
-
-static int
-nmea_reader_update_altitude( NmeaReader*  r,
-                             Token        altitude,
-                             Token        units )
-{
-    double  alt;
-    Token   tok = altitude;
-
-    if (tok.p >= tok.end)
-        return -1;
-
-    r->fix.flags   |= GPS_LOCATION_HAS_ALTITUDE;
-    r->fix.altitude = str2float(tok.p, tok.end);
-    return 0;
-}
-
-static int
-nmea_reader_update_accuracy( NmeaReader*  r,
-                             Token        accuracy )
-{
-    double  acc;
-    Token   tok = accuracy;
-
-    if (tok.p >= tok.end)
-        return -1;
-
-    r->fix.accuracy = str2float(tok.p, tok.end);
-
-    if (r->fix.accuracy == 99.99){
-      return 0;
-    }
-
-    r->fix.flags   |= GPS_LOCATION_HAS_ACCURACY;
-    return 0;
-}
-
-static int
-nmea_reader_update_bearing( NmeaReader*  r,
-                            Token        bearing )
-{
-    double  alt;
-    Token   tok = bearing;
-
-    if (tok.p >= tok.end)
-        return -1;
-
-    r->fix.flags   |= GPS_LOCATION_HAS_BEARING;
-    r->fix.bearing  = str2float(tok.p, tok.end);
-    return 0;
-}
-
-
-static int
-nmea_reader_update_speed( NmeaReader*  r,
-                          Token        speed )
-{
-    double  alt;
-    Token   tok = speed;
-
-    if (tok.p >= tok.end)
-        return -1;
-
-    r->fix.flags   |= GPS_LOCATION_HAS_SPEED;
-    // convert knots into m/sec (1 knot equals 1.852 km/h, 1 km/h equals 3.6 m/s)
-    // since 1.852 / 3.6 is an odd value (periodic), we're calculating the quotient on the fly
-    // to obtain maximum precision (we don't want 1.9999 instead of 2)
-    r->fix.speed    = str2float(tok.p, tok.end) * 1.852 / 3.6;
-    return 0;
-}
-
-
+/* called once an epoch is complete, and when a held back fix is due.
+ * Reports right away unless the last report was less than fix_interval ago,
+ * in which case the fix is held until then; gps_state_thread sleeps no
+ * longer than that. Called with the fix lock held.
+ */
 static void
-nmea_reader_parse( NmeaReader*  r )
+gps_state_deliver( GpsState*  s )
 {
-   /* we received a complete sentence, now parse it to generate
-    * a new GPS fix...
-    */
-    NmeaTokenizer  tzer[1];
-    Token          tok;
+    long long  now;
+    int        reported = 0;
 
-    D("Received: '%.*s'", r->pos, r->in);
+    s->fix_pending = 0;
 
-    if (r->pos < 9) {
-        D("Too short. discarded.");
+    // not configured, or the single shot fix has already been sent
+    if (s->init != STATE_START || s->fix_interval < 0)
         return;
-    }
 
-    nmea_tokenizer_init(tzer, r->in, r->in + r->pos);
+    now = gps_now_ms();
 
-    tok = nmea_tokenizer_get(tzer, 0);
+    // fix_interval may have been lowered since the last report
+    if (s->next_fix > now + s->fix_interval)
+        s->next_fix = now;
 
-    if (tok.p + 5 > tok.end) {
-        D("sentence id '%.*s' too short, ignored.", tok.end-tok.p, tok.p);
+    if (now < s->next_fix) {
+        s->fix_pending = 1;
         return;
     }
 
-    // ignore first two characters.
-    tok.p += 2;
-
-    if ( !memcmp(tok.p, "GGA", 3) ) {
-        // GPS fix
-        Token  tok_fixstaus      = nmea_tokenizer_get(tzer,6);
-
-        if ((tok_fixstaus.p[0] > '0') && (r->utc_year >= 0)) {
-          // ignore this until we have a valid timestamp
-
-          Token  tok_time          = nmea_tokenizer_get(tzer,1);
-          Token  tok_latitude      = nmea_tokenizer_get(tzer,2);
-          Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,3);
-          Token  tok_longitude     = nmea_tokenizer_get(tzer,4);
-          Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,5);
-          Token  tok_altitude      = nmea_tokenizer_get(tzer,9);
-          Token  tok_altitudeUnits = nmea_tokenizer_get(tzer,10);
-
-          // don't use this as we have no fractional seconds and no date; there are better ways to
-          // get a good timestamp from GPS
-          //nmea_reader_update_time(r, tok_time);
-          nmea_reader_update_latlong(r, tok_latitude,
-                                        tok_latitudeHemi.p[0],
-                                        tok_longitude,
-                                        tok_longitudeHemi.p[0]);
-          nmea_reader_update_altitude(r, tok_altitude, tok_altitudeUnits);
-        }
-
-    } else if ( !memcmp(tok.p, "GLL", 3) ) {
-
-        Token  tok_fixstaus      = nmea_tokenizer_get(tzer,6);
-
-        if ((tok_fixstaus.p[0] == 'A') && (r->utc_year >= 0)) {
-          // ignore this until we have a valid timestamp
-
-          Token  tok_latitude      = nmea_tokenizer_get(tzer,1);
-          Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,2);
-          Token  tok_longitude     = nmea_tokenizer_get(tzer,3);
-          Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,4);
-          Token  tok_time          = nmea_tokenizer_get(tzer,5);
-
-          // don't use this as we have no fractional seconds and no date; there are better ways to
-          // get a good timestamp from GPS
-          //nmea_reader_update_time(r, tok_time);
-          nmea_reader_update_latlong(r, tok_latitude,
-                                        tok_latitudeHemi.p[0],
-                                        tok_longitude,
-                                        tok_longitudeHemi.p[0]);
-        }
-
-    } else if ( !memcmp(tok.p, "GSA", 3) ) {
-
-        Token  tok_fixStatus   = nmea_tokenizer_get(tzer, 2);
-        int i;
-
-        if (tok_fixStatus.p[0] != '\0' && tok_fixStatus.p[0] != '1') {
-
-          Token  tok_accuracy      = nmea_tokenizer_get(tzer, 15);
-
-          nmea_reader_update_accuracy(r, tok_accuracy);
-
-          r->sv_status.used_in_fix_mask = 0ul;
-
-          for (i = 3; i <= 14; ++i){
-
-            Token  tok_prn  = nmea_tokenizer_get(tzer, i);
-            int prn = str2int(tok_prn.p, tok_prn.end);
-
-            if (prn > 0){
-              r->sv_status.used_in_fix_mask |= (1ul << (32 - prn));
-              r->sv_status_changed = 1;
-              D("%s: fix mask is %d", __FUNCTION__, r->sv_status.used_in_fix_mask);
-            }
-
-          }
-
-        }
-
-    } else if ( !memcmp(tok.p, "GSV", 3) ) {
-
-        Token  tok_noSatellites  = nmea_tokenizer_get(tzer, 3);
-        int    noSatellites = str2int(tok_noSatellites.p, tok_noSatellites.end);
-       
-        if (noSatellites > 0) {
-
-          Token  tok_noSentences   = nmea_tokenizer_get(tzer, 1);
-          Token  tok_sentence      = nmea_tokenizer_get(tzer, 2);
-
-          int sentence = str2int(tok_sentence.p, tok_sentence.end);
-          int totalSentences = str2int(tok_noSentences.p, tok_noSentences.end);
-          int curr;
-          int i;
-          
-          if (sentence == 1) {
-              r->sv_status_changed = 0;
-              r->sv_status.num_svs = 0;
-          }
-
-          curr = r->sv_status.num_svs;
-
-          i = 0;
-
-          while (i < 4 && r->sv_status.num_svs < noSatellites){
-
-                 Token  tok_prn = nmea_tokenizer_get(tzer, i * 4 + 4);
-                 Token  tok_elevation = nmea_tokenizer_get(tzer, i * 4 + 5);
-                 Token  tok_azimuth = nmea_tokenizer_get(tzer, i * 4 + 6);
-                 Token  tok_snr = nmea_tokenizer_get(tzer, i * 4 + 7);
-
-                 r->sv_status.sv_list[curr].prn = str2int(tok_prn.p, tok_prn.end);
-                 r->sv_status.sv_list[curr].elevation = str2float(tok_elevation.p, tok_elevation.end);
-                 r->sv_status.sv_list[curr].azimuth = str2float(tok_azimuth.p, tok_azimuth.end);
-                 r->sv_status.sv_list[curr].snr = str2float(tok_snr.p, tok_snr.end);
-
-                 r->sv_status.num_svs += 1;
-
-                 curr += 1;
-
-                 i += 1;
-          }
-
-          if (sentence == totalSentences) {
-              r->sv_status_changed = 1;
-          }
-
-          D("%s: GSV message with total satellites %d", __FUNCTION__, noSatellites);   
-
-        }
-
-    } else if ( !memcmp(tok.p, "RMC", 3) ) {
-
-        Token  tok_fixStatus     = nmea_tokenizer_get(tzer,2);
-
-        if (tok_fixStatus.p[0] == 'A')
-        {
-          Token  tok_time          = nmea_tokenizer_get(tzer,1);
-          Token  tok_latitude      = nmea_tokenizer_get(tzer,3);
-          Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,4);
-          Token  tok_longitude     = nmea_tokenizer_get(tzer,5);
-          Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,6);
-          Token  tok_speed         = nmea_tokenizer_get(tzer,7);
-          Token  tok_bearing       = nmea_tokenizer_get(tzer,8);
-          Token  tok_date          = nmea_tokenizer_get(tzer,9);
-
-            nmea_reader_update_date( r, tok_date, tok_time );
-
-            nmea_reader_update_latlong( r, tok_latitude,
-                                           tok_latitudeHemi.p[0],
-                                           tok_longitude,
-                                           tok_longitudeHemi.p[0] );
-
-            nmea_reader_update_bearing( r, tok_bearing );
-            nmea_reader_update_speed  ( r, tok_speed );
-        }
-
-    } else if ( !memcmp(tok.p, "VTG", 3) ) {
-
-        Token  tok_fixStatus     = nmea_tokenizer_get(tzer,9);
-
-        if (tok_fixStatus.p[0] != '\0' && tok_fixStatus.p[0] != 'N')
-        {
-            Token  tok_bearing       = nmea_tokenizer_get(tzer,1);
-            Token  tok_speed         = nmea_tokenizer_get(tzer,5);
-
-            nmea_reader_update_bearing( r, tok_bearing );
-            nmea_reader_update_speed  ( r, tok_speed );
-        }
-
-    } else if ( !memcmp(tok.p, "ZDA", 3) ) {
-
-        Token  tok_time;
-        Token  tok_year  = nmea_tokenizer_get(tzer,4);
-        tok_time  = nmea_tokenizer_get(tzer,1);
-
-        if ((tok_year.p[0] != '\0') && (tok_time.p[0] != '\0')) {
-
-          // make sure to always set date and time together, lest bad things happen
-          Token  tok_day   = nmea_tokenizer_get(tzer,2);
-          Token  tok_mon   = nmea_tokenizer_get(tzer,3);
-
-          nmea_reader_update_cdate( r, tok_day, tok_mon, tok_year );
-          nmea_reader_update_time(r, tok_time);
-        }
-
-
-    } else {
-        tok.p -= 2;
-        DFR("unknown sentence '%.*s", tok.end-tok.p, tok.p);
+    if (s->reader.fix.flags != 0 && s->callbacks.location_cb) {
+        D("gps fix cb: 0x%x", s->reader.fix.flags);
+        gps_state_report_fix( s );
+        s->first_fix = 1;
+        reported = 1;
     }
 
-    if (!gps_state->first_fix &&
-        gps_state->init == STATE_INIT &&
-        r->fix.flags & GPS_LOCATION_HAS_LAT_LONG) {
-
-        if (gps_state->callbacks.location_cb) {
-            gps_state->callbacks.location_cb( &r->fix );
-            r->fix.flags = 0;
-        }
-
-        gps_state->first_fix = 1;
+    if (s->reader.sv_status_changed != 0 && s->callbacks.sv_status_cb) {
+        D("gps sv status callback");
+        gps_state_report_sv_status( s );
     }
 
-#if 0
-    if (r->fix.flags != 0) {
-#if GPS_DEBUG
-        char   temp[256];
-        char*  p   = temp;
-        char*  end = p + sizeof(temp);
-        struct tm   utc;
-
-        p += snprintf( p, end-p, "sending fix" );
-        if (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG) {
-            p += snprintf(p, end-p, " lat=%g lon=%g", r->fix.latitude, r->fix.longitude);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_ALTITUDE) {
-            p += snprintf(p, end-p, " altitude=%g", r->fix.altitude);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_SPEED) {
-            p += snprintf(p, end-p, " speed=%g", r->fix.speed);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_BEARING) {
-            p += snprintf(p, end-p, " bearing=%g", r->fix.bearing);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_ACCURACY) {
-            p += snprintf(p,end-p, " accuracy=%g", r->fix.accuracy);
-        }
-        gmtime_r( (time_t*) &r->fix.timestamp, &utc );
-        p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
-        D(temp);
-#endif
-        if (r->callback) {
-            r->callback( &r->fix );
-            r->fix.flags = 0;
-        }
-        else {
-            D("no callback, keeping data until needed !");
-        }
-    }
-#endif
-}
+    if (!reported)
+        return;
 
+    if (s->fix_interval == 0)
+        s->fix_interval = -1;
+    else
+        s->next_fix = now + s->fix_interval;
+}
 
-static void
-nmea_reader_addc( NmeaReader*  r, int  c )
+/* how long gps_state_thread may wait for input, in ms for epoll_wait() */
+static int
+gps_state_timeout( GpsState*  s )
 {
-    if (r->overflow) {
-        r->overflow = (c != '\n');
-        return;
-    }
-
-    if (r->pos >= (int) sizeof(r->in)-1 ) {
-        r->overflow = 1;
-        r->pos      = 0;
-        return;
-    }
+    long long  left;
 
-    r->in[r->pos] = (char)c;
-    r->pos       += 1;
+    if (!s->fix_pending)
+        return -1;
 
-    if (c == '\n') {
-        GPS_STATE_LOCK_FIX(gps_state);
-        nmea_reader_parse( r );
-        GPS_STATE_UNLOCK_FIX(gps_state);
-        r->pos = 0;
-    }
+    left = s->next_fix - gps_now_ms();
+    return left > 0 ? (int)left : 0;
 }
 
 /*****************************************************************/
@@ -848,14 +244,36 @@ nmea_reader_addc( NmeaReader*  r, int  c )
 enum {
     CMD_QUIT  = 0,
     CMD_START = 1,
-    CMD_STOP  = 2
+    CMD_STOP  = 2,
+    CMD_RATE  = 3
 };
 
 
-static void gps_state_update_fix_freq(GpsState *s, int fix_freq)
+/* The framework asks for whole seconds, the gps.fix_interval_ms property
+ * lets it go below that for a session (setprop before starting it).
+ * Single shot requests are left alone.
+ */
+static void gps_state_update_fix_interval(GpsState *s, int interval)
 {
+  char prop[PROPERTY_VALUE_MAX];
+  char cmd = CMD_RATE;
+  int ret;
+
+  if (interval > 0 && property_get("gps.fix_interval_ms", prop, "") > 0 &&
+      atoi(prop) > 0)
+    interval = atoi(prop);
+
+  // gps_state_deliver() reads it under the fix lock
+  GPS_STATE_LOCK_FIX(s);
+  s->fix_interval = interval;
+  GPS_STATE_UNLOCK_FIX(s);
+
+  D("gps fix interval set to %d ms", interval);
+
+  // the receiver is reconfigured from gps_state_thread
+  do { ret = write( s->control[0], &cmd, 1 ); }
+  while (ret < 0 && errno == EINTR);
 
-  s->fix_freq = fix_freq;
   return;
 
 }
@@ -878,9 +296,8 @@ gps_state_done( GpsState*  s )
 
     pthread_join(s->thread, &dummy);
 
-    /* Timer thread depends on this state check */
     s->init = STATE_QUIT;
-    s->fix_freq = -1;
+    s->fix_interval = -1;
 
     // close the control socket pair
     close( s->control[0] ); s->control[0] = -1;
@@ -990,12 +407,19 @@ gps_state_thread( void*  arg )
         struct epoll_event   events[2];
         int                  ne, nevents;
 
-        nevents = epoll_wait( epoll_fd, events, 2, -1 );
+        nevents = epoll_wait( epoll_fd, events, 2, gps_state_timeout(state) );
         if (nevents < 0) {
             if (errno != EINTR)
                 LOGE("epoll_wait() unexpected error: %s", strerror(errno));
             continue;
         }
+        if (nevents == 0) {
+            // a held back fix is due
+            GPS_STATE_LOCK_FIX(state);
+            gps_state_deliver( state );
+            GPS_STATE_UNLOCK_FIX(state);
+            continue;
+        }
         D("gps thread received %d events", nevents);
         for (ne = 0; ne < nevents; ne++) {
             if ((events[ne].events & (EPOLLERR|EPOLLHUP)) != 0) {
@@ -1024,50 +448,75 @@ gps_state_thread( void*  arg )
                             D("gps thread starting  location_cb=%p", state->callbacks.location_cb);
                             started = 1;
 
-                            gps_dev_start(gps_fd);
+                            gps_dev_start(gps_fd, state->fix_interval, state->ubx);
 
                             GPS_STATUS_CB(state->callbacks, GPS_STATUS_SESSION_BEGIN);
 
+                            GPS_STATE_LOCK_FIX(state);
                             state->init = STATE_START;
-
-                            if ( pthread_create( &state->tmr_thread, NULL, gps_timer_thread, state ) != 0 ) {
-                                LOGE("could not create gps timer thread: %s", strerror(errno));
-                                started = 0;
-                                state->init = STATE_INIT;
-                                goto Exit;
-                            }
+                            state->next_fix = 0;
+                            state->fix_pending = 0;
+                            GPS_STATE_UNLOCK_FIX(state);
 
                         }
                     }
                     else if (cmd == CMD_STOP) {
                         if (started) {
-                            void *dummy;
                             D("gps thread stopping");
                             started = 0;
 
                             gps_dev_stop(gps_fd);
 
+                            GPS_STATE_LOCK_FIX(state);
                             state->init = STATE_INIT;
-
-                            pthread_join(state->tmr_thread, &dummy);
+                            state->fix_pending = 0;
+                            GPS_STATE_UNLOCK_FIX(state);
 
                             GPS_STATUS_CB(state->callbacks, GPS_STATUS_SESSION_END);
 
                         }
                     }
+                    else if (cmd == CMD_RATE) {
+                        if (started)
+                            gps_dev_set_rate(gps_fd, state->fix_interval, state->ubx);
+                    }
                 }
                 else if (fd == gps_fd)
                 {
-                    char buf[512];
-                    int  nn, ret;
+                    int  ret;
 
                     do {
-                        ret = read( fd, buf, sizeof(buf) );
+                        ret = read( fd, reader->in + reader->pos,
+                                    sizeof(reader->in) - reader->pos );
                     } while (ret < 0 && errno == EINTR);
 
-                    if (ret > 0)
-                        for (nn = 0; nn < ret; nn++)
-                            nmea_reader_addc( reader, buf[nn] );
+                    if (ret > 0) {
+                        GPS_STATE_LOCK_FIX(state);
+                        if (state->ubx)
+                            ubx_reader_frame( reader, ret );
+                        else
+                            nmea_reader_frame( reader, ret );
+
+                        // deliver as soon as the receiver has sent all of
+                        // the fix, rather than polling for it
+                        if (reader->epochs != state->epochs) {
+                            state->epochs = reader->epochs;
+                            gps_state_deliver( state );
+                        }
+
+                        // report the first fix as soon as there is one,
+                        // even before the session is started
+                        if (!state->first_fix &&
+                            state->init == STATE_INIT &&
+                            reader->fix.flags & NMEA_HAS_LAT_LONG) {
+
+                            if (state->callbacks.location_cb)
+                                gps_state_report_fix( state );
+
+                            state->first_fix = 1;
+                        }
+                        GPS_STATE_UNLOCK_FIX(state);
+                    }
                     D("gps fd event end");
                 }
                 else
@@ -1084,58 +533,6 @@ Exit:
     return NULL;
 }
 
-static void*
-gps_timer_thread( void*  arg )
-{
-
-  GpsState *state = (GpsState *)arg;
-
-  DFR("gps entered timer thread");
-
-  do {
-
-    DFR ("gps timer exp");
-
-    GPS_STATE_LOCK_FIX(state);
-
-    if (state->reader.fix.flags != 0) {
-
-      D("gps fix cb: 0x%x", state->reader.fix.flags);
-
-      if (state->callbacks.location_cb) {
-          state->callbacks.location_cb( &state->reader.fix );
-          state->reader.fix.flags = 0;
-          state->first_fix = 1;
-      }
-
-      if (state->fix_freq == 0) {
-        state->fix_freq = -1;
-      }
-
-    }
-
-    if (state->reader.sv_status_changed != 0) {
-
-      D("gps sv status callback");
-
-      if (state->callbacks.sv_status_cb) {
-          state->callbacks.sv_status_cb( &state->reader.sv_status );
-          state->reader.sv_status_changed = 0;
-      }
-
-    }
-
-    GPS_STATE_UNLOCK_FIX(state);
-    sleep(state->fix_freq);
-
-  } while(state->init == STATE_START);
-
-  DFR("gps timer thread destroyed");
-
-  return NULL;
-
-}
-
 static void
 gps_state_init( GpsState*  state )
 {
@@ -1150,9 +547,13 @@ gps_state_init( GpsState*  state )
     state->control[0] = -1;
     state->control[1] = -1;
     state->fd         = -1;
-    state->fix_freq   = -1;
+    state->fix_interval = -1;
     state->first_fix  = 0;
 
+    // binary NAV messages instead of NMEA, on request
+    property_get("gps.protocol", prop, "nmea");
+    state->ubx = (strcmp(prop, "ubx") == 0);
+
     if (sem_init(&state->fix_sem, 0, 1) != 0) {
       D("gps semaphore initialization failed! errno = %d", errno);
       return;
@@ -1189,6 +590,8 @@ gps_state_init( GpsState*  state )
         ios.c_oflag &= (~ONLCR); /* Stop \n -> \r\n translation on output */
         ios.c_iflag &= (~(ICRNL | INLCR)); /* Stop \r -> \n & \n -> \r translation on input */
         ios.c_iflag |= (IGNCR | IXOFF);  /* Ignore \r & XON/XOFF on input */
+        if (state->ubx)  /* every byte of a UBX frame counts */
+            ios.c_iflag &= ~(IGNCR | ISTRIP | IXON);
         tcsetattr( state->fd, TCSANOW, &ios );
     }
 
@@ -1291,9 +694,7 @@ bug20_gps_set_fix_frequency(int freq)
 
     D("%s: called", __FUNCTION__);
 
-    s->fix_freq = (freq <= 0) ? 1 : freq;
-
-    D("gps fix frquency set to %d secs", freq);
+    gps_state_update_fix_interval(s, ((freq <= 0) ? 1 : freq) * 1000);
 }
 
 static int
@@ -1320,9 +721,7 @@ static int bug20_gps_set_position_mode(GpsPositionMode mode, int fix_frequency)
         return -1;
     }
 
-    s->fix_freq = fix_frequency;
-
-    D("gps fix frquency set to %d secs", fix_frequency);
+    gps_state_update_fix_interval(s, fix_frequency * 1000);
 
     return 0;
 }
@@ -1400,28 +799,57 @@ static void gps_dev_power(int state)
 
 }
 
-static void gps_dev_send(int fd, char *msg)
-{
-  int i, n, ret;
+/* The UART is non-blocking. A receiver that stops taking bytes (hardware
+ * flow control, or powered down) fails the write after this long rather
+ * than stalling the state thread. */
+#define GPS_WRITE_TIMEOUT_MS  1000
 
-  i = strlen(msg);
+static int gps_dev_write(int fd, const unsigned char *buf, int len)
+{
+  struct pollfd pfd;
+  int n, ret;
 
   n = 0;
 
   do {
 
-    ret = write(fd, msg + n, i - n);
+    ret = write(fd, buf + n, len - n);
 
-    if (ret < 0 && errno == EINTR) {
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN) {
+        LOGE("gps write to device failed: %s", strerror(errno));
+        return -1;
+      }
+
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      do { ret = poll(&pfd, 1, GPS_WRITE_TIMEOUT_MS); }
+      while (ret < 0 && errno == EINTR);
+
+      if (ret < 0) {
+        LOGE("gps poll on device failed: %s", strerror(errno));
+        return -1;
+      }
+      if (ret == 0) {
+        LOGE("gps write to device timed out, %d of %d bytes sent", n, len);
+        return -1;
+      }
       continue;
     }
 
     n += ret;
 
-  } while (n < i);
+  } while (n < len);
 
-  return;
+  return 0;
+
+}
 
+static int gps_dev_send(int fd, char *msg)
+{
+  return gps_dev_write(fd, (unsigned char *)msg, strlen(msg));
 }
 
 static unsigned char gps_dev_calc_nmea_csum(char *msg)
@@ -1436,6 +864,42 @@ static unsigned char gps_dev_calc_nmea_csum(char *msg)
   return csum;
 }
 
+/* u-blox binary UBX frame: sync chars, class, id, little endian length,
+ * payload, then the 8-bit Fletcher checksum over class to payload */
+static void gps_dev_send_ubx(int fd, int cls, int id,
+                             const unsigned char *payload, int len)
+{
+  unsigned char buff[64];
+  unsigned char ck_a = 0, ck_b = 0;
+  int i;
+
+  if (len > (int)sizeof(buff) - 8)
+    return;
+
+  buff[0] = 0xb5;
+  buff[1] = 0x62;
+  buff[2] = cls;
+  buff[3] = id;
+  buff[4] = len & 0xff;
+  buff[5] = len >> 8;
+  memcpy(buff + 6, payload, len);
+
+  for (i = 2; i < len + 6; ++i) {
+    ck_a += buff[i];
+    ck_b += ck_a;
+  }
+
+  buff[len + 6] = ck_a;
+  buff[len + 7] = ck_b;
+
+  gps_dev_write(fd, buff, len + 8);
+
+  D("gps sent UBX %02x-%02x, %d bytes payload", cls, id, len);
+
+  return;
+
+}
+
 static void gps_dev_set_nmea_message_rate(int fd, char *msg, int rate)
 {
 
@@ -1480,21 +944,148 @@ static void gps_dev_set_baud_rate(int fd, int baud)
 
 }
 
-static void gps_dev_set_message_rate(int fd, int rate)
+/* NMEA output, per sentence. What the parser does not need (GLL, VTG and
+ * ZDA repeat what RMC and GGA carry) is turned off at the receiver, GSV
+ * is sent every gsv_rate epochs. The gps.nmea_sentences property, a list
+ * of sentence names such as "GGA,RMC,GSA,GSV,ZDA", overrides the default;
+ * GGA and RMC are always on since the fix is built from them. */
+#define GPS_NMEA_SENTENCES  (NMEA_GGA | NMEA_GSA | NMEA_GSV | NMEA_RMC)
+#define GPS_NMEA_REQUIRED   (NMEA_GGA | NMEA_RMC)
+
+static const struct {
+  const char *name;
+  int bit;
+} gps_nmea_msg[] = {
+               { "GGA", NMEA_GGA }, { "GLL", NMEA_GLL }, { "ZDA", NMEA_ZDA },
+               { "VTG", NMEA_VTG }, { "GSA", NMEA_GSA }, { "GSV", NMEA_GSV },
+               { "RMC", NMEA_RMC }
+              };
+
+static int gps_dev_nmea_sentences(void)
+{
+
+  char prop[PROPERTY_VALUE_MAX];
+  int mask = 0;
+  unsigned int i;
+
+  if (property_get("gps.nmea_sentences", prop, "") <= 0)
+    return GPS_NMEA_SENTENCES;
+
+  for (i = 0; i < sizeof(gps_nmea_msg)/sizeof(gps_nmea_msg[0]); ++i) {
+    if (strstr(prop, gps_nmea_msg[i].name) != NULL)
+      mask |= gps_nmea_msg[i].bit;
+  }
+
+  D("gps NMEA sentences from gps.nmea_sentences: %s", prop);
+
+  return mask | GPS_NMEA_REQUIRED;
+
+}
+
+static void gps_dev_set_message_rate(int fd, int mask, int gsv_rate)
+{
+
+  unsigned int i;
+
+  for (i = 0; i < sizeof(gps_nmea_msg)/sizeof(gps_nmea_msg[0]); ++i) {
+    int rate = 0;
+
+    if (mask & gps_nmea_msg[i].bit)
+      rate = (gps_nmea_msg[i].bit == NMEA_GSV) ? gsv_rate : 1;
+
+    gps_dev_set_nmea_message_rate(fd, (char *)gps_nmea_msg[i].name, rate);
+  }
+
+  return;
+
+}
+
+/* Navigation rate, the receiver takes 200 ms at its fastest. Longer
+ * intervals than a second are left to gps_state_deliver(), so that the
+ * receiver keeps tracking. */
+#define GPS_MIN_MEAS_RATE   200
+#define GPS_MAX_MEAS_RATE   1000
+
+/* UBX output, per NAV message: the fix every epoch, the satellites every
+ * svinfo_rate epochs. NAV-PVT needs a u-blox 7 or later, older receivers
+ * NAK it and send the fix as NAV-SOL and NAV-TIMEUTC. */
+static void gps_dev_set_ubx_message_rate(int fd, int svinfo_rate)
 {
 
   unsigned int i;
 
-  char *msg[] = {
-                 "GGA", "GLL", "ZDA",
-                 "VTG", "GSA", "GSV",
-                 "RMC"
+  static const struct {
+    unsigned char id;
+    int every_epoch;
+  } msg[] = {
+                 { UBX_NAV_PVT, 1 }, { UBX_NAV_SOL, 1 },
+                 { UBX_NAV_TIMEUTC, 1 }, { UBX_NAV_SVINFO, 0 }
                 };
 
   for (i = 0; i < sizeof(msg)/sizeof(msg[0]); ++i) {
-    gps_dev_set_nmea_message_rate(fd, msg[i], rate);
+    unsigned char cfg_msg[3];
+
+    // UBX-CFG-MSG: class, id, rate on the current port
+    cfg_msg[0] = UBX_CLASS_NAV;
+    cfg_msg[1] = msg[i].id;
+    cfg_msg[2] = msg[i].every_epoch ? 1 : svinfo_rate;
+
+    gps_dev_send_ubx(fd, UBX_CLASS_CFG, 0x01, cfg_msg, sizeof(cfg_msg));
+  }
+
+  return;
+
+}
+
+static void gps_dev_set_rate(int fd, int interval, int ubx)
+{
+
+  unsigned char cfg_rate[6];
+  int meas_rate = interval;
+
+  if (meas_rate <= 0 || meas_rate > GPS_MAX_MEAS_RATE)
+    meas_rate = GPS_MAX_MEAS_RATE;
+  else if (meas_rate < GPS_MIN_MEAS_RATE)
+    meas_rate = GPS_MIN_MEAS_RATE;
+
+  // UBX-CFG-RATE: measRate ms, navRate 1 cycle, timeRef GPS time
+  cfg_rate[0] = meas_rate & 0xff;
+  cfg_rate[1] = meas_rate >> 8;
+  cfg_rate[2] = 1;
+  cfg_rate[3] = 0;
+  cfg_rate[4] = 1;
+  cfg_rate[5] = 0;
+
+  gps_dev_send_ubx(fd, 0x06, 0x08, cfg_rate, sizeof(cfg_rate));
+
+  // satellites change slowly, keep GSV near once a second
+  if (ubx) {
+    gps_dev_set_message_rate(fd, 0, 0);
+    gps_dev_set_ubx_message_rate(fd, GPS_MAX_MEAS_RATE / meas_rate);
+  } else {
+    gps_dev_set_message_rate(fd, gps_dev_nmea_sentences(),
+                             GPS_MAX_MEAS_RATE / meas_rate);
   }
 
+  D("gps measurement rate %d ms", meas_rate);
+
+  return;
+
+}
+
+/* UBX-CFG-RST with a hot start (nothing cleared) and a controlled GPS
+ * start or stop: stopping shuts down the RF and baseband but keeps the
+ * ephemeris, so starting again gives a fix within seconds. */
+#define GPS_RST_GPS_STOP    0x08
+#define GPS_RST_GPS_START   0x09
+
+static void gps_dev_reset(int fd, int mode)
+{
+
+  unsigned char cfg_rst[4] = { 0x00, 0x00, mode, 0x00 };
+
+  gps_dev_send_ubx(fd, 0x06, 0x04, cfg_rst, sizeof(cfg_rst));
+
   return;
 
 }
@@ -1515,14 +1106,19 @@ static void gps_dev_init(int fd)
 
 static void gps_dev_deinit(int fd)
 {
+  gps_dev_stop(fd);
   gps_dev_power(0);
 }
 
-static void gps_dev_start(int fd)
+static void gps_dev_start(int fd, int interval, int ubx)
 {
 
   D("gps dev start initiated");
 
+  gps_dev_reset(fd, GPS_RST_GPS_START);
+
+  gps_dev_set_rate(fd, interval, ubx);
+
 }
 
 static void gps_dev_stop(int fd)
@@ -1530,4 +1126,6 @@ static void gps_dev_stop(int fd)
 
   D("gps dev stop initiated");
 
+  gps_dev_reset(fd, GPS_RST_GPS_STOP);
+
 }
@@ -0,0 +1,395 @@
+/* //hardware/hw/gps/gps_sim.c
+**
+** Host test: runs the BUG20 GPS HAL against a simulated receiver on a pty and
+** checks what it sends to the receiver through start, stop and fix interval
+** changes, and that fixes the receiver sends come back as location callbacks.
+**
+** Copyright 2009, Michael Trimarchi <michael@panicking.kicks-ass.org>
+**
+** This program is free software; you can redistribute it and/or modify it under
+** the terms of the GNU General Public License as published by the Free
+** Software Foundation; either version 2, or (at your option) any later
+** version.
+**
+** This program is distributed in the hope that it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+**
+** You should have received a copy of the GNU General Public License along with
+** this program; if not, write to the Free Software Foundation, Inc., 59
+** Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <hardware_legacy/gps.h>
+
+/* what the HAL sent to the receiver, one per UBX frame or NMEA sentence */
+enum {
+    MSG_NONE = 0,
+    MSG_RST,        /* UBX-CFG-RST, arg is the reset mode */
+    MSG_RATE,       /* UBX-CFG-RATE, arg is measRate in ms */
+    MSG_CFG_MSG,    /* UBX-CFG-MSG */
+    MSG_PUBX40,     /* $PUBX,40, name is the sentence, arg its rate */
+    MSG_OTHER
+};
+
+typedef struct {
+    int   type;
+    int   arg;
+    char  name[4];
+} SimMsg;
+
+/* the HAL reads its device and its settings from properties, the host has
+ * none so they are kept here */
+static char  sim_device[PROPERTY_VALUE_MAX];
+static char  sim_fix_interval_ms[PROPERTY_VALUE_MAX];
+
+int
+property_get( const char*  key, char*  value, const char*  default_value )
+{
+    const char*  v = default_value ? default_value : "";
+
+    if (!strcmp(key, "ro.kernel.android.gps"))
+        v = sim_device;
+    else if (!strcmp(key, "gps.fix_interval_ms") && sim_fix_interval_ms[0])
+        v = sim_fix_interval_ms;
+
+    strncpy(value, v, PROPERTY_VALUE_MAX - 1);
+    value[PROPERTY_VALUE_MAX - 1] = '\0';
+    return strlen(value);
+}
+
+int
+property_set( const char*  key, const char*  value )
+{
+    (void)key;
+    (void)value;
+    return 0;
+}
+
+static int  sim_fd = -1;       /* pty master, the receiver end */
+static int  failures;
+
+static pthread_mutex_t  sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static int  sim_locations;
+static int  sim_status[8];     /* status callbacks, by GpsStatusValue */
+
+static void
+sim_location_cb( GpsLocation*  location )
+{
+    (void)location;
+    pthread_mutex_lock(&sim_lock);
+    sim_locations++;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+static void
+sim_status_cb( GpsStatus*  status )
+{
+    pthread_mutex_lock(&sim_lock);
+    if (status->status < sizeof(sim_status) / sizeof(sim_status[0]))
+        sim_status[status->status]++;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+static void
+sim_sv_status_cb( GpsSvStatus*  sv_info )
+{
+    (void)sv_info;
+}
+
+static int
+sim_get( int*  counter )
+{
+    int  n;
+
+    pthread_mutex_lock(&sim_lock);
+    n = *counter;
+    pthread_mutex_unlock(&sim_lock);
+    return n;
+}
+
+static void
+check( int  ok, const char*  what )
+{
+    printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+/* reads one byte sent by the HAL, -1 if nothing came within timeout_ms */
+static int
+sim_read_byte( int  timeout_ms )
+{
+    struct pollfd  pfd;
+    unsigned char  c;
+    int            ret;
+
+    pfd.fd = sim_fd;
+    pfd.events = POLLIN;
+    do { ret = poll(&pfd, 1, timeout_ms); }
+    while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+        return -1;
+
+    do { ret = read(sim_fd, &c, 1); }
+    while (ret < 0 && errno == EINTR);
+    return ret == 1 ? c : -1;
+}
+
+/* reads the next UBX frame or NMEA sentence, MSG_NONE on timeout */
+static void
+sim_read_msg( SimMsg*  m, int  timeout_ms )
+{
+    unsigned char  buf[256];
+    int            c, len, i;
+
+    memset(m, 0, sizeof(*m));
+
+    do {
+        c = sim_read_byte(timeout_ms);
+        if (c < 0)
+            return;
+    } while (c != 0xb5 && c != '$');
+
+    m->type = MSG_OTHER;
+
+    if (c == '$') {
+        for (len = 0; len < (int)sizeof(buf) - 1; len++) {
+            c = sim_read_byte(timeout_ms);
+            if (c < 0 || c == '\n')
+                break;
+            buf[len] = c;
+        }
+        buf[len] = '\0';
+
+        // PUBX,40,<msg>,<rddc>,<rus1>,<rus2>,<rusb>,<rspi>*cs
+        if (!strncmp((char *)buf, "PUBX,40,", 8) && len > 11) {
+            m->type = MSG_PUBX40;
+            memcpy(m->name, buf + 8, 3);
+            m->arg = atoi((char *)buf + 12);
+        }
+        return;
+    }
+
+    // sync char 2, class, id, 16 bit length
+    for (i = 0; i < 5; i++) {
+        c = sim_read_byte(timeout_ms);
+        if (c < 0)
+            return;
+        buf[i] = c;
+    }
+    len = buf[3] | (buf[4] << 8);
+    if (buf[0] != 0x62 || len + 7 > (int)sizeof(buf))
+        return;
+    for (i = 5; i < len + 7; i++) {
+        c = sim_read_byte(timeout_ms);
+        if (c < 0)
+            return;
+        buf[i] = c;
+    }
+
+    if (buf[1] == 0x06 && buf[2] == 0x04 && len == 4) {
+        m->type = MSG_RST;
+        m->arg = buf[7];
+    } else if (buf[1] == 0x06 && buf[2] == 0x08 && len == 6) {
+        m->type = MSG_RATE;
+        m->arg = buf[5] | (buf[6] << 8);
+    } else if (buf[1] == 0x06 && buf[2] == 0x01) {
+        m->type = MSG_CFG_MSG;
+    }
+}
+
+static void
+expect_reset( int  mode, const char*  what )
+{
+    SimMsg  m;
+
+    sim_read_msg(&m, 3000);
+    check(m.type == MSG_RST && m.arg == mode, what);
+}
+
+/* CFG-RATE, then the NMEA output rates: GGA, GSA and RMC every epoch, GSV
+ * every gsv_rate epochs and the rest off */
+static void
+expect_rate( int  meas_rate, int  gsv_rate, const char*  what )
+{
+    SimMsg  m;
+    int     ok, i;
+
+    sim_read_msg(&m, 3000);
+    ok = (m.type == MSG_RATE && m.arg == meas_rate);
+
+    for (i = 0; i < 7; i++) {
+        int  rate;
+
+        sim_read_msg(&m, 3000);
+        if (m.type != MSG_PUBX40) {
+            ok = 0;
+            break;
+        }
+        if (!strcmp(m.name, "GSV"))
+            rate = gsv_rate;
+        else if (!strcmp(m.name, "GGA") || !strcmp(m.name, "GSA") ||
+                 !strcmp(m.name, "RMC"))
+            rate = 1;
+        else
+            rate = 0;
+        if (m.arg != rate)
+            ok = 0;
+    }
+    check(ok, what);
+}
+
+static void
+expect_quiet( const char*  what )
+{
+    SimMsg  m;
+
+    sim_read_msg(&m, 300);
+    check(m.type == MSG_NONE, what);
+}
+
+static void
+sim_send_nmea( const char*  body )
+{
+    char           line[128];
+    unsigned char  csum = 0;
+    const char*    p;
+
+    for (p = body; *p; p++)
+        csum ^= *p;
+    snprintf(line, sizeof(line), "$%s*%02X\r\n", body, csum);
+    if (write(sim_fd, line, strlen(line)) < 0)
+        perror("write");
+}
+
+/* one epoch per second of receiver time, the fix from GGA and RMC */
+static void
+sim_send_epoch( int  second )
+{
+    char  body[100];
+
+    snprintf(body, sizeof(body),
+             "GPGGA,1200%02d.00,4807.03800,N,01131.00000,E,1,08,0.9,545.4,M,46.9,M,,",
+             second);
+    sim_send_nmea(body);
+    snprintf(body, sizeof(body),
+             "GPRMC,1200%02d.00,A,4807.03800,N,01131.00000,E,0.02,84.4,230394,,,A",
+             second);
+    sim_send_nmea(body);
+}
+
+static int
+sim_open( void )
+{
+    struct termios  ios;
+    const char*     name;
+
+    sim_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim_fd < 0 || grantpt(sim_fd) < 0 || unlockpt(sim_fd) < 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+
+    // what the HAL writes comes through unchanged
+    tcgetattr(sim_fd, &ios);
+    cfmakeraw(&ios);
+    tcsetattr(sim_fd, TCSANOW, &ios);
+
+    name = ptsname(sim_fd);
+    if (name == NULL || strncmp(name, "/dev/", 5)) {
+        fprintf(stderr, "unexpected pty name %s\n", name ? name : "(null)");
+        return -1;
+    }
+
+    // the HAL opens /dev/<ro.kernel.android.gps>
+    strncpy(sim_device, name + 5, sizeof(sim_device) - 1);
+    return 0;
+}
+
+int
+main( void )
+{
+    const GpsInterface*  gps;
+    GpsCallbacks         callbacks;
+    int                  i, n;
+
+    if (sim_open() < 0)
+        return 1;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.location_cb  = sim_location_cb;
+    callbacks.status_cb    = sim_status_cb;
+    callbacks.sv_status_cb = sim_sv_status_cb;
+
+    gps = gps_get_hardware_interface();
+
+    check(gps->init(&callbacks) == 0, "init opens the receiver");
+    expect_reset(0x08, "init stops the receiver");
+    check(sim_get(&sim_status[GPS_STATUS_ENGINE_ON]) == 1, "engine on");
+
+    gps->set_position_mode(GPS_POSITION_MODE_STANDALONE, 1);
+    expect_quiet("fix interval before start is not sent");
+
+    gps->start();
+    expect_reset(0x09, "start starts the receiver");
+    expect_rate(1000, 1, "start configures 1 s fixes");
+    check(sim_get(&sim_status[GPS_STATUS_SESSION_BEGIN]) == 1,
+          "session begin");
+
+    gps->start();
+    expect_quiet("second start is ignored");
+
+    for (i = 0; i < 3; i++)
+        sim_send_epoch(i);
+    for (i = 0; i < 30 && sim_get(&sim_locations) == 0; i++)
+        usleep(100 * 1000);
+    check(sim_get(&sim_locations) > 0, "fix reported");
+
+    strcpy(sim_fix_interval_ms, "200");
+    gps->set_fix_frequency(1);
+    expect_rate(200, 5, "gps.fix_interval_ms goes below a second");
+    sim_fix_interval_ms[0] = '\0';
+
+    gps->set_fix_frequency(5);
+    expect_rate(1000, 1, "longer intervals keep 1 s measurements");
+
+    gps->set_fix_frequency(1);
+    expect_rate(1000, 1, "back to 1 s fixes");
+
+    gps->stop();
+    expect_reset(0x08, "stop stops the receiver");
+    check(sim_get(&sim_status[GPS_STATUS_SESSION_END]) == 1, "session end");
+
+    gps->set_fix_frequency(2);
+    expect_quiet("fix interval while stopped is not sent");
+
+    n = sim_get(&sim_locations);
+    for (i = 3; i < 6; i++)
+        sim_send_epoch(i);
+    usleep(300 * 1000);
+    check(sim_get(&sim_locations) == n, "no fixes while stopped");
+
+    gps->start();
+    expect_reset(0x09, "restart starts the receiver");
+    expect_rate(1000, 1, "restart configures the rate set while stopped");
+
+    gps->cleanup();
+    expect_reset(0x08, "cleanup stops the receiver");
+    check(sim_get(&sim_status[GPS_STATUS_ENGINE_OFF]) == 1, "engine off");
+
+    printf("%d failed\n", failures);
+    return failures != 0;
+}
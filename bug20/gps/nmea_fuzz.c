@@ -0,0 +1,67 @@
+/* //hardware/hw/gps/nmea_fuzz.c
+**
+** Host libFuzzer target: feeds arbitrary bytes through the BUG20 NMEA and UBX
+** framers in reads of varying size, the same way gps_state_thread does.
+**
+** Copyright 2009, Michael Trimarchi <michael@panicking.kicks-ass.org>
+**
+** This program is free software; you can redistribute it and/or modify it under
+** the terms of the GNU General Public License as published by the Free
+** Software Foundation; either version 2, or (at your option) any later
+** version.
+**
+** This program is distributed in the hope that it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+**
+** You should have received a copy of the GNU General Public License along with
+** this program; if not, write to the Free Software Foundation, Inc., 59
+** Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nmea_parser.h"
+#include "ubx_parser.h"
+
+/* The first input byte picks the framer, bit 7 set for UBX, and the read
+ * size, the low bits plus one. The rest is handed over as the UART would.
+ */
+int
+LLVMFuzzerTestOneInput( const uint8_t*  data, size_t  size )
+{
+    static NmeaReader  reader;
+    void   (*reader_frame)( NmeaReader*  r, int  len );
+    int    chunk;
+    size_t off = 1;
+
+    if (size < 1)
+        return 0;
+
+    reader_frame = (data[0] & 0x80) ? ubx_reader_frame : nmea_reader_frame;
+    chunk = (data[0] & 0x7f) + 1;
+
+    nmea_reader_init( &reader );
+    while (off < size) {
+        int  n = sizeof(reader.in) - reader.pos;
+
+        if (n > chunk)
+            n = chunk;
+        if ((size_t)n > size - off)
+            n = size - off;
+
+        memcpy( reader.in + reader.pos, data + off, n );
+        reader_frame( &reader, n );
+        off += n;
+
+        /* there has to be room left for the next read */
+        if (reader.pos < 0 || reader.pos >= (int)sizeof(reader.in))
+            abort();
+    }
+
+    return 0;
+}
@@ -0,0 +1,955 @@
+/* //hardware/hw/gps/nmea_parser.c
+**
+** NMEA 0183 sentence framing and parsing for the BUG20 GPS module, split
+** out of gps_bug20.c so that it can also be built and run on the host.
+**
+** Copyright 2006, The Android Open Source Project
+** Copyright 2009, Michael Trimarchi <michael@panicking.kicks-ass.org>
+**
+** This program is free software; you can redistribute it and/or modify it under
+** the terms of the GNU General Public License as published by the Free
+** Software Foundation; either version 2, or (at your option) any later
+** version.
+**
+** This program is distributed in the hope that it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+**
+** You should have received a copy of the GNU General Public License along with
+** this program; if not, write to the Free Software Foundation, Inc., 59
+** Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nmea_parser.h"
+
+#define  GPS_DEBUG  0
+
+#if GPS_DEBUG
+#  define  LOG_TAG  "gps"
+#  include <cutils/log.h>
+#  define  D(...)   LOGD(__VA_ARGS__)
+#else
+#  define  D(...)   ((void)0)
+#endif
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       N M E A   T O K E N I Z E R                     *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+typedef struct {
+    const char*  p;
+    const char*  end;
+} Token;
+
+#define  MAX_NMEA_TOKENS  32
+
+typedef struct {
+    int     count;
+    Token   tokens[ MAX_NMEA_TOKENS ];
+} NmeaTokenizer;
+
+static int
+nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
+{
+    int    count = 0;
+    char*  q;
+
+    // the initial '$' is optional
+    if (p < end && p[0] == '$')
+        p += 1;
+
+    // remove trailing newline
+    if (end > p && end[-1] == '\n') {
+        end -= 1;
+        if (end > p && end[-1] == '\r')
+            end -= 1;
+    }
+
+    // get rid of checksum at the end of the sentecne
+    if (end >= p+3 && end[-3] == '*') {
+        end -= 3;
+    }
+
+    while (p < end) {
+        const char*  q = p;
+
+        q = memchr(p, ',', end-p);
+        if (q == NULL)
+            q = end;
+
+        if (count < MAX_NMEA_TOKENS) {
+            t->tokens[count].p   = p;
+            t->tokens[count].end = q;
+            count += 1;
+        }
+
+        if (q < end)
+            q += 1;
+
+        p = q;
+    }
+
+    t->count = count;
+    return count;
+}
+
+static Token
+nmea_tokenizer_get( NmeaTokenizer*  t, int  index )
+{
+    Token  tok;
+    static const char*  dummy = "";
+
+    if (index < 0 || index >= t->count) {
+        tok.p = tok.end = dummy;
+    } else
+        tok = t->tokens[index];
+
+    return tok;
+}
+
+
+static int
+str2int( const char*  p, const char*  end )
+{
+    int   result = 0;
+    int   len    = end - p;
+
+    // no field needs more, and it keeps result from overflowing
+    if (len == 0 || len > 9) {
+      return -1;
+    }
+
+    for ( ; len > 0; len--, p++ )
+    {
+        int  c;
+
+        if (p >= end)
+            goto Fail;
+
+        c = *p - '0';
+        if ((unsigned)c >= 10)
+            goto Fail;
+
+        result = result*10 + c;
+    }
+    return  result;
+
+Fail:
+    return -1;
+}
+
+static double
+str2float_slow( const char*  p, const char*  end )
+{
+    int   len    = end - p;
+    char  temp[16];
+
+    if (len >= (int)sizeof(temp))
+        return 0.;
+
+    memcpy( temp, p, len );
+    temp[len] = 0;
+    return strtod( temp, NULL );
+}
+
+static const double  pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+/* the fields are plain decimals, so the digits are gathered into an
+ * integer and scaled once. Both are exact doubles, which makes the result
+ * the same as strtod() gives. Anything else goes the slow way.
+ */
+static double
+str2float( const char*  p, const char*  end )
+{
+    const char*  q = p;
+    int64_t      mant = 0;
+    int          digits = 0;
+    int          frac = -1;
+    int          neg = 0;
+
+    if (p == end) {
+      return -1.0;
+    }
+
+    if (*q == '-' || *q == '+') {
+        neg = (*q == '-');
+        q++;
+    }
+
+    for ( ; q < end; q++) {
+        unsigned  c = (unsigned)(*q - '0');
+
+        if (c < 10) {
+            mant = mant*10 + c;
+            digits++;
+        } else if (*q == '.' && frac < 0) {
+            frac = digits;
+        } else {
+            return str2float_slow(p, end);
+        }
+    }
+
+    if (digits == 0 || digits > 15)
+        return str2float_slow(p, end);
+
+    if (frac >= 0 && digits > frac) {
+        double  val = (double)mant / pow10_table[digits - frac];
+        return neg ? -val : val;
+    }
+    return neg ? -(double)mant : (double)mant;
+}
+
+/** @desc Convert struct tm to time_t (time zone neutral).
+ *
+ * The one missing function in libc: It works basically like mktime, with the main difference that
+ * it does no time zone-related processing but interprets the members of the struct tm as UTC.
+ * Unlike mktime, it will not modify any fields of the tm structure; if you need this behavior, call
+ * mktime before this function.
+ *
+ * @param t Pointer to a struct tm containing date and time. Only the tm_year, tm_mon, tm_mday,
+ * tm_hour, tm_min and tm_sec members will be evaluated, all others will be ignored.
+ *
+ * @return The epoch time (seconds since 1970-01-01 00:00:00 UTC) which corresponds to t.
+ *
+ * @author Originally written by Philippe De Muyter <phdm@macqel.be> for Lynx.
+ * http://lynx.isc.org/current/lynx2-8-8/src/mktime.c
+ */
+
+time_t
+nmea_mkgmtime(struct tm *t)
+{
+    short month, year;
+    time_t result;
+    static int m_to_d[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+
+    month = t->tm_mon;
+    year = t->tm_year + month / 12 + 1900;
+    month %= 12;
+    if (month < 0) {
+	    year -= 1;
+	    month += 12;
+    }
+    result = (year - 1970) * 365 + m_to_d[month];
+    if (month <= 1)
+	    year -= 1;
+    result += (year - 1968) / 4;
+    result -= (year - 1900) / 100;
+    result += (year - 1600) / 400;
+    result += t->tm_mday;
+    result -= 1;
+    result *= 24;
+    result += t->tm_hour;
+    result *= 60;
+    result += t->tm_min;
+    result *= 60;
+    result += t->tm_sec;
+    return (result);
+}
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       N M E A   P A R S E R                           *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+static void
+nmea_reader_update_utc_diff( NmeaReader*  r )
+{
+    time_t         now = time(NULL);
+    struct tm      tm_local;
+    struct tm      tm_utc;
+    long           time_local, time_utc;
+
+    gmtime_r( &now, &tm_utc );
+    localtime_r( &now, &tm_local );
+
+    time_local = mktime(&tm_local);
+    time_utc = mktime(&tm_utc);
+
+    r->utc_diff = time_local - time_utc;
+}
+
+
+void
+nmea_reader_init( NmeaReader*  r )
+{
+    memset( r, 0, sizeof(*r) );
+
+    r->pos      = 0;
+    r->overflow = 0;
+    r->utc_year = -1;
+    r->utc_mon  = -1;
+    r->utc_day  = -1;
+
+    r->epoch_time   = -1;
+    r->epoch_expect = NMEA_EPOCH_SENTENCES;
+    r->ubx_itow     = -1;
+
+    // not sure if we still need this (this module doesn't use utc_diff)
+    nmea_reader_update_utc_diff( r );
+}
+
+static int
+nmea_reader_update_time( NmeaReader*  r, Token  tok )
+{
+    int        hour, minute, seconds, milliseconds;
+    struct tm  tm;
+    time_t     fix_time;
+
+    if (tok.p + 6 > tok.end)
+        return -1;
+
+    if (r->utc_year < 0) {
+        // no date, can't return valid timestamp (never ever make up a date, this could wreak havoc)
+        return -1;
+    }
+    else
+    {
+        tm.tm_year = r->utc_year - 1900;
+        tm.tm_mon  = r->utc_mon - 1;
+        tm.tm_mday = r->utc_day;
+    }
+
+    hour    = str2int(tok.p,   tok.p+2);
+    minute  = str2int(tok.p+2, tok.p+4);
+    seconds = str2int(tok.p+4, tok.p+6);
+
+    // parse also milliseconds (if present) for better precision
+    milliseconds = 0;
+    if (tok.end - (tok.p+7) == 2) {
+        milliseconds = str2int(tok.p+7, tok.end) * 10;
+    }
+    else if (tok.end - (tok.p+7) == 1) {
+        milliseconds = str2int(tok.p+7, tok.end) * 100;
+    }
+    else if (tok.end - (tok.p+7) >= 3) {
+        milliseconds = str2int(tok.p+7, tok.p+10);
+    }
+
+    // the following is only guaranteed to work if we have previously set a correct date, so be sure
+    // to always do that before
+
+    tm.tm_hour = hour;
+    tm.tm_min  = minute;
+    tm.tm_sec  = seconds;
+
+    fix_time = nmea_mkgmtime( &tm );
+
+    r->fix.timestamp = (long long)fix_time * 1000 + milliseconds;
+    return 0;
+}
+
+static int
+nmea_reader_update_cdate( NmeaReader*  r, Token  tok_d, Token tok_m, Token tok_y )
+{
+
+    if ( (tok_d.p + 2 > tok_d.end) ||
+         (tok_m.p + 2 > tok_m.end) ||
+         (tok_y.p + 4 > tok_y.end) )
+        return -1;
+
+    r->utc_day = str2int(tok_d.p,   tok_d.p+2);
+    r->utc_mon = str2int(tok_m.p, tok_m.p+2);
+    r->utc_year = str2int(tok_y.p, tok_y.p+4);
+
+    return 0;
+}
+
+static int
+nmea_reader_update_date( NmeaReader*  r, Token  date, Token  time )
+{
+    Token  tok = date;
+    int    day, mon, year;
+
+    if (tok.p + 6 != tok.end) {
+        D("date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
+    day  = str2int(tok.p, tok.p+2);
+    mon  = str2int(tok.p+2, tok.p+4);
+    year = str2int(tok.p+4, tok.p+6) + 2000;
+
+    if ((day|mon|year) < 0) {
+        D("date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
+
+    r->utc_year  = year;
+    r->utc_mon   = mon;
+    r->utc_day   = day;
+
+    return nmea_reader_update_time( r, time );
+}
+
+
+/* "dddmm.mmmmm" to degrees. The minutes are kept as an integer count
+ * of 1e-7 minutes, so the only floating point operation is the final
+ * division.
+ */
+static double
+convert_from_hhmm( Token  tok )
+{
+    const char*  p = tok.p;
+    int          whole = 0;
+    int64_t      minutes;
+    int          scale = 10000000;
+
+    for ( ; p < tok.end && p < tok.p+6 && (unsigned)(*p - '0') < 10; p++)
+        whole = whole*10 + (*p - '0');
+
+    if (p - tok.p < 3 || p - tok.p > 5)
+        goto Slow;
+
+    minutes = (int64_t)(whole % 100) * scale;
+
+    if (p < tok.end) {
+        if (*p++ != '.')
+            goto Slow;
+        for ( ; p < tok.end; p++) {
+            unsigned  c = (unsigned)(*p - '0');
+            if (c >= 10)
+                goto Slow;
+            if (scale > 1) {
+                scale /= 10;
+                minutes += c * scale;
+            }
+        }
+    }
+
+    return (whole / 100) + (double)minutes / (60.0 * 10000000);
+
+Slow:
+    {
+        double  val     = str2float(tok.p, tok.end);
+        int     degrees = (int)(floor(val) / 100);
+        double  minutes = val - degrees*100.;
+        double  dcoord  = degrees + minutes / 60.0;
+        return dcoord;
+    }
+}
+
+
+static int
+nmea_reader_update_latlong( NmeaReader*  r,
+                            Token        latitude,
+                            char         latitudeHemi,
+                            Token        longitude,
+                            char         longitudeHemi )
+{
+    double   lat, lon;
+    Token    tok;
+
+    tok = latitude;
+    if (tok.p + 6 > tok.end) {
+        D("latitude is too short: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
+    lat = convert_from_hhmm(tok);
+    if (latitudeHemi == 'S')
+        lat = -lat;
+
+    tok = longitude;
+    if (tok.p + 6 > tok.end) {
+        D("longitude is too short: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
+    lon = convert_from_hhmm(tok);
+    if (longitudeHemi == 'W')
+        lon = -lon;
+
+    r->fix.flags    |= NMEA_HAS_LAT_LONG;
+    r->fix.latitude  = lat;
+    r->fix.longitude = lon;
+    return 0;
+}
+
+
+static int
+nmea_reader_update_altitude( NmeaReader*  r,
+                             Token        altitude,
+                             Token        units )
+{
+    double  alt;
+    Token   tok = altitude;
+
+    if (tok.p >= tok.end)
+        return -1;
+
+    r->fix.flags   |= NMEA_HAS_ALTITUDE;
+    r->fix.altitude = str2float(tok.p, tok.end);
+    return 0;
+}
+
+static int
+nmea_reader_update_accuracy( NmeaReader*  r,
+                             Token        accuracy )
+{
+    double  acc;
+    Token   tok = accuracy;
+
+    if (tok.p >= tok.end)
+        return -1;
+
+    r->fix.accuracy = str2float(tok.p, tok.end);
+
+    if (r->fix.accuracy == 99.99){
+      return 0;
+    }
+
+    r->fix.flags   |= NMEA_HAS_ACCURACY;
+    return 0;
+}
+
+static int
+nmea_reader_update_bearing( NmeaReader*  r,
+                            Token        bearing )
+{
+    double  alt;
+    Token   tok = bearing;
+
+    if (tok.p >= tok.end)
+        return -1;
+
+    r->fix.flags   |= NMEA_HAS_BEARING;
+    r->fix.bearing  = str2float(tok.p, tok.end);
+    return 0;
+}
+
+
+static int
+nmea_reader_update_speed( NmeaReader*  r,
+                          Token        speed )
+{
+    double  alt;
+    Token   tok = speed;
+
+    if (tok.p >= tok.end)
+        return -1;
+
+    r->fix.flags   |= NMEA_HAS_SPEED;
+    // convert knots into m/sec (1 knot equals 1.852 km/h, 1 km/h equals 3.6 m/s)
+    // since 1.852 / 3.6 is an odd value (periodic), we're calculating the quotient on the fly
+    // to obtain maximum precision (we don't want 1.9999 instead of 2)
+    r->fix.speed    = str2float(tok.p, tok.end) * 1.852 / 3.6;
+    return 0;
+}
+
+
+/* "hhmmss.sss" to ms since midnight, -1 if malformed */
+static int
+nmea_time_of_day( Token  tok )
+{
+    int  hour, minute, seconds, milliseconds = 0;
+    int  digits;
+
+    if (tok.p + 6 > tok.end)
+        return -1;
+
+    hour    = str2int(tok.p,   tok.p+2);
+    minute  = str2int(tok.p+2, tok.p+4);
+    seconds = str2int(tok.p+4, tok.p+6);
+    if ((hour|minute|seconds) < 0)
+        return -1;
+
+    digits = tok.end - (tok.p+7);
+    if (digits > 0 && tok.p[6] == '.') {
+        if (digits > 3)
+            digits = 3;
+        milliseconds = str2int(tok.p+7, tok.p+7+digits);
+        if (milliseconds < 0)
+            milliseconds = 0;
+        for ( ; digits < 3; digits++)
+            milliseconds *= 10;
+    }
+
+    return ((hour*60 + minute)*60 + seconds)*1000 + milliseconds;
+}
+
+/* account an epoch sentence, time is empty for GSA which belongs to the
+ * epoch of the sentences around it. A new time of day starts a new epoch,
+ * and what the previous one got is what the receiver is expected to send
+ * from then on, in case it has some of them turned off.
+ */
+static void
+nmea_reader_epoch( NmeaReader*  r, int  sentence, Token  time )
+{
+    int  t = (time.p < time.end) ? nmea_time_of_day(time) : -1;
+
+    if (t >= 0 && t != r->epoch_time) {
+        if (r->epoch_mask != 0)
+            r->epoch_expect = r->epoch_mask;
+        r->epoch_time = t;
+        r->epoch_mask = 0;
+        r->epoch_done = 0;
+    }
+
+    r->epoch_mask |= sentence;
+
+    if (!r->epoch_done &&
+        (r->epoch_mask & r->epoch_expect) == r->epoch_expect) {
+        r->epoch_done = 1;
+        r->epochs    += 1;
+    }
+}
+
+static void
+nmea_reader_parse( NmeaReader*  r, const char*  p, const char*  end )
+{
+   /* we received a complete sentence, now parse it to generate
+    * a new GPS fix...
+    */
+    NmeaTokenizer  tzer[1];
+    Token          tok;
+
+    D("Received: '%.*s'", (int)(end-p), p);
+
+    if (end - p < 9) {
+        D("Too short. discarded.");
+        return;
+    }
+
+    nmea_tokenizer_init(tzer, p, end);
+
+    tok = nmea_tokenizer_get(tzer, 0);
+
+    if (tok.p + 5 > tok.end) {
+        D("sentence id '%.*s' too short, ignored.", tok.end-tok.p, tok.p);
+        return;
+    }
+
+    // ignore first two characters.
+    tok.p += 2;
+
+    if ( !memcmp(tok.p, "GGA", 3) ) {
+        // GPS fix
+        Token  tok_fixstaus      = nmea_tokenizer_get(tzer,6);
+
+        nmea_reader_epoch(r, NMEA_GGA, nmea_tokenizer_get(tzer,1));
+
+        if ((tok_fixstaus.p[0] > '0') && (r->utc_year >= 0)) {
+          // ignore this until we have a valid timestamp
+
+          Token  tok_time          = nmea_tokenizer_get(tzer,1);
+          Token  tok_latitude      = nmea_tokenizer_get(tzer,2);
+          Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,3);
+          Token  tok_longitude     = nmea_tokenizer_get(tzer,4);
+          Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,5);
+          Token  tok_altitude      = nmea_tokenizer_get(tzer,9);
+          Token  tok_altitudeUnits = nmea_tokenizer_get(tzer,10);
+
+          // don't use this as we have no fractional seconds and no date; there are better ways to
+          // get a good timestamp from GPS
+          //nmea_reader_update_time(r, tok_time);
+          nmea_reader_update_latlong(r, tok_latitude,
+                                        tok_latitudeHemi.p[0],
+                                        tok_longitude,
+                                        tok_longitudeHemi.p[0]);
+          nmea_reader_update_altitude(r, tok_altitude, tok_altitudeUnits);
+        }
+
+    } else if ( !memcmp(tok.p, "GLL", 3) ) {
+
+        Token  tok_fixstaus      = nmea_tokenizer_get(tzer,6);
+
+        if ((tok_fixstaus.p[0] == 'A') && (r->utc_year >= 0)) {
+          // ignore this until we have a valid timestamp
+
+          Token  tok_latitude      = nmea_tokenizer_get(tzer,1);
+          Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,2);
+          Token  tok_longitude     = nmea_tokenizer_get(tzer,3);
+          Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,4);
+          Token  tok_time          = nmea_tokenizer_get(tzer,5);
+
+          // don't use this as we have no fractional seconds and no date; there are better ways to
+          // get a good timestamp from GPS
+          //nmea_reader_update_time(r, tok_time);
+          nmea_reader_update_latlong(r, tok_latitude,
+                                        tok_latitudeHemi.p[0],
+                                        tok_longitude,
+                                        tok_longitudeHemi.p[0]);
+        }
+
+    } else if ( !memcmp(tok.p, "GSA", 3) ) {
+
+        Token  tok_fixStatus   = nmea_tokenizer_get(tzer, 2);
+        int i;
+
+        nmea_reader_epoch(r, NMEA_GSA, nmea_tokenizer_get(tzer, -1));
+
+        if (tok_fixStatus.p[0] != '\0' && tok_fixStatus.p[0] != '1') {
+
+          Token  tok_accuracy      = nmea_tokenizer_get(tzer, 15);
+
+          nmea_reader_update_accuracy(r, tok_accuracy);
+
+          r->sv_status.used_in_fix_mask = 0ul;
+
+          for (i = 3; i <= 14; ++i){
+
+            Token  tok_prn  = nmea_tokenizer_get(tzer, i);
+            int prn = str2int(tok_prn.p, tok_prn.end);
+
+            if (prn > 0 && prn <= 32){
+              r->sv_status.used_in_fix_mask |= (1ul << (32 - prn));
+              r->sv_status_changed = 1;
+              D("%s: fix mask is %d", __FUNCTION__, r->sv_status.used_in_fix_mask);
+            }
+
+          }
+
+        }
+
+    } else if ( !memcmp(tok.p, "GSV", 3) ) {
+
+        Token  tok_noSatellites  = nmea_tokenizer_get(tzer, 3);
+        int    noSatellites = str2int(tok_noSatellites.p, tok_noSatellites.end);
+       
+        if (noSatellites > 0) {
+
+          Token  tok_noSentences   = nmea_tokenizer_get(tzer, 1);
+          Token  tok_sentence      = nmea_tokenizer_get(tzer, 2);
+
+          int sentence = str2int(tok_sentence.p, tok_sentence.end);
+          int totalSentences = str2int(tok_noSentences.p, tok_noSentences.end);
+          int curr;
+          int i;
+          
+          if (sentence == 1) {
+              r->sv_status_changed = 0;
+              r->sv_status.num_svs = 0;
+          }
+
+          curr = r->sv_status.num_svs;
+
+          i = 0;
+
+          while (i < 4 && r->sv_status.num_svs < noSatellites &&
+                 r->sv_status.num_svs < NMEA_MAX_SVS){
+
+                 Token  tok_prn = nmea_tokenizer_get(tzer, i * 4 + 4);
+                 Token  tok_elevation = nmea_tokenizer_get(tzer, i * 4 + 5);
+                 Token  tok_azimuth = nmea_tokenizer_get(tzer, i * 4 + 6);
+                 Token  tok_snr = nmea_tokenizer_get(tzer, i * 4 + 7);
+
+                 r->sv_status.sv_list[curr].prn = str2int(tok_prn.p, tok_prn.end);
+                 r->sv_status.sv_list[curr].elevation = str2float(tok_elevation.p, tok_elevation.end);
+                 r->sv_status.sv_list[curr].azimuth = str2float(tok_azimuth.p, tok_azimuth.end);
+                 r->sv_status.sv_list[curr].snr = str2float(tok_snr.p, tok_snr.end);
+
+                 r->sv_status.num_svs += 1;
+
+                 curr += 1;
+
+                 i += 1;
+          }
+
+          if (sentence == totalSentences) {
+              r->sv_status_changed = 1;
+          }
+
+          D("%s: GSV message with total satellites %d", __FUNCTION__, noSatellites);   
+
+        }
+
+    } else if ( !memcmp(tok.p, "RMC", 3) ) {
+
+        Token  tok_fixStatus     = nmea_tokenizer_get(tzer,2);
+
+        nmea_reader_epoch(r, NMEA_RMC, nmea_tokenizer_get(tzer,1));
+
+        if (tok_fixStatus.p[0] == 'A')
+        {
+          Token  tok_time          = nmea_tokenizer_get(tzer,1);
+          Token  tok_latitude      = nmea_tokenizer_get(tzer,3);
+          Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,4);
+          Token  tok_longitude     = nmea_tokenizer_get(tzer,5);
+          Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,6);
+          Token  tok_speed         = nmea_tokenizer_get(tzer,7);
+          Token  tok_bearing       = nmea_tokenizer_get(tzer,8);
+          Token  tok_date          = nmea_tokenizer_get(tzer,9);
+
+            nmea_reader_update_date( r, tok_date, tok_time );
+
+            nmea_reader_update_latlong( r, tok_latitude,
+                                           tok_latitudeHemi.p[0],
+                                           tok_longitude,
+                                           tok_longitudeHemi.p[0] );
+
+            nmea_reader_update_bearing( r, tok_bearing );
+            nmea_reader_update_speed  ( r, tok_speed );
+        }
+
+    } else if ( !memcmp(tok.p, "VTG", 3) ) {
+
+        Token  tok_fixStatus     = nmea_tokenizer_get(tzer,9);
+
+        if (tok_fixStatus.p[0] != '\0' && tok_fixStatus.p[0] != 'N')
+        {
+            Token  tok_bearing       = nmea_tokenizer_get(tzer,1);
+            Token  tok_speed         = nmea_tokenizer_get(tzer,5);
+
+            nmea_reader_update_bearing( r, tok_bearing );
+            nmea_reader_update_speed  ( r, tok_speed );
+        }
+
+    } else if ( !memcmp(tok.p, "ZDA", 3) ) {
+
+        Token  tok_time;
+        Token  tok_year  = nmea_tokenizer_get(tzer,4);
+        tok_time  = nmea_tokenizer_get(tzer,1);
+
+        if ((tok_year.p[0] != '\0') && (tok_time.p[0] != '\0')) {
+
+          // make sure to always set date and time together, lest bad things happen
+          Token  tok_day   = nmea_tokenizer_get(tzer,2);
+          Token  tok_mon   = nmea_tokenizer_get(tzer,3);
+
+          nmea_reader_update_cdate( r, tok_day, tok_mon, tok_year );
+          nmea_reader_update_time(r, tok_time);
+        }
+
+
+    } else {
+        tok.p -= 2;
+        D("unknown sentence '%.*s", (int)(tok.end-tok.p), tok.p);
+        return;
+    }
+
+    r->sentences += 1;
+
+#if 0
+    if (r->fix.flags != 0) {
+#if GPS_DEBUG
+        char   temp[256];
+        char*  p   = temp;
+        char*  end = p + sizeof(temp);
+        struct tm   utc;
+
+        p += snprintf( p, end-p, "sending fix" );
+        if (r->fix.flags & NMEA_HAS_LAT_LONG) {
+            p += snprintf(p, end-p, " lat=%g lon=%g", r->fix.latitude, r->fix.longitude);
+        }
+        if (r->fix.flags & NMEA_HAS_ALTITUDE) {
+            p += snprintf(p, end-p, " altitude=%g", r->fix.altitude);
+        }
+        if (r->fix.flags & NMEA_HAS_SPEED) {
+            p += snprintf(p, end-p, " speed=%g", r->fix.speed);
+        }
+        if (r->fix.flags & NMEA_HAS_BEARING) {
+            p += snprintf(p, end-p, " bearing=%g", r->fix.bearing);
+        }
+        if (r->fix.flags & NMEA_HAS_ACCURACY) {
+            p += snprintf(p,end-p, " accuracy=%g", r->fix.accuracy);
+        }
+        gmtime_r( (time_t*) &r->fix.timestamp, &utc );
+        p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
+        D(temp);
+#endif
+        if (r->callback) {
+            r->callback( &r->fix );
+            r->fix.flags = 0;
+        }
+        else {
+            D("no callback, keeping data until needed !");
+        }
+    }
+#endif
+}
+
+
+static int
+hex2int( char  c )
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* check the '$' ... '*hh' framing of the line [p, end), which ends with
+ * the newline, and parse the sentence if the checksum matches.
+ */
+void
+nmea_reader_sentence( NmeaReader*  r, const char*  p, const char*  end )
+{
+    const char*     q;
+    unsigned char   csum = 0;
+    int             hi, lo;
+
+    // skip any noise in front of the sentence
+    p = memchr(p, '$', end-p);
+    if (p == NULL)
+        return;
+
+    // remove trailing newline
+    end -= 1;
+    if (end > p && end[-1] == '\r')
+        end -= 1;
+
+    if (end < p+4 || end[-3] != '*') {
+        D("no checksum, discarded: '%.*s'", (int)(end-p), p);
+        r->bad_checksums += 1;
+        return;
+    }
+
+    for (q = p+1; q < end-3; q++)
+        csum ^= (unsigned char)*q;
+
+    hi = hex2int(end[-2]);
+    lo = hex2int(end[-1]);
+    if (hi < 0 || lo < 0 || ((hi << 4) | lo) != csum) {
+        D("bad checksum, discarded: '%.*s'", (int)(end-p), p);
+        r->bad_checksums += 1;
+        return;
+    }
+
+    nmea_reader_parse( r, p, end );
+}
+
+/* frame and parse the len bytes just read into r->in after r->pos. Every
+ * complete sentence is parsed in place; a trailing partial one is moved
+ * to the start of the buffer for the next read. Called with the fix lock
+ * held, once per read.
+ */
+void
+nmea_reader_frame( NmeaReader*  r, int  len )
+{
+    char*  p   = r->in;
+    char*  end = r->in + r->pos + len;
+    char*  nl;
+
+    while (p < end && (nl = memchr(p, '\n', end-p)) != NULL) {
+        if (r->overflow)
+            r->overflow = 0;    // tail of a sentence too long to keep
+        else
+            nmea_reader_sentence( r, p, nl+1 );
+        p = nl+1;
+    }
+
+    r->pos = end - p;
+    if (r->pos == (int) sizeof(r->in)) {
+        D("sentence longer than %d bytes, discarded", r->pos);
+        r->overflow = 1;
+        r->pos      = 0;
+    } else if (r->pos > 0 && p != r->in) {
+        memmove( r->in, p, r->pos );
+    }
+}
@@ -0,0 +1,124 @@
+/* //hardware/hw/gps/nmea_parser.h
+**
+** NMEA 0183 sentence framing and parsing for the BUG20 GPS module.
+**
+** Copyright 2006, The Android Open Source Project
+** Copyright 2009, Michael Trimarchi <michael@panicking.kicks-ass.org>
+**
+** This program is free software; you can redistribute it and/or modify it under
+** the terms of the GNU General Public License as published by the Free
+** Software Foundation; either version 2, or (at your option) any later
+** version.
+**
+** This program is distributed in the hope that it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+**
+** You should have received a copy of the GNU General Public License along with
+** this program; if not, write to the Free Software Foundation, Inc., 59
+** Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**/
+
+#ifndef NMEA_PARSER_H
+#define NMEA_PARSER_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* This has no dependencies on the Android headers, so that it can be
+ * built for the host as well as into the HAL.
+ */
+
+#define  NMEA_MAX_SIZE  83
+
+/* Reads from the device go straight into the reader buffer, after any
+ * partial sentence left from the previous read. Proprietary sentences
+ * may be well above NMEA_MAX_SIZE. */
+#define  NMEA_BUFFER_SIZE  1024
+
+#define  NMEA_MAX_SVS  32
+
+/* same values as the GPS_LOCATION_HAS_* flags of the HAL */
+#define  NMEA_HAS_LAT_LONG   0x0001
+#define  NMEA_HAS_ALTITUDE   0x0002
+#define  NMEA_HAS_SPEED      0x0004
+#define  NMEA_HAS_BEARING    0x0008
+#define  NMEA_HAS_ACCURACY   0x0010
+
+/* sentence types, as bits */
+#define  NMEA_GGA  0x0001
+#define  NMEA_GLL  0x0002
+#define  NMEA_GSA  0x0004
+#define  NMEA_GSV  0x0008
+#define  NMEA_RMC  0x0010
+#define  NMEA_VTG  0x0020
+#define  NMEA_ZDA  0x0040
+
+/* the sentences that make up a complete fix, an epoch is over once all of
+ * them that the receiver sends have arrived for the same time of day.
+ */
+#define  NMEA_EPOCH_SENTENCES  (NMEA_GGA | NMEA_RMC | NMEA_GSA)
+
+typedef struct {
+    uint16_t  flags;
+    double    latitude;
+    double    longitude;
+    double    altitude;
+    float     speed;        /* m/s */
+    float     bearing;
+    float     accuracy;
+    int64_t   timestamp;    /* ms since the epoch, UTC */
+} NmeaFix;
+
+typedef struct {
+    int     prn;
+    float   snr;
+    float   elevation;
+    float   azimuth;
+} NmeaSv;
+
+typedef struct {
+    int       num_svs;
+    NmeaSv    sv_list[ NMEA_MAX_SVS ];
+    uint32_t  used_in_fix_mask;
+} NmeaSvStatus;
+
+typedef struct {
+    int     pos;
+    int     overflow;
+    int     utc_year;
+    int     utc_mon;
+    int     utc_day;
+    int     utc_diff;
+    NmeaFix       fix;
+    NmeaSvStatus  sv_status;
+    int     sv_status_changed;
+    int     epoch_time;     /* ms since midnight UTC, -1 if none yet */
+    int     epoch_mask;     /* NMEA_EPOCH_SENTENCES seen for epoch_time */
+    int     epoch_expect;   /* what the receiver sends per epoch */
+    int     epoch_done;
+    int     epochs;         /* completed epochs, only ever increases */
+    int     ubx_pvt;        /* NAV-PVT seen, NAV-SOL is then ignored */
+    int     ubx_itow;       /* ms of GPS week of the NAV-SOL epoch */
+    int     ubx_mask;       /* NAV-SOL, NAV-TIMEUTC of ubx_itow seen */
+    int64_t ubx_utc;        /* NAV-TIMEUTC of ubx_itow in ms, 0 if unknown */
+    int     sentences;
+    int     bad_checksums;
+    char    in[ NMEA_BUFFER_SIZE ];
+} NmeaReader;
+
+void nmea_reader_init( NmeaReader*  r );
+
+/* frame and parse len bytes that were read into r->in + r->pos, there is
+ * room for sizeof(r->in) - r->pos of them.
+ */
+void nmea_reader_frame( NmeaReader*  r, int  len );
+
+/* check and parse the single line [p, end), which ends with the newline */
+void nmea_reader_sentence( NmeaReader*  r, const char*  p, const char*  end );
+
+/* mktime() for a struct tm in UTC */
+time_t nmea_mkgmtime( struct tm*  t );
+
+#endif
@@ -0,0 +1,196 @@
+/* //hardware/hw/gps/nmea_replay.c
+**
+** Host tool: feeds a recorded NMEA or UBX log through the BUG20 parser, the same
+** way gps_state_thread does, and prints the fixes or the parser throughput.
+**
+** Copyright 2009, Michael Trimarchi <michael@panicking.kicks-ass.org>
+**
+** This program is free software; you can redistribute it and/or modify it under
+** the terms of the GNU General Public License as published by the Free
+** Software Foundation; either version 2, or (at your option) any later
+** version.
+**
+** This program is distributed in the hope that it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+**
+** You should have received a copy of the GNU General Public License along with
+** this program; if not, write to the Free Software Foundation, Inc., 59
+** Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nmea_parser.h"
+#include "ubx_parser.h"
+
+static void
+usage( const char*  prog )
+{
+    fprintf(stderr, "usage: %s [-u] [-c chunk] [-b loops] <log>\n"
+                    "  -u        the log is UBX binary, not NMEA\n"
+                    "  -c chunk  bytes per read, as the UART driver would hand them\n"
+                    "            over (default: as much as fits)\n"
+                    "  -b loops  parse the log loops times from memory and print\n"
+                    "            the throughput instead of the fixes\n", prog);
+    exit(1);
+}
+
+static void
+print_fix( NmeaReader*  r )
+{
+    NmeaFix*  f = &r->fix;
+
+    printf("fix %lld", (long long)f->timestamp);
+    if (f->flags & NMEA_HAS_LAT_LONG)
+        printf(" lat=%.7f lon=%.7f", f->latitude, f->longitude);
+    if (f->flags & NMEA_HAS_ALTITUDE)
+        printf(" alt=%.1f", f->altitude);
+    if (f->flags & NMEA_HAS_SPEED)
+        printf(" speed=%.2f", f->speed);
+    if (f->flags & NMEA_HAS_BEARING)
+        printf(" bearing=%.1f", f->bearing);
+    if (f->flags & NMEA_HAS_ACCURACY)
+        printf(" acc=%.2f", f->accuracy);
+    printf("\n");
+    f->flags = 0;
+
+    if (r->sv_status_changed) {
+        printf("svs %d used 0x%08x\n", r->sv_status.num_svs,
+               r->sv_status.used_in_fix_mask);
+        r->sv_status_changed = 0;
+    }
+}
+
+static void (*reader_frame)( NmeaReader*  r, int  len ) = nmea_reader_frame;
+
+static int
+replay( NmeaReader*  r, int  fd, int  chunk )
+{
+    for (;;) {
+        int  room = sizeof(r->in) - r->pos;
+        int  ret;
+
+        if (chunk > 0 && chunk < room)
+            room = chunk;
+
+        do {
+            ret = read( fd, r->in + r->pos, room );
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret <= 0)
+            return ret;
+
+        reader_frame( r, ret );
+
+        if (r->fix.flags & NMEA_HAS_LAT_LONG)
+            print_fix( r );
+    }
+}
+
+static int
+bench( NmeaReader*  r, int  fd, int  chunk, int  loops )
+{
+    struct timespec  t0, t1;
+    char*    log;
+    off_t    size;
+    int      i, sentences = 0;
+    double   secs;
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size <= 0 || lseek(fd, 0, SEEK_SET) < 0)
+        return -1;
+
+    log = malloc(size);
+    if (log == NULL || read(fd, log, size) != size)
+        return -1;
+
+    if (chunk <= 0)
+        chunk = sizeof(r->in);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < loops; i++) {
+        off_t  off = 0;
+
+        nmea_reader_init( r );
+        while (off < size) {
+            int  n = sizeof(r->in) - r->pos;
+
+            if (n > chunk)
+                n = chunk;
+            if (n > size - off)
+                n = size - off;
+
+            memcpy( r->in + r->pos, log + off, n );
+            reader_frame( r, n );
+            off += n;
+        }
+        sentences += r->sentences;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%d sentences in %.3f s: %.0f sentences/s, %.1f MB/s, %d bad checksums per pass\n",
+           sentences, secs, sentences / secs,
+           (double)size * loops / secs / 1e6, r->bad_checksums);
+
+    free(log);
+    return 0;
+}
+
+int
+main( int  argc, char**  argv )
+{
+    static NmeaReader  reader;
+    int  chunk = 0;
+    int  loops = 0;
+    int  fd, opt, ret;
+
+    while ((opt = getopt(argc, argv, "uc:b:")) != -1) {
+        switch (opt) {
+        case 'u':
+            reader_frame = ubx_reader_frame;
+            break;
+        case 'c':
+            chunk = atoi(optarg);
+            break;
+        case 'b':
+            loops = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    nmea_reader_init( &reader );
+
+    if (loops > 0)
+        ret = bench( &reader, fd, chunk, loops );
+    else
+        ret = replay( &reader, fd, chunk );
+
+    if (ret < 0)
+        fprintf(stderr, "%s: read failed: %s\n", argv[optind], strerror(errno));
+    else if (loops == 0)
+        printf("%d sentences, %d bad checksums\n", reader.sentences,
+               reader.bad_checksums);
+
+    close(fd);
+    return ret < 0;
+}
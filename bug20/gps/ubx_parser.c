@@ -0,0 +1,375 @@
+/* //hardware/hw/gps/ubx_parser.c
+**
+** u-blox UBX binary protocol framing and decoding for the BUG20 GPS module.
+** Fills the same NmeaReader fix and satellite status as the NMEA parser,
+** straight from the binary fields.
+**
+** This program is free software; you can redistribute it and/or modify it under
+** the terms of the GNU General Public License as published by the Free
+** Software Foundation; either version 2, or (at your option) any later
+** version.
+**
+** This program is distributed in the hope that it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+**
+** You should have received a copy of the GNU General Public License along with
+** this program; if not, write to the Free Software Foundation, Inc., 59
+** Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**/
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "ubx_parser.h"
+
+#define  GPS_DEBUG  0
+
+#if GPS_DEBUG
+#  define  LOG_TAG  "gps"
+#  include <cutils/log.h>
+#  define  D(...)   LOGD(__VA_ARGS__)
+#else
+#  define  D(...)   ((void)0)
+#endif
+
+/* NAV-SOL and NAV-TIMEUTC seen for ubx_itow */
+#define  UBX_EPOCH_SOL      0x01
+#define  UBX_EPOCH_TIMEUTC  0x02
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       F I E L D S                                     *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* UBX is little endian, whatever the host is */
+static unsigned
+ubx_u2( const unsigned char*  p )
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+ubx_u4( const unsigned char*  p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int32_t
+ubx_i4( const unsigned char*  p )
+{
+    return (int32_t)ubx_u4(p);
+}
+
+/* UTC date and time to ms since the epoch, nano may be negative */
+static int64_t
+ubx_utc_ms( int year, int month, int day, int hour, int min, int sec,
+            int32_t nano )
+{
+    struct tm  tm;
+    int64_t    ms;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon  = month - 1;
+    tm.tm_mday = day;
+    tm.tm_hour = hour;
+    tm.tm_min  = min;
+    tm.tm_sec  = sec;
+
+    ms = (int64_t)nmea_mkgmtime(&tm) * 1000;
+    if (nano >= 0)
+        ms += nano / 1000000;
+    else
+        ms -= (-nano + 999999) / 1000000;
+    return ms;
+}
+
+/* WGS84 ECEF to geodetic, Bowring's method. Good to well below a
+ * millimetre near the surface of the earth. */
+static void
+ubx_ecef_to_lla( double x, double y, double z,
+                 double*  lat, double*  lon, double*  alt )
+{
+    static const double  a   = 6378137.0;
+    static const double  f   = 1.0 / 298.257223563;
+    double  b   = a * (1.0 - f);
+    double  e2  = f * (2.0 - f);
+    double  ep2 = (a*a - b*b) / (b*b);
+    double  p   = sqrt(x*x + y*y);
+    double  th  = atan2(z * a, p * b);
+    double  st  = sin(th), ct = cos(th);
+    double  phi = atan2(z + ep2 * b * st*st*st, p - e2 * a * ct*ct*ct);
+    double  sp  = sin(phi);
+    double  n   = a / sqrt(1.0 - e2 * sp*sp);
+
+    *lat = phi * 180.0 / M_PI;
+    *lon = atan2(y, x) * 180.0 / M_PI;
+    *alt = p / cos(phi) - n;
+}
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       M E S S A G E S                                 *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* NAV-PVT: the whole epoch in one message */
+static void
+ubx_reader_nav_pvt( NmeaReader*  r, const unsigned char*  m, int  len )
+{
+    int  valid, fix_type, flags;
+
+    if (len < 84)
+        return;
+
+    r->ubx_pvt = 1;
+
+    valid    = m[11];
+    fix_type = m[20];
+    flags    = m[21];
+
+    // validDate and validTime
+    if ((valid & 0x03) == 0x03)
+        r->fix.timestamp = ubx_utc_ms(ubx_u2(m+4), m[6], m[7], m[8], m[9],
+                                      m[10], ubx_i4(m+16));
+
+    // 2D or 3D, and gnssFixOK
+    if (fix_type >= 2 && fix_type <= 4 && (flags & 0x01)) {
+        r->fix.flags    |= NMEA_HAS_LAT_LONG | NMEA_HAS_ALTITUDE |
+                           NMEA_HAS_SPEED | NMEA_HAS_BEARING |
+                           NMEA_HAS_ACCURACY;
+        r->fix.longitude = ubx_i4(m+24) * 1e-7;
+        r->fix.latitude  = ubx_i4(m+28) * 1e-7;
+        r->fix.altitude  = ubx_i4(m+36) / 1000.0;   // above mean sea level
+        r->fix.accuracy  = ubx_u4(m+40) / 1000.0;   // horizontal
+        r->fix.speed     = ubx_i4(m+60) / 1000.0;   // ground speed
+        r->fix.bearing   = ubx_i4(m+64) * 1e-5;
+    }
+
+    r->epochs += 1;
+}
+
+/* NAV-SOL and NAV-TIMEUTC of the same iTOW make an epoch */
+static void
+ubx_reader_epoch( NmeaReader*  r, uint32_t  itow, int  part )
+{
+    if ((int)itow != r->ubx_itow) {
+        r->ubx_itow = itow;
+        r->ubx_mask = 0;
+    }
+
+    r->ubx_mask |= part;
+
+    if (r->ubx_mask == (UBX_EPOCH_SOL | UBX_EPOCH_TIMEUTC)) {
+        r->fix.timestamp = r->ubx_utc;
+        r->ubx_mask = 0;
+        r->epochs += 1;
+    }
+}
+
+/* NAV-TIMEUTC, for the timestamp of a NAV-SOL */
+static void
+ubx_reader_nav_timeutc( NmeaReader*  r, const unsigned char*  m, int  len )
+{
+    if (len < 20 || r->ubx_pvt)
+        return;
+
+    // validUTC
+    if (m[19] & 0x04)
+        r->ubx_utc = ubx_utc_ms(ubx_u2(m+12), m[14], m[15], m[16], m[17],
+                                m[18], ubx_i4(m+8));
+    else
+        r->ubx_utc = 0;
+
+    ubx_reader_epoch(r, ubx_u4(m), UBX_EPOCH_TIMEUTC);
+}
+
+/* NAV-SOL: ECEF position and velocity, for receivers without NAV-PVT */
+static void
+ubx_reader_nav_sol( NmeaReader*  r, const unsigned char*  m, int  len )
+{
+    int  fix_type, flags;
+
+    if (len < 52 || r->ubx_pvt)
+        return;
+
+    fix_type = m[10];
+    flags    = m[11];
+
+    // 2D or 3D, and gpsFixOK
+    if (fix_type >= 2 && fix_type <= 4 && (flags & 0x01)) {
+        double  lat, lon, alt;
+        double  vx = ubx_i4(m+28) / 100.0;
+        double  vy = ubx_i4(m+32) / 100.0;
+        double  vz = ubx_i4(m+36) / 100.0;
+        double  sl, cl, sp, cp, ve, vn;
+
+        ubx_ecef_to_lla(ubx_i4(m+12) / 100.0, ubx_i4(m+16) / 100.0,
+                        ubx_i4(m+20) / 100.0, &lat, &lon, &alt);
+
+        // ECEF velocity to east and north
+        sl = sin(lon * M_PI / 180.0);
+        cl = cos(lon * M_PI / 180.0);
+        sp = sin(lat * M_PI / 180.0);
+        cp = cos(lat * M_PI / 180.0);
+        ve = -sl * vx + cl * vy;
+        vn = -sp * cl * vx - sp * sl * vy + cp * vz;
+
+        r->fix.flags    |= NMEA_HAS_LAT_LONG | NMEA_HAS_ALTITUDE |
+                           NMEA_HAS_SPEED | NMEA_HAS_BEARING |
+                           NMEA_HAS_ACCURACY;
+        r->fix.latitude  = lat;
+        r->fix.longitude = lon;
+        r->fix.altitude  = alt;                     // above the ellipsoid
+        r->fix.accuracy  = ubx_u4(m+24) / 100.0;    // 3D
+        r->fix.speed     = sqrt(ve*ve + vn*vn);
+        r->fix.bearing   = atan2(ve, vn) * 180.0 / M_PI;
+        if (r->fix.bearing < 0)
+            r->fix.bearing += 360.0;
+    }
+
+    ubx_reader_epoch(r, ubx_u4(m), UBX_EPOCH_SOL);
+}
+
+/* NAV-SVINFO: the satellites in view, GPS ones only */
+static void
+ubx_reader_nav_svinfo( NmeaReader*  r, const unsigned char*  m, int  len )
+{
+    int  num_ch, i;
+
+    if (len < 8)
+        return;
+
+    num_ch = m[4];
+    if (len < 8 + num_ch * 12)
+        return;
+
+    r->sv_status.num_svs = 0;
+    r->sv_status.used_in_fix_mask = 0ul;
+
+    for (i = 0; i < num_ch && r->sv_status.num_svs < NMEA_MAX_SVS; i++) {
+        const unsigned char*  sv = m + 8 + i * 12;
+        int   prn = sv[1];
+        NmeaSv*  info;
+
+        if (prn < 1 || prn > 32)
+            continue;
+
+        info = &r->sv_status.sv_list[r->sv_status.num_svs++];
+        info->prn       = prn;
+        info->snr       = sv[4];
+        info->elevation = (signed char)sv[5];
+        info->azimuth   = (int16_t)ubx_u2(sv+6);
+
+        // svUsed, same mask layout as the GSA parser
+        if (sv[2] & 0x01)
+            r->sv_status.used_in_fix_mask |= (1ul << (32 - prn));
+    }
+
+    r->sv_status_changed = 1;
+}
+
+static void
+ubx_reader_parse( NmeaReader*  r, int  cls, int  id,
+                  const unsigned char*  m, int  len )
+{
+    if (cls != UBX_CLASS_NAV) {
+        D("UBX %02x-%02x ignored", cls, id);
+        return;
+    }
+
+    switch (id) {
+    case UBX_NAV_PVT:
+        ubx_reader_nav_pvt(r, m, len);
+        break;
+    case UBX_NAV_SOL:
+        ubx_reader_nav_sol(r, m, len);
+        break;
+    case UBX_NAV_TIMEUTC:
+        ubx_reader_nav_timeutc(r, m, len);
+        break;
+    case UBX_NAV_SVINFO:
+        ubx_reader_nav_svinfo(r, m, len);
+        break;
+    default:
+        D("UBX NAV-%02x ignored", id);
+        return;
+    }
+
+    r->sentences += 1;
+}
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       F R A M I N G                                   *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+static int
+ubx_checksum_ok( const unsigned char*  p, int  len )
+{
+    unsigned char  ck_a = 0, ck_b = 0;
+    int            i;
+
+    // over class, id, length and payload
+    for (i = 2; i < UBX_HEADER_SIZE + len; i++) {
+        ck_a += p[i];
+        ck_b += ck_a;
+    }
+
+    return p[UBX_HEADER_SIZE + len] == ck_a &&
+           p[UBX_HEADER_SIZE + len + 1] == ck_b;
+}
+
+void
+ubx_reader_frame( NmeaReader*  r, int  len )
+{
+    unsigned char*  p   = (unsigned char*) r->in;
+    unsigned char*  end = p + r->pos + len;
+
+    while (end - p >= UBX_FRAME_SIZE(0)) {
+        int  size;
+
+        // skip anything that is not a frame, eg. NMEA text
+        if (p[0] != UBX_SYNC1 || p[1] != UBX_SYNC2) {
+            unsigned char*  q = memchr(p+1, UBX_SYNC1, end-p-1);
+            p = q ? q : end;
+            continue;
+        }
+
+        size = ubx_u2(p+4);
+        if (UBX_FRAME_SIZE(size) > (int) sizeof(r->in)) {
+            D("UBX length %d is bogus, resyncing", size);
+            r->bad_checksums += 1;
+            p += 2;
+            continue;
+        }
+
+        if (end - p < UBX_FRAME_SIZE(size))
+            break;      // the rest comes with the next read
+
+        if (!ubx_checksum_ok(p, size)) {
+            D("UBX %02x-%02x bad checksum, resyncing", p[2], p[3]);
+            r->bad_checksums += 1;
+            p += 2;
+            continue;
+        }
+
+        ubx_reader_parse( r, p[2], p[3], p + UBX_HEADER_SIZE, size );
+        p += UBX_FRAME_SIZE(size);
+    }
+
+    r->pos = end - p;
+    if (r->pos > 0 && p != (unsigned char*) r->in)
+        memmove( r->in, p, r->pos );
+}
@@ -0,0 +1,47 @@
+/* //hardware/hw/gps/ubx_parser.h
+**
+** u-blox UBX binary protocol framing and decoding for the BUG20 GPS module.
+**
+** This program is free software; you can redistribute it and/or modify it under
+** the terms of the GNU General Public License as published by the Free
+** Software Foundation; either version 2, or (at your option) any later
+** version.
+**
+** This program is distributed in the hope that it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+**
+** You should have received a copy of the GNU General Public License along with
+** this program; if not, write to the Free Software Foundation, Inc., 59
+** Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**/
+
+#ifndef UBX_PARSER_H
+#define UBX_PARSER_H
+
+#include "nmea_parser.h"
+
+#define  UBX_SYNC1   0xb5
+#define  UBX_SYNC2   0x62
+
+/* sync chars, class, id and length before the payload, checksum after */
+#define  UBX_HEADER_SIZE  6
+#define  UBX_FRAME_SIZE(len)  (UBX_HEADER_SIZE + (len) + 2)
+
+#define  UBX_CLASS_NAV   0x01
+#define  UBX_CLASS_CFG   0x06
+
+#define  UBX_NAV_SOL      0x06
+#define  UBX_NAV_PVT      0x07    /* u-blox 7 and later */
+#define  UBX_NAV_TIMEUTC  0x21
+#define  UBX_NAV_SVINFO   0x30
+
+/* The binary counterpart of nmea_reader_frame(): frames and checks the
+ * UBX messages among len bytes read into r->in + r->pos, and fills the
+ * same fix and satellite status. An epoch is a NAV-PVT, or a NAV-SOL and
+ * NAV-TIMEUTC pair on receivers without it.
+ */
+void ubx_reader_frame( NmeaReader*  r, int  len );
+
+#endif
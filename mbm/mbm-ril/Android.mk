@@ -29,6 +29,8 @@ LOCAL_SRC_FILES:= \
     u300-ril-oem.h \
     u300-ril-error.c \
     u300-ril-error.h \
+    u300-ril-cache.c \
+    u300-ril-cache.h \
     atchannel.c \
     atchannel.h \
     misc.c \
@@ -62,3 +64,103 @@ LOCAL_CFLAGS += -DRIL_SHLIB
 LOCAL_CFLAGS += -Wall
 LOCAL_MODULE:= libmbm-ril
 include $(BUILD_SHARED_LIBRARY)
+
+# The AT channel on its own, for replaying the recorded modem transcripts
+# in transcripts/ on the host and measuring the reader.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := at_replay
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+    at_replay.c \
+    atchannel.c \
+    at_tok.c \
+    misc.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE -Wall
+LOCAL_STATIC_LIBRARIES := liblog
+LOCAL_LDLIBS += -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# libFuzzer target for at_tok_parse() and at_tok_nextgroup(), build with a
+# clang that supports -fsanitize=fuzzer and run as
+# "at_tok_fuzz at_tok_corpus".
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := at_tok_fuzz
+LOCAL_MODULE_TAGS := optional
+LOCAL_CLANG := true
+
+LOCAL_SRC_FILES := \
+    at_tok_fuzz.c \
+    at_tok.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE -Wall -g -fsanitize=fuzzer,address,undefined
+LOCAL_LDFLAGS += -fsanitize=fuzzer,address,undefined
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# The same parses timed against the at_tok_next*() chains, run as
+# "at_tok_bench at_tok_corpus/*".
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := at_tok_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+    at_tok_fuzz.c \
+    at_tok.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE -Wall -O2 -DAT_TOK_BENCH
+LOCAL_LDLIBS += -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# The hex codec in misc.c timed against the code it replaced and against
+# word at a time and NEON versions, run as "hex_bench" on the host or as
+# "hex_bench_neon" on the target, where the NEON version is built in.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hex_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+    hex_bench.c \
+    misc.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE -Wall -O2
+LOCAL_LDLIBS += -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hex_bench_neon
+LOCAL_MODULE_TAGS := optional
+LOCAL_ARM_NEON := true
+
+LOCAL_SRC_FILES := \
+    hex_bench.c \
+    misc.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE -Wall -O2
+
+include $(BUILD_EXECUTABLE)
+
+# ifc_nl_configure() and ifc_configure() against a veth pair in a network
+# namespace of its own, run as "ifc_test.sh ifc_test" on the host.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := ifc_test
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+    ifc_test.c \
+    net-utils.c
+
+LOCAL_CFLAGS := -D_GNU_SOURCE -Wall
+LOCAL_STATIC_LIBRARIES := liblog
+
+include $(BUILD_HOST_EXECUTABLE)
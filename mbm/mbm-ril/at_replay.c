@@ -0,0 +1,379 @@
+/* ST-Ericsson U300 RIL
+**
+** Host tool: replays a recorded AT transcript through atchannel over a socket
+** pair, with a thread playing the modem, and prints the reader, response
+** allocation and URC dispatch statistics or the throughput.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * A transcript is a text file, see transcripts/. Lines starting with "AT"
+ * are commands the RIL sends, lines starting with '#' are comments, and
+ * every other line is sent by the modem, framed by CR LF. The modem
+ * thread holds back what follows a command until the command has come
+ * in, and the next command only goes out once everything before it has
+ * been read, so the URCs after a response can not be taken for the
+ * response to the next command. Replays are thereby repeatable.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atchannel.h"
+
+struct step {
+    char *command;      /* NULL for the URCs before the first command. */
+    char *prefix;       /* Intermediate response prefix, NULL if none. */
+    char *output;       /* What the modem sends after the command. */
+    size_t outputLen;
+    int lines;
+};
+
+static struct step *s_steps;
+static int s_stepCount;
+static int s_loops = 1;
+static int s_chunk;
+static int s_modemFd;
+static int s_unsolicited;
+static int s_linear;
+static int s_linearCompares;
+static int s_linearHandled;
+
+static void onUrc(const char *s, const char *sms_pdu)
+{
+    (void) s; (void) sms_pdu;
+}
+
+/* The URCs u300-ril.c registers, in its order. */
+static const char *s_urcPrefixes[] = {
+    "*ETZV:", "*EPEV", "*ESIMSR", "*E2NAP:", "*EESIMSWAP:", "+CRING:",
+    "RING", "NO CARRIER", "+CCWA", "BUSY", "+CREG:", "+CGREG:", "+CMT:",
+    "+CBM:", "+CMTI:", "+CDS:", "+CIEV: 2", "+CSSI:", "+CSSU:", "+CUSD:",
+    "*STKEND"
+};
+
+#define URC_PREFIXES (sizeof(s_urcPrefixes) / sizeof(s_urcPrefixes[0]))
+
+/* The strStartsWith() chain the RIL used before at_dispatch_unsol(). */
+static void dispatchLinear(const char *s)
+{
+    size_t i;
+
+    for (i = 0; i < URC_PREFIXES; i++) {
+        s_linearCompares++;
+        if (strncmp(s, s_urcPrefixes[i], strlen(s_urcPrefixes[i])) == 0) {
+            s_linearHandled++;
+            return;
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-l] [-c chunk] [-b loops] <transcript>\n"
+                    "  -l        dispatch URCs with a linear prefix scan instead\n"
+                    "            of at_dispatch_unsol(), for comparison\n"
+                    "  -c chunk  bytes per write by the modem, as the UART\n"
+                    "            driver would hand them over (default: all)\n"
+                    "  -b loops  replay the transcript loops times and print\n"
+                    "            the throughput\n", prog);
+    exit(1);
+}
+
+static void appendOutput(struct step *st, const char *line)
+{
+    size_t len = strlen(line);
+
+    st->output = realloc(st->output, st->outputLen + len + 5);
+    if (st->output == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    memcpy(st->output + st->outputLen, "\r\n", 2);
+    memcpy(st->output + st->outputLen + 2, line, len);
+    memcpy(st->output + st->outputLen + 2 + len, "\r\n", 3);
+    st->outputLen += len + 4;
+    st->lines++;
+}
+
+/* "AT+COPS=?" expects "+COPS:" lines, "ATE0" none. */
+static char *commandPrefix(const char *command)
+{
+    const char *p = command + 2;
+    char *prefix;
+    size_t len;
+
+    if (*p != '+' && *p != '*')
+        return NULL;
+
+    len = strcspn(p, "=?");
+    prefix = malloc(len + 2);
+    if (prefix == NULL)
+        return NULL;
+    memcpy(prefix, p, len);
+    prefix[len] = ':';
+    prefix[len + 1] = '\0';
+
+    return prefix;
+}
+
+static void loadTranscript(const char *path)
+{
+    char *line = NULL;
+    size_t size = 0;
+    FILE *f;
+    struct step *st;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    s_steps = calloc(1, sizeof(struct step));
+    s_stepCount = 1;
+
+    while (getline(&line, &size, f) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+
+        if (strncmp(line, "AT", 2) == 0) {
+            s_steps = realloc(s_steps, (s_stepCount + 1) * sizeof(struct step));
+            if (s_steps == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            st = &s_steps[s_stepCount++];
+            memset(st, 0, sizeof(*st));
+            st->command = strdup(line);
+            st->prefix = commandPrefix(line);
+            continue;
+        }
+
+        appendOutput(&s_steps[s_stepCount - 1], line);
+    }
+
+    free(line);
+    fclose(f);
+}
+
+static void modemWrite(const char *buf, size_t len)
+{
+    while (len > 0) {
+        size_t n = len;
+        ssize_t ret;
+
+        if (s_chunk > 0 && n > (size_t) s_chunk)
+            n = s_chunk;
+
+        ret = write(s_modemFd, buf, n);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/* Reads up to and including the next CR, the end of a command line. */
+static int modemReadCommand(void)
+{
+    char c;
+    ssize_t ret;
+
+    do {
+        ret = read(s_modemFd, &c, 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+    } while (c != '\r');
+
+    return 0;
+}
+
+static void *modemLoop(void *arg)
+{
+    int loop, i;
+    (void) arg;
+
+    for (loop = 0; loop < s_loops; loop++) {
+        for (i = 0; i < s_stepCount; i++) {
+            if (s_steps[i].command != NULL && modemReadCommand() < 0)
+                return NULL;
+            modemWrite(s_steps[i].output, s_steps[i].outputLen);
+        }
+    }
+
+    /* The final "AT", everything before it has been read once it is OK. */
+    if (modemReadCommand() == 0)
+        modemWrite("\r\nOK\r\n", 6);
+
+    return NULL;
+}
+
+/* Waits until the reader has handled lines lines in total. */
+static void waitForLines(int lines)
+{
+    struct at_stats stats;
+
+    for (;;) {
+        at_get_stats(&stats);
+        if (stats.lines >= lines)
+            return;
+        sched_yield();
+    }
+}
+
+static void onUnsolicited(const char *s, const char *sms_pdu)
+{
+    s_unsolicited++;
+
+    if (s_linear)
+        dispatchLinear(s);
+    else
+        at_dispatch_unsol(s, sms_pdu);
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec t0, t1;
+    struct at_stats stats;
+    pthread_t modem;
+    int fds[2];
+    int commands = 0, failed = 0, lines = 0;
+    int loop, i, opt, err;
+    double secs;
+
+    while ((opt = getopt(argc, argv, "lc:b:")) != -1) {
+        switch (opt) {
+        case 'l':
+            s_linear = 1;
+            break;
+        case 'c':
+            s_chunk = atoi(optarg);
+            break;
+        case 'b':
+            s_loops = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || s_loops < 1)
+        usage(argv[0]);
+
+    loadTranscript(argv[optind]);
+
+    for (i = 0; i < (int) URC_PREFIXES; i++)
+        at_register_unsol_handler(s_urcPrefixes[i], onUrc);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    s_modemFd = fds[1];
+
+    if (pthread_create(&modem, NULL, modemLoop, NULL) != 0) {
+        perror("pthread_create");
+        return 1;
+    }
+
+    if (at_open(fds[0], onUnsolicited) < 0) {
+        fprintf(stderr, "at_open failed\n");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (loop = 0; loop < s_loops; loop++) {
+        for (i = 0; i < s_stepCount; i++) {
+            const struct step *st = &s_steps[i];
+            ATResponse *response = NULL;
+
+            if (st->command != NULL)
+                waitForLines(lines);
+            lines += st->lines;
+
+            if (st->command == NULL)
+                continue;
+
+            if (st->prefix != NULL)
+                err = at_send_command_multiline(st->command, st->prefix,
+                                                &response);
+            else
+                err = at_send_command(st->command, &response);
+
+            commands++;
+            if (err < 0 || response->success == 0) {
+                failed++;
+                if (s_loops == 1)
+                    fprintf(stderr, "%s: %s\n", st->command,
+                            err < 0 ? "no response" : response->finalResponse);
+            }
+            at_response_free(response);
+        }
+    }
+
+    waitForLines(lines);
+    err = at_send_command("AT", NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (err < 0) {
+        fprintf(stderr, "modem went away\n");
+        return 1;
+    }
+
+    at_get_stats(&stats);
+
+    if (s_loops > 1) {
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%d lines in %.3f s: %.0f lines/s, %.1f MB/s\n",
+               stats.lines, secs, stats.lines / secs,
+               stats.readBytes / secs / 1e6);
+    }
+
+    printf("%d commands, %d failed, %d unsolicited\n", commands, failed,
+           s_unsolicited);
+    printf("reader: %d bytes, %d lines, %d compactions, %d buffer grows\n",
+           stats.readBytes, stats.lines, stats.compactions, stats.grows);
+    /* Without the arena every intermediate cost an ATLine and a strdup(). */
+    printf("responses: %d allocated, %d intermediates, %d extra arena "
+           "chunks, %d mallocs (%d with one per line)\n", stats.responses,
+           stats.intermediates, stats.arenaChunks,
+           stats.responses + stats.arenaChunks,
+           stats.responses + 2 * stats.intermediates);
+    if (s_linear)
+        printf("urcs: %d dispatched, %d handled, %d prefix compares\n",
+               s_unsolicited, s_linearHandled, s_linearCompares);
+    else
+        printf("urcs: %d dispatched, %d handled, %d prefix compares\n",
+               stats.unsolDispatched, stats.unsolHandled,
+               stats.unsolCompares);
+
+    return failed != 0;
+}
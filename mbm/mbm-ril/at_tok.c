@@ -206,3 +206,115 @@ int at_tok_charcounter(char *p_in, char needle, int *p_out)
     *p_out = num_found;
     return 0;
 }
+
+/**
+ * Finds the next parenthesized group, as in "+COPS: (1,"A","B","1"),(..)".
+ * *p_out points to the group contents, NUL terminated in place, and
+ * *p_cur is moved past it. Parentheses within quotes are skipped.
+ * Returns -1 when there are no more groups, or at an empty list element,
+ * which ends the groups in eg +COPS=?.
+ */
+int at_tok_nextgroup(char **p_cur, char **p_out)
+{
+    char *p = *p_cur;
+    int quoted = 0;
+
+    if (p == NULL)
+        return -1;
+
+    skipWhiteSpace(&p);
+    if (*p == ',') {
+        p++;
+        skipWhiteSpace(&p);
+    }
+    if (*p != '(')
+        return -1;
+
+    *p_out = ++p;
+    for (; *p != '\0'; p++) {
+        if (*p == '"')
+            quoted = !quoted;
+        else if (*p == ')' && !quoted)
+            break;
+    }
+    if (*p != ')')
+        return -1;
+
+    *p++ = '\0';
+    *p_cur = p;
+
+    return 0;
+}
+
+/* A number must make up the whole field, up to trailing spaces. */
+static int endOfField(const char *end)
+{
+    while (*end == ' ')
+        end++;
+    return *end == '\0';
+}
+
+/**
+ * Parses the rest of an AT response line, as tokenized by the functions
+ * above, into record according to the count fields of the format.
+ * Values past the last field are ignored.
+ *
+ * Returns the number of fields present on the line, or -(n + 1) when
+ * field n is missing or malformed. Updates *p_cur.
+ */
+int at_tok_parse(char **p_cur, const struct at_tok_field *fields, int count,
+                 void *record)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        void *out = (char *) record + fields[i].offset;
+        int optional = fields[i].type & AT_TOK_OPTIONAL;
+        int type = fields[i].type & ~AT_TOK_OPTIONAL;
+        char *tok;
+        char *end;
+        long l;
+
+        if (*p_cur == NULL)
+            return optional ? i : -(i + 1);
+
+        tok = nextTok(p_cur);
+        if (tok == NULL)
+            return optional ? i : -(i + 1);
+
+        if (*tok == '\0' && optional && type != AT_TOK_STR)
+            continue;
+
+        switch (type) {
+        case AT_TOK_INT:
+        case AT_TOK_BOOL:
+            l = strtol(tok, &end, 10);
+            if (end == tok || !endOfField(end))
+                return -(i + 1);
+            if (type == AT_TOK_INT) {
+                *(int *) out = (int) l;
+            } else {
+                if (l != 0 && l != 1)
+                    return -(i + 1);
+                *(char *) out = (char) l;
+            }
+            break;
+
+        case AT_TOK_HEXINT:
+            l = strtoul(tok, &end, 16);
+            if (end == tok || !endOfField(end))
+                return -(i + 1);
+            *(int *) out = (int) l;
+            break;
+
+        case AT_TOK_STR:
+            *(char **) out = tok;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return count;
+}
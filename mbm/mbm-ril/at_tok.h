@@ -18,6 +18,8 @@
 #ifndef AT_TOK_H
 #define AT_TOK_H 1
 
+#include <stddef.h>
+
 int at_tok_start(char **p_cur);
 int at_tok_nextint(char **p_cur, int *p_out);
 int at_tok_nexthexint(char **p_cur, int *p_out);
@@ -28,4 +30,40 @@ int at_tok_nextstr(char **p_cur, char **out);
 int at_tok_hasmore(char **p_cur);
 
 int at_tok_charcounter(char *p_in, char needle, int *p_out);
+
+int at_tok_nextgroup(char **p_cur, char **p_out);
+
+/*
+ * Record parsing. A format is an array of fields, one per comma
+ * separated value, giving its type and where in the record it is
+ * stored. Fields marked AT_TOK_OPTIONAL may be missing at the end of the
+ * line, or empty if numeric, and then keep what the record held before.
+ * A numeric field with anything but spaces after the number is malformed.
+ * Strings point into the line, which is modified in place as with the
+ * functions above.
+ */
+enum at_tok_type {
+    AT_TOK_INT,         /* int, base 10 */
+    AT_TOK_HEXINT,      /* int, base 16, quoted or not */
+    AT_TOK_BOOL,        /* char, 0 or 1 */
+    AT_TOK_STR,         /* char *, quotes removed */
+    AT_TOK_SKIP         /* Not stored */
+};
+
+#define AT_TOK_OPTIONAL 0x80
+
+struct at_tok_field {
+    unsigned char type;         /* at_tok_type, may be or:ed with AT_TOK_OPTIONAL */
+    unsigned short offset;      /* offsetof() the record member */
+};
+
+#define AT_TOK_FIELD(type, record, member) { (type), offsetof(record, member) }
+#define AT_TOK_SKIPPED { AT_TOK_SKIP, 0 }
+
+int at_tok_parse(char **p_cur, const struct at_tok_field *fields, int count,
+                 void *record);
+
+/* Index of the failing field for a negative at_tok_parse() return. */
+#define AT_TOK_ERROR_FIELD(ret) (-(ret) - 1)
+
 #endif
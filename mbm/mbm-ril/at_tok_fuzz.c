@@ -0,0 +1,388 @@
+/* ST-Ericsson U300 RIL
+**
+** Host libFuzzer target for at_tok_parse() and at_tok_nextgroup() with the
+** record formats the RIL uses, and, built with -DAT_TOK_BENCH, a benchmark
+** of the same parses against the at_tok_next*() chains they replaced.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * An input is one response line after a selector character, the low two
+ * bits of which pick the format: '0' +CLCC, '1' +COPS=? groups, '2'
+ * +CREG/+CGREG, '3' *E2IPCFG groups. See at_tok_corpus/.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "at_tok.h"
+
+#define NUM_ELEMS(x) (sizeof(x) / sizeof(x[0]))
+
+/* The formats below are copies of the ones in u300-ril.c,
+   u300-ril-network.c and u300-ril-pdp.c. */
+
+struct clccRecord {
+    int index;
+    char isMT;
+    int state;
+    int mode;
+    char isMpty;
+    char *number;
+    int toa;
+    char *name;
+    int priority;
+    int causeNoCLI;
+};
+
+static const struct at_tok_field s_clccFormat[] = {
+    AT_TOK_FIELD(AT_TOK_INT, struct clccRecord, index),
+    AT_TOK_FIELD(AT_TOK_BOOL, struct clccRecord, isMT),
+    AT_TOK_FIELD(AT_TOK_INT, struct clccRecord, state),
+    AT_TOK_FIELD(AT_TOK_INT, struct clccRecord, mode),
+    AT_TOK_FIELD(AT_TOK_BOOL, struct clccRecord, isMpty),
+    AT_TOK_FIELD(AT_TOK_STR | AT_TOK_OPTIONAL, struct clccRecord, number),
+    AT_TOK_FIELD(AT_TOK_INT | AT_TOK_OPTIONAL, struct clccRecord, toa),
+    AT_TOK_FIELD(AT_TOK_STR | AT_TOK_OPTIONAL, struct clccRecord, name),
+    AT_TOK_FIELD(AT_TOK_INT | AT_TOK_OPTIONAL, struct clccRecord, priority),
+    AT_TOK_FIELD(AT_TOK_INT | AT_TOK_OPTIONAL, struct clccRecord, causeNoCLI)
+};
+
+struct copsRecord {
+    int status;
+    char *longAlphaNumeric;
+    char *shortAlphaNumeric;
+    char *numeric;
+};
+
+static const struct at_tok_field s_copsFormat[] = {
+    AT_TOK_FIELD(AT_TOK_INT, struct copsRecord, status),
+    AT_TOK_FIELD(AT_TOK_STR, struct copsRecord, longAlphaNumeric),
+    AT_TOK_FIELD(AT_TOK_STR, struct copsRecord, shortAlphaNumeric),
+    AT_TOK_FIELD(AT_TOK_STR, struct copsRecord, numeric)
+};
+
+struct regRecord {
+    int n;
+    int stat;
+    int lac;
+    int cid;
+    int act;
+};
+
+static const struct at_tok_field s_regFormat[] = {
+    AT_TOK_FIELD(AT_TOK_INT, struct regRecord, n),
+    AT_TOK_FIELD(AT_TOK_INT, struct regRecord, stat),
+    AT_TOK_FIELD(AT_TOK_HEXINT | AT_TOK_OPTIONAL, struct regRecord, lac),
+    AT_TOK_FIELD(AT_TOK_HEXINT | AT_TOK_OPTIONAL, struct regRecord, cid),
+    AT_TOK_FIELD(AT_TOK_INT | AT_TOK_OPTIONAL, struct regRecord, act)
+};
+
+struct ipcfgRecord {
+    int stat;
+    char *address;
+};
+
+static const struct at_tok_field s_ipcfgFormat[] = {
+    AT_TOK_FIELD(AT_TOK_INT, struct ipcfgRecord, stat),
+    AT_TOK_FIELD(AT_TOK_STR, struct ipcfgRecord, address)
+};
+
+enum {
+    KIND_CLCC,
+    KIND_COPS,
+    KIND_REG,
+    KIND_IPCFG
+};
+
+static const char *kindNames[] = { "CLCC", "COPS", "CREG", "E2IPCFG" };
+
+/* A string field must point into the line. */
+static void checkString(const char *s, const char *line, size_t len)
+{
+    if (s != NULL && (s < line || s > line + len))
+        abort();
+}
+
+/* Parses line, modified in place, and returns the records found. */
+static int parseLine(int kind, char *line, size_t len)
+{
+    char *p = line;
+    char *group;
+    int records = 0;
+    int ret;
+
+    if (at_tok_start(&p) < 0)
+        return 0;
+
+    switch (kind) {
+    case KIND_CLCC: {
+        struct clccRecord clcc = { .number = NULL, .name = NULL };
+
+        ret = at_tok_parse(&p, s_clccFormat, NUM_ELEMS(s_clccFormat), &clcc);
+        if (ret > (int) NUM_ELEMS(s_clccFormat))
+            abort();
+        if (ret >= 0) {
+            if (clcc.isMT > 1 || clcc.isMpty > 1)
+                abort();
+            checkString(clcc.number, line, len);
+            checkString(clcc.name, line, len);
+            records++;
+        }
+        break;
+    }
+
+    case KIND_COPS:
+        while (at_tok_nextgroup(&p, &group) == 0) {
+            struct copsRecord cops = { 0, NULL, NULL, NULL };
+
+            checkString(group, line, len);
+            if (at_tok_parse(&group, s_copsFormat, NUM_ELEMS(s_copsFormat),
+                             &cops) < 0)
+                break;
+            checkString(cops.longAlphaNumeric, line, len);
+            checkString(cops.shortAlphaNumeric, line, len);
+            checkString(cops.numeric, line, len);
+            records++;
+        }
+        break;
+
+    case KIND_REG: {
+        struct regRecord reg = { -1, -1, -1, -1, -1 };
+
+        /* The solicited form, the URC is the same without <n>. */
+        ret = at_tok_parse(&p, s_regFormat, NUM_ELEMS(s_regFormat), &reg);
+        if (ret > (int) NUM_ELEMS(s_regFormat))
+            abort();
+        if (ret >= 0)
+            records++;
+        break;
+    }
+
+    case KIND_IPCFG:
+        while (at_tok_nextgroup(&p, &group) == 0) {
+            struct ipcfgRecord ipcfg = { 0, NULL };
+
+            checkString(group, line, len);
+            if (at_tok_parse(&group, s_ipcfgFormat, NUM_ELEMS(s_ipcfgFormat),
+                             &ipcfg) < 0)
+                break;
+            checkString(ipcfg.address, line, len);
+            records++;
+        }
+        break;
+    }
+
+    return records;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *line;
+
+    if (size < 1)
+        return 0;
+
+    /* The reader hands over NUL terminated lines. */
+    line = malloc(size);
+    if (line == NULL)
+        return 0;
+    memcpy(line, data + 1, size - 1);
+    line[size - 1] = '\0';
+
+    parseLine(data[0] & 3, line, size - 1);
+
+    free(line);
+    return 0;
+}
+
+#ifdef AT_TOK_BENCH
+#include <time.h>
+#include <unistd.h>
+
+/* How the RIL parsed these lines before at_tok_parse(). */
+static int parseLineChain(int kind, char *line)
+{
+    char *p = line;
+    char *group;
+    char *s;
+    int records = 0;
+    int i;
+
+    if (at_tok_start(&p) < 0)
+        return 0;
+
+    switch (kind) {
+    case KIND_CLCC: {
+        struct clccRecord clcc;
+
+        if (at_tok_nextint(&p, &clcc.index) < 0 ||
+            at_tok_nextbool(&p, &clcc.isMT) < 0 ||
+            at_tok_nextint(&p, &clcc.state) < 0 ||
+            at_tok_nextint(&p, &clcc.mode) < 0 ||
+            at_tok_nextbool(&p, &clcc.isMpty) < 0)
+            break;
+        if (at_tok_hasmore(&p)) {
+            if (at_tok_nextstr(&p, &clcc.number) < 0 ||
+                at_tok_nextint(&p, &clcc.toa) < 0)
+                break;
+            if (at_tok_hasmore(&p) &&
+                at_tok_nextstr(&p, &clcc.name) < 0)
+                break;
+            if (at_tok_hasmore(&p) &&
+                at_tok_nextint(&p, &clcc.priority) < 0)
+                break;
+            if (at_tok_hasmore(&p) &&
+                at_tok_nextint(&p, &clcc.causeNoCLI) < 0)
+                break;
+        }
+        records++;
+        break;
+    }
+
+    case KIND_COPS:
+        while (at_tok_nextgroup(&p, &group) == 0) {
+            struct copsRecord cops;
+
+            if (at_tok_nextint(&group, &cops.status) < 0 ||
+                at_tok_nextstr(&group, &cops.longAlphaNumeric) < 0 ||
+                at_tok_nextstr(&group, &cops.shortAlphaNumeric) < 0 ||
+                at_tok_nextstr(&group, &cops.numeric) < 0)
+                break;
+            records++;
+        }
+        break;
+
+    case KIND_REG: {
+        struct regRecord reg;
+
+        if (at_tok_nextint(&p, &reg.n) < 0 ||
+            at_tok_nextint(&p, &reg.stat) < 0)
+            break;
+        if (at_tok_hasmore(&p) &&
+            (at_tok_nexthexint(&p, &reg.lac) < 0 ||
+             at_tok_nexthexint(&p, &reg.cid) < 0))
+            break;
+        if (at_tok_hasmore(&p) && at_tok_nextint(&p, &reg.act) < 0)
+            break;
+        records++;
+        break;
+    }
+
+    case KIND_IPCFG:
+        while (at_tok_nextgroup(&p, &group) == 0) {
+            if (at_tok_nextint(&group, &i) < 0 ||
+                at_tok_nextstr(&group, &s) < 0)
+                break;
+            records++;
+        }
+        break;
+    }
+
+    return records;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b loops] <corpus file>...\n"
+                    "  -b loops  parses per line and parser (default: "
+                    "100000)\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    double parseNs[4] = { 0 }, chainNs[4] = { 0 };
+    int lines[4] = { 0 };
+    int loops = 100000;
+    int opt, i, n;
+
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        switch (opt) {
+        case 'b':
+            loops = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind == argc || loops < 1)
+        usage(argv[0]);
+
+    for (i = optind; i < argc; i++) {
+        char input[16384];
+        char line[16384];
+        size_t size;
+        int kind, records, chainRecords = 0;
+        double t0, t1, t2;
+        FILE *f;
+
+        f = fopen(argv[i], "r");
+        if (f == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        size = fread(input, 1, sizeof(input) - 1, f);
+        fclose(f);
+        if (size < 2)
+            continue;
+        input[size] = '\0';
+        input[strcspn(input, "\r\n")] = '\0';
+        size = strlen(input);
+        kind = input[0] & 3;
+
+        /* Each parse gets a fresh copy, the copies are timed for both. */
+        t0 = now();
+        for (n = 0; n < loops; n++) {
+            memcpy(line, input + 1, size);
+            records = parseLine(kind, line, size - 1);
+        }
+        t1 = now();
+        for (n = 0; n < loops; n++) {
+            memcpy(line, input + 1, size);
+            chainRecords = parseLineChain(kind, line);
+        }
+        t2 = now();
+
+        printf("%-8s %4d records %8.0f ns at_tok_parse %8.0f ns chain  %s\n",
+               kindNames[kind], records, (t1 - t0) / loops * 1e9,
+               (t2 - t1) / loops * 1e9, argv[i]);
+        if (records != chainRecords)
+            printf("         the chain found %d records\n", chainRecords);
+
+        parseNs[kind] += (t1 - t0) / loops * 1e9;
+        chainNs[kind] += (t2 - t1) / loops * 1e9;
+        lines[kind]++;
+    }
+
+    for (i = 0; i < 4; i++)
+        if (lines[i] > 0)
+            printf("%-8s %d lines, %.0f ns at_tok_parse, %.0f ns chain "
+                   "per line\n", kindNames[i], lines[i],
+                   parseNs[i] / lines[i], chainNs[i] / lines[i]);
+
+    return 0;
+}
+#endif
@@ -29,6 +29,7 @@
 #include <pthread.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/time.h>
@@ -53,9 +54,37 @@
 #endif /* HAVE_ANDROID_OS */
 
 #define MAX_AT_RESPONSE (8 * 1024)
+#define MAX_AT_RESPONSE_LIMIT (128 * 1024)
 #define HANDSHAKE_RETRY_COUNT 8
 #define HANDSHAKE_TIMEOUT_MSEC 250
 #define DEFAULT_AT_TIMEOUT_MSEC (3 * 60 * 1000)
+#define AT_ARENA_CHUNK_SIZE 512
+#define AT_ARENA_MAX_CHUNK_SIZE (8 * 1024)
+
+/*
+ * Backing store for the lines of one ATResponse. The first chunk is
+ * allocated together with the response itself, further chunks are
+ * chained in front of it when a long multiline response needs them.
+ */
+struct ATArena {
+    struct ATArena *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+/* A queued pipelined command, see at_send_command_async(). */
+struct ATAsyncCommand {
+    struct ATAsyncCommand *next;
+    ATCommandType type;
+    const char *responsePrefix;
+    ATCommandCallback callback;
+    void *param;
+    ATResponse *response;
+    int err;
+    int written;
+    char command[];
+};
 
 struct atcontext {
     pthread_t tid_reader;
@@ -64,11 +93,32 @@ struct atcontext {
     int isInitialized;
     ATUnsolHandler unsolHandler;
 
-    /* For input buffering. */
-    char ATBuffer[MAX_AT_RESPONSE+1];
-    char *ATBufferCur;
+    /*
+     * For input buffering. Lines are handed out in place; data between
+     * ATBufferHead and ATBufferTail is not yet consumed, and everything
+     * before ATBufferScan has already been searched for an EOL.
+     */
+    char *ATBuffer;
+    size_t ATBufferSize;
+    size_t ATBufferHead;
+    size_t ATBufferTail;
+    size_t ATBufferScan;
 
+    /* Reader statistics, dumped when the reader closes. */
     int readCount;
+    int lineCount;
+    int compactCount;
+    int growCount;
+
+    /* Response allocation statistics, dumped with the reader ones. */
+    int responseCount;
+    int intermediateCount;
+    int arenaChunkCount;
+
+    /* Unsolicited dispatch statistics, see at_dispatch_unsol(). */
+    int unsolCount;
+    int unsolHandledCount;
+    int unsolProbeCount;
 
     /*
      * For current pending command, these are protected by commandmutex.
@@ -86,6 +136,21 @@ struct atcontext {
     const char *smsPDU;
     ATResponse *response;
 
+    /*
+     * Pipelined commands, protected by commandmutex. The oldest command
+     * on the wire owns response while it is active. Completed commands
+     * wait on the done list until their callbacks have been run.
+     */
+    struct ATAsyncCommand *asyncHead;
+    struct ATAsyncCommand *asyncTail;
+    struct ATAsyncCommand *asyncDone;
+    struct ATAsyncCommand *asyncDoneTail;
+    int asyncWritten;
+    int asyncOutstanding;
+    int asyncError;
+    int pipelineDepth;
+    pthread_cond_t asynccond;
+
     void (*onTimeout)(void);
     void (*onReaderClosed)(void);
     int readerClosed;
@@ -101,6 +166,10 @@ static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 static int writeCtrlZ (const char *s);
 static int writeline (const char *s);
 static void onReaderClosed();
+static ATResponse * at_response_new();
+static void asyncCompleteHead(struct atcontext *ac);
+static void asyncFailAll(struct atcontext *ac, int err);
+static void asyncRunCallbacks(struct atcontext *ac);
 
 static void make_key()
 {
@@ -137,7 +206,12 @@ static int initializeAtContext()
         ac->fd = -1;
         ac->readerCmdFds[0] = -1;
         ac->readerCmdFds[1] = -1;
-        ac->ATBufferCur = ac->ATBuffer;
+        ac->ATBuffer = malloc(MAX_AT_RESPONSE + 1);
+        if (ac->ATBuffer == NULL) {
+            LOGE("at_open(): Failed to allocate input buffer");
+            return -1;
+        }
+        ac->ATBufferSize = MAX_AT_RESPONSE;
 
         if (pipe(ac->readerCmdFds)) {
             LOGE("at_open(): Failed to create pipe: %s", strerror(errno));
@@ -148,8 +222,10 @@ static int initializeAtContext()
         pthread_mutex_init(&ac->requestmutex, NULL);
         pthread_cond_init(&ac->requestcond, NULL);
         pthread_cond_init(&ac->commandcond, NULL);
+        pthread_cond_init(&ac->asynccond, NULL);
 
         ac->timeoutMsec = DEFAULT_AT_TIMEOUT_MSEC;
+        ac->pipelineDepth = 1;
 
         if (pthread_setspecific(key, ac)) {
             LOGE("pthread_setspecific failed!");
@@ -194,6 +270,24 @@ void at_make_default_channel(void)
         s_defaultAtContext = ac;
 }
 
+void at_get_stats(struct at_stats *stats)
+{
+    struct atcontext *ac = getAtContext();
+
+    pthread_mutex_lock(&ac->commandmutex);
+    stats->readBytes = ac->readCount;
+    stats->lines = ac->lineCount;
+    stats->compactions = ac->compactCount;
+    stats->grows = ac->growCount;
+    stats->responses = ac->responseCount;
+    stats->intermediates = ac->intermediateCount;
+    stats->arenaChunks = ac->arenaChunkCount;
+    stats->unsolDispatched = ac->unsolCount;
+    stats->unsolHandled = ac->unsolHandledCount;
+    stats->unsolCompares = ac->unsolProbeCount;
+    pthread_mutex_unlock(&ac->commandmutex);
+}
+
 #if AT_DEBUG
 void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
 {
@@ -233,103 +327,191 @@ static void sleepMsec(long long msec)
 
 
 
+/**
+ * Allocates len bytes from the arena of p_response.
+ * Returns NULL if a new chunk was needed and could not be allocated.
+ */
+static void *arenaAlloc(ATResponse *p_response, size_t len)
+{
+    struct ATArena *chunk = p_response->arena;
+    size_t size;
+
+    len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (chunk->size - chunk->used < len) {
+        size = chunk->size * 2;
+        if (size > AT_ARENA_MAX_CHUNK_SIZE)
+            size = AT_ARENA_MAX_CHUNK_SIZE;
+        if (size < len)
+            size = len;
+
+        chunk = malloc(sizeof(struct ATArena) + size);
+        if (chunk == NULL)
+            return NULL;
+
+        chunk->next = p_response->arena;
+        chunk->used = 0;
+        chunk->size = size;
+        p_response->arena = chunk;
+
+        getAtContext()->arenaChunkCount++;
+    }
+
+    chunk->used += len;
+    return chunk->data + chunk->used - len;
+}
+
+/** Copies line into the arena of p_response. */
+static char *arenaStrdup(ATResponse *p_response, const char *line)
+{
+    size_t len = strlen(line) + 1;
+    char *p_new = arenaAlloc(p_response, len);
+
+    if (p_new != NULL)
+        memcpy(p_new, line, len);
+
+    return p_new;
+}
+
 /** Add an intermediate response to sp_response. */
 static void addIntermediate(const char *line)
 {
     ATLine *p_new;
     struct atcontext *ac = getAtContext();
+    ATResponse *p_response = ac->response;
 
-    p_new = (ATLine  *) malloc(sizeof(ATLine));
+    p_new = arenaAlloc(p_response, sizeof(ATLine));
+    if (p_new == NULL || (p_new->line = arenaStrdup(p_response, line)) == NULL) {
+        LOGE("Out of memory, dropping intermediate response");
+        return;
+    }
 
-    p_new->line = strdup(line);
+    /* Lines are appended in the order they are received. */
+    p_new->p_next = NULL;
+    if (p_response->p_lastIntermediate != NULL)
+        p_response->p_lastIntermediate->p_next = p_new;
+    else
+        p_response->p_intermediates = p_new;
+    p_response->p_lastIntermediate = p_new;
 
-    /* Note: This adds to the head of the list, so the list will
-       be in reverse order of lines received. the order is flipped
-       again before passing on to the command issuer. */
-    p_new->p_next = ac->response->p_intermediates;
-    ac->response->p_intermediates = p_new;
+    ac->intermediateCount++;
 }
 
 
+/* Line classes, see lineClass(). */
+enum {
+    LINE_OTHER,
+    LINE_FINAL_SUCCESS,    /* OK, CONNECT */
+    LINE_FINAL_ERROR,      /* ERROR, +CMS ERROR:, +CME ERROR:, NO ... */
+    LINE_SMS_UNSOLICITED   /* +CMT:, +CDS:, +CBM:, followed by a PDU line */
+};
+
 /**
- * Returns 1 if line is a final response indicating error.
- * See 27.007 annex B.
+ * Classify a line in a single pass over its leading characters, instead
+ * of matching it against one table of prefixes after the other.
+ *
+ * Final responses are per 27.007 annex B.
  * WARNING: NO CARRIER and others are sometimes unsolicited.
+ * "CONNECT" counts as success as some stacks start up data on another
+ * channel.
  */
-static const char * s_finalResponsesError[] = {
-    "ERROR",
-    "+CMS ERROR:",
-    "+CME ERROR:",
-    "NO CARRIER",      /* Sometimes! */
-    "NO ANSWER",
-    "NO DIALTONE",
-};
-static int isFinalResponseError(const char *line)
+static int lineClass(const char *line)
 {
-    size_t i;
+    switch (line[0]) {
+    case 'O':
+        if (line[1] == 'K')
+            return LINE_FINAL_SUCCESS;
+        break;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesError) ; i++) {
-        if (strStartsWith(line, s_finalResponsesError[i])) {
-            return 1;
-        }
-    }
+    case 'C':
+        if (strStartsWith(line + 1, "ONNECT"))
+            return LINE_FINAL_SUCCESS;
+        break;
 
-    return 0;
-}
+    case 'E':
+        if (strStartsWith(line + 1, "RROR"))
+            return LINE_FINAL_ERROR;
+        break;
 
-/**
- * Returns 1 if line is a final response indicating success.
- * See 27.007 annex B.
- * WARNING: NO CARRIER and others are sometimes unsolicited.
- */
-static const char * s_finalResponsesSuccess[] = {
-    "OK",
-    "CONNECT"       /* Some stacks start up data on another channel. */
-};
-static int isFinalResponseSuccess(const char *line)
-{
-    size_t i;
+    case 'N':
+        if (line[1] == 'O' && line[2] == ' ' &&
+            (strStartsWith(line + 3, "CARRIER") ||   /* Sometimes! */
+             strStartsWith(line + 3, "ANSWER") ||
+             strStartsWith(line + 3, "DIALTONE")))
+            return LINE_FINAL_ERROR;
+        break;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesSuccess) ; i++) {
-        if (strStartsWith(line, s_finalResponsesSuccess[i])) {
-            return 1;
+    case '+':
+        if (line[1] != 'C')
+            break;
+        switch (line[2]) {
+        case 'M':
+            if (strStartsWith(line + 3, "E ERROR:") ||
+                strStartsWith(line + 3, "S ERROR:"))
+                return LINE_FINAL_ERROR;
+            if (strStartsWith(line + 3, "T:"))
+                return LINE_SMS_UNSOLICITED;
+            break;
+        case 'D':
+            if (strStartsWith(line + 3, "S:"))
+                return LINE_SMS_UNSOLICITED;
+            break;
+        case 'B':
+            if (strStartsWith(line + 3, "M:"))
+                return LINE_SMS_UNSOLICITED;
+            break;
         }
+        break;
     }
 
-    return 0;
+    return LINE_OTHER;
 }
 
-/**
- * Returns 1 if line is the first line in (what will be) a two-line
- * SMS unsolicited response.
+/*
+ * Registered unsolicited handlers, hashed on the URC name, ie the prefix
+ * up to the first ':' or space. Buckets are chains of entry indexes + 1
+ * so that the zeroed table is empty; entries sharing a bucket are tried
+ * in registration order. The table is built at registration rather than
+ * generated at compile time since the handlers belong to the RIL, not to
+ * atchannel; building it costs one hash per handler at startup.
  */
-static const char * s_smsUnsoliciteds[] = {
-    "+CMT:",
-    "+CDS:",
-    "+CBM:"
+#define AT_UNSOL_MAX_HANDLERS 32
+#define AT_UNSOL_HASH_SIZE 64
+#define AT_UNSOL_NAME_MAX 16
+
+struct ATUnsolEntry {
+    const char *prefix;
+    ATUnsolHandler handler;
+    int next;
 };
-static int isSMSUnsolicited(const char *line)
+
+static struct ATUnsolEntry s_unsolEntries[AT_UNSOL_MAX_HANDLERS];
+static int s_unsolEntryCount;
+static int s_unsolBuckets[AT_UNSOL_HASH_SIZE];
+
+static unsigned int unsolNameHash(const char *s)
 {
-    size_t i;
+    unsigned int h = 0;
+    int i;
 
-    for (i = 0 ; i < NUM_ELEMS(s_smsUnsoliciteds) ; i++) {
-        if (strStartsWith(line, s_smsUnsoliciteds[i])) {
-            return 1;
-        }
-    }
+    for (i = 0; i < AT_UNSOL_NAME_MAX && s[i] != '\0' && s[i] != ':' &&
+         s[i] != ' '; i++)
+        h = h * 31 + (unsigned char) s[i];
 
-    return 0;
+    return h & (AT_UNSOL_HASH_SIZE - 1);
 }
 
-
 /** Assumes s_commandmutex is held. */
 static void handleFinalResponse(const char *line)
 {
     struct atcontext *ac = getAtContext();
 
-    ac->response->finalResponse = strdup(line);
+    ac->response->finalResponse = arenaStrdup(ac->response, line);
 
-    pthread_cond_signal(&ac->commandcond);
+    if (ac->asyncHead != NULL && ac->response == ac->asyncHead->response)
+        asyncCompleteHead(ac);
+    else
+        pthread_cond_signal(&ac->commandcond);
 }
 
 static void handleUnsolicited(const char *line)
@@ -341,18 +523,21 @@ static void handleUnsolicited(const char *line)
     }
 }
 
-static void processLine(const char *line)
+static void processLine(const char *line, int class)
 {
     struct atcontext *ac = getAtContext();
     pthread_mutex_lock(&ac->commandmutex);
 
-    if (ac->response == NULL) {
-        /* No command pending. */
+    ac->lineCount++;
+
+    if (ac->response == NULL || ac->response->finalResponse != NULL) {
+        /* No command pending, or its final response is in and the
+           command thread has yet to pick it up. */
         handleUnsolicited(line);
-    } else if (isFinalResponseSuccess(line)) {
+    } else if (class == LINE_FINAL_SUCCESS) {
         ac->response->success = 1;
         handleFinalResponse(line);
-    } else if (isFinalResponseError(line)) {
+    } else if (class == LINE_FINAL_ERROR) {
         ac->response->success = 0;
         handleFinalResponse(line);
     } else if (ac->smsPDU != NULL && 0 == strcmp(line, "> ")) {
@@ -400,93 +585,149 @@ static void processLine(const char *line)
     }
 
     pthread_mutex_unlock(&ac->commandmutex);
+
+    asyncRunCallbacks(ac);
 }
 
 
+/* Word-at-a-time helpers for the EOL scan. */
+#define WORD_ONES   ((unsigned long) -1 / 0xff)
+#define WORD_HIGHS  (WORD_ONES * 0x80)
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
 /**
- * Returns a pointer to the end of the next line,
- * special-cases the "> " SMS prompt.
+ * Returns a pointer to the first \r or \n in [cur, end),
+ * or NULL if there is none.
  *
- * returns NULL if there is no complete line.
+ * Scans a machine word at a time once cur is aligned.
  */
-static char * findNextEOL(char *cur)
+static char * findNextEOL(char *cur, char *end)
 {
-    if (cur[0] == '>' && cur[1] == ' ' && cur[2] == '\0') {
-        /* SMS prompt character...not \r terminated */
-        return cur+2;
+    const unsigned long cr = WORD_ONES * '\r';
+    const unsigned long lf = WORD_ONES * '\n';
+
+    while (cur < end && ((uintptr_t) cur & (sizeof(unsigned long) - 1))) {
+        if (*cur == '\r' || *cur == '\n')
+            return cur;
+        cur++;
     }
 
-    // Find next newline
-    while (*cur != '\0' && *cur != '\r' && *cur != '\n') cur++;
+    while ((size_t) (end - cur) >= sizeof(unsigned long)) {
+        unsigned long w;
 
-    return *cur == '\0' ? NULL : cur;
+        memcpy(&w, cur, sizeof(w));
+        if (WORD_HAS_ZERO(w ^ cr) || WORD_HAS_ZERO(w ^ lf))
+            break;
+        cur += sizeof(unsigned long);
+    }
+
+    while (cur < end) {
+        if (*cur == '\r' || *cur == '\n')
+            return cur;
+        cur++;
+    }
+
+    return NULL;
 }
 
+/**
+ * Makes room for more input at the tail of the buffer. Consumed data
+ * at the front is reclaimed first; only when a single line fills the
+ * whole buffer is it grown, up to MAX_AT_RESPONSE_LIMIT.
+ *
+ * Returns 0 on success, -1 if the line had to be dropped.
+ */
+static int makeRoom(struct atcontext *ac)
+{
+    char *p_new;
+    size_t size;
+
+    if (ac->ATBufferTail < ac->ATBufferSize)
+        return 0;
+
+    if (ac->ATBufferHead > 0) {
+        size_t len = ac->ATBufferTail - ac->ATBufferHead;
+
+        memmove(ac->ATBuffer, ac->ATBuffer + ac->ATBufferHead, len);
+        ac->ATBufferScan -= ac->ATBufferHead;
+        ac->ATBufferTail = len;
+        ac->ATBufferHead = 0;
+        ac->compactCount++;
+        return 0;
+    }
+
+    size = ac->ATBufferSize * 2;
+    if (size <= MAX_AT_RESPONSE_LIMIT) {
+        p_new = realloc(ac->ATBuffer, size + 1);
+        if (p_new != NULL) {
+            ac->ATBuffer = p_new;
+            ac->ATBufferSize = size;
+            ac->growCount++;
+            LOGD("AT(%d) input buffer grown to %d bytes", ac->fd, (int) size);
+            return 0;
+        }
+    }
+
+    LOGE("ERROR: Input line exceeded buffer\n");
+    /* Ditch buffer and start over again. */
+    ac->ATBufferHead = ac->ATBufferTail = ac->ATBufferScan = 0;
+    return -1;
+}
 
 /**
  * Reads a line from the AT channel, returns NULL on timeout.
  * Assumes it has exclusive read access to the FD.
  *
- * This line is valid only until the next call to readline.
+ * The line is returned in place in the input buffer and is valid only
+ * until the next call to readline.
  *
  * This function exists because as of writing, android libc does not
  * have buffered stdio.
  */
-
 static const char *readline()
 {
     ssize_t count;
-
-    char *p_read = NULL;
-    char *p_eol = NULL;
+    char *base;
+    char *p_eol;
     char *ret;
 
     struct atcontext *ac = getAtContext();
     read(ac->fd,NULL,0);
 
-    /* This is a little odd. I use *s_ATBufferCur == 0 to mean
-     * "buffer consumed completely". If it points to a character,
-     * then the buffer continues until a \0.
-     */
-    if (*ac->ATBufferCur == '\0') {
-        /* Empty buffer. */
-        ac->ATBufferCur = ac->ATBuffer;
-        *ac->ATBufferCur = '\0';
-        p_read = ac->ATBuffer;
-    } else {   /* *s_ATBufferCur != '\0' */
-        /* There's data in the buffer from the last read. */
-
-        /* skip over leading newlines */
-        while (*ac->ATBufferCur == '\r' || *ac->ATBufferCur == '\n')
-            ac->ATBufferCur++;
-
-        p_eol = findNextEOL(ac->ATBufferCur);
+    for (;;) {
+        int err;
+        struct pollfd pfds[2];
 
-        if (p_eol == NULL) {
-            /* A partial line. Move it up and prepare to read more. */
-            size_t len;
+        base = ac->ATBuffer;
+
+        /* Skip over leading newlines. */
+        while (ac->ATBufferHead < ac->ATBufferTail
+               && (base[ac->ATBufferHead] == '\r'
+                   || base[ac->ATBufferHead] == '\n'))
+            ac->ATBufferHead++;
+
+        if (ac->ATBufferHead == ac->ATBufferTail) {
+            /* Empty buffer, rewind for free. */
+            ac->ATBufferHead = ac->ATBufferTail = ac->ATBufferScan = 0;
+        } else if (ac->ATBufferTail - ac->ATBufferHead == 2
+                   && base[ac->ATBufferHead] == '>'
+                   && base[ac->ATBufferHead + 1] == ' ') {
+            /* SMS prompt character...not \r terminated */
+            p_eol = base + ac->ATBufferTail;
+            break;
+        } else {
+            if (ac->ATBufferScan < ac->ATBufferHead)
+                ac->ATBufferScan = ac->ATBufferHead;
 
-            len = strlen(ac->ATBufferCur);
+            p_eol = findNextEOL(base + ac->ATBufferScan,
+                                base + ac->ATBufferTail);
+            if (p_eol != NULL)
+                break;
 
-            memmove(ac->ATBuffer, ac->ATBufferCur, len + 1);
-            p_read = ac->ATBuffer + len;
-            ac->ATBufferCur = ac->ATBuffer;
+            ac->ATBufferScan = ac->ATBufferTail;
         }
-        /* Otherwise, (p_eol !- NULL) there is a complete line 
-           that will be returned from the while () loop below. */
-    }
 
-    while (p_eol == NULL) {
-        int err;
-        struct pollfd pfds[2];
-
-        if (0 == MAX_AT_RESPONSE - (p_read - ac->ATBuffer)) {
-            LOGE("ERROR: Input line exceeded buffer\n");
-            /* Ditch buffer and start over again. */
-            ac->ATBufferCur = ac->ATBuffer;
-            *ac->ATBufferCur = '\0';
-            p_read = ac->ATBuffer;
-        }
+        makeRoom(ac);
 
         /* If our fd is invalid, we are probably closed. Return. */
         if (ac->fd < 0)
@@ -522,23 +763,15 @@ static const char *readline()
             continue;
 
         do {
-            count = read(ac->fd, p_read,
-                            MAX_AT_RESPONSE - (p_read - ac->ATBuffer));
+            count = read(ac->fd, ac->ATBuffer + ac->ATBufferTail,
+                            ac->ATBufferSize - ac->ATBufferTail);
         } while (count < 0 && errno == EINTR);
 
         if (count > 0) {
-            AT_DUMP( "<< ", p_read, count );
+            AT_DUMP( "<< ", ac->ATBuffer + ac->ATBufferTail, count );
             ac->readCount += count;
-
-            p_read[count] = '\0';
-
-            /* Skip over leading newlines. */
-            while (*ac->ATBufferCur == '\r' || *ac->ATBufferCur == '\n')
-                ac->ATBufferCur++;
-
-            p_eol = findNextEOL(ac->ATBufferCur);
-            p_read += count;
-        } else if (count <= 0) {
+            ac->ATBufferTail += count;
+        } else {
             /* Read error encountered or EOF reached. */
             if(count == 0) {
                 LOGD("atchannel: EOF reached.");
@@ -549,12 +782,17 @@ static const char *readline()
         }
     }
 
-    /* A full line in the buffer. Place a \0 over the \r and return. */
+    /* A full line in the buffer. Place a \0 over the \r and return.
+       The buffer always has one spare byte past ATBufferSize for the
+       unterminated SMS prompt. */
 
-    ret = ac->ATBufferCur;
+    ret = base + ac->ATBufferHead;
     *p_eol = '\0';
-    ac->ATBufferCur = p_eol + 1;     /* This will always be <= p_read,    
-                                        and there will be a \0 at *p_read. */
+
+    ac->ATBufferHead = p_eol - base;
+    if (ac->ATBufferHead < ac->ATBufferTail)
+        ac->ATBufferHead++;
+    ac->ATBufferScan = ac->ATBufferHead;
 
     LOGI("AT(%d)< %s\n", ac->fd, ret);
     return ret;
@@ -564,18 +802,24 @@ static const char *readline()
 static void onReaderClosed()
 {
     struct atcontext *ac = getAtContext();
-    if (ac->onReaderClosed != NULL && ac->readerClosed == 0) {
+    int wasClosed;
 
-        pthread_mutex_lock(&ac->commandmutex);
+    /* Mark the channel closed together with failing the pipeline, so a
+       command woken by the drain does not write to a dead channel. */
+    pthread_mutex_lock(&ac->commandmutex);
 
-        ac->readerClosed = 1;
+    wasClosed = ac->readerClosed;
+    ac->readerClosed = 1;
+    asyncFailAll(ac, AT_ERROR_CHANNEL_CLOSED);
 
-        pthread_cond_signal(&ac->commandcond);
+    pthread_cond_signal(&ac->commandcond);
 
-        pthread_mutex_unlock(&ac->commandmutex);
+    pthread_mutex_unlock(&ac->commandmutex);
 
+    asyncRunCallbacks(ac);
+
+    if (ac->onReaderClosed != NULL && wasClosed == 0)
         ac->onReaderClosed();
-    }
 }
 
 
@@ -590,6 +834,7 @@ static void *readerLoop(void *arg)
 
     for (;;) {
         const char * line;
+        int class;
 
         line = readline();
 
@@ -597,7 +842,9 @@ static void *readerLoop(void *arg)
             break;
         }
 
-        if(isSMSUnsolicited(line)) {
+        class = lineClass(line);
+
+        if (class == LINE_SMS_UNSOLICITED) {
             char *line1;
             const char *line2;
 
@@ -611,15 +858,29 @@ static void *readerLoop(void *arg)
                 break;
             }
 
+            pthread_mutex_lock(&ac->commandmutex);
+            ac->lineCount += 2;
+            pthread_mutex_unlock(&ac->commandmutex);
+
             if (ac->unsolHandler != NULL) {
                 ac->unsolHandler (line1, line2);
             }
             free(line1);
         } else {
-            processLine(line);
+            processLine(line, class);
         }
     }
 
+    LOGD("AT(%d) reader closed: %d bytes, %d lines, %d compactions, "
+         "%d buffer grows", ac->fd, ac->readCount, ac->lineCount,
+         ac->compactCount, ac->growCount);
+    LOGD("AT(%d) responses: %d allocated, %d intermediates, "
+         "%d extra arena chunks", ac->fd, ac->responseCount,
+         ac->intermediateCount, ac->arenaChunkCount);
+    LOGD("AT(%d) unsolicited: %d dispatched, %d handled, %d prefix "
+         "compares", ac->fd, ac->unsolCount, ac->unsolHandledCount,
+         ac->unsolProbeCount);
+
     onReaderClosed();
 
     return NULL;
@@ -729,6 +990,164 @@ static void clearPendingCommand()
     ac->smsPDU = NULL;
 }
 
+/**
+ * Makes the oldest written pipelined command the one that incoming
+ * lines are matched against. Assumes commandmutex is held.
+ */
+static void asyncActivateHead(struct atcontext *ac)
+{
+    struct ATAsyncCommand *cmd = ac->asyncHead;
+
+    if (cmd == NULL || !cmd->written || ac->response != NULL)
+        return;
+
+    ac->type = cmd->type;
+    ac->responsePrefix = cmd->responsePrefix;
+    ac->smsPDU = NULL;
+    ac->response = cmd->response;
+}
+
+/**
+ * Writes queued pipelined commands until the pipeline depth is reached.
+ * Nothing is written while a synchronous command is pending.
+ * Assumes commandmutex is held.
+ */
+static void asyncKick(struct atcontext *ac)
+{
+    struct ATAsyncCommand *cmd;
+    int err;
+
+    if (ac->response != NULL
+        && (ac->asyncHead == NULL || ac->response != ac->asyncHead->response))
+        return;
+
+    for (cmd = ac->asyncHead; cmd != NULL; cmd = cmd->next) {
+        if (cmd->written)
+            continue;
+        if (ac->asyncWritten >= ac->pipelineDepth)
+            break;
+
+        err = writeline(cmd->command);
+        if (err < 0) {
+            asyncFailAll(ac, err);
+            return;
+        }
+
+        cmd->written = 1;
+        ac->asyncWritten++;
+    }
+
+    asyncActivateHead(ac);
+}
+
+/** Moves cmd to the done list. Assumes commandmutex is held. */
+static void asyncRetire(struct atcontext *ac, struct ATAsyncCommand *cmd,
+                        int err)
+{
+    cmd->err = err;
+    if (err < 0 && ac->asyncError == 0)
+        ac->asyncError = err;
+
+    cmd->next = NULL;
+    if (ac->asyncDoneTail != NULL)
+        ac->asyncDoneTail->next = cmd;
+    else
+        ac->asyncDone = cmd;
+    ac->asyncDoneTail = cmd;
+}
+
+/**
+ * Called when the active pipelined command got its final response.
+ * Assumes commandmutex is held.
+ */
+static void asyncCompleteHead(struct atcontext *ac)
+{
+    struct ATAsyncCommand *cmd = ac->asyncHead;
+    int err = 0;
+
+    ac->asyncHead = cmd->next;
+    if (ac->asyncHead == NULL)
+        ac->asyncTail = NULL;
+    ac->asyncWritten--;
+
+    ac->response = NULL;
+    ac->responsePrefix = NULL;
+
+    /* Same rule as at_send_command_singleline()/_numeric(). */
+    if ((cmd->type == SINGLELINE || cmd->type == NUMERIC)
+        && cmd->response->success > 0
+        && cmd->response->p_intermediates == NULL)
+        err = AT_ERROR_INVALID_RESPONSE;
+
+    asyncRetire(ac, cmd, err);
+
+    if (ac->asyncHead == NULL)
+        pthread_cond_broadcast(&ac->asynccond);
+    else
+        asyncKick(ac);
+}
+
+/**
+ * Fails every queued pipelined command with err.
+ * Assumes commandmutex is held.
+ */
+static void asyncFailAll(struct atcontext *ac, int err)
+{
+    struct ATAsyncCommand *cmd;
+
+    if (ac->asyncHead != NULL && ac->response == ac->asyncHead->response) {
+        ac->response = NULL;
+        ac->responsePrefix = NULL;
+    }
+
+    while ((cmd = ac->asyncHead) != NULL) {
+        ac->asyncHead = cmd->next;
+        asyncRetire(ac, cmd, err);
+    }
+
+    ac->asyncTail = NULL;
+    ac->asyncWritten = 0;
+
+    pthread_cond_broadcast(&ac->asynccond);
+}
+
+/**
+ * Runs the callbacks of completed pipelined commands and frees them.
+ * Must be called without commandmutex held.
+ */
+static void asyncRunCallbacks(struct atcontext *ac)
+{
+    struct ATAsyncCommand *cmd;
+    int count = 0;
+
+    pthread_mutex_lock(&ac->commandmutex);
+    cmd = ac->asyncDone;
+    ac->asyncDone = ac->asyncDoneTail = NULL;
+    pthread_mutex_unlock(&ac->commandmutex);
+
+    if (cmd == NULL)
+        return;
+
+    while (cmd != NULL) {
+        struct ATAsyncCommand *next = cmd->next;
+
+        if (cmd->callback != NULL)
+            cmd->callback(cmd->err, cmd->response, cmd->param);
+
+        at_response_free(cmd->response);
+        free(cmd);
+        count++;
+
+        cmd = next;
+    }
+
+    pthread_mutex_lock(&ac->commandmutex);
+    ac->asyncOutstanding -= count;
+    if (ac->asyncOutstanding == 0)
+        pthread_cond_broadcast(&ac->asynccond);
+    pthread_mutex_unlock(&ac->commandmutex);
+}
+
 
 /**
  * Starts AT handler on stream "fd'.
@@ -787,6 +1206,7 @@ void at_close()
     ac->readerClosed = 1;
 
     pthread_cond_signal(&ac->commandcond);
+    pthread_cond_broadcast(&ac->asynccond);
 
     pthread_mutex_unlock(&ac->commandmutex);
 
@@ -794,52 +1214,52 @@ void at_close()
     write(ac->readerCmdFds[1], "x", 1);
 }
 
+/**
+ * Allocates a response with its first arena chunk in the same block,
+ * so short responses cost a single malloc and a single free.
+ */
 static ATResponse * at_response_new()
 {
-    return (ATResponse *) calloc(1, sizeof(ATResponse));
+    ATResponse *p_response;
+    struct ATArena *chunk;
+
+    p_response = malloc(sizeof(ATResponse) + sizeof(struct ATArena)
+                        + AT_ARENA_CHUNK_SIZE);
+    if (p_response == NULL)
+        return NULL;
+
+    memset(p_response, 0, sizeof(ATResponse));
+
+    chunk = (struct ATArena *) (p_response + 1);
+    chunk->next = NULL;
+    chunk->used = 0;
+    chunk->size = AT_ARENA_CHUNK_SIZE;
+    p_response->arena = chunk;
+
+    getAtContext()->responseCount++;
+
+    return p_response;
 }
 
 void at_response_free(ATResponse *p_response)
 {
-    ATLine *p_line;
+    struct ATArena *chunk;
 
     if (p_response == NULL) return;
 
-    p_line = p_response->p_intermediates;
-
-    while (p_line != NULL) {
-        ATLine *p_toFree;
+    chunk = p_response->arena;
 
-        p_toFree = p_line;
-        p_line = p_line->p_next;
+    /* The last chunk in the chain is part of the response block. */
+    while (chunk != NULL && chunk->next != NULL) {
+        struct ATArena *p_toFree = chunk;
 
-        free(p_toFree->line);
+        chunk = chunk->next;
         free(p_toFree);
     }
 
-    free (p_response->finalResponse);
     free (p_response);
 }
 
-/**
- * The line reader places the intermediate responses in reverse order,
- * here we flip them back.
- */
-static void reverseIntermediates(ATResponse *p_response)
-{
-    ATLine *pcur,*pnext;
-
-    pcur = p_response->p_intermediates;
-    p_response->p_intermediates = NULL;
-
-    while (pcur != NULL) {
-        pnext = pcur->p_next;
-        pcur->p_next = p_response->p_intermediates;
-        p_response->p_intermediates = pcur;
-        pcur = pnext;
-    }
-}
-
 /**
  * Internal send_command implementation.
  * Doesn't lock or call the timeout callback.
@@ -855,6 +1275,7 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
 #ifndef USE_NP
     struct timespec ts;
 #endif /*USE_NP*/
+    ATResponse *p_response = NULL;
 
     struct atcontext *ac = getAtContext();
 
@@ -863,27 +1284,56 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
         pthread_cond_wait(&ac->requestcond, &ac->commandmutex);
     }
 
-    if(ac->response != NULL) {
-        err = AT_ERROR_COMMAND_PENDING;
-        goto error;
+#ifndef USE_NP
+    if (timeoutMsec != 0) {
+        setTimespecRelative(&ts, timeoutMsec);
     }
+#endif /*USE_NP*/
 
-    err = writeline (command);
+    /* Let pipelined commands drain first, they own the channel. The
+       timeout covers the wait for them as well. */
+    while (ac->asyncHead != NULL && ac->readerClosed == 0) {
+        if (timeoutMsec != 0) {
+#ifdef USE_NP
+            err = pthread_cond_timeout_np(&ac->asynccond, &ac->commandmutex, timeoutMsec);
+#else
+            err = pthread_cond_timedwait(&ac->asynccond, &ac->commandmutex, &ts);
+#endif /*USE_NP*/
+        } else {
+            err = pthread_cond_wait(&ac->asynccond, &ac->commandmutex);
+        }
 
-    if (err < 0) {
+        if (err == ETIMEDOUT) {
+            err = AT_ERROR_TIMEOUT;
+            goto error;
+        }
+    }
+
+    /* A pipelined head may still own ac->response, leave it alone. */
+    if (ac->readerClosed > 0) {
+        err = AT_ERROR_CHANNEL_CLOSED;
+        goto error;
+    }
+
+    if(ac->response != NULL) {
+        err = AT_ERROR_COMMAND_PENDING;
         goto error;
     }
 
     ac->type = type;
     ac->responsePrefix = responsePrefix;
     ac->smsPDU = smspdu;
-    ac->response = at_response_new();
+    ac->response = p_response = at_response_new();
+    if (ac->response == NULL) {
+        err = AT_ERROR_GENERIC;
+        goto error;
+    }
 
-#ifndef USE_NP
-    if (timeoutMsec != 0) {
-        setTimespecRelative(&ts, timeoutMsec);
+    err = writeline (command);
+
+    if (err < 0) {
+        goto error;
     }
-#endif /*USE_NP*/
 
     while (ac->response->finalResponse == NULL && ac->readerClosed == 0) {
         if (timeoutMsec != 0) {
@@ -905,12 +1355,10 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
     if (pp_outResponse == NULL) {
         at_response_free(ac->response);
     } else {
-        /* Line reader stores intermediate responses in reverse order. */
-        reverseIntermediates(ac->response);
         *pp_outResponse = ac->response;
     }
 
-    ac->response = NULL;
+    ac->response = p_response = NULL;
 
     if(ac->readerClosed > 0) {
         err = AT_ERROR_CHANNEL_CLOSED;
@@ -919,7 +1367,12 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
 
     err = 0;
 error:
-    clearPendingCommand();
+    /* Only clear what this call installed, never a pipelined response. */
+    if (ac->response == p_response)
+        clearPendingCommand();
+
+    /* Pipelined commands queued meanwhile can go out now. */
+    asyncKick(ac);
 
     pthread_cond_broadcast(&ac->requestcond);
     pthread_mutex_unlock(&ac->requestmutex);
@@ -1084,6 +1537,154 @@ int at_send_command_multiline (const char *command,
     return err;
 }
 
+/**
+ * Queue a command for pipelined execution, see atchannel.h.
+ * Returns 0 when queued, AT_ERROR_* otherwise. Errors that happen once
+ * the command is queued are reported through the callback.
+ */
+int at_send_command_async (const char *command, ATCommandType type,
+                           const char *responsePrefix,
+                           ATCommandCallback callback, void *param)
+{
+    struct ATAsyncCommand *cmd;
+    size_t commandLen = strlen(command) + 1;
+    size_t prefixLen = responsePrefix != NULL ? strlen(responsePrefix) + 1 : 0;
+
+    struct atcontext *ac = getAtContext();
+
+    LOGE("--- %s (async)", command);
+
+    if (0 != pthread_equal(ac->tid_reader, pthread_self())) {
+        /* Cannot be called from reader thread. */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    cmd = malloc(sizeof(struct ATAsyncCommand) + commandLen + prefixLen);
+    if (cmd == NULL)
+        return AT_ERROR_GENERIC;
+
+    memset(cmd, 0, sizeof(struct ATAsyncCommand));
+    memcpy(cmd->command, command, commandLen);
+    if (responsePrefix != NULL) {
+        memcpy(cmd->command + commandLen, responsePrefix, prefixLen);
+        cmd->responsePrefix = cmd->command + commandLen;
+    }
+    cmd->type = type;
+    cmd->callback = callback;
+    cmd->param = param;
+
+    pthread_mutex_lock(&ac->commandmutex);
+
+    if (ac->fd < 0 || ac->readerClosed > 0) {
+        pthread_mutex_unlock(&ac->commandmutex);
+        free(cmd);
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    cmd->response = at_response_new();
+    if (cmd->response == NULL) {
+        pthread_mutex_unlock(&ac->commandmutex);
+        free(cmd);
+        return AT_ERROR_GENERIC;
+    }
+
+    if (ac->asyncTail != NULL)
+        ac->asyncTail->next = cmd;
+    else
+        ac->asyncHead = cmd;
+    ac->asyncTail = cmd;
+    ac->asyncOutstanding++;
+
+    asyncKick(ac);
+
+    pthread_mutex_unlock(&ac->commandmutex);
+
+    /* A write error fails the queue right away. */
+    asyncRunCallbacks(ac);
+
+    return 0;
+}
+
+/**
+ * Wait until all pipelined commands have completed and their callbacks
+ * have returned. Returns the first AT_ERROR_* seen by any of them since
+ * the last call, or 0.
+ */
+int at_wait_async (void)
+{
+    int err = 0;
+#ifndef USE_NP
+    struct timespec ts;
+#endif /*USE_NP*/
+
+    struct atcontext *ac = getAtContext();
+
+    if (0 != pthread_equal(ac->tid_reader, pthread_self())) {
+        /* Cannot be called from reader thread. */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+#ifndef USE_NP
+    if (ac->timeoutMsec != 0) {
+        setTimespecRelative(&ts, ac->timeoutMsec);
+    }
+#endif /*USE_NP*/
+
+    pthread_mutex_lock(&ac->commandmutex);
+
+    while (ac->asyncOutstanding > 0) {
+        if (ac->readerClosed > 0 && ac->asyncHead != NULL) {
+            asyncFailAll(ac, AT_ERROR_CHANNEL_CLOSED);
+        } else if (ac->asyncDone == NULL) {
+            if (ac->timeoutMsec != 0) {
+#ifdef USE_NP
+                err = pthread_cond_timeout_np(&ac->asynccond, &ac->commandmutex, ac->timeoutMsec);
+#else
+                err = pthread_cond_timedwait(&ac->asynccond, &ac->commandmutex, &ts);
+#endif /*USE_NP*/
+            } else {
+                err = pthread_cond_wait(&ac->asynccond, &ac->commandmutex);
+            }
+
+            if (err == ETIMEDOUT) {
+                asyncFailAll(ac, AT_ERROR_TIMEOUT);
+            }
+            err = 0;
+        }
+
+        if (ac->asyncDone != NULL) {
+            /* Failed commands are not run by the reader; do it here. */
+            pthread_mutex_unlock(&ac->commandmutex);
+            asyncRunCallbacks(ac);
+            pthread_mutex_lock(&ac->commandmutex);
+        }
+    }
+
+    err = ac->asyncError;
+    ac->asyncError = 0;
+
+    pthread_mutex_unlock(&ac->commandmutex);
+
+    if (err == AT_ERROR_TIMEOUT && ac->onTimeout != NULL) {
+        ac->onTimeout();
+    }
+
+    return err;
+}
+
+/**
+ * Set how many pipelined commands may be written before the final
+ * response of the oldest one has been received. Default is 1.
+ */
+void at_set_pipeline_depth(int depth)
+{
+    struct atcontext *ac = getAtContext();
+
+    pthread_mutex_lock(&ac->commandmutex);
+    ac->pipelineDepth = depth > 0 ? depth : 1;
+    pthread_mutex_unlock(&ac->commandmutex);
+}
+
 /**
  * Set the default timeout. Let it be reasonably high, some commands
  * take their time. Default is 10 minutes.
@@ -1197,3 +1798,61 @@ AT_CME_Error at_get_cme_error(const ATResponse *p_response)
     return (AT_CME_Error) ret;
 }
 
+/**
+ * Register handler for unsolicited responses starting with prefix.
+ * prefix must contain the complete URC name, eg "+CREG:" or "+CIEV: 2"
+ * but not "+CRE". Handlers for the same name are tried in the order they
+ * were registered. Not thread safe, register before at_open().
+ *
+ * Returns 0 on success, -1 if the handler table is full.
+ */
+int at_register_unsol_handler(const char *prefix, ATUnsolHandler handler)
+{
+    struct ATUnsolEntry *e;
+    int *link;
+
+    if (s_unsolEntryCount >= AT_UNSOL_MAX_HANDLERS) {
+        LOGE("at_register_unsol_handler: No room for %s", prefix);
+        return -1;
+    }
+
+    e = &s_unsolEntries[s_unsolEntryCount++];
+    e->prefix = prefix;
+    e->handler = handler;
+    e->next = 0;
+
+    link = &s_unsolBuckets[unsolNameHash(prefix)];
+    while (*link != 0)
+        link = &s_unsolEntries[*link - 1].next;
+    *link = s_unsolEntryCount;
+
+    return 0;
+}
+
+/**
+ * Run the first registered handler whose prefix matches s. Meant to be
+ * called from the ATUnsolHandler passed to at_open().
+ *
+ * Returns 1 if a handler was run, 0 otherwise.
+ */
+int at_dispatch_unsol(const char *s, const char *sms_pdu)
+{
+    struct atcontext *ac = getAtContext();
+    int i;
+
+    ac->unsolCount++;
+
+    for (i = s_unsolBuckets[unsolNameHash(s)]; i != 0;
+         i = s_unsolEntries[i - 1].next) {
+        const struct ATUnsolEntry *e = &s_unsolEntries[i - 1];
+
+        ac->unsolProbeCount++;
+        if (strStartsWith(s, e->prefix)) {
+            ac->unsolHandledCount++;
+            e->handler(s, sms_pdu);
+            return 1;
+        }
+    }
+
+    return 0;
+}
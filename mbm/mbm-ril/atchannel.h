@@ -76,12 +76,21 @@ typedef struct ATLine  {
     char *line;
 } ATLine;
 
-/** Free this with at_response_free(). */
+struct ATArena;
+
+/**
+ * Free this with at_response_free(). The lines and the final response
+ * live in the response's own arena and must not be freed separately.
+ */
 typedef struct {
     int success;              /* True if final response indicates
                                  success (eg "OK"). */
     char *finalResponse;      /* Eg OK, ERROR */
     ATLine  *p_intermediates; /* Any intermediate responses. */
+
+    /* Private to atchannel.c. */
+    ATLine *p_lastIntermediate;
+    struct ATArena *arena;
 } ATResponse;
 
 /**
@@ -95,6 +104,15 @@ typedef void (*ATUnsolHandler)(const char *s, const char *sms_pdu);
 int at_open(int fd, ATUnsolHandler h);
 void at_close();
 
+/*
+ * Prefix dispatch for unsolicited responses. Handlers are hashed on the
+ * URC name so a line costs one hash and usually a single prefix compare.
+ * Register all handlers before at_open(); at_dispatch_unsol() is then
+ * called from the ATUnsolHandler and returns 1 if a handler matched.
+ */
+int at_register_unsol_handler(const char *prefix, ATUnsolHandler handler);
+int at_dispatch_unsol(const char *s, const char *sms_pdu);
+
 /*
  * Set default timeout for at commands. Let it be reasonable high
  * since some commands take their time. Default is 10 minutes.
@@ -137,10 +155,62 @@ int at_send_command_sms (const char *command, const char *pdu,
                             const char *responsePrefix,
                             ATResponse **pp_outResponse);
 
+/*
+ * Pipelined commands. at_send_command_async() queues a command and
+ * returns at once; queued commands go out in order, the next one being
+ * written by the reader thread as soon as the previous final response
+ * is in, so a burst of commands does not pay a thread round trip per
+ * command. Responses are matched to commands in FIFO order, anything
+ * else is routed to the unsolicited handler as usual.
+ *
+ * The callback is invoked on the reader thread (like ATUnsolHandler),
+ * so do not block or issue AT commands from it. p_response is freed
+ * when the callback returns. callback may be NULL.
+ *
+ * at_wait_async() blocks until every queued command has completed and
+ * returns the first AT_ERROR_* any of them got, or 0. Synchronous
+ * commands wait for the pipeline to drain before they are sent.
+ */
+typedef void (*ATCommandCallback)(int err, ATResponse *p_response,
+                                  void *param);
+
+int at_send_command_async (const char *command, ATCommandType type,
+                           const char *responsePrefix,
+                           ATCommandCallback callback, void *param);
+
+int at_wait_async (void);
+
+/*
+ * Number of pipelined commands that may be on the wire at once.
+ * Default is 1, which still saves the command thread round trip;
+ * only raise it for modems known to buffer command lines.
+ */
+void at_set_pipeline_depth(int depth);
+
 void at_response_free(ATResponse *p_response);
 
 void at_make_default_channel(void);
 
+/*
+ * Reader statistics of the calling thread's channel, as logged when the
+ * reader closes. A line is counted once it has been handled, so when
+ * lines has reached n the first n lines have all been dispatched.
+ */
+struct at_stats {
+    int readBytes;
+    int lines;
+    int compactions;    /* Partial lines moved to the buffer start. */
+    int grows;          /* Buffer grown for a long line. */
+    int responses;      /* One malloc each, with the first arena chunk. */
+    int intermediates;
+    int arenaChunks;    /* Extra chunks, one malloc each. */
+    int unsolDispatched;        /* at_dispatch_unsol() calls. */
+    int unsolHandled;
+    int unsolCompares;          /* Prefix compares made by them. */
+};
+
+void at_get_stats(struct at_stats *stats);
+
 typedef enum {
     CME_ERROR_NON_CME = -1,
     CME_SUCCESS = 0,
@@ -0,0 +1,330 @@
+/* ST-Ericsson U300 RIL
+**
+** Host tool: times the hex codec in misc.c, stringToBinary() and
+** binaryToString(), against the branching per character code it replaced
+** and against word at a time and NEON versions, at the lengths the RIL
+** converts.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * The word at a time version does with plain 64 bit arithmetic what a
+ * vector unit would, 8 digits per step. It stands in for NEON on the
+ * host; built for the target with NEON the intrinsics version is timed
+ * as well. Both assume a little endian CPU. The lengths are in bytes:
+ * a status word, an ICCID, an SMS PDU, a full SIM record, and a large
+ * cell broadcast page set.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "misc.h"
+
+static const size_t s_lengths[] = { 2, 10, 176, 256, 1024 };
+
+/* What misc.c did before the tables. */
+static unsigned char branchNib(char c)
+{
+    if (c >= 0x30 && c <= 0x39)
+        return c - 0x30;
+    if (c >= 0x41 && c <= 0x46)
+        return c - 0x41 + 0xA;
+    if (c >= 0x61 && c <= 0x66)
+        return c - 0x61 + 0xA;
+    return 0;
+}
+
+static int branchToBinary(const char *string, size_t len,
+                          unsigned char *binary)
+{
+    size_t i;
+
+    if (len & 1)
+        return -EINVAL;
+    for (i = 0; i < len; i += 2)
+        *binary++ = branchNib(string[i]) << 4 | branchNib(string[i + 1]);
+    return 0;
+}
+
+static int branchToString(const unsigned char *binary, size_t len,
+                          char *string)
+{
+    static const char nibbles[] = "0123456789ABCDEF";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        *string++ = nibbles[binary[i] >> 4];
+        *string++ = nibbles[binary[i] & 0x0f];
+    }
+    *string = 0;
+    return 0;
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGH 0x8080808080808080ULL
+
+static int wordToBinary(const char *string, size_t len,
+                        unsigned char *binary)
+{
+    uint64_t bad = 0;
+    uint64_t x, folded, digit, letter, n;
+    size_t i;
+
+    if (len & 1)
+        return -EINVAL;
+
+    for (i = 0; i + 8 <= len; i += 8, binary += 4) {
+        memcpy(&x, string + i, 8);
+
+        /* Every byte below 0x80, so the additions below do not carry. */
+        bad |= x & HIGH;
+        x &= ~HIGH;
+        digit = ~((x ^ 0x30 * ONES) + 0x76 * ONES) & HIGH;
+        folded = x | 0x20 * ONES;
+        letter = (folded + 0x1f * ONES) & ~(folded + 0x19 * ONES) & HIGH;
+        bad |= (digit | letter) ^ HIGH;
+
+        /* '0'-'9' are 0x3n, letters 0x4n or 0x6n plus nine. */
+        n = (x & 0x0f * ONES) + ((x >> 6) & ONES) * 9;
+
+        /* Pairs of nibbles to bytes, then the bytes together. */
+        n = ((n << 4) | (n >> 8)) & 0x00ff00ff00ff00ffULL;
+        n = (n | (n >> 8)) & 0x0000ffff0000ffffULL;
+        n = (n | (n >> 16)) & 0x00000000ffffffffULL;
+        memcpy(binary, &n, 4);
+    }
+
+    if (i < len && stringToBinary(string + i, len - i, binary) < 0)
+        return -EINVAL;
+
+    return bad ? -EINVAL : 0;
+}
+
+static int wordToString(const unsigned char *binary, size_t len,
+                        char *string)
+{
+    uint32_t b;
+    uint64_t x, n;
+    size_t i;
+
+    for (i = 0; i + 4 <= len; i += 4, string += 8) {
+        memcpy(&b, binary + i, 4);
+
+        /* One byte per 16 bits, then high nibble first. */
+        x = b;
+        x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+        x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+        n = ((x >> 4) & 0x000f000f000f000fULL) |
+            ((x & 0x000f000f000f000fULL) << 8);
+
+        /* Above 9, skip the seven characters between '9' and 'A'. */
+        n += 0x30 * ONES + (((n + 0x76 * ONES) & HIGH) >> 7) * 7;
+        memcpy(string, &n, 8);
+    }
+
+    return binaryToString(binary + i, len - i, string);
+}
+
+#ifdef __ARM_NEON__
+static int neonToBinary(const char *string, size_t len,
+                        unsigned char *binary)
+{
+    uint8x16_t bad = vdupq_n_u8(0);
+    size_t i;
+
+    if (len & 1)
+        return -EINVAL;
+
+    for (i = 0; i + 16 <= len; i += 16, binary += 8) {
+        uint8x16_t c = vld1q_u8((const uint8_t *) string + i);
+        uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+        uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)),
+                                vdupq_n_u8('a'));
+        uint8x16_t isDigit = vcltq_u8(d, vdupq_n_u8(10));
+        uint8x16_t isLetter = vcltq_u8(l, vdupq_n_u8(6));
+        uint8x16_t n = vbslq_u8(isDigit, d, vaddq_u8(l, vdupq_n_u8(10)));
+        uint16x8_t w;
+
+        bad = vorrq_u8(bad, vmvnq_u8(vorrq_u8(isDigit, isLetter)));
+
+        /* Even characters are the high nibbles. */
+        w = vreinterpretq_u16_u8(n);
+        vst1_u8(binary, vmovn_u16(vorrq_u16(vshlq_n_u16(w, 4),
+                                            vshrq_n_u16(w, 8))));
+    }
+
+    if (i < len && stringToBinary(string + i, len - i, binary) < 0)
+        return -EINVAL;
+
+    {
+        uint8x8_t b = vorr_u8(vget_low_u8(bad), vget_high_u8(bad));
+
+        return vget_lane_u64(vreinterpret_u64_u8(b), 0) ? -EINVAL : 0;
+    }
+}
+
+static int neonToString(const unsigned char *binary, size_t len,
+                        char *string)
+{
+    static const uint8_t digits[] = "0123456789ABCDEF";
+    uint8x8x2_t table = { { vld1_u8(digits), vld1_u8(digits + 8) } };
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8, string += 16) {
+        uint8x8_t b = vld1_u8(binary + i);
+        uint8x8_t hi = vtbl2_u8(table, vshr_n_u8(b, 4));
+        uint8x8_t lo = vtbl2_u8(table, vand_u8(b, vdup_n_u8(0x0f)));
+        uint8x8x2_t z = vzip_u8(hi, lo);
+
+        vst1_u8((uint8_t *) string, z.val[0]);
+        vst1_u8((uint8_t *) string + 8, z.val[1]);
+    }
+
+    return binaryToString(binary + i, len - i, string);
+}
+#endif
+
+struct codec {
+    const char *name;
+    int (*toBinary)(const char *, size_t, unsigned char *);
+    int (*toString)(const unsigned char *, size_t, char *);
+};
+
+static const struct codec s_codecs[] = {
+    { "branch", branchToBinary, branchToString },
+    { "table", stringToBinary, binaryToString },
+    { "word", wordToBinary, wordToString },
+#ifdef __ARM_NEON__
+    { "neon", neonToBinary, neonToString },
+#endif
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The table codec is the reference, the others must agree with it on
+   mixed case input and reject what it rejects. */
+static int verify(const struct codec *c, const unsigned char *binary,
+                  size_t len)
+{
+    char expect[2 * 1024 + 1], string[2 * 1024 + 1];
+    unsigned char decoded[1024];
+    size_t i;
+
+    binaryToString(binary, len, expect);
+    c->toString(binary, len, string);
+    if (strcmp(expect, string) != 0)
+        return -1;
+
+    for (i = 0; i < 2 * len; i += 3)
+        string[i] = tolower((unsigned char) string[i]);
+    if (c->toBinary(string, 2 * len, decoded) < 0 ||
+        memcmp(decoded, binary, len) != 0)
+        return -1;
+
+    if (c->toBinary == branchToBinary)
+        return 0;
+    /* The neighbours of the digit and letter ranges. */
+    for (i = 0; i < 2 * len; i++) {
+        static const char notHex[] = "/:@G`g\x80\xb0";
+        char saved = string[i];
+
+        string[i] = notHex[i % (sizeof(notHex) - 1)];
+        if (c->toBinary(string, 2 * len, decoded) == 0)
+            return -1;
+        string[i] = saved;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned char binary[1024], decoded[1024];
+    static char string[2 * 1024 + 1];
+    size_t i, l, k;
+    long loops, n;
+    double bytes = 2e7;
+    double t0, t1, t2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        switch (opt) {
+        case 'b':
+            bytes = atof(optarg) * 1e6;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b MB]\n"
+                            "  -b MB  bytes decoded and encoded per length "
+                            "and codec (default: 20)\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < sizeof(binary); i++)
+        binary[i] = rand();
+
+    for (k = 0; k < NUM_ELEMS(s_codecs); k++)
+        for (l = 0; l < NUM_ELEMS(s_lengths); l++)
+            if (verify(&s_codecs[k], binary, s_lengths[l]) < 0) {
+                fprintf(stderr, "%s codec is wrong at %u bytes\n",
+                        s_codecs[k].name, (unsigned) s_lengths[l]);
+                return 1;
+            }
+
+    printf("%6s %-7s %12s %12s\n", "bytes", "codec", "decode ns", "encode ns");
+    for (l = 0; l < NUM_ELEMS(s_lengths); l++) {
+        size_t len = s_lengths[l];
+
+        loops = (long) (bytes / len);
+        binaryToString(binary, len, string);
+
+        for (k = 0; k < NUM_ELEMS(s_codecs); k++) {
+            const struct codec *c = &s_codecs[k];
+
+            t0 = now();
+            for (n = 0; n < loops; n++) {
+                c->toBinary(string, 2 * len, decoded);
+                __asm__ __volatile__("" : : "r" (decoded) : "memory");
+            }
+            t1 = now();
+            for (n = 0; n < loops; n++) {
+                c->toString(binary, len, string);
+                __asm__ __volatile__("" : : "r" (string) : "memory");
+            }
+            t2 = now();
+
+            printf("%6u %-7s %12.1f %12.1f\n", (unsigned) len, c->name,
+                   (t1 - t0) / loops * 1e9, (t2 - t1) / loops * 1e9);
+        }
+    }
+
+    return 0;
+}
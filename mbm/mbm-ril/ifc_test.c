@@ -0,0 +1,267 @@
+/*
+ * Host test for net-utils.c: configures two interfaces with
+ * ifc_nl_configure() and ifc_configure() and checks the addresses, routes
+ * and DNS properties that result. It changes the interfaces it is given,
+ * so run it through ifc_test.sh, which makes a veth pair in a network
+ * namespace of its own.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+
+#include <cutils/properties.h>
+
+#include "net-utils.h"
+
+/* ifc_configure() publishes through properties, which the host does not
+   have. They are kept here so that they can be checked. */
+#define MAX_PROPS 32
+
+static struct {
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+} s_props[MAX_PROPS];
+
+int property_set(const char *key, const char *value)
+{
+    int i;
+
+    for (i = 0; i < MAX_PROPS; i++)
+	if (s_props[i].key[0] == '\0' || strcmp(s_props[i].key, key) == 0)
+	    break;
+    if (i == MAX_PROPS)
+	return -1;
+
+    strncpy(s_props[i].key, key, PROPERTY_KEY_MAX - 1);
+    strncpy(s_props[i].value, value, PROPERTY_VALUE_MAX - 1);
+    return 0;
+}
+
+int property_get(const char *key, char *value, const char *default_value)
+{
+    int i;
+
+    for (i = 0; i < MAX_PROPS; i++)
+	if (strcmp(s_props[i].key, key) == 0)
+	    break;
+    strncpy(value, i < MAX_PROPS ? s_props[i].value :
+	    (default_value ? default_value : ""), PROPERTY_VALUE_MAX - 1);
+    value[PROPERTY_VALUE_MAX - 1] = '\0';
+    return strlen(value);
+}
+
+static int s_failures;
+
+static void check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok)
+	s_failures++;
+}
+
+static void checkProp(const char *key, const char *expect)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char what[128];
+
+    property_get(key, value, "");
+    snprintf(what, sizeof(what), "%s is \"%s\"", key, expect);
+    if (strcmp(value, expect) != 0)
+	printf("      it is \"%s\"\n", value);
+    check(strcmp(value, expect) == 0, what);
+}
+
+static void parseAddr(struct ifc_addr *a, const char *s, int prefixlen)
+{
+    memset(a, 0, sizeof(*a));
+    a->family = strchr(s, ':') ? AF_INET6 : AF_INET;
+    a->prefixlen = prefixlen;
+    inet_pton(a->family, s, &a->addr);
+}
+
+/* Whether ifname has address s, as getifaddrs() sees it. */
+static int hasAddr(const char *ifname, const char *s)
+{
+    struct ifaddrs *ifa, *it;
+    char buf[INET6_ADDRSTRLEN];
+    int found = 0;
+
+    if (getifaddrs(&ifa) < 0)
+	return 0;
+    for (it = ifa; it != NULL && !found; it = it->ifa_next) {
+	const void *addr;
+
+	if (it->ifa_addr == NULL || strcmp(it->ifa_name, ifname) != 0)
+	    continue;
+	if (it->ifa_addr->sa_family == AF_INET)
+	    addr = &((struct sockaddr_in *) it->ifa_addr)->sin_addr;
+	else if (it->ifa_addr->sa_family == AF_INET6)
+	    addr = &((struct sockaddr_in6 *) it->ifa_addr)->sin6_addr;
+	else
+	    continue;
+	inet_ntop(it->ifa_addr->sa_family, addr, buf, sizeof(buf));
+	found = strcmp(buf, s) == 0;
+    }
+    freeifaddrs(ifa);
+
+    return found;
+}
+
+static int isUp(const char *ifname)
+{
+    struct ifaddrs *ifa, *it;
+    int up = 0;
+
+    if (getifaddrs(&ifa) < 0)
+	return 0;
+    for (it = ifa; it != NULL; it = it->ifa_next)
+	if (strcmp(it->ifa_name, ifname) == 0)
+	    up = (it->ifa_flags & IFF_UP) != 0;
+    freeifaddrs(ifa);
+
+    return up;
+}
+
+/*
+ * Whether /proc/net/route has an IPv4 route on ifname to dest/mask
+ * through gateway, both as dotted quads, gateway "0.0.0.0" for none.
+ */
+static int hasRoute(const char *ifname, const char *dest, const char *mask,
+		    const char *gateway)
+{
+    char line[256];
+    char iface[IFNAMSIZ];
+    unsigned int d, g, m;
+    in_addr_t wantD = inet_addr(dest);
+    in_addr_t wantG = inet_addr(gateway);
+    in_addr_t wantM = inet_addr(mask);
+    int found = 0;
+    FILE *f;
+
+    f = fopen("/proc/net/route", "r");
+    if (f == NULL)
+	return 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+	if (sscanf(line, "%15s %x %x %*x %*d %*d %*d %x", iface, &d, &g,
+		   &m) != 4)
+	    continue;
+	found = strcmp(iface, ifname) == 0 && d == wantD && g == wantG &&
+		m == wantM;
+    }
+    fclose(f);
+
+    return found;
+}
+
+static void testNlConfigure(const char *ifname)
+{
+    struct ifc_addr addrs[3];
+    struct ifc_addr gw;
+    int err;
+
+    parseAddr(&addrs[0], "10.1.0.2", 32);
+    parseAddr(&addrs[1], "10.1.1.2", 24);
+    parseAddr(&addrs[2], "fd00:1::2", 64);
+    parseAddr(&gw, "10.1.1.1", 32);
+
+    err = ifc_nl_configure(ifname, addrs, 3, &gw,
+			   IFC_HOST_ROUTE | IFC_DEFAULT_ROUTE);
+    check(err == 0, "ifc_nl_configure applies the whole batch");
+    check(isUp(ifname), "the link is up");
+    check(hasAddr(ifname, "10.1.0.2"), "the /32 address is set");
+    check(hasAddr(ifname, "10.1.1.2"), "the /24 address is set");
+    check(hasAddr(ifname, "fd00:1::2"), "the IPv6 address is set");
+    check(hasRoute(ifname, "10.1.1.1", "255.255.255.255", "0.0.0.0"),
+	  "the host route to the gateway is set");
+    check(hasRoute(ifname, "0.0.0.0", "0.0.0.0", "10.1.1.1"),
+	  "the default route is set");
+
+    err = ifc_nl_configure(ifname, addrs, 3, &gw,
+			   IFC_HOST_ROUTE | IFC_DEFAULT_ROUTE);
+    check(err == 0, "ifc_nl_configure again for the same configuration");
+
+    err = ifc_nl_configure("ifc_test_none", addrs, 1, NULL, 0);
+    check(err == -ENODEV, "an unknown interface is -ENODEV");
+
+    /* rtnetlink has no transactions, what comes before the error stays. */
+    parseAddr(&addrs[0], "10.1.2.2", 32);
+    parseAddr(&addrs[1], "10.1.3.2", 33);
+    err = ifc_nl_configure(ifname, addrs, 2, NULL, 0);
+    check(err < 0, "a bad prefix in the batch fails it");
+    check(hasAddr(ifname, "10.1.2.2"), "requests before the bad one stay");
+    check(!hasAddr(ifname, "10.1.3.2"), "the bad one is not applied");
+}
+
+/* Two data interfaces, the way two data calls would come and go. */
+static void testConfigureDns(const char *if0, const char *if1)
+{
+    char key[PROPERTY_KEY_MAX];
+    int err;
+
+    err = ifc_configure(if0, inet_addr("10.2.0.2"), inet_addr("10.2.0.1"),
+			inet_addr("10.2.0.53"), inet_addr("10.2.0.54"));
+    check(err == 0, "ifc_configure the first interface");
+    check(hasAddr(if0, "10.2.0.2"), "its address is set");
+    check(hasRoute(if0, "10.2.0.1", "255.255.255.255", "0.0.0.0"),
+	  "its host route is set");
+    snprintf(key, sizeof(key), "net.%s.dns1", if0);
+    checkProp(key, "10.2.0.53");
+    checkProp("net.dns1", "10.2.0.53");
+    checkProp("net.dns2", "10.2.0.54");
+
+    err = ifc_configure(if1, inet_addr("10.3.0.2"), inet_addr("10.3.0.1"),
+			inet_addr("10.3.0.53"), 0);
+    check(err == 0, "ifc_configure the second interface");
+    checkProp("net.dns1", "10.3.0.53");
+    checkProp("net.dns2", "");
+
+    err = ifc_unconfigure(if0);
+    check(err == 0, "ifc_unconfigure the first interface");
+    check(!isUp(if0), "its link is down");
+    snprintf(key, sizeof(key), "net.%s.dns1", if0);
+    checkProp(key, "");
+    checkProp("net.dns1", "10.3.0.53");
+
+    err = ifc_unconfigure(if1);
+    check(err == 0, "ifc_unconfigure the second interface");
+    checkProp("net.dns1", "");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <interface> <interface>\n"
+			"  both interfaces are reconfigured, see "
+			"ifc_test.sh\n", argv[0]);
+	return 1;
+    }
+
+    if (if_nametoindex(argv[1]) == 0 || if_nametoindex(argv[2]) == 0) {
+	fprintf(stderr, "%s or %s does not exist\n", argv[1], argv[2]);
+	return 1;
+    }
+
+    testNlConfigure(argv[1]);
+    testConfigureDns(argv[1], argv[2]);
+
+    printf("%d failed\n", s_failures);
+    return s_failures != 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Runs ifc_test against a veth pair in a network namespace of its own, so
+# that the host interfaces are left alone. As root a named namespace is
+# used, otherwise an unprivileged user and network namespace.
+#
+# usage: ifc_test.sh <path to ifc_test>
+
+if [ $# -ne 1 ] || [ ! -x "$1" ]; then
+    echo "usage: $0 <path to ifc_test>" >&2
+    exit 1
+fi
+
+test=$1
+
+if [ "$(id -u)" -eq 0 ] && ip netns help >/dev/null 2>&1; then
+    ns=ifc_test.$$
+    ip netns add $ns || exit 1
+    trap 'ip netns del $ns' EXIT
+    ip netns exec $ns ip link add ifc0 type veth peer name ifc1 || exit 1
+    ip netns exec $ns "$test" ifc0 ifc1
+else
+    unshare -rn sh -c '
+        ip link add ifc0 type veth peer name ifc1 || exit 1
+        exec "$0" ifc0 ifc1' "$test"
+fi
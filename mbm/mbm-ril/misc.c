@@ -21,6 +21,7 @@
 ** Author: Christian Bejram <christian.bejram@stericsson.com>
 */
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
@@ -97,62 +98,158 @@ char *getFirstElementValue(const char* document,
     return value;
 }
 
+/*
+ * Hex conversion tables. s_hexValues maps a character to its nibble
+ * value, or 0xFF if it is no hex digit. s_hexPairs holds the two
+ * characters for each byte value.
+ */
+static const unsigned char s_hexValues[256] = {
+    [0 ... 255] = 0xFF,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+};
+
+#define HEX_PAIR(h, l) { "0123456789ABCDEF"[h], "0123456789ABCDEF"[l] }
+#define HEX_ROW(h) \
+    HEX_PAIR(h, 0), HEX_PAIR(h, 1), HEX_PAIR(h, 2), HEX_PAIR(h, 3), \
+    HEX_PAIR(h, 4), HEX_PAIR(h, 5), HEX_PAIR(h, 6), HEX_PAIR(h, 7), \
+    HEX_PAIR(h, 8), HEX_PAIR(h, 9), HEX_PAIR(h, 10), HEX_PAIR(h, 11), \
+    HEX_PAIR(h, 12), HEX_PAIR(h, 13), HEX_PAIR(h, 14), HEX_PAIR(h, 15)
+
+static const char s_hexPairs[256][2] = {
+    HEX_ROW(0), HEX_ROW(1), HEX_ROW(2), HEX_ROW(3),
+    HEX_ROW(4), HEX_ROW(5), HEX_ROW(6), HEX_ROW(7),
+    HEX_ROW(8), HEX_ROW(9), HEX_ROW(10), HEX_ROW(11),
+    HEX_ROW(12), HEX_ROW(13), HEX_ROW(14), HEX_ROW(15)
+};
+
+#undef HEX_ROW
+#undef HEX_PAIR
+
+/** Returns the value of hex digit c, 0 if c is no hex digit. */
 char char2nib(char c)
 {
-    if (c >= 0x30 && c <= 0x39)
-        return c - 0x30;
+    unsigned char v = s_hexValues[(unsigned char) c];
 
-    if (c >= 0x41 && c <= 0x46)
-        return c - 0x41 + 0xA;
+    return v == 0xFF ? 0 : v;
+}
 
-    if (c >= 0x61 && c <= 0x66)
-        return c - 0x61 + 0xA;
+/** Returns the byte encoded by the two hex digits at hex, 0 for non-hex. */
+unsigned char hexToByte(const char *hex)
+{
+    unsigned char hi = s_hexValues[(unsigned char) hex[0]];
+    unsigned char lo = s_hexValues[(unsigned char) hex[1]];
 
-    return 0;
+    if ((hi | lo) & 0xF0)
+        return 0;
+    return hi << 4 | lo;
 }
 
+/**
+ * Decode len hex digits from string into len / 2 bytes at binary.
+ * Returns -EINVAL if len is odd or string holds anything but hex digits.
+ */
 int stringToBinary(/*in*/ const char *string,
                    /*in*/ size_t len,
                    /*out*/ unsigned char *binary)
 {
-    int pos;
-    const char *it;
-    const char *end = &string[len];
+    const unsigned char *it = (const unsigned char *) string;
+    const unsigned char *end = it + len;
+    unsigned char bad = 0;
+    unsigned char hi, lo;
 
-    if (end < string)
+    if (end < it)
         return -EINVAL;
 
     if (len & 1)
         return -EINVAL;
 
-    for (pos = 0, it = string; it != end; ++pos, it += 2) {
-        binary[pos] = char2nib(it[0]) << 4 | char2nib(it[1]);
+    /* Check once at the end instead of branching on every digit. */
+    for (; it != end; it += 2) {
+        hi = s_hexValues[it[0]];
+        lo = s_hexValues[it[1]];
+        bad |= hi | lo;
+        *binary++ = hi << 4 | (lo & 0x0F);
     }
-    return 0;
+
+    return (bad & 0xF0) ? -EINVAL : 0;
 }
 
+/**
+ * Encode len bytes from binary as upper case hex digits into string,
+ * which must have room for 2 * len + 1 characters.
+ */
 int binaryToString(/*in*/ const unsigned char *binary,
                    /*in*/ size_t len,
                    /*out*/ char *string)
 {
-    int pos;
     const unsigned char *it;
     const unsigned char *end = &binary[len];
-    static const char nibbles[] =
-        {'0', '1', '2', '3', '4', '5', '6', '7',
-         '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
 
     if (end < binary)
         return -EINVAL;
 
-    for (pos = 0, it = binary; it != end; ++it, pos += 2) {
-        string[pos + 0] = nibbles[*it >> 4];
-        string[pos + 1] = nibbles[*it & 0x0f];
-    }
-    string[pos] = 0;
+    for (it = binary; it != end; ++it, string += 2)
+        memcpy(string, s_hexPairs[*it], 2);
+    *string = 0;
     return 0;
 }
 
+/**
+ * Returns the UTF-8 string s converted to UCS-2 in hex, as used by AT
+ * commands with +CSCS="UCS2". Bytes that do not form valid UTF-8 are
+ * taken as Latin-1, characters outside the BMP become U+FFFD.
+ * NULL is taken as the empty string. The caller frees the result.
+ */
+char *ucs2HexFromUtf8(const char *s)
+{
+    const unsigned char *it = (const unsigned char *) (s ? s : "");
+    size_t len = strlen((const char *) it);
+    char *out = malloc(len * 4 + 1);
+    char *pos = out;
+    unsigned int c;
+    int n, i;
+
+    if (out == NULL)
+        return NULL;
+
+    while (*it != '\0') {
+        c = *it;
+        n = 0;
+        if (c >= 0xF0 && c <= 0xF4)
+            n = 3;
+        else if (c >= 0xE0)
+            n = (c <= 0xEF) ? 2 : 0;
+        else if (c >= 0xC2)
+            n = 1;
+
+        for (i = 1; i <= n; i++)
+            if ((it[i] & 0xC0) != 0x80)
+                break;
+
+        if (n == 0 || i <= n) {
+            /* ASCII, or not UTF-8 at all. */
+            it++;
+        } else {
+            c &= 0x3F >> n;
+            for (i = 1; i <= n; i++)
+                c = c << 6 | (it[i] & 0x3F);
+            it += n + 1;
+            if (c > 0xFFFF)
+                c = 0xFFFD;
+        }
+
+        memcpy(pos, s_hexPairs[c >> 8], 2);
+        memcpy(pos + 2, s_hexPairs[c & 0xFF], 2);
+        pos += 4;
+    }
+    *pos = '\0';
+
+    return out;
+}
+
 int parseTlv(/*in*/ const char *stream,
              /*in*/ const char *end,
              /*out*/ struct tlv *tlv)
@@ -161,8 +258,7 @@ int parseTlv(/*in*/ const char *stream,
     do {                                \
         if (stream + 1 >= end)          \
             goto underflow;             \
-        p = ((unsigned)char2nib(stream[0]) << 4)  \
-          | ((unsigned)char2nib(stream[1]) << 0); \
+        p = hexToByte(stream);          \
         stream += 2;                    \
     } while (0)
 
@@ -39,6 +39,7 @@ char *getFirstElementValue(const char* document,
                            char** remainingDocument);
 
 char char2nib(char c);
+unsigned char hexToByte(const char *hex);
 
 int stringToBinary(/*in*/ const char *string,
                    /*in*/ size_t len,
@@ -48,11 +49,12 @@ int binaryToString(/*in*/ const unsigned char *binary,
                    /*in*/ size_t len,
                    /*out*/ char *string);
 
+char *ucs2HexFromUtf8(const char *s);
+
 int parseTlv(/*in*/ const char *stream,
              /*in*/ const char *end,
              /*out*/ struct tlv *tlv);
-#define TLV_DATA(tlv, pos) (((unsigned)char2nib(tlv.data[(pos) * 2 + 0]) << 4) | \
-                            ((unsigned)char2nib(tlv.data[(pos) * 2 + 1]) << 0))
+#define TLV_DATA(tlv, pos) ((unsigned)hexToByte(&tlv.data[(pos) * 2]))
 
 #define NUM_ELEMS(x) (sizeof(x) / sizeof(x[0]))
 
@@ -25,11 +25,16 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 
 #include <linux/if.h>
 #include <linux/sockios.h>
 #include <linux/route.h>
 #include <linux/wireless.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "net-utils.h"
 
 #define LOG_TAG "mbm-netutils"
 #include <cutils/log.h>
@@ -135,6 +140,7 @@ int ifc_add_ipv4_route(const char *ifname, struct in_addr dst,
 {
     struct rtentry rt;
     int result;
+    int opened;
     in_addr_t netmask;
 
     memset(&rt, 0, sizeof(rt));
@@ -156,6 +162,9 @@ int ifc_add_ipv4_route(const char *ifname, struct in_addr dst,
 	init_sockaddr_in(&rt.rt_gateway, gw.s_addr);
     }
 
+    /* Only close the socket if it was opened here, ifc_configure() still
+       needs it. */
+    opened = ifc_ctl_sock < 0;
     ifc_init();
 
     if (ifc_ctl_sock < 0) {
@@ -170,7 +179,8 @@ int ifc_add_ipv4_route(const char *ifname, struct in_addr dst,
 	    result = -errno;
 	}
     }
-    ifc_close();
+    if (opened)
+	ifc_close();
     return result;
 }
 
@@ -195,12 +205,263 @@ int ifc_add_host_route(const char *name, in_addr_t dst)
 }
 
 
-int ifc_configure(const char *ifname,
-		  in_addr_t address,
-		  in_addr_t gateway, in_addr_t dns1, in_addr_t dns2)
+/*
+ * rtnetlink backend. All changes for an interface go out in one sendmsg()
+ * as a batch of requests; only the last asks for an ack, the kernel sends
+ * an error for any earlier request that fails, so one round trip covers
+ * the whole configuration.
+ */
+#define IFC_NL_BUFSIZE 2048
+
+struct ifc_nl_req {
+    char *buf;
+    size_t len;
+    size_t size;
+    unsigned int seq;
+    int count;
+};
+
+static struct nlmsghdr *ifc_nl_msg(struct ifc_nl_req *req, int type,
+				   int flags, const void *body,
+				   size_t bodylen)
+{
+    struct nlmsghdr *nh;
+    size_t len = NLMSG_SPACE(bodylen);
+
+    if (req->len + len > req->size)
+	return NULL;
+
+    nh = (struct nlmsghdr *) (req->buf + req->len);
+    memset(nh, 0, len);
+    nh->nlmsg_len = NLMSG_LENGTH(bodylen);
+    nh->nlmsg_type = type;
+    nh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nh->nlmsg_seq = ++req->seq;
+    memcpy(NLMSG_DATA(nh), body, bodylen);
+
+    req->len += len;
+    req->count++;
+    return nh;
+}
+
+static int ifc_nl_attr(struct ifc_nl_req *req, struct nlmsghdr *nh,
+		       int type, const void *data, size_t datalen)
 {
+    struct rtattr *rta;
+    size_t len = RTA_SPACE(datalen);
 
-    char dns_prop_name[PROPERTY_KEY_MAX];
+    if (req->len + len > req->size)
+	return -1;
+
+    rta = (struct rtattr *) (req->buf + req->len);
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(datalen);
+    memcpy(RTA_DATA(rta), data, datalen);
+
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + len;
+    req->len += len;
+    return 0;
+}
+
+static size_t ifc_addr_len(const struct ifc_addr *a)
+{
+    return a->family == AF_INET6 ? sizeof(struct in6_addr)
+				 : sizeof(struct in_addr);
+}
+
+static int ifc_nl_link_up(struct ifc_nl_req *req, int ifindex)
+{
+    struct ifinfomsg ifi;
+
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = ifindex;
+    ifi.ifi_flags = IFF_UP;
+    ifi.ifi_change = IFF_UP;
+
+    return ifc_nl_msg(req, RTM_NEWLINK, 0, &ifi, sizeof(ifi)) ? 0 : -1;
+}
+
+static int ifc_nl_add_addr(struct ifc_nl_req *req, int ifindex,
+			   const struct ifc_addr *a)
+{
+    struct ifaddrmsg ifa;
+    struct nlmsghdr *nh;
+
+    memset(&ifa, 0, sizeof(ifa));
+    ifa.ifa_family = a->family;
+    ifa.ifa_prefixlen = a->prefixlen;
+    ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+    ifa.ifa_index = ifindex;
+
+    nh = ifc_nl_msg(req, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE,
+		    &ifa, sizeof(ifa));
+    if (nh == NULL)
+	return -1;
+    if (ifc_nl_attr(req, nh, IFA_LOCAL, &a->addr, ifc_addr_len(a)) ||
+	ifc_nl_attr(req, nh, IFA_ADDRESS, &a->addr, ifc_addr_len(a)))
+	return -1;
+    return 0;
+}
+
+/* Route to dst/prefixlen on ifindex, through gw if it is not NULL. */
+static int ifc_nl_add_route(struct ifc_nl_req *req, int ifindex,
+			    const struct ifc_addr *dst, int prefixlen,
+			    const struct ifc_addr *gw)
+{
+    struct rtmsg rtm;
+    struct nlmsghdr *nh;
+
+    memset(&rtm, 0, sizeof(rtm));
+    rtm.rtm_family = dst->family;
+    rtm.rtm_dst_len = prefixlen;
+    rtm.rtm_table = RT_TABLE_MAIN;
+    rtm.rtm_protocol = RTPROT_BOOT;
+    rtm.rtm_scope = gw ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+    rtm.rtm_type = RTN_UNICAST;
+
+    nh = ifc_nl_msg(req, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE,
+		    &rtm, sizeof(rtm));
+    if (nh == NULL)
+	return -1;
+    if (prefixlen > 0 &&
+	ifc_nl_attr(req, nh, RTA_DST, &dst->addr, ifc_addr_len(dst)))
+	return -1;
+    if (gw && ifc_nl_attr(req, nh, RTA_GATEWAY, &gw->addr, ifc_addr_len(gw)))
+	return -1;
+    if (ifc_nl_attr(req, nh, RTA_OIF, &ifindex, sizeof(ifindex)))
+	return -1;
+    return 0;
+}
+
+/**
+ * Send the batch in req and wait for the ack of its last request.
+ * Returns 0 on success or a negative errno of the first failure.
+ */
+static int ifc_nl_commit(struct ifc_nl_req *req)
+{
+    struct sockaddr_nl nladdr;
+    struct nlmsghdr *last;
+    char reply[IFC_NL_BUFSIZE];
+    int sock;
+    int result = 0;
+    int done = 0;
+    size_t off = 0;
+    int i;
+
+    if (req->count == 0)
+	return 0;
+
+    /* Ask for an ack on the last request only. */
+    for (i = 0, last = (struct nlmsghdr *) req->buf; i < req->count - 1; i++) {
+	off += NLMSG_ALIGN(last->nlmsg_len);
+	last = (struct nlmsghdr *) (req->buf + off);
+    }
+    last->nlmsg_flags |= NLM_F_ACK;
+
+    sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+    if (sock < 0) {
+	LOGE("ifc_nl_commit: socket() failed: %s\n", strerror(errno));
+	return -errno;
+    }
+
+    memset(&nladdr, 0, sizeof(nladdr));
+    nladdr.nl_family = AF_NETLINK;
+
+    if (sendto(sock, req->buf, req->len, 0, (struct sockaddr *) &nladdr,
+	       sizeof(nladdr)) < 0) {
+	result = -errno;
+	LOGE("ifc_nl_commit: sendto() failed: %s\n", strerror(errno));
+	goto out;
+    }
+
+    while (!done) {
+	struct nlmsghdr *nh;
+	int len = recv(sock, reply, sizeof(reply), 0);
+
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    result = -errno;
+	    LOGE("ifc_nl_commit: recv() failed: %s\n", strerror(errno));
+	    break;
+	}
+
+	for (nh = (struct nlmsghdr *) reply; NLMSG_OK(nh, (unsigned) len);
+	     nh = NLMSG_NEXT(nh, len)) {
+	    struct nlmsgerr *err;
+
+	    if (nh->nlmsg_type != NLMSG_ERROR)
+		continue;
+
+	    err = (struct nlmsgerr *) NLMSG_DATA(nh);
+	    if (err->error != 0 && result == 0) {
+		result = err->error;
+		LOGE("ifc_nl_commit: request %u of %d failed: %s\n",
+		     nh->nlmsg_seq, req->count, strerror(-err->error));
+	    }
+	    if (nh->nlmsg_seq == last->nlmsg_seq)
+		done = 1;
+	}
+    }
+
+out:
+    close(sock);
+    return result;
+}
+
+/**
+ * Bring up ifname and configure it with naddrs addresses, IPv4 and IPv6
+ * mixed, in a single rtnetlink transaction. With IFC_HOST_ROUTE a host
+ * route to gateway is added, with IFC_DEFAULT_ROUTE a default route
+ * through it for the gateway's family.
+ *
+ * Returns 0 on success or a negative errno.
+ */
+int ifc_nl_configure(const char *ifname, const struct ifc_addr *addrs,
+		     int naddrs, const struct ifc_addr *gateway, int flags)
+{
+    char buf[IFC_NL_BUFSIZE];
+    struct ifc_nl_req req;
+    int ifindex;
+    int i;
+
+    ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+	LOGE("ifc_nl_configure: no interface %s\n", ifname);
+	return -ENODEV;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.buf = buf;
+    req.size = sizeof(buf);
+
+    if (ifc_nl_link_up(&req, ifindex))
+	goto overflow;
+
+    for (i = 0; i < naddrs; i++)
+	if (ifc_nl_add_addr(&req, ifindex, &addrs[i]))
+	    goto overflow;
+
+    if (gateway != NULL && (flags & IFC_HOST_ROUTE))
+	if (ifc_nl_add_route(&req, ifindex, gateway,
+			     gateway->family == AF_INET6 ? 128 : 32, NULL))
+	    goto overflow;
+
+    if (gateway != NULL && (flags & IFC_DEFAULT_ROUTE))
+	if (ifc_nl_add_route(&req, ifindex, gateway, 0, gateway))
+	    goto overflow;
+
+    return ifc_nl_commit(&req);
+
+overflow:
+    LOGE("ifc_nl_configure: too many changes for one request\n");
+    return -ENOBUFS;
+}
+
+static int ifc_configure_ioctl(const char *ifname, in_addr_t address,
+			       in_addr_t gateway)
+{
     in_addr_t netmask = ~0;
 
     ifc_init();
@@ -234,10 +495,42 @@ int ifc_configure(const char *ifname,
     }
 
     ifc_close();
+    return 0;
+}
+
+/* The interface net.dns1/2 were last set from, "" when they are clear. */
+static char s_dns_ifname[IFNAMSIZ];
+
+int ifc_configure(const char *ifname,
+		  in_addr_t address,
+		  in_addr_t gateway, in_addr_t dns1, in_addr_t dns2)
+{
+
+    char dns_prop_name[PROPERTY_KEY_MAX];
+    struct ifc_addr addr;
+    struct ifc_addr gw;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.family = AF_INET;
+    addr.prefixlen = 32;
+    addr.addr.in.s_addr = address;
+
+    memset(&gw, 0, sizeof(gw));
+    gw.family = AF_INET;
+    gw.addr.in.s_addr = gateway;
+
+    /* Older kernels without rtnetlink get the ioctl path. */
+    if (ifc_nl_configure(ifname, &addr, 1, &gw, IFC_HOST_ROUTE) < 0) {
+	LOGW("ifc_configure: rtnetlink failed, falling back to ioctl\n");
+	if (ifc_configure_ioctl(ifname, address, gateway))
+	    return -1;
+    }
 
     snprintf(dns_prop_name, sizeof(dns_prop_name), "net.%s.gw", ifname);
     property_set(dns_prop_name, gateway ? ipaddr_to_string(gateway) : "");
 
+    /* The resolver only reads net.dns1/2, which follow the most
+       recently configured interface. */
     snprintf(dns_prop_name, sizeof(dns_prop_name), "net.%s.dns1", ifname);
     property_set(dns_prop_name, dns1 ? ipaddr_to_string(dns1) : "");
     property_set("net.dns1", dns1 ? ipaddr_to_string(dns1) : "");
@@ -246,7 +539,35 @@ int ifc_configure(const char *ifname,
     property_set(dns_prop_name, dns2 ? ipaddr_to_string(dns2) : "");
     property_set("net.dns2", dns2 ? ipaddr_to_string(dns2) : "");
 
-
+    strncpy(s_dns_ifname, ifname, sizeof(s_dns_ifname) - 1);
+    s_dns_ifname[sizeof(s_dns_ifname) - 1] = '\0';
 
     return 0;
 }
+
+/* Bring ifname down and clear what ifc_configure() published for it. */
+int ifc_unconfigure(const char *ifname)
+{
+    char prop_name[PROPERTY_KEY_MAX];
+    int ret;
+
+    ifc_init();
+    ret = ifc_down(ifname);
+    ifc_close();
+
+    snprintf(prop_name, sizeof(prop_name), "net.%s.gw", ifname);
+    property_set(prop_name, "");
+    snprintf(prop_name, sizeof(prop_name), "net.%s.dns1", ifname);
+    property_set(prop_name, "");
+    snprintf(prop_name, sizeof(prop_name), "net.%s.dns2", ifname);
+    property_set(prop_name, "");
+
+    /* Left alone if another interface has set them since. */
+    if (strcmp(s_dns_ifname, ifname) == 0) {
+	property_set("net.dns1", "");
+	property_set("net.dns2", "");
+	s_dns_ifname[0] = '\0';
+    }
+
+    return ret;
+}
@@ -17,6 +17,8 @@
 #ifndef MBM_NET_UTILS_H
 #define MBM_NET_UTILS_H 1
 
+#include <netinet/in.h>
+
 int ifc_init(void);
 void ifc_close(void);
 int ifc_up(const char *name);
@@ -27,5 +29,22 @@ int ifc_add_host_route(const char *name, in_addr_t addr);
 int ifc_configure(const char *ifname,
 		  in_addr_t address,
 		  in_addr_t gateway, in_addr_t dns1, in_addr_t dns2);
+int ifc_unconfigure(const char *ifname);
+
+/* An IPv4 or IPv6 address with prefix length, for ifc_nl_configure(). */
+struct ifc_addr {
+    int family;			/* AF_INET or AF_INET6 */
+    int prefixlen;
+    union {
+	struct in_addr in;
+	struct in6_addr in6;
+    } addr;
+};
+
+#define IFC_HOST_ROUTE    0x1	/* Host route to the gateway. */
+#define IFC_DEFAULT_ROUTE 0x2	/* Default route through the gateway. */
+
+int ifc_nl_configure(const char *ifname, const struct ifc_addr *addrs,
+		     int naddrs, const struct ifc_addr *gateway, int flags);
 
 #endif
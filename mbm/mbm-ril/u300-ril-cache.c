@@ -0,0 +1,272 @@
+/* Ericsson MBM RIL
+ *
+ * Copyright (C) Ericsson AB 2011
+ * Copyright 2006, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <telephony/ril.h>
+
+#include "u300-ril.h"
+#include "u300-ril-cache.h"
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+extern const char *requestToString(int request);
+
+#define REQUEST_CACHE_MAX_WAITERS 8
+
+typedef struct RequestCacheEntry {
+    int request;
+    unsigned int group;
+    long long ttlMsec;
+    char isStrings;         /* Response is a char *[] to deep copy. */
+
+    RIL_Token inflight;     /* Request fetching the entry, or NULL. */
+    unsigned int inflightGeneration;
+    RIL_Token waiters[REQUEST_CACHE_MAX_WAITERS];
+    int waiterCount;
+
+    unsigned int generation; /* Bumped on every invalidation. */
+    char valid;
+    struct timespec stamp;
+    void *response;
+    size_t responselen;
+
+    int hits;
+    int merged;
+    int misses;
+} RequestCacheEntry;
+
+static RequestCacheEntry s_cache[] = {
+    { .request = RIL_REQUEST_SIGNAL_STRENGTH,
+      .group = REQUEST_CACHE_SIGNAL, .ttlMsec = 1000, .isStrings = 0 },
+    { .request = RIL_REQUEST_REGISTRATION_STATE,
+      .group = REQUEST_CACHE_REGISTRATION, .ttlMsec = 3000, .isStrings = 1 },
+    { .request = RIL_REQUEST_GPRS_REGISTRATION_STATE,
+      .group = REQUEST_CACHE_REGISTRATION, .ttlMsec = 3000, .isStrings = 1 },
+    { .request = RIL_REQUEST_OPERATOR,
+      .group = REQUEST_CACHE_REGISTRATION, .ttlMsec = 3000, .isStrings = 1 },
+};
+
+#define REQUEST_CACHE_ENTRIES (sizeof(s_cache) / sizeof(s_cache[0]))
+
+static pthread_mutex_t s_cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static RequestCacheEntry *findEntry(int request)
+{
+    unsigned int i;
+
+    for (i = 0; i < REQUEST_CACHE_ENTRIES; i++)
+        if (s_cache[i].request == request)
+            return &s_cache[i];
+    return NULL;
+}
+
+static long long msecSince(const struct timespec *ts)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - ts->tv_sec) * 1000LL +
+           (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+/* Copy a response, strings arrays are copied into a single block. */
+static void *copyResponse(const RequestCacheEntry *e, void *response,
+                          size_t responselen)
+{
+    char **src = response;
+    char **dst;
+    char *p;
+    size_t count = responselen / sizeof(char *);
+    size_t size = responselen;
+    size_t i;
+
+    if (!e->isStrings) {
+        p = malloc(responselen);
+        if (p != NULL)
+            memcpy(p, response, responselen);
+        return p;
+    }
+
+    for (i = 0; i < count; i++)
+        if (src[i] != NULL)
+            size += strlen(src[i]) + 1;
+
+    dst = malloc(size);
+    if (dst == NULL)
+        return NULL;
+
+    p = (char *) (dst + count);
+    for (i = 0; i < count; i++) {
+        if (src[i] == NULL) {
+            dst[i] = NULL;
+            continue;
+        }
+        dst[i] = p;
+        strcpy(p, src[i]);
+        p += strlen(p) + 1;
+    }
+
+    return dst;
+}
+
+static void dropResponse(RequestCacheEntry *e)
+{
+    free(e->response);
+    e->response = NULL;
+    e->responselen = 0;
+    e->valid = 0;
+}
+
+/*
+ * Responses are handed to the framework without s_cacheMutex held, so
+ * that completions from different channels don't serialize on it and a
+ * framework that calls back into the RIL can't deadlock.
+ */
+
+int requestCacheLookup(int request, RIL_Token t)
+{
+    RequestCacheEntry *e = findEntry(request);
+    void *response = NULL;
+    size_t responselen = 0;
+    int ret = 0;
+
+    if (e == NULL)
+        return 0;
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    if (e->valid && msecSince(&e->stamp) < e->ttlMsec) {
+        /* A copy, an invalidation may drop the entry meanwhile. */
+        response = copyResponse(e, e->response, e->responselen);
+        if (response != NULL) {
+            e->hits++;
+            responselen = e->responselen;
+            ret = 1;
+        }
+    } else if (e->inflight != NULL && e->inflight != t &&
+               e->waiterCount < REQUEST_CACHE_MAX_WAITERS) {
+        e->merged++;
+        e->waiters[e->waiterCount++] = t;
+        ret = 1;
+    }
+
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    if (response != NULL) {
+        s_rilenv->OnRequestComplete(t, RIL_E_SUCCESS, response, responselen);
+        free(response);
+    }
+
+    return ret;
+}
+
+void requestCacheBegin(int request, RIL_Token t)
+{
+    RequestCacheEntry *e = findEntry(request);
+
+    if (e == NULL)
+        return;
+
+    pthread_mutex_lock(&s_cacheMutex);
+    if (e->inflight == NULL) {
+        e->misses++;
+        e->inflight = t;
+        e->inflightGeneration = e->generation;
+    }
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+void requestCacheInvalidate(unsigned int groups)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&s_cacheMutex);
+    for (i = 0; i < REQUEST_CACHE_ENTRIES; i++) {
+        RequestCacheEntry *e = &s_cache[i];
+
+        if (!(e->group & groups))
+            continue;
+        e->generation++;
+        dropResponse(e);
+    }
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+/**
+ * Every RIL_onRequestComplete() ends up here. Completions of a request
+ * fetching a cache entry also complete the requests parked behind it,
+ * and a successful response is kept unless the entry was invalidated
+ * while the request was running.
+ */
+void requestCacheComplete(RIL_Token t, RIL_Errno e, void *response,
+                          size_t responselen)
+{
+    RequestCacheEntry *entry = NULL;
+    RIL_Token waiters[REQUEST_CACHE_MAX_WAITERS];
+    int waiterCount;
+    unsigned int i;
+    int n;
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    for (i = 0; i < REQUEST_CACHE_ENTRIES; i++) {
+        if (s_cache[i].inflight == t) {
+            entry = &s_cache[i];
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        pthread_mutex_unlock(&s_cacheMutex);
+        s_rilenv->OnRequestComplete(t, e, response, responselen);
+        return;
+    }
+
+    entry->inflight = NULL;
+
+    if (e == RIL_E_SUCCESS && entry->inflightGeneration == entry->generation) {
+        dropResponse(entry);
+        entry->response = copyResponse(entry, response, responselen);
+        if (entry->response != NULL) {
+            entry->responselen = responselen;
+            entry->valid = 1;
+            clock_gettime(CLOCK_MONOTONIC, &entry->stamp);
+        }
+    }
+
+    waiterCount = entry->waiterCount;
+    memcpy(waiters, entry->waiters, waiterCount * sizeof(RIL_Token));
+    entry->waiterCount = 0;
+
+    if ((entry->misses & 0x3f) == 0)
+        LOGD("requestCacheComplete: %s %d hits, %d merged, %d misses",
+             requestToString(entry->request), entry->hits, entry->merged,
+             entry->misses);
+
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    s_rilenv->OnRequestComplete(t, e, response, responselen);
+    for (n = 0; n < waiterCount; n++)
+        s_rilenv->OnRequestComplete(waiters[n], e, response, responselen);
+}
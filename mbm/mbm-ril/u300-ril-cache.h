@@ -0,0 +1,47 @@
+/* Ericsson MBM RIL
+ *
+ * Copyright (C) Ericsson AB 2011
+ * Copyright 2006, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ */
+
+#ifndef U300_RIL_CACHE_H
+#define U300_RIL_CACHE_H 1
+
+/*
+ * Response cache for the idempotent queries telephony polls in bursts.
+ * Requests for an entry that is being fetched are parked and completed
+ * with the same response, and a successful response is served for a
+ * short while after that unless a URC invalidates it.
+ */
+
+/* Invalidation groups. */
+#define REQUEST_CACHE_SIGNAL        0x1 /* RIL_REQUEST_SIGNAL_STRENGTH */
+#define REQUEST_CACHE_REGISTRATION  0x2 /* (GPRS_)REGISTRATION_STATE, OPERATOR */
+#define REQUEST_CACHE_ALL           0x3
+
+/*
+ * Complete t from the cache, or park it behind an identical request in
+ * flight. Returns 1 if t was taken care of, 0 if it should be run.
+ */
+int requestCacheLookup(int request, RIL_Token t);
+
+/* Mark t as the request fetching the entry for request, if cacheable. */
+void requestCacheBegin(int request, RIL_Token t);
+
+void requestCacheInvalidate(unsigned int groups);
+
+#endif
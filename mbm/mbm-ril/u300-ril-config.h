@@ -51,5 +51,71 @@ static int prioRequests[] = {
     RIL_REQUEST_DTMF_START,
     RIL_REQUEST_DTMF_STOP
 };
+
+/*
+ * Request classes that can be given a channel of their own with
+ * "-c <class>[,<class>...]:<device>", eg "-c sms:/dev/ttyACM2". Requests
+ * of a class without a channel go on the normal queue. The priority
+ * queue takes precedence for requests that are in both tables.
+ */
+enum {
+    REQUEST_CLASS_NONE = -1,
+    REQUEST_CLASS_SMS = 0,
+    REQUEST_CLASS_SIM,
+    REQUEST_CLASS_NETWORK,
+    REQUEST_CLASS_DATA,
+    REQUEST_CLASS_COUNT
+};
+
+static const char *requestClassNames[REQUEST_CLASS_COUNT] = {
+    "sms",
+    "sim",
+    "network",
+    "data"
+};
+
+/*
+ * RIL_REQUEST_SMS_ACKNOWLEDGE and RIL_REQUEST_GSM_SMS_BROADCAST_ACTIVATION
+ * are left out on purpose, +CNMA has to go out on the channel +CNMI was
+ * set up on, and the class channels never get +CNMI.
+ */
+static const struct {
+    int request;
+    int requestClass;
+} requestClasses[] = {
+    { RIL_REQUEST_SEND_SMS, REQUEST_CLASS_SMS },
+    { RIL_REQUEST_SEND_SMS_EXPECT_MORE, REQUEST_CLASS_SMS },
+    { RIL_REQUEST_WRITE_SMS_TO_SIM, REQUEST_CLASS_SMS },
+    { RIL_REQUEST_DELETE_SMS_ON_SIM, REQUEST_CLASS_SMS },
+    { RIL_REQUEST_GET_SMSC_ADDRESS, REQUEST_CLASS_SMS },
+    { RIL_REQUEST_SET_SMSC_ADDRESS, REQUEST_CLASS_SMS },
+    { RIL_REQUEST_GSM_GET_BROADCAST_SMS_CONFIG, REQUEST_CLASS_SMS },
+    { RIL_REQUEST_GSM_SET_BROADCAST_SMS_CONFIG, REQUEST_CLASS_SMS },
+
+    { RIL_REQUEST_SIM_IO, REQUEST_CLASS_SIM },
+    { RIL_REQUEST_GET_IMSI, REQUEST_CLASS_SIM },
+    { RIL_REQUEST_QUERY_FACILITY_LOCK, REQUEST_CLASS_SIM },
+    { RIL_REQUEST_SET_FACILITY_LOCK, REQUEST_CLASS_SIM },
+    { RIL_REQUEST_CHANGE_SIM_PIN, REQUEST_CLASS_SIM },
+    { RIL_REQUEST_CHANGE_SIM_PIN2, REQUEST_CLASS_SIM },
+
+    { RIL_REQUEST_QUERY_AVAILABLE_NETWORKS, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_SET_NETWORK_SELECTION_MANUAL, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_OPERATOR, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_REGISTRATION_STATE, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_GPRS_REGISTRATION_STATE, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_SET_BAND_MODE, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_QUERY_AVAILABLE_BAND_MODE, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_GET_PREFERRED_NETWORK_TYPE, REQUEST_CLASS_NETWORK },
+    { RIL_REQUEST_SET_LOCATION_UPDATES, REQUEST_CLASS_NETWORK },
+
+    { RIL_REQUEST_SETUP_DATA_CALL, REQUEST_CLASS_DATA },
+    { RIL_REQUEST_DEACTIVATE_DATA_CALL, REQUEST_CLASS_DATA },
+    { RIL_REQUEST_DATA_CALL_LIST, REQUEST_CLASS_DATA },
+    { RIL_REQUEST_LAST_DATA_CALL_FAIL_CAUSE, REQUEST_CLASS_DATA }
+};
 #endif
 
@@ -22,11 +22,15 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <telephony/ril.h>
 #include "atchannel.h"
 #include "at_tok.h"
 #include "misc.h"
 #include "u300-ril.h"
+#include "u300-ril-network.h"
+#include "u300-ril-sim.h"
 
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
@@ -36,54 +40,233 @@ static char s_outstanding_acknowledge = 0;
 #define OUTSTANDING_SMS    0
 #define OUTSTANDING_STATUS 1
 
+/*
+ * PDUs received while an acknowledge is outstanding are held in a fixed
+ * ring, so bursts normally never allocate on the reader thread. From
+ * HELD_PDU_HIGH_WATER held PDUs on new messages are stored on the SIM
+ * and indicated with +CMTI instead, until the queue has drained to
+ * HELD_PDU_LOW_WATER. We run +CSMS=0 where the modem acknowledges
+ * deliveries itself, so there is no +CNMA to refuse one with and a PDU
+ * that arrives before the +CNMI change has taken effect can not be
+ * dropped: once the ring is full the rest spill to a list on the heap.
+ */
+#define HELD_PDU_SLOTS 16
+#define HELD_PDU_HIGH_WATER 12
+#define HELD_PDU_LOW_WATER 4
+
+/* SMSC address and the longest TPDU in hex, or "00" and a status report. */
+#define HELD_PDU_MAX_LENGTH (2 * (12 + 164))
+
 struct held_pdu {
     char type;
-    char *sms_pdu;
-    struct held_pdu *next;
+    char sms_pdu[HELD_PDU_MAX_LENGTH + 1];
+};
+
+struct held_pdu_spill {
+    struct held_pdu_spill *next;
+    struct held_pdu pdu;
 };
 
 static pthread_mutex_t s_held_pdus_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct held_pdu *s_held_pdus = NULL;
+static struct held_pdu s_held_pdus[HELD_PDU_SLOTS];
+static unsigned int s_held_pdus_head = 0;
+static unsigned int s_held_pdus_count = 0;
+static struct held_pdu_spill *s_held_pdus_spill = NULL;
+static struct held_pdu_spill **s_held_pdus_spill_tail = &s_held_pdus_spill;
+static unsigned int s_held_pdus_spilled = 0;
+
+/* Wanted and current routing, 1 while new SMS go to the SIM. Both are
+   protected by s_held_pdus_mutex. */
+static char s_sms_flow_control = 0;
+static char s_sms_flow_control_set = 0;
+
+/*
+ * Only <mt> is changed, the rest of +CNMI is read back so that a
+ * GSM_SMS_BROADCAST_ACTIVATION in between is not undone. Runs on the
+ * normal channel, where that request rewrites +CNMI as well.
+ */
+static void updateSmsRouting(void *param)
+{
+    ATResponse *atresponse = NULL;
+    int mode, mt, bm, ds, bfr;
+    char flowControl;
+    char *cmd = NULL;
+    char *tok;
+    int err;
+    (void) param;
 
-static struct held_pdu *dequeue_held_pdu()
+    pthread_mutex_lock(&s_held_pdus_mutex);
+    flowControl = s_sms_flow_control;
+    if (flowControl == s_sms_flow_control_set) {
+        pthread_mutex_unlock(&s_held_pdus_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&s_held_pdus_mutex);
+
+    /* AT+CNMI=[<mode>[,<mt>[,<bm>[,<ds>[,<bfr>]]]]] */
+    err = at_send_command_singleline("AT+CNMI?", "+CNMI:", &atresponse);
+    if (err < 0 || atresponse->success == 0)
+        goto error;
+
+    tok = atresponse->p_intermediates->line;
+
+    err = at_tok_start(&tok);
+    if (err < 0)
+        goto error;
+    err = at_tok_nextint(&tok, &mode);
+    if (err < 0)
+        goto error;
+    err = at_tok_nextint(&tok, &mt);
+    if (err < 0)
+        goto error;
+    err = at_tok_nextint(&tok, &bm);
+    if (err < 0)
+        goto error;
+    err = at_tok_nextint(&tok, &ds);
+    if (err < 0)
+        goto error;
+    err = at_tok_nextint(&tok, &bfr);
+    if (err < 0)
+        goto error;
+
+    at_response_free(atresponse);
+    atresponse = NULL;
+
+    /* mt = 1 - store on the SIM and indicate with +CMTI,
+       mt = 2 - route to the TE with +CMT. */
+    if (flowControl) {
+        LOGI("SMS flow control on, storing new messages on SIM");
+        mt = 1;
+    } else {
+        LOGI("SMS flow control off");
+        mt = 2;
+    }
+
+    asprintf(&cmd, "AT+CNMI=%d,%d,%d,%d,%d", mode, mt, bm, ds, bfr);
+
+    err = at_send_command(cmd, &atresponse);
+    free(cmd);
+
+    if (err < 0 || atresponse->success == 0)
+        goto error;
+
+    pthread_mutex_lock(&s_held_pdus_mutex);
+    s_sms_flow_control_set = flowControl;
+    pthread_mutex_unlock(&s_held_pdus_mutex);
+
+finally:
+    at_response_free(atresponse);
+    return;
+
+error:
+    LOGE("updateSmsRouting: Failed to set +CNMI");
+    goto finally;
+}
+
+/* Called with s_held_pdus_mutex held. */
+static void setSmsFlowControl(char on)
+{
+    if (s_sms_flow_control == on)
+        return;
+
+    s_sms_flow_control = on;
+    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, updateSmsRouting, NULL, NULL);
+}
+
+/**
+ * Called after onSIMReady() has (re)written +CNMI with new messages
+ * routed to the TE, so that flow control is turned on again if the
+ * held PDUs still want it.
+ */
+void onSmsRoutingReset(void)
 {
-    struct held_pdu *hpdu = NULL;
+    pthread_mutex_lock(&s_held_pdus_mutex);
+    s_sms_flow_control_set = 0;
+    if (s_sms_flow_control)
+        enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, updateSmsRouting, NULL, NULL);
+    pthread_mutex_unlock(&s_held_pdus_mutex);
+}
 
-    if (s_held_pdus != NULL) {
-        hpdu = s_held_pdus;
-        s_held_pdus = hpdu->next;
-        hpdu->next = NULL;
+/* Called with s_held_pdus_mutex held. Copies the oldest held PDU to
+   hpdu, returns 0 if there is none. */
+static int dequeue_held_pdu(struct held_pdu *hpdu)
+{
+    struct held_pdu_spill *spill;
+
+    if (s_held_pdus_count == 0)
+        return 0;
+
+    *hpdu = s_held_pdus[s_held_pdus_head];
+    s_held_pdus_head = (s_held_pdus_head + 1) % HELD_PDU_SLOTS;
+    s_held_pdus_count--;
+
+    /* Spilled PDUs are newer than any in the ring, refill its tail. */
+    if ((spill = s_held_pdus_spill) != NULL) {
+        s_held_pdus_spill = spill->next;
+        if (s_held_pdus_spill == NULL)
+            s_held_pdus_spill_tail = &s_held_pdus_spill;
+        s_held_pdus[(s_held_pdus_head + s_held_pdus_count) %
+                    HELD_PDU_SLOTS] = spill->pdu;
+        s_held_pdus_count++;
+        s_held_pdus_spilled--;
+        free(spill);
     }
 
-    return hpdu;
+    if (s_held_pdus_count + s_held_pdus_spilled <= HELD_PDU_LOW_WATER)
+        setSmsFlowControl(0);
+
+    return 1;
 }
 
-static void enqueue_held_pdu(char type, const char *sms_pdu)
+/* Called with s_held_pdus_mutex held. */
+static void enqueue_held_pdu(char type, const char *prefix,
+                             const char *sms_pdu)
 {
-    struct held_pdu *hpdu = malloc(sizeof(*hpdu));
+    struct held_pdu_spill *spill;
+    struct held_pdu *hpdu;
+
+    if (s_held_pdus_count < HELD_PDU_SLOTS)
+        hpdu = &s_held_pdus[(s_held_pdus_head + s_held_pdus_count) %
+                            HELD_PDU_SLOTS];
+    else {
+        spill = malloc(sizeof(*spill));
+        if (spill == NULL) {
+            LOGE("Held PDU queue full and out of memory, losing PDU");
+            return;
+        }
+        spill->next = NULL;
+        hpdu = &spill->pdu;
+    }
 
-    memset(hpdu, 0, sizeof(*hpdu));
     hpdu->type = type;
-    hpdu->sms_pdu = strdup(sms_pdu);
+    snprintf(hpdu->sms_pdu, sizeof(hpdu->sms_pdu), "%s%s", prefix, sms_pdu);
 
-    if (s_held_pdus == NULL)
-       s_held_pdus = hpdu; 
+    if (s_held_pdus_count < HELD_PDU_SLOTS)
+        s_held_pdus_count++;
     else {
-        struct held_pdu *p = s_held_pdus;
-        while (p->next != NULL)
-            p = p->next;
-
-        p->next = hpdu;
+        *s_held_pdus_spill_tail = spill;
+        s_held_pdus_spill_tail = &spill->next;
+        s_held_pdus_spilled++;
+        LOGW("Held PDU ring full, %u PDUs spilled to the heap",
+             s_held_pdus_spilled);
     }
+
+    if (s_held_pdus_count + s_held_pdus_spilled >= HELD_PDU_HIGH_WATER)
+        setSmsFlowControl(1);
 }
 
 void onNewSms(const char *sms_pdu)
 {
+    if (strlen(sms_pdu) > HELD_PDU_MAX_LENGTH) {
+        LOGE("onNewSms: PDU too long, discarding");
+        return;
+    }
+
     pthread_mutex_lock(&s_held_pdus_mutex);
 
     if (s_outstanding_acknowledge) {
         LOGI("Waiting for ack for previous sms, enqueueing PDU.");
-        enqueue_held_pdu(OUTSTANDING_SMS, sms_pdu);
+        enqueue_held_pdu(OUTSTANDING_SMS, "", sms_pdu);
     } else {
         s_outstanding_acknowledge = 1;
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NEW_SMS,
@@ -95,18 +278,22 @@ void onNewSms(const char *sms_pdu)
 
 void onNewStatusReport(const char *sms_pdu)
 {
-    char *response = NULL;
+    char response[HELD_PDU_MAX_LENGTH + 1];
 
-    /* Baseband will not prepend SMSC addr, but Android expects it. */
-    asprintf(&response, "%s%s", "00", sms_pdu);
+    if (strlen(sms_pdu) > HELD_PDU_MAX_LENGTH - 2) {
+        LOGE("onNewStatusReport: PDU too long, discarding");
+        return;
+    }
 
     pthread_mutex_lock(&s_held_pdus_mutex);
 
+    /* Baseband will not prepend SMSC addr, but Android expects it. */
     if (s_outstanding_acknowledge) {
         LOGE("Waiting for previous ack, enqueueing PDU..");
-        enqueue_held_pdu(OUTSTANDING_STATUS, response);
+        enqueue_held_pdu(OUTSTANDING_STATUS, "00", sms_pdu);
     } else {
         s_outstanding_acknowledge = 1;
+        snprintf(response, sizeof(response), "00%s", sms_pdu);
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
                                   response, strlen(response));
     }
@@ -114,29 +301,221 @@ void onNewStatusReport(const char *sms_pdu)
     pthread_mutex_unlock(&s_held_pdus_mutex);
 }
 
+/*
+ * Cell broadcast. Pages are decoded into stack buffers, messages that
+ * have already been delivered are dropped, and multi-page messages are
+ * held until every page is in and then delivered in page order. Floods
+ * of repeated emergency broadcasts thereby cost one upcall per page.
+ *
+ * A message is a repeat if its serial number and message id match one
+ * delivered less than CBS_RECENT_EXPIRY_S ago in the same area, where
+ * the geographical scope of the serial number (TS 23.041 9.4.1.2.1)
+ * says whether that is the cell, the location area or the PLMN.
+ * +CBM is handled on the reader thread of whichever channel it arrives
+ * on, so the state is guarded by s_cbs_mutex.
+ */
+#define CBS_PAGE_SIZE 88
+#define CBS_MAX_PAGES 15
+#define CBS_PENDING_MAX 4
+#define CBS_RECENT_MAX 32
+#define CBS_RECENT_EXPIRY_S (24 * 60 * 60)
+
+/* Geographical scope, the two top bits of the serial number. */
+#define CBS_GS(serial) (((serial) >> 14) & 0x3)
+#define CBS_GS_CELL_IMMEDIATE 0
+#define CBS_GS_PLMN 1
+#define CBS_GS_LOCATION_AREA 2
+#define CBS_GS_CELL 3
+
+struct cbs_message {
+    unsigned short serial;
+    unsigned short messageId;
+    int pages;                  /* 0 while the slot is free. */
+    unsigned int received;      /* Bit n set once page n + 1 is in. */
+    unsigned int age;
+    unsigned char data[CBS_MAX_PAGES][CBS_PAGE_SIZE];
+};
+
+struct cbs_recent {
+    unsigned short serial;
+    unsigned short messageId;
+    int lac;
+    int cid;
+    time_t delivered;           /* CLOCK_MONOTONIC seconds. */
+};
+
+static pthread_mutex_t s_cbs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cbs_message s_cbs_pending[CBS_PENDING_MAX];
+static unsigned int s_cbs_age = 0;
+
+/* Recently delivered messages, oldest overwritten first. */
+static struct cbs_recent s_cbs_recent[CBS_RECENT_MAX];
+static unsigned int s_cbs_recent_count = 0;
+static unsigned int s_cbs_recent_next = 0;
+static unsigned int s_cbs_duplicates = 0;
+
+static time_t cbsNow(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* Called with s_cbs_mutex held. */
+static int cbsRecentlyDelivered(unsigned short serial,
+                                unsigned short messageId,
+                                int lac, int cid, time_t now)
+{
+    const struct cbs_recent *r;
+    unsigned int i;
+
+    for (i = 0; i < s_cbs_recent_count; i++) {
+        r = &s_cbs_recent[i];
+        if (r->serial != serial || r->messageId != messageId)
+            continue;
+        if (now - r->delivered >= CBS_RECENT_EXPIRY_S)
+            continue;
+
+        switch (CBS_GS(serial)) {
+        case CBS_GS_CELL_IMMEDIATE:
+        case CBS_GS_CELL:
+            if (r->lac != lac || r->cid != cid)
+                continue;
+            break;
+        case CBS_GS_LOCATION_AREA:
+            if (r->lac != lac)
+                continue;
+            break;
+        default:
+            /* PLMN wide, the location area does not matter. */
+            break;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Called with s_cbs_mutex held. */
+static void cbsRecordDelivered(const struct cbs_message *msg,
+                               int lac, int cid, time_t now)
+{
+    struct cbs_recent *r = &s_cbs_recent[s_cbs_recent_next];
+
+    r->serial = msg->serial;
+    r->messageId = msg->messageId;
+    r->lac = lac;
+    r->cid = cid;
+    r->delivered = now;
+
+    s_cbs_recent_next = (s_cbs_recent_next + 1) % CBS_RECENT_MAX;
+    if (s_cbs_recent_count < CBS_RECENT_MAX)
+        s_cbs_recent_count++;
+}
+
+/* Slot for the message, reusing the oldest one if all are taken.
+   Called with s_cbs_mutex held. */
+static struct cbs_message *cbsPendingSlot(unsigned short serial,
+                                          unsigned short messageId,
+                                          int pages)
+{
+    struct cbs_message *msg = NULL;
+    struct cbs_message *oldest = &s_cbs_pending[0];
+    int i;
+
+    for (i = 0; i < CBS_PENDING_MAX; i++) {
+        struct cbs_message *m = &s_cbs_pending[i];
+
+        if (m->pages != 0 && m->serial == serial &&
+            m->messageId == messageId && m->pages == pages)
+            return m;
+        if (m->pages == 0 && msg == NULL)
+            msg = m;
+        if (m->age < oldest->age)
+            oldest = m;
+    }
+
+    if (msg == NULL) {
+        LOGW("Dropping incomplete broadcast %04x/%04x", oldest->serial,
+             oldest->messageId);
+        msg = oldest;
+    }
+
+    msg->serial = serial;
+    msg->messageId = messageId;
+    msg->pages = pages;
+    msg->received = 0;
+    msg->age = s_cbs_age++;
+
+    return msg;
+}
+
 void onNewBroadcastSms(const char *pdu)
 {
-    char *message = NULL;
+    unsigned char page[CBS_PAGE_SIZE];
+    unsigned char deliver[CBS_MAX_PAGES][CBS_PAGE_SIZE];
+    struct cbs_message *msg;
+    unsigned short serial, messageId;
+    int number, pages;
+    int deliverPages = 0;
+    int lac, cid;
+    time_t now;
     int i;
 
-    if (strlen(pdu) != (2 * 88)) {
+    if (strlen(pdu) != (2 * CBS_PAGE_SIZE)) {
         LOGE("Broadcast Message length error! Discarding!");
-        goto error;
+        return;
     }
 
-    message = alloca(88);
-    memset(message, 0, 88);
+    if (stringToBinary(pdu, 2 * CBS_PAGE_SIZE, page) < 0) {
+        LOGE("Broadcast Message not hex! Discarding!");
+        return;
+    }
 
-    for (i = 0; i < 88; i++) {
-        message[i] |= (char2nib(pdu[i * 2]) << 4);
-        message[i] |= char2nib(pdu[i * 2 + 1]);
+    /* TS 23.041 9.4.1.2: serial number, message id, dcs, page parameter. */
+    serial = (page[0] << 8) | page[1];
+    messageId = (page[2] << 8) | page[3];
+    number = page[5] >> 4;
+    pages = page[5] & 0x0F;
+    if (number == 0 || pages == 0 || number > pages) {
+        /* Reserved, treat as a single page. */
+        number = 1;
+        pages = 1;
     }
 
-    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NEW_BROADCAST_SMS,
-                              message, sizeof(char *));
+    getServingCell(&lac, &cid);
+    now = cbsNow();
 
-error:
-    return;
+    pthread_mutex_lock(&s_cbs_mutex);
+
+    if (cbsRecentlyDelivered(serial, messageId, lac, cid, now)) {
+        s_cbs_duplicates++;
+        if ((s_cbs_duplicates & 0x3F) == 1)
+            LOGD("Dropped %u repeated broadcasts", s_cbs_duplicates);
+        goto finally;
+    }
+
+    msg = cbsPendingSlot(serial, messageId, pages);
+    if (msg->received & (1 << (number - 1)))
+        goto finally;
+    memcpy(msg->data[number - 1], page, CBS_PAGE_SIZE);
+    msg->received |= 1 << (number - 1);
+
+    if (msg->received == (1u << pages) - 1) {
+        cbsRecordDelivered(msg, lac, cid, now);
+        memcpy(deliver, msg->data, pages * CBS_PAGE_SIZE);
+        deliverPages = pages;
+        msg->pages = 0;
+    }
+
+finally:
+    pthread_mutex_unlock(&s_cbs_mutex);
+
+    for (i = 0; i < deliverPages; i++)
+        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NEW_BROADCAST_SMS,
+                                  deliver[i], CBS_PAGE_SIZE);
 }
 
 void onNewSmsOnSIM(const char *s)
@@ -164,6 +543,9 @@ void onNewSmsOnSIM(const char *s)
     if (err < 0)
         goto error;
 
+    /* The modem wrote the record, a cached EF_SMS is stale. */
+    simFileCacheDropFile(SIM_EF_SMS);
+
     RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NEW_SMS_ON_SIM, 
                               &index, sizeof(int *));
 
@@ -281,7 +663,8 @@ void requestGSMSetBroadcastSMSConfig(void *data, size_t datalen,
 {
     ATResponse *atresponse = NULL;
     int err, count, i;
-    char *cmd, *tmp, *mids = NULL;
+    char *cmd, *pos;
+    int selected = 0;
     RIL_GSM_BroadcastSmsConfigInfo **configInfoArray =
         (RIL_GSM_BroadcastSmsConfigInfo **) data;
     RIL_GSM_BroadcastSmsConfigInfo *configInfo = NULL;
@@ -289,23 +672,28 @@ void requestGSMSetBroadcastSMSConfig(void *data, size_t datalen,
     count = datalen / sizeof(RIL_GSM_BroadcastSmsConfigInfo *);
     LOGI("Number of MID ranges in BROADCAST_SMS_CONFIG: %d", count);
 
+    /* Room for "nnnnn-nnnnn," per range, built in one buffer. */
+    cmd = malloc(sizeof("AT+CSCB=0,\"\"") + count * 12);
+    if (cmd == NULL)
+        goto error;
+    pos = cmd + sprintf(cmd, "AT+CSCB=0,\"");
+
     for (i = 0; i < count; i++) {
         configInfo = configInfoArray[i];
         /* No support for "Not accepted mids" in AT */
         if (configInfo->selected) {
-            tmp = mids;
-            asprintf(&mids, "%s%d-%d%s", (tmp ? tmp : ""),
-                configInfo->fromServiceId, configInfo->toServiceId,
-                (i == (count - 1) ? "" : ",")); /* Last one? Skip comma */
-            free(tmp);
+            pos += sprintf(pos, "%s%d-%d", selected ? "," : "",
+                           configInfo->fromServiceId & 0xFFFF,
+                           configInfo->toServiceId & 0xFFFF);
+            selected++;
         }
     }
+    strcpy(pos, "\"");
 
-    if (mids == NULL)
+    if (selected == 0) {
+        free(cmd);
         goto error;
-
-    asprintf(&cmd, "AT+CSCB=0,\"%s\"", mids);
-    free(mids);
+    }
 
     err = at_send_command(cmd, &atresponse);
     free(cmd);
@@ -393,14 +781,72 @@ error:
 }
 
 
-/**
- * RIL_REQUEST_SEND_SMS
- * 
- * Sends an SMS message.
-*/
-void requestSendSMS(void *data, size_t datalen, RIL_Token t)
+/*
+ * Multipart sends. The first RIL_REQUEST_SEND_SMS_EXPECT_MORE opens the
+ * relay link with AT+CMMS=1, and the RIL closes it with AT+CMMS=0 after
+ * the last part, sent as a plain RIL_REQUEST_SEND_SMS, or after
+ * SMS_LINK_IDLE_MS without a part if the sender gives up. With <n>=1 the
+ * modem itself drops the link and falls back to <n>=0 when no part
+ * follows within 1-5 s, so AT+CMMS=1 is sent again for a part that comes
+ * later than SMS_LINK_REFRESH_MS after the previous one.
+ *
+ * Both requests are of REQUEST_CLASS_SMS and closeIdleSmsLink() is queued
+ * on the same queue, so the link state is only ever used from one thread
+ * and needs no lock.
+ */
+#define SMS_LINK_IDLE_MS 5000
+#define SMS_LINK_REFRESH_MS 1000
+
+static const struct timeval TIMEVAL_SMS_LINK_IDLE = { SMS_LINK_IDLE_MS / 1000, 0 };
+
+static char s_smsLinkOpen = 0;
+static int s_smsLinkParts = 0;
+static struct timespec s_smsLinkStart;
+static struct timespec s_smsLinkLast;
+
+static long smsElapsedMs(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 +
+           (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static void closeSmsLink(const char *reason)
+{
+    struct timespec now;
+
+    at_send_command("AT+CMMS=0", NULL);
+    s_smsLinkOpen = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    LOGD("SMS link closed (%s), %d parts in %ld ms", reason, s_smsLinkParts,
+         smsElapsedMs(&s_smsLinkStart, &now));
+}
+
+static void closeIdleSmsLink(void *param)
+{
+    struct timespec now;
+    long idle;
+    (void) param;
+
+    if (!s_smsLinkOpen)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    idle = smsElapsedMs(&s_smsLinkLast, &now);
+    if (idle >= SMS_LINK_IDLE_MS)
+        closeSmsLink("idle");
+    else {
+        struct timeval tv;
+
+        tv.tv_sec = (SMS_LINK_IDLE_MS - idle) / 1000;
+        tv.tv_usec = ((SMS_LINK_IDLE_MS - idle) % 1000) * 1000;
+        enqueueRILEvent(getRequestEventQueue(RIL_REQUEST_SEND_SMS_EXPECT_MORE),
+                        closeIdleSmsLink, NULL, &tv);
+    }
+}
+
+static void sendSMS(void *data, RIL_Token t, int more)
 {
-    (void) datalen;
     int err;
     const char *smsc;
     const char *pdu;
@@ -410,6 +856,7 @@ void requestSendSMS(void *data, size_t datalen, RIL_Token t)
     RIL_SMS_Response response;
     RIL_Errno ret = RIL_E_SUCCESS;
     ATResponse *atresponse = NULL;
+    struct timespec start, end;
 
     smsc = ((const char **) data)[0];
     pdu = ((const char **) data)[1];
@@ -424,10 +871,38 @@ void requestSendSMS(void *data, size_t datalen, RIL_Token t)
     asprintf(&cmd1, "AT+CMGS=%d", tpLayerLength);
     asprintf(&cmd2, "%s%s", smsc, pdu);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (more && (!s_smsLinkOpen ||
+                 smsElapsedMs(&s_smsLinkLast, &start) >= SMS_LINK_REFRESH_MS)) {
+        /* Ignore errors, the message has to be sent anyway. */
+        at_send_command("AT+CMMS=1", NULL);
+        if (!s_smsLinkOpen) {
+            s_smsLinkOpen = 1;
+            s_smsLinkParts = 0;
+            s_smsLinkStart = start;
+        }
+    }
+
     err = at_send_command_sms(cmd1, cmd2, "+CMGS:", &atresponse);
+    clock_gettime(CLOCK_MONOTONIC, &end);
     free(cmd1);
     free(cmd2);
 
+    if (s_smsLinkOpen) {
+        s_smsLinkParts++;
+        s_smsLinkLast = end;
+        LOGD("SMS part %d sent in %ld ms", s_smsLinkParts,
+             smsElapsedMs(&start, &end));
+
+        if (!more)
+            closeSmsLink("last part");
+        else
+            enqueueRILEvent(getRequestEventQueue(RIL_REQUEST_SEND_SMS_EXPECT_MORE),
+                            closeIdleSmsLink, NULL, &TIMEVAL_SMS_LINK_IDLE);
+    } else
+        LOGD("SMS sent in %ld ms", smsElapsedMs(&start, &end));
+
     if (err != 0 || atresponse->success == 0)
         goto error;
 
@@ -464,7 +939,17 @@ error:
     goto finally;
 }
 
-#if 0
+/**
+ * RIL_REQUEST_SEND_SMS
+ * 
+ * Sends an SMS message.
+*/
+void requestSendSMS(void *data, size_t datalen, RIL_Token t)
+{
+    (void) datalen;
+    sendSMS(data, t, 0);
+}
+
 /**
  * RIL_REQUEST_SEND_SMS_EXPECT_MORE
  * 
@@ -474,13 +959,9 @@ error:
 */
 void requestSendSMSExpectMore(void *data, size_t datalen, RIL_Token t)
 {
-    /* Throw the command on the channel and ignore any errors, since we
-       need to send the SMS anyway and subsequent SMSes will be sent anyway. */
-    at_send_command("AT+CMMS=1", NULL);
-
-    requestSendSMS(data, datalen, t);
+    (void) datalen;
+    sendSMS(data, t, 1);
 }
-#endif
 
 /**
  * RIL_REQUEST_SMS_ACKNOWLEDGE
@@ -491,26 +972,21 @@ void requestSendSMSExpectMore(void *data, size_t datalen, RIL_Token t)
 void requestSMSAcknowledge(void *data, size_t datalen, RIL_Token t)
 {
     (void) data; (void) datalen;
-    struct held_pdu *hpdu;
+    struct held_pdu hpdu;
 
     pthread_mutex_lock(&s_held_pdus_mutex);
 
-    hpdu = dequeue_held_pdu();
-
-    if (hpdu != NULL) {
+    if (dequeue_held_pdu(&hpdu)) {
         LOGE("Outstanding requests in queue, dequeueing and sending.");
         int unsolResponse = 0;
 
-        if (hpdu->type == OUTSTANDING_SMS)
+        if (hpdu.type == OUTSTANDING_SMS)
             unsolResponse = RIL_UNSOL_RESPONSE_NEW_SMS;
         else
             unsolResponse = RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT;
 
-        RIL_onUnsolicitedResponse(unsolResponse, hpdu->sms_pdu,
-                                  strlen(hpdu->sms_pdu));
-
-        free(hpdu->sms_pdu);
-        free(hpdu);
+        RIL_onUnsolicitedResponse(unsolResponse, hpdu.sms_pdu,
+                                  strlen(hpdu.sms_pdu));
     } else
         s_outstanding_acknowledge = 0;
 
@@ -545,6 +1021,7 @@ void requestWriteSmsToSim(void *data, size_t datalen, RIL_Token t)
     err = at_send_command_sms(cmd, pdu, "+CMGW:", &atresponse);
     free(cmd);
     free(pdu);
+    simFileCacheDropFile(SIM_EF_SMS);
 
     if (err < 0 || atresponse->success == 0)
         goto error;
@@ -589,6 +1066,7 @@ void requestDeleteSmsOnSim(void *data, size_t datalen, RIL_Token t)
     asprintf(&cmd, "AT+CMGD=%d", ((int *) data)[0]);
     err = at_send_command(cmd, &atresponse);
     free(cmd);
+    simFileCacheDropFile(SIM_EF_SMS);
     if (err < 0 || atresponse->success == 0) {
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     } else {
@@ -28,6 +28,7 @@ void onNewSms(const char *sms_pdu);
 void onNewStatusReport(const char *sms_pdu);
 void onNewBroadcastSms(const char *sms_pdu);
 void onNewSmsOnSIM(const char* s);
+void onSmsRoutingReset(void);
 
 void requestSendSMS(void *data, size_t datalen, RIL_Token t);
 void requestSendSMSExpectMore(void *data, size_t datalen, RIL_Token t);
@@ -22,6 +22,7 @@
 */
 
 #include <stdio.h>
+#include <pthread.h>
 #include <telephony/ril.h>
 #include <assert.h>
 #include "atchannel.h"
@@ -265,7 +266,7 @@ void onSignalStrengthChanged(const char *s)
 
 error:
     free(line);
-    enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSignalStrength, (void *)bars, NULL);
+    enqueueRILEventLatest(RIL_EVENT_QUEUE_PRIO, pollSignalStrength, (void *)bars, NULL);
 }
 
 /**
@@ -385,6 +386,21 @@ error:
     goto finally;
 }
 
+struct copsRecord {
+    int status;
+    char *longAlphaNumeric;
+    char *shortAlphaNumeric;
+    char *numeric;
+};
+
+/* (<stat>,long alphanumeric <oper>,short alphanumeric <oper>,numeric <oper>[,<AcT>]) */
+static const struct at_tok_field s_copsFormat[] = {
+    AT_TOK_FIELD(AT_TOK_INT, struct copsRecord, status),
+    AT_TOK_FIELD(AT_TOK_STR, struct copsRecord, longAlphaNumeric),
+    AT_TOK_FIELD(AT_TOK_STR, struct copsRecord, shortAlphaNumeric),
+    AT_TOK_FIELD(AT_TOK_STR, struct copsRecord, numeric)
+};
+
 /**
  * RIL_REQUEST_QUERY_AVAILABLE_NETWORKS
  *
@@ -411,6 +427,7 @@ void requestQueryAvailableNetworks(void *data, size_t datalen, RIL_Token t)
         { "unknown", "available", "current", "forbidden" };
     char **responseArray = NULL;
     char *p;
+    char *group;
     int n = 0;
     int i = 0;
 
@@ -431,73 +448,39 @@ void requestQueryAvailableNetworks(void *data, size_t datalen, RIL_Token t)
     responseArray = alloca(n * 4 * sizeof(char *));
 
     p = atresponse->p_intermediates->line;
+    err = at_tok_start(&p);
+    if (err < 0)
+        goto error;
 
-    /* Loop and collect response information into the response array. */
-    for (i = 0; i < n; i++) {
-        int status = 0;
-        char *line = NULL;
-        char *s = NULL;
-        char *longAlphaNumeric = NULL;
-        char *shortAlphaNumeric = NULL;
-        char *numeric = NULL;
-        char *remaining = NULL;
-
-        s = line = getFirstElementValue(p, "(", ")", &remaining);
-        p = remaining;
-
-        if (line == NULL) {
-            LOGE("Null pointer while parsing COPS response. This should not happen.");
-            break;
-        }
-        /* <stat> */
-        err = at_tok_nextint(&line, &status);
-        if (err < 0)
-            goto error;
-
-        /* long alphanumeric <oper> */
-        err = at_tok_nextstr(&line, &longAlphaNumeric);
-        if (err < 0)
-            goto error;
-
-        /* short alphanumeric <oper> */            
-        err = at_tok_nextstr(&line, &shortAlphaNumeric);
-        if (err < 0)
-            goto error;
-
-        /* numeric <oper> */
-        err = at_tok_nextstr(&line, &numeric);
-        if (err < 0)
+    /*
+     * Loop and collect response information into the response array,
+     * stopping at the empty element before the lists of modes and formats.
+     * The strings point into the response line.
+     */
+    for (i = 0; i < n && at_tok_nextgroup(&p, &group) == 0; i++) {
+        struct copsRecord cops;
+
+        err = at_tok_parse(&group, s_copsFormat, NUM_ELEMS(s_copsFormat),
+                           &cops);
+        if (err < 0) {
+            LOGE("%s: bad field %d in operator %d", __func__,
+                 AT_TOK_ERROR_FIELD(err), i);
             goto error;
+        }
 
-        responseArray[i * 4 + 0] = alloca(strlen(longAlphaNumeric) + 1);
-        strcpy(responseArray[i * 4 + 0], longAlphaNumeric);
-
-        responseArray[i * 4 + 1] = alloca(strlen(shortAlphaNumeric) + 1);
-        strcpy(responseArray[i * 4 + 1], shortAlphaNumeric);
-
-        responseArray[i * 4 + 2] = alloca(strlen(numeric) + 1);
-        strcpy(responseArray[i * 4 + 2], numeric);
-
-        free(s);
+        if (cops.status < 0 || cops.status >= (int) NUM_ELEMS(statusTable))
+            cops.status = 0;
 
         /* 
          * Check if modem returned an empty string, and fill it with MNC/MMC 
          * if that's the case.
          */
-        if (responseArray[i * 4 + 0] && strlen(responseArray[i * 4 + 0]) == 0) {
-            responseArray[i * 4 + 0] = alloca(strlen(responseArray[i * 4 + 2])
-                                              + 1);
-            strcpy(responseArray[i * 4 + 0], responseArray[i * 4 + 2]);
-        }
-
-        if (responseArray[i * 4 + 1] && strlen(responseArray[i * 4 + 1]) == 0) {
-            responseArray[i * 4 + 1] = alloca(strlen(responseArray[i * 4 + 2])
-                                              + 1);
-            strcpy(responseArray[i * 4 + 1], responseArray[i * 4 + 2]);
-        }
-
-        responseArray[i * 4 + 3] = alloca(strlen(statusTable[status]) + 1);
-        sprintf(responseArray[i * 4 + 3], "%s", statusTable[status]);
+        responseArray[i * 4 + 0] = strlen(cops.longAlphaNumeric) == 0 ?
+                                   cops.numeric : cops.longAlphaNumeric;
+        responseArray[i * 4 + 1] = strlen(cops.shortAlphaNumeric) == 0 ?
+                                   cops.numeric : cops.shortAlphaNumeric;
+        responseArray[i * 4 + 2] = cops.numeric;
+        responseArray[i * 4 + 3] = (char *) statusTable[cops.status];
     }
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, responseArray,
@@ -686,10 +669,8 @@ void requestSignalStrength(void *data, size_t datalen, RIL_Token t)
 
     err = at_send_command_singleline("AT+CSQ", "+CSQ:", &atresponse);
 
-    if (err < 0 || atresponse->success == 0) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    if (err < 0 || atresponse->success == 0)
         goto error;
-    }
 
     line = atresponse->p_intermediates->line;
 
@@ -802,6 +783,140 @@ Reg_Deny_DetailReason convertRegistrationDeniedReason(int detailedReason)
     return reason;
 }
 
+struct regRecord {
+    int n;
+    int stat;
+    int lac;
+    int cid;
+    int act;
+};
+
+/* +C(G)REG: [<n>,]<stat>[,<lac>,<cid>[,<AcT>]] */
+static const struct at_tok_field s_regFormat[] = {
+    AT_TOK_FIELD(AT_TOK_INT, struct regRecord, n),
+    AT_TOK_FIELD(AT_TOK_INT, struct regRecord, stat),
+    AT_TOK_FIELD(AT_TOK_HEXINT | AT_TOK_OPTIONAL, struct regRecord, lac),
+    AT_TOK_FIELD(AT_TOK_HEXINT | AT_TOK_OPTIONAL, struct regRecord, cid),
+    AT_TOK_FIELD(AT_TOK_INT | AT_TOK_OPTIONAL, struct regRecord, act)
+};
+
+/**
+ * Parses a +CREG or +CGREG response into reg. Values not on the line
+ * are set to -1. Returns -1 if the line could not be parsed.
+ *
+ * The solicited version of the response is
+ * +CGREG: n, stat, [lac, cid [,<AcT>]]
+ * and the unsolicited version is
+ * +CGREG: stat, [lac, cid [,<AcT>]]
+ * The <n> parameter is basically "is unsolicited creg on?"
+ * which it should always be.
+ *
+ * Now we should normally get the solicited version here,
+ * but the unsolicited version could have snuck in
+ * so we have to handle both.
+ *
+ * Also since the LAC, CID and AcT are only reported when registered,
+ * we can have 1, 2, 3, 4 or 5 arguments here. With 4 the second one
+ * is the quoted <lac> if there is no <n>.
+ */
+static int parseRegistrationState(char *line, struct regRecord *reg)
+{
+    const struct at_tok_field *format = s_regFormat;
+    int count = NUM_ELEMS(s_regFormat);
+    int commas = 0;
+    char *p;
+    int err;
+
+    reg->n = reg->lac = reg->cid = reg->act = -1;
+
+    err = at_tok_start(&line);
+    if (err < 0)
+        return -1;
+
+    err = at_tok_charcounter(line, ',', &commas);
+    if (err < 0) {
+        LOGE("at_tok_charcounter failed.\r\n");
+        return -1;
+    }
+
+    switch (commas) {
+    case 0:                    /* <stat> */
+    case 2:                    /* <stat>, <lac>, <cid> */
+        format++;
+        count--;
+        break;
+
+    case 1:                    /* <n>, <stat> */
+    case 4:                    /* <n>, <stat>, <lac>, <cid>, <AcT> */
+        break;
+
+    case 3:                    /* <n>, <stat>, <lac>, <cid> */
+                               /* <stat>, <lac>, <cid>, <AcT> */
+        p = strchr(line, ',') + 1;
+        while (*p == ' ')
+            p++;
+        if (*p == '"') {
+            format++;
+            count--;
+        }
+        break;
+
+    default:
+        LOGE("Invalid input.\r\n");
+        return -1;
+    }
+
+    err = at_tok_parse(&line, format, count, reg);
+    if (err < 0) {
+        LOGE("%s: bad field %d\r\n", __func__, AT_TOK_ERROR_FIELD(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Serving cell as last reported by +CREG, -1 while unknown. Used to tell
+ * a cell broadcast in a new cell or location area from a repeat.
+ */
+static pthread_mutex_t s_servingCellMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_servingLac = -1;
+static int s_servingCid = -1;
+
+static void setServingCell(const struct regRecord *reg)
+{
+    pthread_mutex_lock(&s_servingCellMutex);
+    s_servingLac = reg->lac;
+    s_servingCid = reg->cid;
+    pthread_mutex_unlock(&s_servingCellMutex);
+}
+
+void getServingCell(int *lac, int *cid)
+{
+    pthread_mutex_lock(&s_servingCellMutex);
+    *lac = s_servingLac;
+    *cid = s_servingCid;
+    pthread_mutex_unlock(&s_servingCellMutex);
+}
+
+/**
+ * Called on an unsolicited +CREG.
+ */
+void onRegistrationStateChanged(const char *s)
+{
+    struct regRecord reg;
+    char *line;
+
+    line = strdup(s);
+    if (line == NULL)
+        return;
+
+    if (parseRegistrationState(line, &reg) == 0)
+        setServingCell(&reg);
+
+    free(line);
+}
+
 /**
  * RIL_REQUEST_GPRS_REGISTRATION_STATE
  *
@@ -816,9 +931,9 @@ void requestGprsRegistrationState(int request, void *data,
     int response[resp_size];
     char *responseStr[resp_size];
     ATResponse *atresponse = NULL, *p_response = NULL;
-    char *line, *p;
-    int commas = 0;
-    int skip, tmp;
+    struct regRecord reg;
+    char *line;
+    int skip;
     int count = 3;
     int ul_sp = 0;
     int dl_sp = 0;
@@ -840,98 +955,18 @@ void requestGprsRegistrationState(int request, void *data,
         goto error;
     }
 
-    line = atresponse->p_intermediates->line;
-    err = at_tok_start(&line);
+    err = parseRegistrationState(atresponse->p_intermediates->line, &reg);
     if (err < 0)
         goto error;
-    /*
-     * The solicited version of the +CGREG response is
-     * +CGREG: n, stat, [lac, cid [,<AcT>]]
-     * and the unsolicited version is
-     * +CGREG: stat, [lac, cid [,<AcT>]]
-     * The <n> parameter is basically "is unsolicited creg on?"
-     * which it should always be.
-     *
-     * Now we should normally get the solicited version here,
-     * but the unsolicited version could have snuck in
-     * so we have to handle both.
-     *
-     * Also since the LAC, CID and AcT are only reported when registered,
-     * we can have 1, 2, 3, 4 or 5 arguments here.
-     */
-    /* Count number of commas */
-    p = line;
-    err = at_tok_charcounter(line, ',', &commas);
-    if (err < 0) {
-        LOGE("at_tok_charcounter failed.\r\n");
-        goto error;
-    }
 
-    switch (commas) {
-    case 0:                    /* +CGREG: <stat> */
-        err = at_tok_nextint(&line, &response[0]);
-        if (err < 0) goto error;
-        break;
-
-    case 1:                    /* +CGREG: <n>, <stat> */
-        err = at_tok_nextint(&line, &skip);
-        if (err < 0) goto error;
-        err = at_tok_nextint(&line, &response[0]);
-        if (err < 0) goto error;
-        break;
-
-    case 2:                    /* +CGREG: <stat>, <lac>, <cid> */
-        err = at_tok_nextint(&line, &response[0]);
-        if (err < 0) goto error;
-        err = at_tok_nexthexint(&line, &response[1]);
-        if (err < 0) goto error;
-        err = at_tok_nexthexint(&line, &response[2]);
-        if (err < 0) goto error;
-        break;
-
-    case 3:                    /* +CGREG: <n>, <stat>, <lac>, <cid> */
-                               /* +CGREG: <stat>, <lac>, <cid>, <AcT> */
-        err = at_tok_nextint(&line, &tmp);
-        if (err < 0) goto error;
-
-        /* We need to check if the second parameter is <lac> */
-        if (*(line) == '"') {
-            response[0] = tmp; /* <stat> */
-            err = at_tok_nexthexint(&line, &response[1]); /* <lac> */
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[2]); /* <cid> */
-            if (err < 0) goto error;
-            err = at_tok_nextint(&line, &response[3]); /* <AcT> */
-            if (err < 0) goto error;
-            count = 4;
-        } else {
-            err = at_tok_nextint(&line, &response[0]); /* <stat> */
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[1]); /* <lac> */
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &response[2]); /* <cid> */
-            if (err < 0) goto error;
-        }
-        break;
-
-    case 4:                    /* +CGREG: <n>, <stat>, <lac>, <cid>, <AcT> */
-        err = at_tok_nextint(&line, &skip); /* <n> */
-        if (err < 0) goto error;
-        err = at_tok_nextint(&line, &response[0]); /* <stat> */
-        if (err < 0) goto error;
-        err = at_tok_nexthexint(&line, &response[1]); /* <lac> */
-        if (err < 0) goto error;
-        err = at_tok_nexthexint(&line, &response[2]); /* <cid> */
-        if (err < 0) goto error;
-        err = at_tok_nextint(&line, &response[3]); /* <AcT> */
-        if (err < 0) goto error;
+    response[0] = reg.stat;
+    response[1] = reg.lac;
+    response[2] = reg.cid;
+    if (reg.act >= 0) {
+        response[3] = reg.act;
         count = 4;
-        break;
-
-    default:
-        LOGE("Invalid input.\r\n");
-        goto error;
     }
+
     if (response[0] == CGREG_STAT_REG_HOME_NET ||
         response[0] == CGREG_STAT_ROAMING) {
             err = at_send_command_singleline("AT*ERINFO?", "*ERINFO:",
@@ -1114,8 +1149,8 @@ void requestRegistrationState(int request, void *data,
     int response[resp_size];
     char *responseStr[resp_size];
     ATResponse *cgreg_resp = NULL, *e2reg_resp = NULL;
-    char *line, *p;
-    int commas = 0;
+    struct regRecord reg;
+    char *line;
     int skip, cs_status = 0;
     int i;
     int count = 3;
@@ -1141,97 +1176,15 @@ void requestRegistrationState(int request, void *data,
         goto error;
     }
 
-    line = cgreg_resp->p_intermediates->line;
-
-    err = at_tok_start(&line);
-    if (err < 0) {
+    err = parseRegistrationState(cgreg_resp->p_intermediates->line, &reg);
+    if (err < 0)
         goto error;
-    }
 
-    /* 
-     * The solicited version of the CREG response is
-     * +CREG: n, stat, [lac, cid]
-     * and the unsolicited version is
-     * +CREG: stat, [lac, cid]
-     * The <n> parameter is basically "is unsolicited creg on?"
-     * which it should always be.
-     *
-     * Now we should normally get the solicited version here,
-     * but the unsolicited version could have snuck in
-     * so we have to handle both.
-     *
-     * Also since the LAC and CID are only reported when registered,
-     * we can have 1, 2, 3, or 4 arguments here.
-     *
-     * finally, a +CGREG: answer may have a fifth value that corresponds
-     * to the network type, as in;
-     *
-     *   +CGREG: n, stat [,lac, cid [,networkType]]
-     */
-
-    /* Count number of commas */
-    for (p = line; *p != '\0'; p++) {
-        if (*p == ',')
-            commas++;
-    }
-
-    switch (commas) {
-    case 0:                    /* +CREG: <stat> */
-        err = at_tok_nextint(&line, &response[0]);
-        if (err < 0)
-            goto error;
-
-        response[1] = -1;
-        response[2] = -1;
-        break;
-
-    case 1:                    /* +CREG: <n>, <stat> */
-        err = at_tok_nextint(&line, &skip);
-        if (err < 0)
-            goto error;
-
-        err = at_tok_nextint(&line, &response[0]);
-        if (err < 0)
-            goto error;
-
-        response[1] = -1;
-        response[2] = -1;
-        if (err < 0)
-            goto error;
-        break;
-    case 2:                    /* +CREG: <stat>, <lac>, <cid> */
-        err = at_tok_nextint(&line, &response[0]);
-        if (err < 0)
-            goto error;
+    setServingCell(&reg);
 
-        err = at_tok_nexthexint(&line, &response[1]);
-        if (err < 0)
-            goto error;
-
-        err = at_tok_nexthexint(&line, &response[2]);
-        if (err < 0)
-            goto error;
-        break;
-    case 3:                    /* +CREG: <n>, <stat>, <lac>, <cid> */
-        err = at_tok_nextint(&line, &skip);
-        if (err < 0)
-            goto error;
-
-        err = at_tok_nextint(&line, &response[0]);
-        if (err < 0)
-            goto error;
-
-        err = at_tok_nexthexint(&line, &response[1]);
-        if (err < 0)
-            goto error;
-
-        err = at_tok_nexthexint(&line, &response[2]);
-        if (err < 0)
-            goto error;
-        break;
-    default:
-        goto error;
-    }
+    response[0] = reg.stat;
+    response[1] = reg.lac;
+    response[2] = reg.cid;
 
     if (response[0] == CGREG_STAT_REG_DENIED) {
         err = at_send_command_singleline("AT*E2REG?", "*E2REG:",
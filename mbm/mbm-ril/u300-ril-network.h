@@ -26,6 +26,8 @@
 
 void onNetworkTimeReceived(const char *s);
 void onSignalStrengthChanged(const char *s);
+void onRegistrationStateChanged(const char *s);
+void getServingCell(int *lac, int *cid);
 
 void requestSetBandMode(void *data, size_t datalen, RIL_Token t);
 void requestQueryAvailableBandMode(void *data, size_t datalen, RIL_Token t);
@@ -22,10 +22,13 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <telephony/ril.h>
 #include "u300-ril.h"
 #include "atchannel.h"
 #include "at_tok.h"
+#include "u300-ril-sim.h"
 
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
@@ -45,11 +48,45 @@ void requestOEMHookRaw(void *data, size_t datalen, RIL_Token t)
 }
 #endif
 
+#define OEM_SIM_TRANSITIONS "SIM_TRANSITIONS"
+#define OEM_SIM_TRANSITIONS_MAX 16
+
+/*
+ * Answers OEM_SIM_TRANSITIONS with the latest SIM state transitions,
+ * oldest first, one "<from>,<to>,<ms ago>" string each. The states are
+ * SIM_Status values.
+ */
+static void requestSIMTransitions(RIL_Token t)
+{
+    struct simTransition transitions[OEM_SIM_TRANSITIONS_MAX];
+    char *response[OEM_SIM_TRANSITIONS_MAX];
+    struct timespec now;
+    long ago;
+    int n;
+    int i;
+
+    n = getSIMTransitions(transitions, OEM_SIM_TRANSITIONS_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < n; i++) {
+        ago = (now.tv_sec - transitions[i].when.tv_sec) * 1000 +
+              (now.tv_nsec - transitions[i].when.tv_nsec) / 1000000;
+        asprintf(&response[i], "%d,%d,%ld", transitions[i].from,
+                 transitions[i].to, ago);
+    }
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, response, n * sizeof(char *));
+
+    for (i = 0; i < n; i++)
+        free(response[i]);
+}
+
 /**
  * RIL_REQUEST_OEM_HOOK_STRINGS
  *
  * This request reserved for OEM-specific uses. It passes strings
- * back and forth.
+ * back and forth. The first string is sent as an AT command, apart
+ * from OEM_SIM_TRANSITIONS.
 */
 void requestOEMHookStrings(void *data, size_t datalen, RIL_Token t)
 {
@@ -67,6 +104,12 @@ void requestOEMHookStrings(void *data, size_t datalen, RIL_Token t)
 
     /* Only take the first string in the array for now */
     cur = (const char **) data;
+
+    if (strcmp(*cur, OEM_SIM_TRANSITIONS) == 0) {
+        requestSIMTransitions(t);
+        return;
+    }
+
     err = at_send_command(*cur, &atresponse);
 
     if (err < 0)
@@ -23,6 +23,7 @@
 */
 
 #include <stdio.h>
+#include <pthread.h>
 #include "atchannel.h"
 #include "at_tok.h"
 #include "misc.h"
@@ -41,84 +42,263 @@
 #include <utils/Log.h>
 
 #include "u300-ril.h"
+#include "u300-ril-pdp.h"
 #include "net-utils.h"
 
-/* Allocate and create an UCS-2 format string */
-static char *ucs2StringCreate(const char *String);
-
 /* Last pdp fail cause */
 static int s_lastPdpFailCause = PDP_FAIL_ERROR_UNSPECIFIED;
 
-#define MBM_ENAP_WAIT_TIME 17*5	/* loops to wait CONNECTION aprox 17s */
+/* Time to wait for *E2NAP: to report the outcome of AT*ENAP. */
+static const struct timeval TIMEVAL_ENAP_WAIT = { 17, 0 };
+
+/*
+ * Data call requests waiting for an *E2NAP: state change. The request
+ * handlers return once AT*ENAP has been accepted and the queue goes on
+ * with other requests; pdpConnectionStateChanged() then schedules the
+ * second half right away, or the TIMEVAL_ENAP_WAIT event runs it. Either
+ * way the token is taken under s_pendingMutex, so it completes once.
+ * The context travels with the token, so whoever takes the token gets
+ * the context that request was started on.
+ */
+struct pendingPDP {
+    RIL_Token token;
+    struct pdpContext *ctx;
+};
+
+static pthread_mutex_t s_pendingMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pendingPDP s_pendingSetup = { NULL, NULL };
+static struct pendingPDP s_pendingDeactivate = { NULL, NULL };
+
+static void finishSetupDefaultPDP(void *param);
+static void finishDeactivateDefaultPDP(void *param);
+
+/*
+ * PDP contexts, one per data interface given with -i (eg "usb0,wwan1").
+ * Slot n uses cid n + 1 and the n:th interface. A slot is in use from
+ * setup until deactivation, and RIL_REQUEST_DATA_CALL_LIST is answered
+ * from this table. Each context has its own address, host route and
+ * net.<iface>.dns1/2. The firmware has a single connection though:
+ * AT*ENAP=0 or a disconnect ends every context, see
+ * teardownPDPContexts(), so only the first slot is handed out, and only
+ * while no other context is in use. Protected by s_pendingMutex.
+ */
+#define MAX_PDP_CONTEXTS 4
+#define MAX_APN_LENGTH 101
+
+struct pdpContext {
+    int cid;                    /* 0 while the slot is free. */
+    int active;
+    char apn[MAX_APN_LENGTH];
+    char address[INET_ADDRSTRLEN];
+    char *iface;
+};
 
-void requestOrSendPDPContextList(RIL_Token *token)
+static struct pdpContext s_pdpContexts[MAX_PDP_CONTEXTS];
+static int s_pdpContextCount = 0;
+
+/**
+ * Set up the context table from a comma separated interface list.
+ */
+void initPDPContexts(const char *ifaces)
 {
-    ATResponse *atresponse = NULL;
-    RIL_Data_Call_Response response;
-    int e2napState = getE2napState();
-    int err;
-    int cid;
-    char *line, *apn, *type, *address;
+    char *list = strdup(ifaces);
+    char *name;
+    char *next;
+
+    for (name = list; name != NULL && s_pdpContextCount < MAX_PDP_CONTEXTS;
+         name = next) {
+        next = strchr(name, ',');
+        if (next != NULL)
+            *next++ = '\0';
+        if (*name == '\0')
+            continue;
+        s_pdpContexts[s_pdpContextCount++].iface = name;
+        LOGI("initPDPContexts: cid %d on %s", s_pdpContextCount, name);
+    }
+    /* The names point into list, which is kept. */
+}
 
-    memset(&response, 0, sizeof(response));
+/*
+ * Reserve a context for apn, NULL if one is in use already. A second
+ * connection can not be told apart from the first on *E2NAP:, and the
+ * AT*ENAP=0 its error path sends would end the first one as well.
+ */
+static struct pdpContext *allocPDPContext(const char *apn)
+{
+    struct pdpContext *ctx = NULL;
+    int i;
+
+    pthread_mutex_lock(&s_pendingMutex);
+    for (i = 0; i < s_pdpContextCount; i++)
+        if (s_pdpContexts[i].cid != 0)
+            break;
+    if (i == s_pdpContextCount && s_pdpContextCount > 0) {
+        ctx = &s_pdpContexts[0];
+        ctx->cid = 1;
+        ctx->active = 0;
+        strncpy(ctx->apn, apn ? apn : "", MAX_APN_LENGTH - 1);
+        ctx->apn[MAX_APN_LENGTH - 1] = '\0';
+        ctx->address[0] = '\0';
+    }
+    pthread_mutex_unlock(&s_pendingMutex);
 
-    err = at_send_command_multiline("AT+CGDCONT?", "+CGDCONT:", &atresponse);
+    return ctx;
+}
 
-    if (err < 0 || atresponse->success == 0)
-        goto error;
+static void releasePDPContext(struct pdpContext *ctx)
+{
+    pthread_mutex_lock(&s_pendingMutex);
+    ctx->cid = 0;
+    ctx->active = 0;
+    pthread_mutex_unlock(&s_pendingMutex);
+}
 
-    line = atresponse->p_intermediates->line;
-    err = at_tok_start(&line);
-    if (err < 0)
-        goto error;
+/*
+ * AT*ENAP=0 and a disconnect take down the whole connection, whichever
+ * cid they were meant for. Release every context and unconfigure its
+ * interface. Returns how many contexts were in use.
+ */
+static int teardownPDPContexts(void)
+{
+    const char *ifaces[MAX_PDP_CONTEXTS];
+    int n = 0;
+    int i;
 
-    err = at_tok_nextint(&line, &cid);
-    if (err < 0)
-        goto error;
+    pthread_mutex_lock(&s_pendingMutex);
+    for (i = 0; i < s_pdpContextCount; i++) {
+        struct pdpContext *ctx = &s_pdpContexts[i];
 
-    response.cid = cid;
+        if (ctx->cid == 0)
+            continue;
+        ifaces[n++] = ctx->iface;
+        ctx->cid = 0;
+        ctx->active = 0;
+    }
+    pthread_mutex_unlock(&s_pendingMutex);
 
-    if (e2napState == E2NAP_ST_CONNECTED)
-        response.active = 1;
+    for (i = 0; i < n; i++)
+        if (ifc_unconfigure(ifaces[i]))
+            LOGW("teardownPDPContexts: Failed to bring down %s", ifaces[i]);
 
-    err = at_tok_nextstr(&line, &type);
-    if (err < 0)
-        goto error;
+    return n;
+}
 
-    response.type = alloca(strlen(type) + 1);
-    strcpy(response.type, type);
+/*
+ * Event for a disconnect nobody asked for, see pdpConnectionStateChanged().
+ */
+static void onPDPDisconnected(void *param)
+{
+    (void) param;
 
-    err = at_tok_nextstr(&line, &apn);
-    if (err < 0)
-        goto error;
+    if (teardownPDPContexts() > 0)
+        requestOrSendPDPContextList(NULL);
+}
 
-    response.apn = alloca(strlen(apn) + 1);
-    strcpy(response.apn, apn);
+static struct pdpContext *findPDPContext(int cid)
+{
+    if (cid < 1 || cid > s_pdpContextCount || s_pdpContexts[cid - 1].cid == 0)
+        return NULL;
+    return &s_pdpContexts[cid - 1];
+}
 
-    err = at_tok_nextstr(&line, &address);
-    if (err < 0)
-        goto error;
+static int setPendingToken(struct pendingPDP *pending, RIL_Token t,
+                           struct pdpContext *ctx)
+{
+    int ret = -1;
 
-    response.address = alloca(strlen(address) + 1);
-    strcpy(response.address, address);
+    pthread_mutex_lock(&s_pendingMutex);
+    if (pending->token == NULL) {
+        pending->token = t;
+        pending->ctx = ctx;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&s_pendingMutex);
 
-    if (token != NULL)
-        RIL_onRequestComplete(*token, RIL_E_SUCCESS, &response,
-                              sizeof(RIL_Data_Call_Response));
-    else
-        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED, &response,
-                                  sizeof(RIL_Data_Call_Response));
+    return ret;
+}
 
-    at_response_free(atresponse);
-    return;
+/* Take the pending token and, if p_ctx is not NULL, its context. */
+static RIL_Token takePendingToken(struct pendingPDP *pending,
+                                  struct pdpContext **p_ctx)
+{
+    RIL_Token t;
+
+    pthread_mutex_lock(&s_pendingMutex);
+    t = pending->token;
+    if (p_ctx != NULL)
+        *p_ctx = pending->ctx;
+    pending->token = NULL;
+    pending->ctx = NULL;
+    pthread_mutex_unlock(&s_pendingMutex);
+
+    return t;
+}
+
+/**
+ * Called from the *E2NAP: handler once the new state has been stored.
+ * Runs on the reader thread, so the AT work is left to the queue.
+ */
+void pdpConnectionStateChanged(int state)
+{
+    int i;
+
+    if (state == E2NAP_ST_CONNECTING)
+        return;
+
+    pthread_mutex_lock(&s_pendingMutex);
+    if (s_pendingSetup.token != NULL)
+        enqueueRILEvent(getRequestEventQueue(RIL_REQUEST_SETUP_DATA_CALL),
+                        finishSetupDefaultPDP, NULL, NULL);
+    if (s_pendingDeactivate.token != NULL && state == E2NAP_ST_DISCONNECTED)
+        enqueueRILEvent(getRequestEventQueue(RIL_REQUEST_DEACTIVATE_DATA_CALL),
+                        finishDeactivateDefaultPDP, NULL, NULL);
+
+    /* *E2NAP: carries no cid, so a disconnect nobody asked for takes
+       down every context. The interfaces are left to the queue. */
+    if (s_pendingSetup.token == NULL && s_pendingDeactivate.token == NULL &&
+        state == E2NAP_ST_DISCONNECTED) {
+        for (i = 0; i < s_pdpContextCount; i++)
+            s_pdpContexts[i].active = 0;
+        enqueueRILEvent(getRequestEventQueue(RIL_REQUEST_DEACTIVATE_DATA_CALL),
+                        onPDPDisconnected, NULL, NULL);
+    }
+    pthread_mutex_unlock(&s_pendingMutex);
+}
+
+void requestOrSendPDPContextList(RIL_Token *token)
+{
+    RIL_Data_Call_Response responses[MAX_PDP_CONTEXTS];
+    char apns[MAX_PDP_CONTEXTS][MAX_APN_LENGTH];
+    char addresses[MAX_PDP_CONTEXTS][INET_ADDRSTRLEN];
+    int n = 0;
+    int i;
+
+    /* Copy out under the lock, the table may change once it is dropped. */
+    pthread_mutex_lock(&s_pendingMutex);
+    for (i = 0; i < s_pdpContextCount; i++) {
+        const struct pdpContext *ctx = &s_pdpContexts[i];
+
+        if (ctx->cid == 0)
+            continue;
+
+        strcpy(apns[n], ctx->apn);
+        strcpy(addresses[n], ctx->address);
+        responses[n].cid = ctx->cid;
+        responses[n].active = ctx->active;
+        responses[n].type = "IP";
+        responses[n].apn = apns[n];
+        responses[n].address = addresses[n];
+        n++;
+    }
+    pthread_mutex_unlock(&s_pendingMutex);
 
-error:
     if (token != NULL)
-        RIL_onRequestComplete(*token, RIL_E_GENERIC_FAILURE, NULL, 0);
+        RIL_onRequestComplete(*token, RIL_E_SUCCESS, n ? responses : NULL,
+                              n * sizeof(RIL_Data_Call_Response));
     else
-        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED, NULL, 0);
-
-    at_response_free(atresponse);
+        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
+                                  n ? responses : NULL,
+                                  n * sizeof(RIL_Data_Call_Response));
 }
 
 /**
@@ -185,26 +365,20 @@ void mbm_check_error_cause()
 void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
 {
     ATResponse *p_response = NULL;
-    in_addr_t addr = 0;
-    in_addr_t gateway = 0;
-    in_addr_t dns1 = 0;
-    in_addr_t dns2 = 0;
 
     const char *apn, *user, *pass, *auth;
     char *cmd = NULL;
     char *atAuth = NULL;
     char *atUser = NULL, *atPass = NULL, *origChSet = NULL, *chSet = NULL;
     char *line = NULL;
-    char *ipAddrStr = NULL;
-    char *p = NULL;
 
     int err = -1;
-    int cme_err, i;
-    int n = 0;
-    int dnscnt = 0;
-    char *response[3] = { "1", "usb0", "0.0.0.0" };
-    int e2napState = setE2napState(-1);
-    int e2napCause = setE2napCause(-1);
+    int cme_err;
+    int enapSent = 0;
+    struct pdpContext *ctx;
+
+    setE2napState(-1);
+    setE2napCause(-1);
 
     (void) data;
     (void) datalen;
@@ -216,21 +390,29 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
 
     s_lastPdpFailCause = PDP_FAIL_ERROR_UNSPECIFIED;
 
-    LOGD("requestSetupDefaultPDP: requesting data connection to APN '%s'",
-	 apn);
+    ctx = allocPDPContext(apn);
+    if (ctx == NULL) {
+	LOGE("requestSetupDefaultPDP: A data call is up already");
+	s_lastPdpFailCause = PDP_FAIL_INSUFFICIENT_RESOURCES;
+	RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+	return;
+    }
+
+    LOGD("requestSetupDefaultPDP: requesting data connection to APN '%s' "
+	 "on cid %d, %s", apn, ctx->cid, ctx->iface);
 
     if (ifc_init()) {
 	LOGE("requestSetupDefaultPDP: FAILED to set up ifc!");
 	goto error;
     }
 
-    if (ifc_down(ril_iface)) {
+    if (ifc_down(ctx->iface)) {
 	LOGE("requestSetupDefaultPDP: Failed to bring down %s!",
-	     ril_iface);
+	     ctx->iface);
 	goto error;
     }
 
-    asprintf(&cmd, "AT+CGDCONT=1,\"IP\",\"%s\"", apn);
+    asprintf(&cmd, "AT+CGDCONT=%d,\"IP\",\"%s\"", ctx->cid, apn);
     err = at_send_command(cmd, &p_response);
     if (err < 0 || (p_response == NULL) || p_response->success == 0) {
 	cme_err = at_get_cme_error(p_response);
@@ -301,9 +483,10 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
     line = NULL;
     chSet = NULL;
 
-    atUser = ucs2StringCreate(user);
-    atPass = ucs2StringCreate(pass);
-    asprintf(&cmd, "AT*EIAAUW=1,1,\"%s\",\"%s\",%s", atUser, atPass, atAuth);
+    atUser = ucs2HexFromUtf8(user);
+    atPass = ucs2HexFromUtf8(pass);
+    asprintf(&cmd, "AT*EIAAUW=%d,1,\"%s\",\"%s\",%s", ctx->cid, atUser,
+             atPass, atAuth);
     free(atUser);
     free(atPass);
     free(atAuth);
@@ -317,7 +500,7 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
     cmd = NULL;
 
     /* Set back to the original character set */
-    chSet = ucs2StringCreate(origChSet);
+    chSet = ucs2HexFromUtf8(origChSet);
     asprintf(&cmd, "AT+CSCS=\"%s\"", chSet);
     free(chSet);
     chSet = NULL;
@@ -333,31 +516,102 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
     free(cmd);
     cmd = NULL;
 
-    /* Start data on PDP context 1 */
-    err = at_send_command("AT*ENAP=1,1", &p_response);
+    if (setPendingToken(&s_pendingSetup, t, ctx) < 0) {
+        LOGE("requestSetupDefaultPDP: Data call setup already in progress");
+        releasePDPContext(ctx);
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        free(cmd);
+        return;
+    }
+    /* Drop a timeout left behind by the previous setup. */
+    cancelRILEvent(finishSetupDefaultPDP, NULL);
+
+    /* Start data on the PDP context */
+    free(cmd);
+    asprintf(&cmd, "AT*ENAP=1,%d", ctx->cid);
+    enapSent = 1;
+    err = at_send_command(cmd, &p_response);
     if (err < 0 || (p_response == NULL) || p_response->success == 0) {
 	cme_err = at_get_cme_error(p_response);
 	LOGE("requestSetupDefaultPDP: ENAP failed: %d  cme: %d", err,
 	     cme_err);
+	/* An *E2NAP: may already have finished the request. */
+	if (takePendingToken(&s_pendingSetup, NULL) == NULL) {
+	    at_response_free(p_response);
+	    free(cmd);
+	    return;
+	}
 	goto error;
     }
     at_response_free(p_response);
     p_response = NULL;
+    free(cmd);
 
-    for (i = 0; i < MBM_ENAP_WAIT_TIME; i++) {
-	e2napState = getE2napState();
+    /* Continued in finishSetupDefaultPDP() on *E2NAP:, or on timeout. */
+    enqueueRILEvent(getRequestEventQueue(RIL_REQUEST_SETUP_DATA_CALL),
+                    finishSetupDefaultPDP, NULL, &TIMEVAL_ENAP_WAIT);
+    return;
 
-	if (e2napState == E2NAP_ST_CONNECTED ||
-	    e2napState == E2NAP_ST_DISCONNECTED) {
-	    LOGD("requestSetupDefaultPDP: %s",
-		 e2napStateToString(e2napState));
-	    break;
-	}
-	usleep(200 * 1000);
-    }
+  error:
+
+    mbm_check_error_cause();
+
+    at_response_free(p_response);
+    p_response = NULL;
+
+    if (enapSent) {
+	/* try to restore enap state, this ends the other contexts too */
+	err = at_send_command("AT*ENAP=0", &p_response);
+	if (teardownPDPContexts() > 1)
+	    requestOrSendPDPContextList(NULL);
+    } else
+	releasePDPContext(ctx);
+
+    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    at_response_free(p_response);
+    free(cmd);
+}
+
+struct ipcfgRecord {
+    int stat;
+    char *address;
+};
+
+/* *E2IPCFG: (<stat>,<address>)... */
+static const struct at_tok_field s_ipcfgFormat[] = {
+    AT_TOK_FIELD(AT_TOK_INT, struct ipcfgRecord, stat),
+    AT_TOK_FIELD(AT_TOK_STR, struct ipcfgRecord, address)
+};
+
+/**
+ * Second half of RIL_REQUEST_SETUP_DATA_CALL, run on the queue once
+ * *E2NAP: has reported connected or disconnected, or the wait timed out.
+ */
+static void finishSetupDefaultPDP(void *param)
+{
+    ATResponse *p_response = NULL;
+    in_addr_t addr = 0;
+    in_addr_t gateway = 0;
+    in_addr_t dns1 = 0;
+    in_addr_t dns2 = 0;
+    char *ipAddrStr = NULL;
+    char *p = NULL;
+    char *group;
+    char *response[3] = { "1", "usb0", "0.0.0.0" };
+    char cidStr[12];
+    int e2napState;
+    int err;
+    int dnscnt = 0;
+    struct pdpContext *ctx;
+    RIL_Token t;
+    (void) param;
+
+    t = takePendingToken(&s_pendingSetup, &ctx);
+    if (t == NULL)
+        return; /* Already finished. */
 
     e2napState = getE2napState();
-    e2napCause = getE2napCause();
+    LOGD("requestSetupDefaultPDP: %s", e2napStateToString(e2napState));
 
     if (e2napState == E2NAP_ST_DISCONNECTED)
 	goto error;
@@ -372,37 +626,25 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
 	goto error;
 
     p = p_response->p_intermediates->line;
-    while (*p != '\0') {
-	if (*p == '(')
-	    n++;
-	p++;
-    }
-
-    p = p_response->p_intermediates->line;
-
-    /* Loop and collect information */
-    for (i = 0; i < n; i++) {
-	int stat = 0;
-	char *line = NULL;
-	char *address = NULL;
-	char *remaining = NULL;
-
-	line = getFirstElementValue(p, "(", ")", &remaining);
-	p = remaining;
-
-	if (line == NULL) {
-	    LOGD("requestSetupDefaultPDP: No more connection info.");
-	    break;
-	}
-	/* <stat> */
-	err = at_tok_nextint(&line, &stat);
-	if (err < 0)
-	    goto error;
+    err = at_tok_start(&p);
+    if (err < 0)
+	goto error;
 
-	/* <address> */
-	err = at_tok_nextstr(&line, &address);
-	if (err < 0)
+    /* Loop and collect information, the addresses point into the line. */
+    while (at_tok_nextgroup(&p, &group) == 0) {
+	struct ipcfgRecord ipcfg;
+	int stat;
+	char *address;
+
+	err = at_tok_parse(&group, s_ipcfgFormat, NUM_ELEMS(s_ipcfgFormat),
+			   &ipcfg);
+	if (err < 0) {
+	    LOGE("requestSetupDefaultPDP: Bad field %d in *E2IPCFG group",
+		 AT_TOK_ERROR_FIELD(err));
 	    goto error;
+	}
+	stat = ipcfg.stat;
+	address = ipcfg.address;
 
 	if (stat == 1) {
 	    ipAddrStr = address;
@@ -450,11 +692,13 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
 
     /* Don't use android netutils. We use our own and get the routing correct.
        Carl Nordbeck */
-    if (ifc_configure(ril_iface, addr, gateway, dns1, dns1)) {
-	LOGE("requestSetupDefaultPDP: Failed to configure the interface %s", ril_iface);
+    if (ifc_configure(ctx->iface, addr, gateway, dns1, dns2)) {
+	LOGE("requestSetupDefaultPDP: Failed to configure the interface %s", ctx->iface);
     }
 
-    response[1] = ril_iface;
+    snprintf(cidStr, sizeof(cidStr), "%d", ctx->cid);
+    response[0] = cidStr;
+    response[1] = ctx->iface;
     response[2] = ipAddrStr;
 
     e2napState = getE2napState();
@@ -464,11 +708,16 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
     if (e2napState == E2NAP_ST_DISCONNECTED)
 	goto error;		/* we got disconnected */
 
+    pthread_mutex_lock(&s_pendingMutex);
+    ctx->active = 1;
+    strncpy(ctx->address, ipAddrStr ? ipAddrStr : "", INET_ADDRSTRLEN - 1);
+    ctx->address[INET_ADDRSTRLEN - 1] = '\0';
+    pthread_mutex_unlock(&s_pendingMutex);
+
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
     RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
 			      NULL, 0);
     at_response_free(p_response);
-    free(cmd);
 
     return;
 
@@ -477,12 +726,13 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
     mbm_check_error_cause();
 
     at_response_free(p_response);
-    /* try to restore enap state */
+    /* try to restore enap state, this ends the other contexts too */
     err = at_send_command("AT*ENAP=0", &p_response);
 
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    if (teardownPDPContexts() > 1)
+	requestOrSendPDPContextList(NULL);
     at_response_free(p_response);
-    free(cmd);
 }
 
 /* CHECK There are several error cases if PDP deactivation fails
@@ -491,12 +741,21 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
 void requestDeactivateDefaultPDP(void *data, size_t datalen, RIL_Token t)
 {
     ATResponse *p_response = NULL;
+    struct pdpContext *ctx;
     int enap = 0;
-    int err, i;
+    int err;
     char *line;
-    (void) data;
     (void) datalen;
 
+    pthread_mutex_lock(&s_pendingMutex);
+    ctx = findPDPContext(atoi(((const char **) data)[0]));
+    pthread_mutex_unlock(&s_pendingMutex);
+    if (ctx == NULL) {
+	LOGE("requestDeactivateDefaultPDP: Unknown cid %s",
+	     ((const char **) data)[0]);
+	goto error;
+    }
+
     err = at_send_command_singleline("AT*ENAP?", "*ENAP:", &p_response);
     if (err < 0 || p_response->success == 0)
 	goto error;
@@ -514,48 +773,80 @@ void requestDeactivateDefaultPDP(void *data, size_t datalen, RIL_Token t)
 	LOGE("requestDeactivateDefaultPDP: When deactivating PDP, enap is IN_PROGRESS");
 
     if (enap == ENAP_T_CONNECTED) {
+	if (setPendingToken(&s_pendingDeactivate, t, ctx) < 0) {
+	    LOGE("requestDeactivateDefaultPDP: Deactivation already in progress");
+	    goto error;
+	}
+	cancelRILEvent(finishDeactivateDefaultPDP, NULL);
+
 	err = at_send_command("AT*ENAP=0", NULL);	/* TODO: can return CME error */
 
-	if (err < 0)
+	if (err < 0) {
+	    if (takePendingToken(&s_pendingDeactivate, NULL) == NULL)
+		goto finally;
 	    goto error;
-	for (i = 0; i < MBM_ENAP_WAIT_TIME; i++) {
-	    err =
-		at_send_command_singleline("AT*ENAP?", "*ENAP:",
-					   &p_response);
+	}
 
-	    if (err < 0 || p_response->success == 0)
-		goto error;
+	/* Continued in finishDeactivateDefaultPDP() on *E2NAP:, or on
+	   timeout. */
+	enqueueRILEvent(getRequestEventQueue(RIL_REQUEST_DEACTIVATE_DATA_CALL),
+	                finishDeactivateDefaultPDP, NULL, &TIMEVAL_ENAP_WAIT);
+	goto finally;
+    }
 
-	    line = p_response->p_intermediates->line;
+    releasePDPContext(ctx);
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 
-	    err = at_tok_start(&line);
-	    if (err < 0)
-		goto error;
+  finally:
+    at_response_free(p_response);
+    return;
 
-	    err = at_tok_nextint(&line, &enap);
-	    if (err < 0)
-		goto error;
+  error:
+    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    at_response_free(p_response);
+}
 
-	    if (enap == 0)
-		break;
+/**
+ * Second half of RIL_REQUEST_DEACTIVATE_DATA_CALL, run on the queue once
+ * *E2NAP: has reported disconnected, or the wait timed out.
+ */
+static void finishDeactivateDefaultPDP(void *param)
+{
+    ATResponse *p_response = NULL;
+    struct pdpContext *ctx;
+    int enap = 0;
+    int err;
+    char *line;
+    RIL_Token t;
+    (void) param;
 
-	    sleep(1);
-	}
+    t = takePendingToken(&s_pendingDeactivate, &ctx);
+    if (t == NULL)
+	return; /* Already finished. */
 
-	if (enap != ENAP_T_NOT_CONNECTED)
-	    goto error;
+    err = at_send_command_singleline("AT*ENAP?", "*ENAP:", &p_response);
+    if (err < 0 || p_response->success == 0)
+	goto error;
 
-	/* Bring down the interface as well. */
-	if (ifc_init())
-	    goto error;
+    line = p_response->p_intermediates->line;
+    err = at_tok_start(&line);
+    if (err < 0)
+	goto error;
 
-	if (ifc_down(ril_iface))
-	    goto error;
+    err = at_tok_nextint(&line, &enap);
+    if (err < 0)
+	goto error;
 
-	ifc_close();
-    }
+    if (enap != ENAP_T_NOT_CONNECTED)
+	goto error;
 
+    /* AT*ENAP=0 takes down the whole connection, not just this cid, so
+       the other contexts are reported gone as well. */
+    LOGD("requestDeactivateDefaultPDP: cid %d on %s down", ctx->cid,
+	 ctx->iface);
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+    if (teardownPDPContexts() > 1)
+	requestOrSendPDPContextList(NULL);
     at_response_free(p_response);
     return;
 
@@ -580,29 +871,3 @@ void requestLastPDPFailCause(void *data, size_t datalen, RIL_Token t)
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &s_lastPdpFailCause,
 			  sizeof(int));
 }
-
-/**
- * Returns a pointer to allocated memory filled with AT command
- * UCS-2 formatted string corresponding to the input string.
- * Note: Caller need to take care of freeing the
- *  allocated memory by calling free( ) when the
- *  created string is no longer used.
- */
-static char *ucs2StringCreate(const char *iString)
-{
-    int slen = 0;
-    int idx = 0;
-    char *ucs2String = NULL;
-
-    /* In case of NULL input, create an empty string as output */
-    if (NULL == iString)
-        slen = 0;
-    else
-        slen = strlen(iString);
-
-    ucs2String = (char *)malloc(sizeof(char)*(slen*4+1));
-    for (idx = 0; idx < slen; idx++)
-        sprintf(&ucs2String[idx*4], "%04x", iString[idx]);
-    ucs2String[idx*4] = '\0';
-    return ucs2String;
-}
@@ -24,11 +24,13 @@
 #ifndef U300_RIL_PDP_H
 #define U300_RIL_PDP_H 1
 
+void initPDPContexts(const char *ifaces);
 void requestOrSendPDPContextList(RIL_Token *t);
 void onPDPContextListChanged(void *param);
 void requestPDPContextList(void *data, size_t datalen, RIL_Token t);
 void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t);
 void requestDeactivateDefaultPDP(void *data, size_t datalen, RIL_Token t);
 void requestLastPDPFailCause(void *data, size_t datalen, RIL_Token t);
+void pdpConnectionStateChanged(int state);
 
 #endif
@@ -26,6 +26,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include "atchannel.h"
 #include "at_tok.h"
 #include "fcp_parser.h"
@@ -36,25 +38,155 @@
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
 
-typedef enum {
-    SIM_ABSENT = 0,
-    SIM_NOT_READY = 1,
-    SIM_READY = 2,         /* SIM_READY means the radio state is RADIO_STATE_SIM_READY. */
-    SIM_PIN = 3,
-    SIM_PUK = 4,
-    SIM_NETWORK_PERSONALIZATION = 5
-} SIM_Status;
-
 typedef enum {
     UICC_TYPE_UNKNOWN,
     UICC_TYPE_SIM,
     UICC_TYPE_USIM,
 } UICC_Type;
 
-static const struct timeval TIMEVAL_SIMPOLL = { 1, 0 };
-static const struct timeval TIMEVAL_SIMRESET = { 60, 0 };
+/*
+ * SIM state machine. The SIM state is checked with AT+CPIN? whenever
+ * *EPEV, *ESIMSR or *EESIMSWAP reports a change. Polling is only a
+ * fallback while the SIM is initializing, with a delay doubling from
+ * SIM_POLL_MIN_MS up to SIM_POLL_MAX_MS. A power failed SIM is reset
+ * the same way, the delay doubling up to SIM_RESET_MAX_MS, for as long as
+ * the SIM stays powered off.
+ */
+#define SIM_POLL_MIN_MS 250
+#define SIM_POLL_MAX_MS 8000
+#define SIM_RESET_MIN_MS 15000
+#define SIM_RESET_MAX_MS 120000
+#define SIM_TRANSITIONS_MAX 16
+
+static const char *simStatusNames[] = {
+    "ABSENT", "NOT_READY", "READY", "PIN", "PUK", "NETWORK_PERSONALIZATION"
+};
+
+static pthread_mutex_t s_simStateMutex = PTHREAD_MUTEX_INITIALIZER;
+static SIM_Status s_simState = SIM_NOT_READY;
+static struct timespec s_simStateSince;
+static struct timespec s_simStartTime;
+static int s_simPollDelayMs = SIM_POLL_MIN_MS;
+static int s_simPollCount = 0;
+static int s_simResetDelayMs = SIM_RESET_MIN_MS;
+static int s_simResetAttempts = 0;
+static struct simTransition s_simTransitions[SIM_TRANSITIONS_MAX];
+static int s_simTransitionCount = 0;    /* Total, index modulo the size. */
+
 static int sim_hotswap;
 
+static void startSimFilePrefetch(void);
+
+static long elapsedMs(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 +
+           (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static void msToTimeval(int ms, struct timeval *tv)
+{
+    tv->tv_sec = ms / 1000;
+    tv->tv_usec = (ms % 1000) * 1000;
+}
+
+/* Record the result of a SIM state check, logging any transition. */
+static void simStateUpdate(SIM_Status state)
+{
+    struct simTransition *tr;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s_simStateMutex);
+    if (state != s_simState) {
+        tr = &s_simTransitions[s_simTransitionCount++ % SIM_TRANSITIONS_MAX];
+        tr->from = s_simState;
+        tr->to = state;
+        tr->when = now;
+
+        LOGI("SIM state %s -> %s after %ld ms", simStatusNames[s_simState],
+             simStatusNames[state], elapsedMs(&s_simStateSince, &now));
+        if (state == SIM_READY)
+            LOGI("SIM ready %ld ms after radio on, %d AT+CPIN? checks",
+                 elapsedMs(&s_simStartTime, &now), s_simPollCount);
+
+        s_simState = state;
+        s_simStateSince = now;
+    }
+    s_simPollCount++;
+    pthread_mutex_unlock(&s_simStateMutex);
+}
+
+/**
+ * Copy out up to max of the latest SIM state transitions, oldest first.
+ * Returns the number copied.
+ */
+int getSIMTransitions(struct simTransition *transitions, int max)
+{
+    int first;
+    int n;
+    int i;
+
+    pthread_mutex_lock(&s_simStateMutex);
+    n = s_simTransitionCount < SIM_TRANSITIONS_MAX ?
+        s_simTransitionCount : SIM_TRANSITIONS_MAX;
+    if (n > max)
+        n = max;
+    first = s_simTransitionCount - n;
+    for (i = 0; i < n; i++)
+        transitions[i] = s_simTransitions[(first + i) % SIM_TRANSITIONS_MAX];
+    pthread_mutex_unlock(&s_simStateMutex);
+
+    return n;
+}
+
+/* The SIM is no longer powered off, restart the reset backoff. */
+static void clearSimReset(void)
+{
+    pthread_mutex_lock(&s_simStateMutex);
+    s_simResetDelayMs = SIM_RESET_MIN_MS;
+    s_simResetAttempts = 0;
+    pthread_mutex_unlock(&s_simStateMutex);
+}
+
+/*
+ * Something reported a SIM change, check the state right away and
+ * restart the fallback poll from the shortest delay. A pending fallback
+ * poll is merged with this one.
+ */
+static void simStateEvent(void)
+{
+    pthread_mutex_lock(&s_simStateMutex);
+    s_simPollDelayMs = SIM_POLL_MIN_MS;
+    pthread_mutex_unlock(&s_simStateMutex);
+
+    enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, NULL, NULL);
+}
+
+/**
+ * Restart SIM state tracking, called when the radio has been powered on.
+ */
+void resetSIMState(void)
+{
+    pthread_mutex_lock(&s_simStateMutex);
+    clock_gettime(CLOCK_MONOTONIC, &s_simStartTime);
+    s_simStateSince = s_simStartTime;
+    s_simPollCount = 0;
+    pthread_mutex_unlock(&s_simStateMutex);
+
+    clearSimReset();
+    simStateEvent();
+}
+
+/**
+ * *EPEV, a PIN has been entered or verified.
+ */
+void onSimPinEvent(const char *s)
+{
+    (void) s;
+    simStateEvent();
+}
+
 int get_pending_hotswap()
 {
     return sim_hotswap;
@@ -90,11 +222,28 @@ static void resetSim(void *param)
         goto error;
 
     if (state == 7) {
+        struct timeval tv;
+        int attempt;
+
+        pthread_mutex_lock(&s_simStateMutex);
+        attempt = ++s_simResetAttempts;
+        msToTimeval(s_simResetDelayMs, &tv);
+        s_simResetDelayMs *= 2;
+        if (s_simResetDelayMs > SIM_RESET_MAX_MS)
+            s_simResetDelayMs = SIM_RESET_MAX_MS;
+        pthread_mutex_unlock(&s_simStateMutex);
+
+        if (attempt > 1)
+            LOGW("resetSim: SIM still powered off, reset %d, next check "
+                 "in %ld ms", attempt, tv.tv_sec * 1000 + tv.tv_usec / 1000);
+
         at_send_command("AT*ESIMR", NULL);
 
-        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, resetSim, NULL,
-                        &TIMEVAL_SIMRESET);
+        /* Normally *ESIMSR reports the outcome before this runs. */
+        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, resetSim, NULL, &tv);
     } else {
+        clearSimReset();
+
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED,
                                   NULL, 0);
         pollSIMState(NULL);
@@ -114,9 +263,13 @@ void onSimStateChanged(const char *s)
     char *tok;
     char *line = tok = strdup(s);
 
+    simFileCacheInvalidate();
     RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
 
     /* Also check sim state, that will trigger radio state to sim absent. */
+    pthread_mutex_lock(&s_simStateMutex);
+    s_simPollDelayMs = SIM_POLL_MIN_MS;
+    pthread_mutex_unlock(&s_simStateMutex);
     enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, (void *) 1, NULL);
 
     /* 
@@ -133,6 +286,10 @@ void onSimStateChanged(const char *s)
 
     if (state == 7) {
         enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, resetSim, NULL, NULL);
+    } else {
+        /* Recovered, drop a pending reset retry. */
+        cancelRILEvent(resetSim, NULL);
+        clearSimReset();
     }
 
 finally:
@@ -146,8 +303,11 @@ error:
 
 void onSimHotswap(const char *s)
 {
+    simFileCacheInvalidate();
     if (strcmp ("*EESIMSWAP:0", s) == 0) {
         LOGD("SIM REMOVED");
+        cancelRILEvent(pollSIMState, NULL);
+        simStateUpdate(SIM_ABSENT);
         setRadioState(RADIO_STATE_SIM_LOCKED_OR_ABSENT);
     } else if (strcmp ("*EESIMSWAP:1", s) == 0) {
         LOGD("SIM INSERTED");
@@ -365,6 +525,9 @@ static void freeCardStatus(RIL_CardStatus *p_card_status) {
  */
 void pollSIMState(void *param)
 {
+    struct timeval tv;
+    SIM_Status state;
+
     if (((int) param) != 1 &&
         currentState() != RADIO_STATE_SIM_NOT_READY &&
         currentState() != RADIO_STATE_SIM_LOCKED_OR_ABSENT) {
@@ -372,22 +535,37 @@ void pollSIMState(void *param)
         return;
     }
 
-    switch (getSIMStatus()) {
+    state = getSIMStatus();
+    simStateUpdate(state);
+
+    switch (state) {
     case SIM_ABSENT:
     case SIM_PIN:
     case SIM_PUK:
     case SIM_NETWORK_PERSONALIZATION:
     default:
+        /* Drop a re-poll still pending from an earlier SIM_NOT_READY,
+           *EPEV or *ESIMSR tells us when this changes. */
+        cancelRILEvent(pollSIMState, NULL);
         setRadioState(RADIO_STATE_SIM_LOCKED_OR_ABSENT);
         return;
 
     case SIM_NOT_READY:
-        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, NULL,
-                        &TIMEVAL_SIMPOLL);
+        /* Fallback in case no URC arrives, backing off. */
+        pthread_mutex_lock(&s_simStateMutex);
+        msToTimeval(s_simPollDelayMs, &tv);
+        s_simPollDelayMs *= 2;
+        if (s_simPollDelayMs > SIM_POLL_MAX_MS)
+            s_simPollDelayMs = SIM_POLL_MAX_MS;
+        pthread_mutex_unlock(&s_simStateMutex);
+
+        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, NULL, &tv);
         return;
 
     case SIM_READY:
+        cancelRILEvent(pollSIMState, NULL);
         setRadioState(RADIO_STATE_SIM_READY);
+        startSimFilePrefetch();
         return;
     }
 }
@@ -647,7 +825,7 @@ error:
     goto finally;
 }
 
-int sendSimIOCmdUICC(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_IO_Response *sr)
+int sendSimIOCmdUICC(const RIL_SIM_IO *ioargs, ATResponse **atresponse, RIL_SIM_IO_Response *sr)
 {
     int err;
     int resplen;
@@ -655,6 +833,9 @@ int sendSimIOCmdUICC(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_I
     char *cmd = NULL, *data = NULL;
     unsigned short lc = simIOGetLogicalChannel();
     unsigned char sw1, sw2;
+    unsigned char apdu[8];
+    size_t apdulen;
+    const char *body = "";
 
     if (lc == 0) {
         err = -EIO;
@@ -663,20 +844,29 @@ int sendSimIOCmdUICC(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_I
 
     memset(sr, 0, sizeof(*sr));
 
+    /* Class, instruction, p1, p2, p3. */
+    apdu[0] = 0x00;
+    apdu[1] = ioargs->command;
+    apdu[2] = ioargs->p1;
+    apdu[3] = ioargs->p2;
+    apdu[4] = ioargs->p3;
+    apdulen = 5;
+
     switch (ioargs->command) {
         case 0xC0: /* Get response */
             /* Convert Get response to Select. */
-            asprintf(&data, "00A4000402%.4X00",
-                ioargs->fileid);
+            apdu[1] = 0xA4;
+            apdu[2] = 0x00;
+            apdu[3] = 0x04;
+            apdu[4] = 0x02;
+            apdu[5] = ioargs->fileid >> 8;
+            apdu[6] = ioargs->fileid;
+            apdu[7] = 0x00;
+            apdulen = 8;
             break;
 
         case 0xB0: /* Read binary */
         case 0xB2: /* Read record */
-            asprintf(&data, "00%.2X%.2X%.2X%.2X",
-                (unsigned char)ioargs->command,
-                (unsigned char)ioargs->p1,
-                (unsigned char)ioargs->p2,
-                (unsigned char)ioargs->p3);
             break;
 
         case 0xD6: /* Update binary */
@@ -685,22 +875,21 @@ int sendSimIOCmdUICC(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_I
                 err = -EINVAL;
                 goto error;
             }
-            asprintf(&data, "00%.2X%.2X%.2X%.2X%s",
-                (unsigned char)ioargs->command,
-                (unsigned char)ioargs->p1,
-                (unsigned char)ioargs->p2,
-                (unsigned char)ioargs->p3,
-                ioargs->data);
+            body = ioargs->data;
             break;
 
         default:
             err = -ENOTSUP;
             goto error;
     }
+
+    data = malloc(apdulen * 2 + strlen(body) + 1);
     if (data == NULL) {
         err = -ENOMEM;
         goto error;
     }
+    binaryToString(apdu, apdulen, data);
+    strcpy(&data[apdulen * 2], body);
 
     asprintf(&cmd, "AT+CGLA=%d,%d,\"%s\"", lc, strlen(data), data);
     if (cmd == NULL) {
@@ -712,16 +901,16 @@ int sendSimIOCmdUICC(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_I
     if (err < 0)
         goto error;
 
-    err = at_send_command_singleline(cmd, "+CGLA:", &atresponse);
+    err = at_send_command_singleline(cmd, "+CGLA:", atresponse);
     if (err < 0)
         goto error;
 
-    if (atresponse->success == 0) {
+    if ((*atresponse)->success == 0) {
         err = -EINVAL;
         goto error;
     }
 
-    line = atresponse->p_intermediates->line;
+    line = (*atresponse)->p_intermediates->line;
 
     err = at_tok_start(&line);
     if (err < 0)
@@ -764,7 +953,7 @@ error:
 }
 
 
-int sendSimIOCmdICC(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_IO_Response *sr)
+int sendSimIOCmdICC(const RIL_SIM_IO *ioargs, ATResponse **atresponse, RIL_SIM_IO_Response *sr)
 {
     int err;
     char *cmd = NULL;
@@ -800,16 +989,16 @@ int sendSimIOCmdICC(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_IO
         goto error;
     }
 
-    err = at_send_command_singleline(cmd, "+CRSM:", &atresponse);
+    err = at_send_command_singleline(cmd, "+CRSM:", atresponse);
     if (err < 0)
         goto error;
 
-    if (atresponse->success == 0) {
+    if ((*atresponse)->success == 0) {
         err = -EINVAL;
         goto error;
     }
 
-    line = atresponse->p_intermediates->line;
+    line = (*atresponse)->p_intermediates->line;
 
     err = at_tok_start(&line);
     if (err < 0)
@@ -837,7 +1026,7 @@ error:
     goto finally;
 }
 
-int sendSimIOCmd(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_IO_Response *sr)
+int sendSimIOCmd(const RIL_SIM_IO *ioargs, ATResponse **atresponse, RIL_SIM_IO_Response *sr)
 {
     int err;
     UICC_Type UiccType;
@@ -856,7 +1045,8 @@ int sendSimIOCmd(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_IO_Re
     err = sendSimIOCmdICC(ioargs, atresponse, sr);
     if ((err < 0 || (sr->sw1 != 0x90 && sr->sw2 != 0x00)) &&
             UiccType != UICC_TYPE_SIM) {
-        at_response_free(atresponse);
+        at_response_free(*atresponse);
+        *atresponse = NULL;
         LOGD("sendSimIOCmd(): Retrying with CGLA access...");
         err = sendSimIOCmdUICC(ioargs, atresponse, sr);
     }
@@ -919,29 +1109,229 @@ error:
 }
 
 
-/**
- * RIL_REQUEST_SIM_IO
+/*
+ * SIM elementary file cache.
  *
- * Request SIM I/O operation.
- * This is similar to the TS 27.007 "restricted SIM" operation
- * where it assumes all of the EF selection will be done by the
- * callee.
+ * Successful GET RESPONSE, READ BINARY and READ RECORD results are kept
+ * keyed by (path, fileid, command, p1, p2, p3), so a record read is keyed
+ * by its record number. Updates drop every entry of the file, and a SIM
+ * swap or reset drops the whole cache. The generation counter is bumped
+ * on each drop so a read that was in flight across one is not stored.
  */
-void requestSIM_IO(void *data, size_t datalen, RIL_Token t)
+#define SIM_FILE_CACHE_HASH_SIZE 64
+#define SIM_FILE_CACHE_MAX 512
+#define SIM_PATH_MAX (4 * 10)
+
+struct simFileCacheEntry {
+    struct simFileCacheEntry *next;
+    int command;
+    int fileid;
+    int p1;
+    int p2;
+    int p3;
+    char path[SIM_PATH_MAX + 1];
+    int sw1;
+    int sw2;
+    char *response;
+};
+
+static struct simFileCacheEntry *s_simFileCache[SIM_FILE_CACHE_HASH_SIZE];
+static int s_simFileCacheCount = 0;
+static unsigned int s_simFileCacheGeneration = 0;
+static unsigned int s_simFileCacheHits = 0;
+static unsigned int s_simFileCacheMisses = 0;
+static pthread_mutex_t s_simFileCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serializes SIM access between channels, selection state is shared. */
+static pthread_mutex_t s_simIOMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int simFileCacheable(const RIL_SIM_IO *ioargs)
+{
+    if (ioargs->pin2 != NULL || ioargs->data != NULL)
+        return 0;
+    if (ioargs->path != NULL && strlen(ioargs->path) > SIM_PATH_MAX)
+        return 0;
+
+    return ioargs->command == 0xC0 || /* Get response */
+           ioargs->command == 0xB0 || /* Read binary */
+           ioargs->command == 0xB2;   /* Read record */
+}
+
+static unsigned int simFileCacheHash(int fileid, int p1)
+{
+    return ((unsigned int) fileid * 31 + (unsigned int) p1) &
+           (SIM_FILE_CACHE_HASH_SIZE - 1);
+}
+
+static struct simFileCacheEntry **simFileCacheFind(const RIL_SIM_IO *ioargs)
+{
+    struct simFileCacheEntry **pe;
+    const char *path = ioargs->path ? ioargs->path : "";
+
+    pe = &s_simFileCache[simFileCacheHash(ioargs->fileid, ioargs->p1)];
+    for (; *pe != NULL; pe = &(*pe)->next) {
+        struct simFileCacheEntry *e = *pe;
+
+        if (e->fileid == ioargs->fileid && e->command == ioargs->command &&
+            e->p1 == ioargs->p1 && e->p2 == ioargs->p2 &&
+            e->p3 == ioargs->p3 && strcmp(e->path, path) == 0)
+            break;
+    }
+
+    return pe;
+}
+
+/**
+ * Fill in sr from the cache. On a hit sr->simResponse is allocated and
+ * must be freed by the caller. Returns 1 on a hit, 0 otherwise.
+ */
+static int simFileCacheLookup(const RIL_SIM_IO *ioargs,
+                              RIL_SIM_IO_Response *sr)
+{
+    struct simFileCacheEntry *e;
+    int hit = 0;
+
+    if (!simFileCacheable(ioargs))
+        return 0;
+
+    pthread_mutex_lock(&s_simFileCacheMutex);
+    e = *simFileCacheFind(ioargs);
+    if (e != NULL) {
+        sr->sw1 = e->sw1;
+        sr->sw2 = e->sw2;
+        sr->simResponse = e->response ? strdup(e->response) : NULL;
+        s_simFileCacheHits++;
+        hit = 1;
+    } else
+        s_simFileCacheMisses++;
+    pthread_mutex_unlock(&s_simFileCacheMutex);
+
+    return hit;
+}
+
+static unsigned int simFileCacheGeneration(void)
+{
+    unsigned int generation;
+
+    pthread_mutex_lock(&s_simFileCacheMutex);
+    generation = s_simFileCacheGeneration;
+    pthread_mutex_unlock(&s_simFileCacheMutex);
+
+    return generation;
+}
+
+static void simFileCacheStore(const RIL_SIM_IO *ioargs,
+                              const RIL_SIM_IO_Response *sr,
+                              unsigned int generation)
+{
+    struct simFileCacheEntry **pe;
+    struct simFileCacheEntry *e;
+
+    /* Only successful results, errors may be transient. */
+    if (!simFileCacheable(ioargs) || (sr->sw1 != 0x90 && sr->sw1 != 0x91))
+        return;
+
+    pthread_mutex_lock(&s_simFileCacheMutex);
+    if (generation != s_simFileCacheGeneration ||
+        s_simFileCacheCount >= SIM_FILE_CACHE_MAX)
+        goto finally;
+
+    pe = simFileCacheFind(ioargs);
+    if (*pe != NULL)
+        goto finally;
+
+    e = malloc(sizeof(*e));
+    if (e == NULL)
+        goto finally;
+    e->next = NULL;
+    e->command = ioargs->command;
+    e->fileid = ioargs->fileid;
+    e->p1 = ioargs->p1;
+    e->p2 = ioargs->p2;
+    e->p3 = ioargs->p3;
+    strcpy(e->path, ioargs->path ? ioargs->path : "");
+    e->sw1 = sr->sw1;
+    e->sw2 = sr->sw2;
+    e->response = sr->simResponse ? strdup(sr->simResponse) : NULL;
+    *pe = e;
+    s_simFileCacheCount++;
+
+finally:
+    pthread_mutex_unlock(&s_simFileCacheMutex);
+}
+
+/*
+ * Drop all entries for fileid, or all entries if fileid is -1, and bump
+ * the generation so a read of the file that is in flight is not stored.
+ */
+static void simFileCacheDrop(int fileid)
+{
+    struct simFileCacheEntry **pe;
+    struct simFileCacheEntry *e;
+    int i;
+
+    for (i = 0; i < SIM_FILE_CACHE_HASH_SIZE; i++) {
+        pe = &s_simFileCache[i];
+        while ((e = *pe) != NULL) {
+            if (fileid != -1 && e->fileid != fileid) {
+                pe = &e->next;
+                continue;
+            }
+            *pe = e->next;
+            free(e->response);
+            free(e);
+            s_simFileCacheCount--;
+        }
+    }
+    s_simFileCacheGeneration++;
+}
+
+/**
+ * Drop the cached contents of fileid, for files the modem changes
+ * outside SIM_IO, like EF_SMS when it stores a new message.
+ */
+void simFileCacheDropFile(int fileid)
+{
+    pthread_mutex_lock(&s_simFileCacheMutex);
+    simFileCacheDrop(fileid);
+    pthread_mutex_unlock(&s_simFileCacheMutex);
+}
+
+/**
+ * Flush the SIM file cache, called when the SIM may have changed.
+ * Also stops a prefetch in progress.
+ */
+void simFileCacheInvalidate(void)
+{
+    pthread_mutex_lock(&s_simFileCacheMutex);
+    LOGD("simFileCacheInvalidate: dropping %d entries (%u hits, %u misses)",
+         s_simFileCacheCount, s_simFileCacheHits, s_simFileCacheMisses);
+    simFileCacheDrop(-1);
+    pthread_mutex_unlock(&s_simFileCacheMutex);
+}
+
+/**
+ * Run a SIM_IO command, serving reads from the cache when possible.
+ * For GET RESPONSE on a UICC the FCP is converted to the 2G format.
+ * On success sr->simResponse is allocated, the caller frees it.
+ */
+static int simIOCommand(const RIL_SIM_IO *ioargs, RIL_SIM_IO_Response *sr)
 {
-    (void) datalen;
     ATResponse *atresponse = NULL;
-    RIL_SIM_IO_Response sr;
-    RIL_SIM_IO *ioargs;
-    int cvt_done = 0;
+    char *cvt = NULL;
+    unsigned int generation;
     int err;
-    UICC_Type UiccType = getUICCType();
 
-    memset(&sr, 0, sizeof(sr));
+    memset(sr, 0, sizeof(*sr));
+
+    if (simFileCacheLookup(ioargs, sr))
+        return 0;
 
-    ioargs = (RIL_SIM_IO *) data;
+    generation = simFileCacheGeneration();
 
-    err = sendSimIOCmd(ioargs, atresponse, &sr);
+    pthread_mutex_lock(&s_simIOMutex);
+    err = sendSimIOCmd(ioargs, &atresponse, sr);
+    pthread_mutex_unlock(&s_simIOMutex);
     if (err < 0)
         goto error;
 
@@ -949,25 +1339,193 @@ void requestSIM_IO(void *data, size_t datalen, RIL_Token t)
      * In case the command is GET_RESPONSE and cardtype is 3G SIM
      * convert to 2G FCP
      */
-    if (ioargs->command == 0xC0 && UiccType != UICC_TYPE_SIM) {
-        err = convertSimIoFcp(&sr, &sr.simResponse);
+    if (ioargs->command == 0xC0 && getUICCType() != UICC_TYPE_SIM) {
+        err = convertSimIoFcp(sr, &cvt);
         if (err < 0)
             goto error;
-        cvt_done = 1; /* sr.simResponse needs to be freed */
-    }
-
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
+        sr->simResponse = cvt;
+    } else if (sr->simResponse != NULL)
+        sr->simResponse = strdup(sr->simResponse);
+
+    if (ioargs->command == 0xD6 || ioargs->command == 0xDC) {
+        /* Update binary/record */
+        pthread_mutex_lock(&s_simFileCacheMutex);
+        simFileCacheDrop(ioargs->fileid);
+        pthread_mutex_unlock(&s_simFileCacheMutex);
+    } else
+        simFileCacheStore(ioargs, sr, generation);
 
 finally:
     at_response_free(atresponse);
-    if (cvt_done)
-        free(sr.simResponse);
-    return;
+    return err;
 
 error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    sr->simResponse = NULL;
     goto finally;
+}
+
+/*
+ * Files read ahead once the SIM is ready, with the paths the framework
+ * uses for them. Phonebook and SMS loads at boot then hit the cache.
+ */
+static const struct {
+    int fileid;
+    const char *path;
+} s_simPrefetchFiles[] = {
+    { 0x2FE2, "3F00" },         /* EF_ICCID */
+    { 0x6FAD, "3F007F20" },     /* EF_AD */
+    { 0x6F46, "3F007F20" },     /* EF_SPN */
+    { 0x6F40, "3F007F10" },     /* EF_MSISDN */
+    { 0x6F3A, "3F007F10" },     /* EF_ADN */
+    { 0x6F3B, "3F007F10" },     /* EF_FDN */
+    { SIM_EF_SMS, "3F007F10" }, /* EF_SMS, dropped on +CMTI */
+};
+
+#define SIM_PREFETCH_FILES \
+    (sizeof(s_simPrefetchFiles) / sizeof(s_simPrefetchFiles[0]))
+
+/* SIM commands per prefetch step, requests get in between steps. */
+#define SIM_PREFETCH_BATCH 8
+
+/* Size of the 2G GET RESPONSE the framework asks for. */
+#define GET_RESPONSE_EF_SIZE_BYTES 15
+
+/* Prefetch progress, only touched from prefetchSimFiles(). */
+static struct {
+    unsigned int generation;
+    size_t file;
+    int size;           /* 0 until GET RESPONSE is done. */
+    int recordSize;     /* 0 for transparent files. */
+    int record;
+} s_simPrefetch;
+
+/* Do the next read of the current prefetch file, -1 when it is done. */
+static int simPrefetchNext(void)
+{
+    RIL_SIM_IO ioargs;
+    RIL_SIM_IO_Response sr;
+    unsigned char resp[GET_RESPONSE_EF_SIZE_BYTES];
+    int err;
+
+    memset(&ioargs, 0, sizeof(ioargs));
+    ioargs.fileid = s_simPrefetchFiles[s_simPrefetch.file].fileid;
+    ioargs.path = (char *) s_simPrefetchFiles[s_simPrefetch.file].path;
+
+    if (s_simPrefetch.size == 0) {
+        ioargs.command = 0xC0;
+        ioargs.p3 = GET_RESPONSE_EF_SIZE_BYTES;
+    } else if (s_simPrefetch.recordSize == 0) {
+        ioargs.command = 0xB0;
+        ioargs.p3 = s_simPrefetch.size;
+    } else {
+        ioargs.command = 0xB2;
+        ioargs.p1 = s_simPrefetch.record;
+        ioargs.p2 = 4; /* Absolute mode */
+        ioargs.p3 = s_simPrefetch.recordSize;
+    }
 
+    err = simIOCommand(&ioargs, &sr);
+    if (err < 0 || (sr.sw1 != 0x90 && sr.sw1 != 0x91))
+        goto done;
+
+    if (ioargs.command == 0xC0) {
+        if (sr.simResponse == NULL ||
+            strlen(sr.simResponse) < 2 * GET_RESPONSE_EF_SIZE_BYTES)
+            goto done;
+        err = stringToBinary(sr.simResponse, 2 * GET_RESPONSE_EF_SIZE_BYTES,
+                             resp);
+        if (err < 0)
+            goto done;
+
+        s_simPrefetch.size = (resp[2] << 8) | resp[3];
+        if (resp[13] == 0) {            /* Transparent */
+            if (s_simPrefetch.size == 0 || s_simPrefetch.size > 0xFF)
+                goto done;
+        } else if (resp[13] == 1) {     /* Linear fixed */
+            s_simPrefetch.recordSize = resp[14];
+            s_simPrefetch.record = 1;
+            if (s_simPrefetch.recordSize == 0 ||
+                s_simPrefetch.size < s_simPrefetch.recordSize)
+                goto done;
+        } else
+            goto done;
+    } else if (ioargs.command == 0xB0 ||
+               s_simPrefetch.record++ * s_simPrefetch.recordSize >=
+               s_simPrefetch.size)
+        goto done; /* Whole file read. */
+
+    free(sr.simResponse);
+    return 0;
+
+done:
+    /* Errors end the file as well, the framework reads it itself. */
+    free(sr.simResponse);
+    return -1;
+}
+
+/**
+ * Read ahead s_simPrefetchFiles into the SIM file cache, a few commands
+ * at a time. param is the cache generation the run belongs to, the run
+ * stops once the cache has been flushed.
+ */
+static void prefetchSimFiles(void *param)
+{
+    unsigned int generation = (unsigned long) param;
+    int n;
+
+    if (generation != simFileCacheGeneration())
+        return;
+
+    if (s_simPrefetch.generation != generation) {
+        memset(&s_simPrefetch, 0, sizeof(s_simPrefetch));
+        s_simPrefetch.generation = generation;
+    }
+
+    for (n = 0; n < SIM_PREFETCH_BATCH &&
+                s_simPrefetch.file < SIM_PREFETCH_FILES; n++) {
+        if (simPrefetchNext() < 0) {
+            s_simPrefetch.file++;
+            s_simPrefetch.size = 0;
+            s_simPrefetch.recordSize = 0;
+        }
+    }
+
+    if (s_simPrefetch.file < SIM_PREFETCH_FILES)
+        enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, prefetchSimFiles, param,
+                        NULL);
+    else
+        LOGD("prefetchSimFiles: done, %d entries cached",
+             s_simFileCacheCount);
+}
+
+static void startSimFilePrefetch(void)
+{
+    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, prefetchSimFiles,
+                    (void *) (unsigned long) simFileCacheGeneration(), NULL);
+}
+
+/**
+ * RIL_REQUEST_SIM_IO
+ *
+ * Request SIM I/O operation.
+ * This is similar to the TS 27.007 "restricted SIM" operation
+ * where it assumes all of the EF selection will be done by the
+ * callee.
+ */
+void requestSIM_IO(void *data, size_t datalen, RIL_Token t)
+{
+    (void) datalen;
+    RIL_SIM_IO_Response sr;
+    int err;
+
+    err = simIOCommand((RIL_SIM_IO *) data, &sr);
+    if (err < 0) {
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        return;
+    }
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
+    free(sr.simResponse);
 }
 
 /**
@@ -24,11 +24,32 @@
 #ifndef U300_RIL_SIM_H
 #define U300_RIL_SIM_H 1
 
+#include <time.h>
+
+typedef enum {
+    SIM_ABSENT = 0,
+    SIM_NOT_READY = 1,
+    SIM_READY = 2,         /* SIM_READY means the radio state is RADIO_STATE_SIM_READY. */
+    SIM_PIN = 3,
+    SIM_PUK = 4,
+    SIM_NETWORK_PERSONALIZATION = 5
+} SIM_Status;
+
+/* SMS records, which the modem also writes when it stores a message. */
+#define SIM_EF_SMS 0x6F3C
+
+struct simTransition {
+    SIM_Status from;
+    SIM_Status to;
+    struct timespec when;       /* CLOCK_MONOTONIC */
+};
+
 int get_pending_hotswap();
 void set_pending_hotswap(int pending_hotswap);
 
 void onSimStateChanged(const char *s);
 void onSimHotswap(const char *s);
+void onSimPinEvent(const char *s);
 
 void requestGetSimStatus(void *data, size_t datalen, RIL_Token t);
 void requestSIM_IO(void *data, size_t datalen, RIL_Token t);
@@ -39,8 +60,12 @@ void requestSetFacilityLock(void *data, size_t datalen, RIL_Token t);
 void requestQueryFacilityLock(void *data, size_t datalen, RIL_Token t);
 
 void pollSIMState(void *param);
+void resetSIMState(void);
+int getSIMTransitions(struct simTransition *transitions, int max);
+void simFileCacheInvalidate(void);
+void simFileCacheDropFile(int fileid);
 
-int sendSimIOCmd(const RIL_SIM_IO *ioargs, ATResponse *atresponse, RIL_SIM_IO_Response *sr);
+int sendSimIOCmd(const RIL_SIM_IO *ioargs, ATResponse **atresponse, RIL_SIM_IO_Response *sr);
 int convertSimIoFcp(RIL_SIM_IO_Response *sr, char **cvt);
 
 #endif
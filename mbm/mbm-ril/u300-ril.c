@@ -31,6 +31,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
 #include <alloca.h>
 #include <getopt.h>
 #include <sys/socket.h>
@@ -52,6 +54,7 @@
 #include "u300-ril-oem.h"
 #include "u300-ril-requestdatahandler.h"
 #include "u300-ril-error.h"
+#include "u300-ril-cache.h"
 
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
@@ -65,6 +68,10 @@
         ? (a).tv_nsec op (b).tv_nsec \
         : (a).tv_sec op (b).tv_sec)
 
+#ifdef HAVE_ANDROID_OS
+#define USE_NP 1
+#endif /* HAVE_ANDROID_OS */
+
 static void onConnectionStateChanged(const char *s);
 
 /*** Declarations ***/
@@ -107,139 +114,525 @@ typedef struct RILRequest {
     struct RILRequest *next;
 } RILRequest;
 
+/*
+ * Events are kept by value in a binary min-heap ordered on abstime, which
+ * is taken from CLOCK_MONOTONIC so that NITZ or user changes to the wall
+ * clock neither fire pending polls early nor stall them. seq breaks ties
+ * so that events with the same deadline run in the order they were queued.
+ *
+ * Coalescing looks events up through a separate open addressed index,
+ * hashed on the callback alone so that all events of one callback sit in
+ * the same probe run. slot is the event's entry in that index, which in
+ * turn holds the event's current heap position.
+ */
 typedef struct RILEvent {
     void (*eventCallback) (void *param);
     void *param;
     struct timespec abstime;
-    struct RILEvent *next;
-    struct RILEvent *prev;
+    unsigned int seq;
+    int slot;
 } RILEvent;
 
+#define RIL_EVENT_HEAP_INITIAL_SIZE 8
+#define RIL_EVENT_INDEX_INITIAL_SIZE 16
+
+/* Max due events queueRunner detaches per wakeup, the rest wait a turn. */
+#define RIL_EVENT_BATCH_MAX 16
+
+/* Dispatcher statistics, logged when the channel is closed. */
+typedef struct RequestQueueStats {
+    unsigned int wakeups;
+    unsigned int events;
+    unsigned int requests;
+    unsigned int maxEventBatch;
+    unsigned int maxRequestBatch;
+    unsigned int maxEventDepth;
+} RequestQueueStats;
+
 typedef struct RequestQueue {
     pthread_mutex_t queueMutex;
     pthread_cond_t cond;
     RILRequest *requestList;
-    RILEvent *eventList;
+    RILRequest *requestTail;
+    RILRequest *freeList;
+    RILRequest *pool;
+    int poolUsed;
+    RILEvent *eventHeap;
+    int eventCount;
+    int eventSize;
+    unsigned int eventSeq;
+    int *eventIndex;
+    int eventIndexSize;
+    RequestQueueStats stats;
     char enabled;
     char closed;
 } RequestQueue;
 
-static RequestQueue s_requestQueue = {
-    .queueMutex = PTHREAD_MUTEX_INITIALIZER,
-    .cond = PTHREAD_COND_INITIALIZER,
-    .requestList = NULL,
-    .eventList = NULL,
-    .enabled = 1,
-    .closed = 1
-};
+/*
+ * Request nodes are recycled through a per-queue freelist. The first
+ * RIL_REQUEST_POOL_SIZE come from a static pool, any beyond that (only
+ * during request storms) are malloc'd once and then kept on the freelist.
+ */
+#define RIL_REQUEST_POOL_SIZE 32
+
+#define REQUEST_QUEUE_INITIALIZER(requestPool, isEnabled) { \
+    .queueMutex = PTHREAD_MUTEX_INITIALIZER, \
+    .cond = PTHREAD_COND_INITIALIZER, \
+    .requestList = NULL, \
+    .requestTail = NULL, \
+    .freeList = NULL, \
+    .pool = (requestPool), \
+    .poolUsed = 0, \
+    .eventHeap = NULL, \
+    .eventCount = 0, \
+    .eventSize = 0, \
+    .eventSeq = 0, \
+    .eventIndex = NULL, \
+    .eventIndexSize = 0, \
+    .enabled = (isEnabled), \
+    .closed = 1 \
+}
+
+/* Channels given to request classes with -c, on top of -d and -x. */
+#define RIL_MAX_EXTRA_CHANNELS 4
+
+static RILRequest s_requestPool[RIL_REQUEST_POOL_SIZE];
+static RILRequest s_requestPoolPrio[RIL_REQUEST_POOL_SIZE];
+static RILRequest s_requestPoolExtra[RIL_MAX_EXTRA_CHANNELS][RIL_REQUEST_POOL_SIZE];
+
+static RequestQueue s_requestQueue =
+    REQUEST_QUEUE_INITIALIZER(s_requestPool, 1);
 
-static RequestQueue s_requestQueuePrio = {
-    .queueMutex = PTHREAD_MUTEX_INITIALIZER,
-    .cond = PTHREAD_COND_INITIALIZER,
-    .requestList = NULL,
-    .eventList = NULL,
-    .enabled = 0,
-    .closed = 1
+static RequestQueue s_requestQueuePrio =
+    REQUEST_QUEUE_INITIALIZER(s_requestPoolPrio, 0);
+
+static RequestQueue s_requestQueueExtra[RIL_MAX_EXTRA_CHANNELS] = {
+    REQUEST_QUEUE_INITIALIZER(s_requestPoolExtra[0], 0),
+    REQUEST_QUEUE_INITIALIZER(s_requestPoolExtra[1], 0),
+    REQUEST_QUEUE_INITIALIZER(s_requestPoolExtra[2], 0),
+    REQUEST_QUEUE_INITIALIZER(s_requestPoolExtra[3], 0)
 };
 
 static RequestQueue *s_requestQueues[] = {
     &s_requestQueue,
-    &s_requestQueuePrio
+    &s_requestQueuePrio,
+    &s_requestQueueExtra[0],
+    &s_requestQueueExtra[1],
+    &s_requestQueueExtra[2],
+    &s_requestQueueExtra[3]
 };
 
+/* Queue per request class, NULL for classes served by the normal queue. */
+static RequestQueue *s_requestClassQueues[REQUEST_CLASS_COUNT];
+
 static const struct timeval TIMEVAL_0 = { 0, 0 };
 
+static void getMonotonicTime(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static int eventBefore(const RILEvent *a, const RILEvent *b)
+{
+    if (a->abstime.tv_sec != b->abstime.tv_sec ||
+        a->abstime.tv_nsec != b->abstime.tv_nsec)
+        return timespec_cmp(a->abstime, b->abstime, < );
+
+    /* Wrap-safe comparison of the insertion sequence numbers. */
+    return (int) (a->seq - b->seq) < 0;
+}
+
+/* Home slot of callback in the event index. */
+static int eventHash(const RequestQueue *q, void (*callback) (void *param))
+{
+    return (int) ((((unsigned long) callback >> 2) * 2654435761UL) &
+                  (q->eventIndexSize - 1));
+}
+
+/* Store e at heap position i and point its index entry there. */
+static void eventPlace(RequestQueue *q, int i, const RILEvent *e)
+{
+    q->eventHeap[i] = *e;
+    q->eventIndex[e->slot] = i;
+}
+
+static void eventSiftUp(RequestQueue *q, int i)
+{
+    RILEvent e = q->eventHeap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!eventBefore(&e, &q->eventHeap[parent]))
+            break;
+        eventPlace(q, i, &q->eventHeap[parent]);
+        i = parent;
+    }
+    eventPlace(q, i, &e);
+}
+
+static void eventSiftDown(RequestQueue *q, int i)
+{
+    RILEvent e = q->eventHeap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= q->eventCount)
+            break;
+        if (child + 1 < q->eventCount &&
+            eventBefore(&q->eventHeap[child + 1], &q->eventHeap[child]))
+            child++;
+        if (!eventBefore(&q->eventHeap[child], &e))
+            break;
+        eventPlace(q, i, &q->eventHeap[child]);
+        i = child;
+    }
+    eventPlace(q, i, &e);
+}
+
 /**
- * Enqueue a RILEvent to the request queue. isPrio specifies in what queue
- * the request will end up.
+ * Find a pending event for callback, with the same param if matchParam
+ * is set. Returns its heap position or -1. Must be called with
+ * queueMutex held.
+ */
+static int eventFind(RequestQueue *q, void (*callback) (void *param),
+                     void *param, int matchParam)
+{
+    int mask = q->eventIndexSize - 1;
+    int s;
+
+    if (q->eventCount == 0)
+        return -1;
+
+    for (s = eventHash(q, callback); q->eventIndex[s] >= 0; s = (s + 1) & mask) {
+        RILEvent *e = &q->eventHeap[q->eventIndex[s]];
+
+        if (e->eventCallback == callback && (!matchParam || e->param == param))
+            return q->eventIndex[s];
+    }
+
+    return -1;
+}
+
+/* Take an index slot for the event at heap position i. */
+static void eventIndexAdd(RequestQueue *q, int i)
+{
+    int mask = q->eventIndexSize - 1;
+    int s = eventHash(q, q->eventHeap[i].eventCallback);
+
+    while (q->eventIndex[s] >= 0)
+        s = (s + 1) & mask;
+
+    q->eventIndex[s] = i;
+    q->eventHeap[i].slot = s;
+}
+
+/* Free index slot s, shifting back the rest of its probe run. */
+static void eventIndexRemove(RequestQueue *q, int s)
+{
+    int mask = q->eventIndexSize - 1;
+    int j = s;
+
+    q->eventIndex[s] = -1;
+
+    for (;;) {
+        int home;
+
+        j = (j + 1) & mask;
+        if (q->eventIndex[j] < 0)
+            break;
+
+        /* Move the entry back unless its home lies cyclically in (s, j]. */
+        home = eventHash(q, q->eventHeap[q->eventIndex[j]].eventCallback);
+        if (s <= j ? (s < home && home <= j) : (s < home || home <= j))
+            continue;
+
+        q->eventIndex[s] = q->eventIndex[j];
+        q->eventHeap[q->eventIndex[s]].slot = s;
+        q->eventIndex[j] = -1;
+        s = j;
+    }
+}
+
+/* Make room for one more event, keeping the index at most half full. */
+static int eventReserve(RequestQueue *q)
+{
+    if (q->eventCount == q->eventSize) {
+        int size = q->eventSize ? q->eventSize * 2 : RIL_EVENT_HEAP_INITIAL_SIZE;
+        RILEvent *heap = realloc(q->eventHeap, size * sizeof(RILEvent));
+
+        if (heap == NULL)
+            return -1;
+        q->eventHeap = heap;
+        q->eventSize = size;
+    }
+
+    if (2 * (q->eventCount + 1) > q->eventIndexSize) {
+        int size = q->eventIndexSize ? q->eventIndexSize * 2 :
+                   RIL_EVENT_INDEX_INITIAL_SIZE;
+        int *index = malloc(size * sizeof(int));
+        int i;
+
+        if (index == NULL)
+            return -1;
+        free(q->eventIndex);
+        q->eventIndex = index;
+        q->eventIndexSize = size;
+
+        memset(index, 0xff, size * sizeof(int));
+        for (i = 0; i < q->eventCount; i++)
+            eventIndexAdd(q, i);
+    }
+
+    return 0;
+}
+
+/**
+ * Remove the event at index i from the heap. Must be called with
+ * queueMutex held.
+ */
+static void eventRemoveAt(RequestQueue *q, int i)
+{
+    RILEvent last;
+
+    eventIndexRemove(q, q->eventHeap[i].slot);
+
+    q->eventCount--;
+    if (i == q->eventCount)
+        return;
+
+    last = q->eventHeap[q->eventCount];
+    eventPlace(q, i, &last);
+    if (i > 0 && eventBefore(&q->eventHeap[i], &q->eventHeap[(i - 1) / 2]))
+        eventSiftUp(q, i);
+    else
+        eventSiftDown(q, i);
+}
+
+/**
+ * Insert an event into the heap of q, coalescing it with an already
+ * pending event for the same callback. If matchParam is set, only an
+ * event with the same param is considered a duplicate, otherwise the
+ * pending event takes over the new param. The coalesced event keeps the
+ * earlier of the two deadlines. Must be called with queueMutex held.
  *
- * 0 = the "normal" queue, 1 = prio queue and 2 = both. If only one queue
- * is present, then the event will be inserted into that queue.
+ * Returns 0 on success, -1 if the heap could not be grown.
  */
-void enqueueRILEvent(int isPrio, void (*callback) (void *param), 
-                     void *param, const struct timeval *relativeTime)
+static int eventInsert(RequestQueue *q, void (*callback) (void *param),
+                       void *param, const struct timespec *abstime,
+                       int matchParam)
 {
-    struct timeval tv;
-    char done = 0;
-    RequestQueue *q = NULL;
+    RILEvent *e;
+    int i;
 
-    RILEvent *e = malloc(sizeof(RILEvent));
-    memset(e, 0, sizeof(RILEvent));
+    i = eventFind(q, callback, param, matchParam);
+    if (i >= 0) {
+        e = &q->eventHeap[i];
+        e->param = param;
+        if (timespec_cmp(*abstime, e->abstime, < )) {
+            e->abstime = *abstime;
+            eventSiftUp(q, i);
+        }
+        return 0;
+    }
+
+    if (eventReserve(q) < 0)
+        return -1;
 
+    i = q->eventCount++;
+    e = &q->eventHeap[i];
     e->eventCallback = callback;
     e->param = param;
+    e->abstime = *abstime;
+    e->seq = q->eventSeq++;
+    eventIndexAdd(q, i);
+    eventSiftUp(q, i);
+
+    return 0;
+}
 
-    if (relativeTime == NULL) {
-        relativeTime = alloca(sizeof(struct timeval));
-        memset((struct timeval *) relativeTime, 0, sizeof(struct timeval));
+/**
+ * Detach up to RIL_EVENT_BATCH_MAX events that are due into events.
+ * Must be called with queueMutex held. Returns the number detached.
+ */
+static unsigned int eventDetachDue(RequestQueue *q, RILEvent *events)
+{
+    struct timespec now;
+    unsigned int n = 0;
+
+    getMonotonicTime(&now);
+
+    while (n < RIL_EVENT_BATCH_MAX && q->eventCount > 0 &&
+           !timespec_cmp(q->eventHeap[0].abstime, now, > )) {
+        events[n++] = q->eventHeap[0];
+        eventRemoveAt(q, 0);
     }
-    
-    gettimeofday(&tv, NULL);
 
-    e->abstime.tv_sec = tv.tv_sec + relativeTime->tv_sec;
-    e->abstime.tv_nsec = (tv.tv_usec + relativeTime->tv_usec) * 1000;
+    return n;
+}
+
+/**
+ * Wait on the queue condition until the event deadline abstime (in
+ * CLOCK_MONOTONIC time) or until signalled. Must be called with
+ * queueMutex held.
+ */
+static int eventTimedWait(RequestQueue *q, const struct timespec *abstime)
+{
+    struct timespec now;
+    long long msec;
+
+    getMonotonicTime(&now);
+    msec = (abstime->tv_sec - now.tv_sec) * 1000LL +
+           (abstime->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    if (msec <= 0)
+        return ETIMEDOUT;
+
+#ifdef USE_NP
+    return pthread_cond_timeout_np(&q->cond, &q->queueMutex, msec);
+#else
+    {
+        /* The wall clock is only used for this single wait, callers
+           recheck the monotonic deadline when it returns. */
+        struct timeval tv;
+        struct timespec ts;
+
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + msec / 1000;
+        ts.tv_nsec = tv.tv_usec * 1000L + (msec % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        return pthread_cond_timedwait(&q->cond, &q->queueMutex, &ts);
+    }
+#endif /* USE_NP */
+}
+
+static void queueRILEvent(int isPrio, void (*callback) (void *param),
+                          void *param, const struct timeval *relativeTime,
+                          int matchParam)
+{
+    struct timespec abstime;
+    RequestQueue *q = NULL;
+    char done = 0;
+
+    getMonotonicTime(&abstime);
 
-    if (e->abstime.tv_nsec > 1000000000) {
-        e->abstime.tv_sec++;
-        e->abstime.tv_nsec -= 1000000000;
+    if (relativeTime != NULL) {
+        abstime.tv_sec += relativeTime->tv_sec;
+        abstime.tv_nsec += relativeTime->tv_usec * 1000;
+
+        if (abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
     }
 
-    if (!s_requestQueuePrio.enabled || 
-        (isPrio == RIL_EVENT_QUEUE_NORMAL || isPrio == RIL_EVENT_QUEUE_ALL)) {
+    if (isPrio >= RIL_EVENT_QUEUE_EXTRA &&
+        isPrio < RIL_EVENT_QUEUE_EXTRA + RIL_MAX_EXTRA_CHANNELS &&
+        s_requestQueueExtra[isPrio - RIL_EVENT_QUEUE_EXTRA].enabled) {
+        q = &s_requestQueueExtra[isPrio - RIL_EVENT_QUEUE_EXTRA];
+    } else if (!s_requestQueuePrio.enabled || isPrio != RIL_EVENT_QUEUE_PRIO) {
         q = &s_requestQueue;
-    } else if (isPrio == RIL_EVENT_QUEUE_PRIO) {
+    } else {
         q = &s_requestQueuePrio;
     }
 
 again:
     pthread_mutex_lock(&q->queueMutex);
 
-    if (q->eventList == NULL) {
-        q->eventList = e;
-    } else {
-        if (timespec_cmp(q->eventList->abstime, e->abstime, > )) {
-            e->next = q->eventList;
-            q->eventList->prev = e;
-            q->eventList = e;
-        } else {
-            RILEvent *tmp = q->eventList;
-            do {
-                if (timespec_cmp(tmp->abstime, e->abstime, > )) {
-                    tmp->prev->next = e;
-                    e->prev = tmp->prev;
-                    tmp->prev = e;
-                    e->next = tmp;
-                    break;
-                } else if (tmp->next == NULL) {
-                    tmp->next = e;
-                    e->prev = tmp;
-                    break;
-                }
-                tmp = tmp->next;
-            } while (tmp);
-        }
-    }
-    
-    pthread_cond_broadcast(&q->cond);
+    /* queueRunner is the only waiter on the queue. */
+    if (eventInsert(q, callback, param, &abstime, matchParam) < 0)
+        LOGE("queueRILEvent: Out of memory, dropping event %p", callback);
+    else
+        pthread_cond_signal(&q->cond);
+
     pthread_mutex_unlock(&q->queueMutex);
 
     if (s_requestQueuePrio.enabled && isPrio == RIL_EVENT_QUEUE_ALL && !done) {
-        RILEvent *e2 = malloc(sizeof(RILEvent));
-        memcpy(e2, e, sizeof(RILEvent));
-        e = e2;
         done = 1;
         q = &s_requestQueuePrio;
 
         goto again;
     }
+}
 
-    return;
+/**
+ * Enqueue a RILEvent to the request queue. isPrio specifies in what queue
+ * the request will end up.
+ *
+ * 0 = the "normal" queue, 1 = prio queue and 2 = both. If only one queue
+ * is present, then the event will be inserted into that queue. The
+ * channel of a request class is selected with getRequestEventQueue().
+ *
+ * If the same callback is already pending with the same param, no new
+ * event is added; the pending one is moved to the earlier deadline.
+ */
+void enqueueRILEvent(int isPrio, void (*callback) (void *param), 
+                     void *param, const struct timeval *relativeTime)
+{
+    queueRILEvent(isPrio, callback, param, relativeTime, 1);
+}
+
+/**
+ * Like enqueueRILEvent(), but keeps at most one pending event for callback
+ * per queue regardless of param. A pending event takes over the new param
+ * and the earlier of the two deadlines. Only use this for callbacks whose
+ * param carries no resources of its own.
+ */
+void enqueueRILEventLatest(int isPrio, void (*callback) (void *param),
+                           void *param, const struct timeval *relativeTime)
+{
+    queueRILEvent(isPrio, callback, param, relativeTime, 0);
+}
+
+/**
+ * Cancel all pending events for callback with param in both queues.
+ */
+void cancelRILEvent(void (*callback) (void *param), void *param)
+{
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < sizeof(s_requestQueues) / sizeof(RequestQueue *); i++) {
+        RequestQueue *q = s_requestQueues[i];
+
+        pthread_mutex_lock(&q->queueMutex);
+        while ((j = eventFind(q, callback, param, 1)) >= 0)
+            eventRemoveAt(q, j);
+        pthread_mutex_unlock(&q->queueMutex);
+    }
 }
 
 /** Do post-AT+CFUN=1 initialization. */
 static void onRadioPowerOn()
 {
-    enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, NULL, NULL);
+    resetSIMState();
+}
+
+/**
+ * Post- SIM ready initialization of a request class channel. The
+ * registration report and SMS modes are per channel, and the requests
+ * served here parse +CREG?/+CGREG? and send PDUs. +CNMI stays with the
+ * normal channel, and so do the requests that touch it.
+ */
+static void onSIMReadyExtraChannel(void *param)
+{
+    ATResponse *atresponse = NULL;
+    int err;
+
+    (void) param;
+
+    at_send_command("AT+CSMS=0", NULL);
+    at_send_command("AT+CMGF=0", NULL);
+
+    err = at_send_command("AT+CREG=2", &atresponse);
+    if (err < 0 || atresponse->success == 0)
+        at_send_command("AT+CREG=1", NULL);
+    at_response_free(atresponse);
+
+    at_send_command("AT+CGREG=2", NULL);
 }
 
 /** Do post- SIM ready initialization. */
@@ -247,6 +640,12 @@ static void onSIMReady()
 {
     ATResponse *atresponse = NULL;
     int err = 0;
+    int i;
+
+    for (i = 0; i < RIL_MAX_EXTRA_CHANNELS; i++)
+        if (s_requestQueueExtra[i].enabled)
+            enqueueRILEvent(RIL_EVENT_QUEUE_EXTRA + i,
+                            onSIMReadyExtraChannel, NULL, NULL);
 
     /* Select message service */
     at_send_command("AT+CSMS=0", NULL);
@@ -271,6 +670,7 @@ static void onSIMReady()
     *             (OK response is given before flushing the codes).
     */
     at_send_command("AT+CNMI=2,2,2,1,0", NULL);
+    onSmsRoutingReset();
 
     /* Configure preferred message storage 
      *   mem1 = SM, mem2 = SM, mem3 = SM
@@ -620,37 +1020,29 @@ static void requestScreenState(void *data, size_t datalen, RIL_Token t)
     pthread_mutex_lock(&s_screen_state_mutex);
     screenState = s_screenState = ((int *) data)[0];
 
+    /* The commands are independent, pipeline them and wait once. */
     if (screenState == 1) {
         /* Screen is on - be sure to enable all unsolicited notifications again. */
-        err = at_send_command("AT+CREG=2", NULL);
-        if (err < 0)
-            goto error;
-        err = at_send_command("AT+CGREG=2", NULL);
-        if (err < 0)
-            goto error;
-        err = at_send_command("AT+CGEREP=1,0", NULL);
-        if (err < 0)
-            goto error;
-        if (at_send_command("AT+CMER=3,0,0,1", NULL) < 0)
+        if (at_send_command_async("AT+CREG=2", NO_RESULT, NULL, NULL, NULL) < 0
+            || at_send_command_async("AT+CGREG=2", NO_RESULT, NULL, NULL, NULL) < 0
+            || at_send_command_async("AT+CGEREP=1,0", NO_RESULT, NULL, NULL, NULL) < 0
+            || at_send_command_async("AT+CMER=3,0,0,1", NO_RESULT, NULL, NULL, NULL) < 0)
             goto error;
     } else if (screenState == 0) {
         /* Screen is off - disable all unsolicited notifications. */
-        err = at_send_command("AT+CREG=0", NULL);
-        if (err < 0)
-            goto error;
-        err = at_send_command("AT+CGREG=0", NULL);
-        if (err < 0)
-            goto error;
-        err = at_send_command("AT+CGEREP=0,0", NULL);
-        if (err < 0)
-            goto error;
-        if (err < 0)
+        if (at_send_command_async("AT+CREG=0", NO_RESULT, NULL, NULL, NULL) < 0
+            || at_send_command_async("AT+CGREG=0", NO_RESULT, NULL, NULL, NULL) < 0
+            || at_send_command_async("AT+CGEREP=0,0", NO_RESULT, NULL, NULL, NULL) < 0)
             goto error;
     } else {
         /* Not a defined value - error. */
         goto error;
     }
 
+    err = at_wait_async();
+    if (err < 0)
+        goto error;
+
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 
 finally:
@@ -659,9 +1051,9 @@ finally:
 
 error:
     LOGE("ERROR: requestScreenState failed");
+    at_wait_async();
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 
-    releaseScreenStateLock();
     goto finally;
 }
 
@@ -741,6 +1133,36 @@ static int clccCauseNoCLIToRILPres(int clccCauseNoCLI, int *rilPresentation)
     }
 }
 
+struct clccRecord {
+    int index;
+    char isMT;
+    int state;
+    int mode;
+    char isMpty;
+    char *number;
+    int toa;
+    char *name;
+    int priority;
+    int causeNoCLI;
+};
+
+/*
+ * +CLCC: index,isMT,state,mode,isMpty(,number,type(,alpha(,priority(,cause_of_no_cli))))
+ * An empty number leaves out the type on some firmwares.
+ */
+static const struct at_tok_field s_clccFormat[] = {
+    AT_TOK_FIELD(AT_TOK_INT, struct clccRecord, index),
+    AT_TOK_FIELD(AT_TOK_BOOL, struct clccRecord, isMT),
+    AT_TOK_FIELD(AT_TOK_INT, struct clccRecord, state),
+    AT_TOK_FIELD(AT_TOK_INT, struct clccRecord, mode),
+    AT_TOK_FIELD(AT_TOK_BOOL, struct clccRecord, isMpty),
+    AT_TOK_FIELD(AT_TOK_STR | AT_TOK_OPTIONAL, struct clccRecord, number),
+    AT_TOK_FIELD(AT_TOK_INT | AT_TOK_OPTIONAL, struct clccRecord, toa),
+    AT_TOK_FIELD(AT_TOK_STR | AT_TOK_OPTIONAL, struct clccRecord, name),
+    AT_TOK_FIELD(AT_TOK_INT | AT_TOK_OPTIONAL, struct clccRecord, priority),
+    AT_TOK_FIELD(AT_TOK_INT | AT_TOK_OPTIONAL, struct clccRecord, causeNoCLI)
+};
+
 /**
  * Note: Directly modified line and has *p_call point directly into
  * modified line.
@@ -749,73 +1171,40 @@ static int clccCauseNoCLIToRILPres(int clccCauseNoCLI, int *rilPresentation)
 static int callFromCLCCLine(char *line, RIL_Call *p_call)
 {
     /*
-     * +CLCC: index,isMT,state,mode,isMpty(,number,type(,alpha(,priority(,cause_of_no_cli))))
      * example of individual values +CLCC: 1,0,2,0,0,"+15161218005",145,"Hansen",0,1
      */
+    struct clccRecord clcc = { .number = NULL, .name = NULL, .causeNoCLI = -1 };
     int err;
-    int state;
-    int mode;
-    int priority;
-    int causeNoCLI = -1;
     int success = 0;
 
     err = at_tok_start(&line);
     if (err < 0)
         goto error;
 
-    err = at_tok_nextint(&line, &(p_call->index));
-    if (err < 0)
-        goto error;
-
-    err = at_tok_nextbool(&line, &(p_call->isMT));
-    if (err < 0)
-        goto error;
-
-    err = at_tok_nextint(&line, &state);
-    if (err < 0)
-        goto error;
-
-    err = clccStateToRILState(state, &(p_call->state));
-    if (err < 0)
+    err = at_tok_parse(&line, s_clccFormat, NUM_ELEMS(s_clccFormat), &clcc);
+    if (err < 0) {
+        LOGE("%s: bad field %d\n", __func__, AT_TOK_ERROR_FIELD(err));
         goto error;
+    }
 
-    err = at_tok_nextint(&line, &mode);
-    if (err < 0)
-        goto error;
-
-    p_call->isVoice = (mode == 0);
-
-    err = at_tok_nextbool(&line, &(p_call->isMpty));
+    err = clccStateToRILState(clcc.state, &(p_call->state));
     if (err < 0)
         goto error;
 
-    if (at_tok_hasmore(&line)) { /* optional number and toa */
-        err = at_tok_nextstr(&line, &(p_call->number)); /* accepting empty string */
-        err = at_tok_nextint(&line, &p_call->toa);
-        if (err < 0 && (p_call->number != NULL && strlen(p_call->number) > 0))
-            goto error;
-
-        if (at_tok_hasmore(&line)) { /* optional alphanummeric name */
-            err = at_tok_nextstr(&line, &(p_call->name)); /* accepting empty string */
-
-            if (at_tok_hasmore(&line)) { /* optional priority */
-                err = at_tok_nextint(&line, &priority); /* accepting empty string */
-
-                if (at_tok_hasmore(&line)) { /* optional cause_no_CLI */
-                    err = at_tok_nextint(&line, &causeNoCLI);
-                    if (err < 0)
-                        goto error;
-                }
-            }
-        }
-    }
+    p_call->index = clcc.index;
+    p_call->isMT = clcc.isMT;
+    p_call->isVoice = (clcc.mode == 0);
+    p_call->isMpty = clcc.isMpty;
+    p_call->number = clcc.number;
+    p_call->toa = clcc.toa;
+    p_call->name = clcc.name;
 
     /*
      * Converting cause of no CLI:
      * Note: CLCC does not include cause of no CLI if number/name is presented;
      *       -1 indicates this to the conversion function.
      */
-    err = clccCauseNoCLIToRILPres(causeNoCLI, &p_call->numberPresentation);
+    err = clccCauseNoCLIToRILPres(clcc.causeNoCLI, &p_call->numberPresentation);
     if (err < 0)
         LOGI("CLCC: cause of no CLI contained an unknown number, update required?");
 
@@ -955,6 +1344,47 @@ static char isPrioRequest(int request)
     return 0;
 }
 
+static int getRequestClass(int request)
+{
+    unsigned int i;
+    for (i = 0; i < NUM_ELEMS(requestClasses); i++)
+        if (request == requestClasses[i].request)
+            return requestClasses[i].requestClass;
+    return REQUEST_CLASS_NONE;
+}
+
+/* The queue that serves request. */
+static RequestQueue *getRequestQueue(int request)
+{
+    int requestClass;
+
+    if (s_requestQueuePrio.enabled && isPrioRequest(request))
+        return &s_requestQueuePrio;
+
+    requestClass = getRequestClass(request);
+    if (requestClass != REQUEST_CLASS_NONE &&
+        s_requestClassQueues[requestClass] != NULL)
+        return s_requestClassQueues[requestClass];
+
+    return &s_requestQueue;
+}
+
+/**
+ * The event queue, as taken by enqueueRILEvent(), of the channel that
+ * request is served on. Follow-ups of a request that must go out on the
+ * same channel as the request itself are queued there.
+ */
+int getRequestEventQueue(int request)
+{
+    RequestQueue *q = getRequestQueue(request);
+
+    if (q == &s_requestQueuePrio)
+        return RIL_EVENT_QUEUE_PRIO;
+    if (q == &s_requestQueue)
+        return RIL_EVENT_QUEUE_NORMAL;
+    return RIL_EVENT_QUEUE_EXTRA + (int) (q - s_requestQueueExtra);
+}
+
 static void processRequest(int request, void *data, size_t datalen, RIL_Token t)
 {
     LOGE("processRequest: %s", requestToString(request));
@@ -1010,13 +1440,29 @@ static void processRequest(int request, void *data, size_t datalen, RIL_Token t)
         return;
     }
 
-    switch (request) {
+    /* Serve polled queries from the response cache when possible. */
+    if (requestCacheLookup(request, t))
+        return;
+    requestCacheBegin(request, t);
 
-	
-        case RIL_REQUEST_GET_CURRENT_CALLS:
-            if (sState == RADIO_STATE_SIM_LOCKED_OR_ABSENT)
-                RIL_onRequestComplete(t, RIL_E_RADIO_NOT_AVAILABLE, NULL, 0);
-            else
+    switch (request) {
+        case RIL_REQUEST_RADIO_POWER:
+        case RIL_REQUEST_SCREEN_STATE:
+        case RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC:
+        case RIL_REQUEST_SET_NETWORK_SELECTION_MANUAL:
+        case RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE:
+        case RIL_REQUEST_SET_BAND_MODE:
+            requestCacheInvalidate(REQUEST_CACHE_REGISTRATION);
+            break;
+    }
+
+    switch (request) {
+
+	
+        case RIL_REQUEST_GET_CURRENT_CALLS:
+            if (sState == RADIO_STATE_SIM_LOCKED_OR_ABSENT)
+                RIL_onRequestComplete(t, RIL_E_RADIO_NOT_AVAILABLE, NULL, 0);
+            else
                 requestGetCurrentCalls(data, datalen, t);
             break;
         case RIL_REQUEST_SCREEN_STATE:
@@ -1046,10 +1492,10 @@ static void processRequest(int request, void *data, size_t datalen, RIL_Token t)
         case RIL_REQUEST_SEND_SMS:
             requestSendSMS(data, datalen, t);
             break;
-        /* case RIL_REQUEST_SEND_SMS_EXPECT_MORE:
+        case RIL_REQUEST_SEND_SMS_EXPECT_MORE:
             requestSendSMSExpectMore(data, datalen, t);
             break;
-        case RIL_REQUEST_WRITE_SMS_TO_SIM:
+        /* case RIL_REQUEST_WRITE_SMS_TO_SIM:
             requestWriteSmsToSim(data, datalen, t);
             break;
         case RIL_REQUEST_DELETE_SMS_ON_SIM:
@@ -1224,34 +1670,54 @@ static void processRequest(int request, void *data, size_t datalen, RIL_Token t)
 static void onRequest(int request, void *data, size_t datalen, RIL_Token t)
 {
     RILRequest *r;
-    RequestQueue *q = &s_requestQueue;
+    RequestQueue *q;
 
-    if (s_requestQueuePrio.enabled && isPrioRequest(request))
-        q = &s_requestQueuePrio;
+    /* Answer straight away when an identical query is cached or in
+       flight. */
+    if (requestCacheLookup(request, t))
+        return;
 
-    r = malloc(sizeof(RILRequest));  
-    memset(r, 0, sizeof(RILRequest));
+    q = getRequestQueue(request);
+
+    /* Copy the data before taking the lock, dupRequestData may be slow. */
+    data = dupRequestData(request, data, datalen);
+
+    pthread_mutex_lock(&q->queueMutex);
+
+    if (q->freeList != NULL) {
+        r = q->freeList;
+        q->freeList = r->next;
+    } else if (q->poolUsed < RIL_REQUEST_POOL_SIZE) {
+        r = &q->pool[q->poolUsed++];
+    } else {
+        r = malloc(sizeof(RILRequest));
+        if (r == NULL) {
+            pthread_mutex_unlock(&q->queueMutex);
+            LOGE("onRequest: Out of memory, failing %s",
+                 requestToString(request));
+            freeRequestData(request, data, datalen);
+            RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+            return;
+        }
+    }
 
     /* Formulate a RILRequest and put it in the queue. */
     r->request = request;
-    r->data = dupRequestData(request, data, datalen);
+    r->data = data;
     r->datalen = datalen;
     r->token = t;
+    r->next = NULL;
 
-    pthread_mutex_lock(&q->queueMutex);
-
-    /* Queue empty, just throw r on top. */
-    if (q->requestList == NULL) {
+    if (q->requestTail == NULL)
         q->requestList = r;
-    } else {
-        RILRequest *l = q->requestList;
-        while (l->next != NULL)
-            l = l->next;
-
-        l->next = r;
-    }
+    else
+        q->requestTail->next = r;
+    q->requestTail = r;
 
-    pthread_cond_broadcast(&q->cond);
+    /* queueRunner only waits when the request list is empty, and it is
+       the only waiter. */
+    if (q->requestList == r)
+        pthread_cond_signal(&q->cond);
     pthread_mutex_unlock(&q->queueMutex);
 }
 
@@ -1312,6 +1778,9 @@ void setRadioState(RIL_RadioState newState)
 
     pthread_mutex_unlock(&s_state_mutex);
 
+    if (sState != oldState)
+        requestCacheInvalidate(REQUEST_CACHE_ALL);
+
     /* Do these outside of the mutex. */
     if (sState != oldState || sState == RADIO_STATE_SIM_LOCKED_OR_ABSENT) {
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
@@ -1369,19 +1838,138 @@ error:
     return -1;
 }
 
-static char initializeCommon(void)
+/*
+ * Init scripts. Each entry is a complete AT command line; consecutive
+ * entries are joined with ';' into as few command lines as possible
+ * (the way AT+CBST and AT+CHSN always were), and the resulting lines
+ * are pipelined. A line that fails is re-sent one command at a time so
+ * the failing command shows up in the log.
+ */
+#define INIT_ALONE          1  /* Never batch with other commands. */
+#define INIT_IGNORE_ERROR   2  /* Failure is expected on some firmware. */
+
+#define INIT_BATCH_MAX_LEN  128
+
+struct initCommand {
+    const char *command;
+    int flags;
+};
+
+struct initBatch {
+    const struct initCommand *first;
+    size_t count;
+    int err;
+    int success;
+    char line[INIT_BATCH_MAX_LEN + 1];
+};
+
+static void onInitBatchDone(int err, ATResponse *p_response, void *param)
+{
+    struct initBatch *batch = param;
+
+    batch->err = err;
+    batch->success = (err == 0 && p_response->success > 0);
+}
+
+/** Sends the commands of a failed batch separately. */
+static int runInitBatchAlone(const struct initBatch *batch)
 {
+    ATResponse *atresponse = NULL;
+    size_t i;
+    int err;
+
+    for (i = 0; i < batch->count; i++) {
+        const struct initCommand *cmd = &batch->first[i];
+
+        err = at_send_command(cmd->command, &atresponse);
+        if (err < 0)
+            return err;
+
+        if (atresponse->success == 0 && !(cmd->flags & INIT_IGNORE_ERROR))
+            LOGW("Init command %s failed: %s", cmd->command,
+                 atresponse->finalResponse);
+
+        at_response_free(atresponse);
+        atresponse = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * Runs an init script, see above.
+ * Returns 0 on success, AT_ERROR_* if the channel failed.
+ */
+static int runInitScript(const struct initCommand *script, size_t count)
+{
+    struct initBatch batches[count];
+    size_t nbatches = 0;
+    size_t i;
     int err = 0;
 
-    set_pending_hotswap(0);
-    s_e2napState = -1;
-    s_e2napCause = -1;
+    for (i = 0; i < count; i++) {
+        const struct initCommand *cmd = &script[i];
+        struct initBatch *batch = nbatches > 0 ? &batches[nbatches - 1] : NULL;
+        size_t len = strlen(batch != NULL ? batch->line : "");
+
+        /* Append to the open batch as ";+CMD" (the "AT" is dropped). */
+        if (batch != NULL && !(cmd->flags & INIT_ALONE)
+            && !(batch->first->flags & INIT_ALONE)
+            && len + 1 + strlen(cmd->command + 2) <= INIT_BATCH_MAX_LEN) {
+            batch->line[len] = ';';
+            strcpy(batch->line + len + 1, cmd->command + 2);
+            batch->count++;
+            continue;
+        }
 
-    if (at_handshake() < 0) {
-        LOG_FATAL("Handshake failed!");
-        goto error;
+        batch = &batches[nbatches++];
+        batch->first = cmd;
+        batch->count = 1;
+        batch->err = 0;
+        batch->success = 0;
+        strncpy(batch->line, cmd->command, INIT_BATCH_MAX_LEN);
+        batch->line[INIT_BATCH_MAX_LEN] = '\0';
     }
 
+    LOGI("Running %d init commands in %d command lines",
+         (int) count, (int) nbatches);
+
+    for (i = 0; i < nbatches; i++) {
+        err = at_send_command_async(batches[i].line, NO_RESULT, NULL,
+                                    onInitBatchDone, &batches[i]);
+        if (err < 0)
+            break;
+    }
+
+    /* Callbacks point into batches[], always wait for them. */
+    if (at_wait_async() < 0 && err == 0)
+        err = AT_ERROR_GENERIC;
+    if (err < 0)
+        return err;
+
+    for (i = 0; i < nbatches; i++) {
+        if (batches[i].err < 0)
+            return batches[i].err;
+        if (batches[i].success)
+            continue;
+
+        if (batches[i].count == 1) {
+            if (!(batches[i].first->flags & INIT_IGNORE_ERROR))
+                LOGW("Init command %s failed", batches[i].line);
+            continue;
+        }
+
+        LOGW("Init command line %s failed, retrying one by one",
+             batches[i].line);
+        err = runInitBatchAlone(&batches[i]);
+        if (err < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+static const struct initCommand s_initCommon[] = {
     /* Configure/set
      *   command echo (E), result code suppression (Q), DCE response format (V)
      *
@@ -1390,63 +1978,47 @@ static char initializeCommon(void)
      *  Q0 = DCE transmits result codes
      *  V1 = Display verbose result codes
      */
-    err = at_send_command("ATE0Q0V1", NULL);
-    if (err < 0)
-        goto error;
+    { "ATE0Q0V1", 0 },
 
-   /* Set default character set. */
-    err = at_send_command("AT+CSCS=\"UTF-8\"", NULL);
-    if (err < 0)
-        goto error;
+    /* Set default character set. */
+    { "AT+CSCS=\"UTF-8\"", 0 },
 
     /* Disable automatic answer. */
-    err = at_send_command("ATS0=0", NULL);
-    if (err < 0)
-        goto error;
+    { "ATS0=0", 0 },
 
     /* Enable +CME ERROR: <err> result code and use numeric <err> values. */
-    err = at_send_command("AT+CMEE=1", NULL);
-    if (err < 0)
-        goto error;
+    { "AT+CMEE=1", 0 },
 
-    err = at_send_command("AT*E2NAP=1", NULL);
     /* TODO: this command may return CME error */
-    if (err < 0)
-        goto error;
+    { "AT*E2NAP=1", 0 },
 
     /* Try to register for hotswap events. Don't care if it fails. */
-    err = at_send_command("AT*EESIMSWAP=1", NULL);
+    { "AT*EESIMSWAP=1", INIT_ALONE | INIT_IGNORE_ERROR },
 
     /* Enable Connected Line Identification Presentation. */
-    err = at_send_command("AT+COLP=0", NULL);
-    if (err < 0)
-        goto error;
+    { "AT+COLP=0", 0 },
 
     /* Disable Service Reporting. */
-    err = at_send_command("AT+CR=0", NULL);
-    if (err < 0)
-        goto error;
+    { "AT+CR=0", 0 },
 
     /* Configure carrier detect signal - 1 = DCD follows the connection. */
-    err = at_send_command("AT&C=1", NULL);
-    if (err < 0)
-        goto error;
+    { "AT&C=1", 0 },
 
     /* Configure DCE response to Data Termnal Ready signal - 0 = ignore. */
-    err = at_send_command("AT&D=0", NULL);
-    if (err < 0)
-        goto error;
+    { "AT&D=0", 0 },
 
     /* Configure Cellular Result Codes - 0 = Disables extended format. */
-    err = at_send_command("AT+CRC=0", NULL);
-    if (err < 0)
-        goto error;
+    { "AT+CRC=0", 0 },
 
-    /* Configure Bearer Service Type and HSCSD Non-Transparent Call
+    /* Configure Bearer Service Type
      *  +CBST
      *     7 = 9600 bps V.32
      *     0 = Asynchronous connection
      *     1 = Non-transparent connection element
+     */
+    { "AT+CBST=7,0,1", 0 },
+
+    /* Configure HSCSD Non-Transparent Call
      *  +CHSN
      *     1 = Wanted air interface user rate is 9,6 kbits/s
      *     1 = Wanted number of receive timeslots is 1
@@ -1455,17 +2027,28 @@ static char initializeCommon(void)
      *     4 = Indicates that the accepted channel coding for the next
      *         established non-transparent HSCSD call is 9,6 kbit/s only
      */
-    err = at_send_command("AT+CBST=7,0,1;+CHSN=1,1,0,4", NULL);
-    if (err < 0)
-        goto error;
+    { "AT+CHSN=1,1,0,4", 0 },
 
     /* Configure Call progress Monitoring
      *    3 = BUSY result code given if called line is busy. 
      *        No NO DIALTONE result code is given.
      *        Reports line speed together with CONNECT result code.
      */
-    err = at_send_command("ATX3", NULL);
-    if (err < 0)
+    { "ATX3", 0 },
+};
+
+static char initializeCommon(void)
+{
+    set_pending_hotswap(0);
+    s_e2napState = -1;
+    s_e2napCause = -1;
+
+    if (at_handshake() < 0) {
+        LOG_FATAL("Handshake failed!");
+        goto error;
+    }
+
+    if (runInitScript(s_initCommon, NUM_ELEMS(s_initCommon)) < 0)
         goto error;
 
     return 0;
@@ -1473,31 +2056,62 @@ error:
     return 1;
 }
 
-/**
- * Initialize everything that can be configured while we're still in
- * AT+CFUN=0.
+/*
+ * Request class channels only need the response format and error
+ * reporting. The URC enables in s_initCommon are left to the normal and
+ * priority channels, so that an extra port adds no duplicate URCs. The
+ * one exception is the +CREG/+CGREG mode set by onSIMReadyExtraChannel(),
+ * which +CREG?/+CGREG? also answer in.
  */
-static char initializeChannel()
+static const struct initCommand s_initExtraChannel[] = {
+    { "ATE0Q0V1", 0 },
+    { "AT+CSCS=\"UTF-8\"", 0 },
+    { "AT+CMEE=1", 0 },
+};
+
+static char initializeExtraChannel(void)
 {
-    int err;
+    LOGI("initializeExtraChannel()");
 
-    LOGI("initializeChannel()");
+    if (at_handshake() < 0) {
+        LOGE("Handshake failed!");
+        return 1;
+    }
 
-    setRadioState(RADIO_STATE_OFF);
+    if (runInitScript(s_initExtraChannel, NUM_ELEMS(s_initExtraChannel)) < 0)
+        return 1;
+
+    /* Reopened after SIM ready, onSIMReady() will not come again. */
+    if (currentState() == RADIO_STATE_SIM_READY)
+        onSIMReadyExtraChannel(NULL);
 
+    return 0;
+}
+
+static const struct initCommand s_initChannel[] = {
     /* Configure Packet Domain Network Registration Status events
      *    2 = Enable network registration and location information
      *        unsolicited result code
      */
-    err = at_send_command("AT+CGREG=2", NULL);
-    if (err < 0)
-        goto error;
+    { "AT+CGREG=2", 0 },
 
     /* Set phone functionality.
      *    4 = Disable the phone's transmit and receive RF circuits.
      */
-    err = at_send_command("AT+CFUN=4", NULL);
-    if (err < 0)
+    { "AT+CFUN=4", 0 },
+};
+
+/**
+ * Initialize everything that can be configured while we're still in
+ * AT+CFUN=0.
+ */
+static char initializeChannel()
+{
+    LOGI("initializeChannel()");
+
+    setRadioState(RADIO_STATE_OFF);
+
+    if (runInitScript(s_initChannel, NUM_ELEMS(s_initChannel)) < 0)
         goto error;
 
     /* Assume radio is off on error. */
@@ -1511,28 +2125,178 @@ error:
     return 1;
 }
 
+static const struct initCommand s_initPrioChannel[] = {
+    /* Subscribe to ST-Ericsson Pin code event.
+     *   The command requests the MS to report when the PIN code has been
+     *   inserted and accepted.
+     *      1 = Request for report on inserted PIN code is activated (on) 
+     */
+    { "AT*EPEE=1", 0 },
+};
+
 /**
  * Initialize everything that can be configured while we're still in
  * AT+CFUN=0.
  */
 static char initializePrioChannel()
 {
-    int err;
-
     LOGI("initializePrioChannel()");
 
-    /* Subscribe to ST-Ericsson Pin code event.
-     *   The command requests the MS to report when the PIN code has been
-     *   inserted and accepted.
-     *      1 = Request for report on inserted PIN code is activated (on) 
-     */
-    err = at_send_command("AT*EPEE=1", NULL);
-    if (err < 0)
+    if (runInitScript(s_initPrioChannel, NUM_ELEMS(s_initPrioChannel)) < 0)
         return 1;
 
     return 0;
 }
 
+/* Unsolicited handlers, these are registered in s_unsolHandlers below. */
+static void unsolNetworkTime(const char *s, const char *sms_pdu)
+{
+    /* If we're in screen state, we have disabled CREG, but the ETZV
+       will catch those few cases. So we send network state changed as
+       well on NITZ. */
+    requestCacheInvalidate(REQUEST_CACHE_REGISTRATION);
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
+                              NULL, 0);
+
+    onNetworkTimeReceived(s);
+}
+
+static void unsolPinEvent(const char *s, const char *sms_pdu)
+{
+    onSimPinEvent(s);
+}
+
+static void unsolSimStateChanged(const char *s, const char *sms_pdu)
+{
+    onSimStateChanged(s);
+}
+
+static void unsolConnectionStateChanged(const char *s, const char *sms_pdu)
+{
+    onConnectionStateChanged(s);
+}
+
+static void unsolSimHotswap(const char *s, const char *sms_pdu)
+{
+    onSimHotswap(s);
+}
+
+static void unsolCallRing(const char *s, const char *sms_pdu)
+{
+    RIL_onUnsolicitedResponse(RIL_UNSOL_CALL_RING, NULL, 0);
+}
+
+static void unsolCallStateChanged(const char *s, const char *sms_pdu)
+{
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
+                              NULL, 0);
+}
+
+static void unsolNetworkStateChanged(const char *s, const char *sms_pdu)
+{
+/*TODO: If only reporting back network change Android can sometimes hang!!/*/
+    requestCacheInvalidate(REQUEST_CACHE_REGISTRATION);
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
+                              NULL, 0);
+}
+
+static void unsolRegistrationStateChanged(const char *s, const char *sms_pdu)
+{
+    onRegistrationStateChanged(s);
+    unsolNetworkStateChanged(s, sms_pdu);
+}
+
+static void unsolNewSms(const char *s, const char *sms_pdu)
+{
+    onNewSms(sms_pdu);
+}
+
+static void unsolNewBroadcastSms(const char *s, const char *sms_pdu)
+{
+    onNewBroadcastSms(sms_pdu);
+}
+
+static void unsolNewSmsOnSIM(const char *s, const char *sms_pdu)
+{
+    onNewSmsOnSIM(s);
+}
+
+static void unsolNewStatusReport(const char *s, const char *sms_pdu)
+{
+    onNewStatusReport(sms_pdu);
+}
+
+static void unsolSignalStrengthChanged(const char *s, const char *sms_pdu)
+{
+    requestCacheInvalidate(REQUEST_CACHE_SIGNAL);
+    onSignalStrengthChanged(s);
+}
+
+static void unsolSuppServiceNotification(const char *s, const char *sms_pdu)
+{
+    onSuppServiceNotification(s, 0);
+}
+
+static void unsolSuppServiceUnsolicited(const char *s, const char *sms_pdu)
+{
+    onSuppServiceNotification(s, 1);
+}
+
+static void unsolUSSDReceived(const char *s, const char *sms_pdu)
+{
+    onUSSDReceived(s);
+}
+
+static void unsolStkSessionEnd(const char *s, const char *sms_pdu)
+{
+    RIL_onUnsolicitedResponse(RIL_UNSOL_STK_SESSION_END, NULL, 0);
+}
+
+/*
+ * URC name to handler, registered with atchannel before the channels are
+ * opened. Each prefix must hold the complete URC name, see
+ * at_register_unsol_handler().
+ *
+ * +CGEV: is not handled. We could ignore NW CLASS and ME CLASS events,
+ * but right now we don't since extranous
+ * RIL_UNSOL_PDP_CONTEXT_LIST_CHANGED calls are tolerated.
+ */
+static const struct {
+    const char *prefix;
+    ATUnsolHandler handler;
+} s_unsolHandlers[] = {
+    { "*ETZV:", unsolNetworkTime },
+    { "*EPEV", unsolPinEvent },
+    { "*ESIMSR", unsolSimStateChanged },
+    { "*E2NAP:", unsolConnectionStateChanged },
+    { "*EESIMSWAP:", unsolSimHotswap },
+    { "+CRING:", unsolCallRing },
+    { "RING", unsolCallRing },
+    { "NO CARRIER", unsolCallStateChanged },
+    { "+CCWA", unsolCallStateChanged },
+    { "BUSY", unsolCallStateChanged },
+    { "+CREG:", unsolRegistrationStateChanged },
+    { "+CGREG:", unsolNetworkStateChanged },
+    { "+CMT:", unsolNewSms },
+    { "+CBM:", unsolNewBroadcastSms },
+    { "+CMTI:", unsolNewSmsOnSIM },
+    { "+CDS:", unsolNewStatusReport },
+    { "+CIEV: 2", unsolSignalStrengthChanged },
+    { "+CSSI:", unsolSuppServiceNotification },
+    { "+CSSU:", unsolSuppServiceUnsolicited },
+    { "+CUSD:", unsolUSSDReceived },
+    { "*STKEND", unsolStkSessionEnd },
+};
+
+static void registerUnsolHandlers(void)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_ELEMS(s_unsolHandlers); i++)
+        at_register_unsol_handler(s_unsolHandlers[i].prefix,
+                                  s_unsolHandlers[i].handler);
+}
+
 /**
  * Called by atchannel when an unsolicited line appears.
  * This is called on atchannel's reader thread. AT commands may
@@ -1546,63 +2310,7 @@ static void onUnsolicited(const char *s, const char *sms_pdu)
         return;
     }
 
-    if (strStartsWith(s, "*ETZV:")) {
-        /* If we're in screen state, we have disabled CREG, but the ETZV
-           will catch those few cases. So we send network state changed as
-           well on NITZ. */
-        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
-                                  NULL, 0);
-
-        onNetworkTimeReceived(s);
-    } else if (strStartsWith(s, "*EPEV")) {
-        /* Pin event, poll SIM State! */
-        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, NULL, NULL);
-    } else if (strStartsWith(s, "*ESIMSR")) {
-        onSimStateChanged(s);
-    }
-    else if(strStartsWith(s, "*E2NAP:")) {
-        onConnectionStateChanged(s);
-    } else if (strStartsWith(s, "*EESIMSWAP:")) {
-        onSimHotswap(s);
-    }
-    else if (strStartsWith(s, "+CRING:")
-               || strStartsWith(s, "RING")) {
-        RIL_onUnsolicitedResponse(RIL_UNSOL_CALL_RING, NULL, 0);
-    } else if (strStartsWith(s, "NO CARRIER")
-               || strStartsWith(s, "+CCWA")
-               || strStartsWith(s, "BUSY")) {
-        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
-                                  NULL, 0);
-    } else if (strStartsWith(s, "+CREG:")
-	    || strStartsWith(s, "+CGREG:")) {
-/*TODO: If only reporting back network change Android can sometimes hang!!/*/
-        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
-                                  NULL, 0);
-    } else if (strStartsWith(s, "+CMT:")) {
-        onNewSms(sms_pdu);
-    } else if (strStartsWith(s, "+CBM:")) {
-        onNewBroadcastSms(sms_pdu);
-    } else if (strStartsWith(s, "+CMTI:")) {
-        onNewSmsOnSIM(s);
-    } else if (strStartsWith(s, "+CDS:")) {
-        onNewStatusReport(sms_pdu);
-    /* } else if (strStartsWith(s, "+CGEV:")) { */
-    /*     /\* Really, we can ignore NW CLASS and ME CLASS events here, */
-    /*        but right now we don't since extranous */
-    /*        RIL_UNSOL_PDP_CONTEXT_LIST_CHANGED calls are tolerated. *\/ */
-    /*     enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, onPDPContextListChanged, */
-    /*                     NULL, NULL); */
-    } else if (strStartsWith(s, "+CIEV: 2")) {
-	    onSignalStrengthChanged(s);
-    } else if (strStartsWith(s, "+CSSI:")) {
-        onSuppServiceNotification(s, 0);
-    } else if (strStartsWith(s, "+CSSU:")) {
-        onSuppServiceNotification(s, 1);
-    } else if (strStartsWith(s, "+CUSD:")) {
-        onUSSDReceived(s);
-    } else if (strStartsWith(s, "*STKEND")) {
-        RIL_onUnsolicitedResponse(RIL_UNSOL_STK_SESSION_END, NULL, 0);
-    }
+    at_dispatch_unsol(s, sms_pdu);
 }
 
 static void signalCloseQueues(void)
@@ -1666,6 +2374,7 @@ static void onConnectionStateChanged(const char *s)
     pthread_mutex_unlock(&s_e2nap_mutex);
 
     LOGD("onConnectionStateChanged: %s",e2napStateToString(m_state));
+    pdpConnectionStateChanged(m_state);
     if (m_state != E2NAP_ST_CONNECTING)
         enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, onPDPContextListChanged, NULL, NULL);
 
@@ -1674,7 +2383,8 @@ static void onConnectionStateChanged(const char *s)
 
 static void usage(char *s)
 {
-    fprintf(stderr, "usage: %s [-z] [-p <tcp port>] [-d /dev/tty_device] [-x /dev/tty_device] [-i <network interface>]\n", s);
+    fprintf(stderr, "usage: %s [-z] [-p <tcp port>] [-d /dev/tty_device] [-x /dev/tty_device] [-c <class>[,<class>...]:/dev/tty_device] [-i <network interface>[,<network interface>...]]\n", s);
+    fprintf(stderr, "       request classes: sms, sim, network, data\n");
     exit(-1);
 }
 
@@ -1682,6 +2392,7 @@ struct queueArgs {
     int port;
     char * loophost;
     const char *device_path;
+    RequestQueue *queue;
     char isPrio;
     char hasPrio;
 };
@@ -1817,15 +2528,21 @@ static void *queueRunner(void *param)
 		at_set_on_reader_closed(onATReaderClosed);
 		at_set_on_timeout(onATTimeout);
 		
-		q = &s_requestQueue;
+		q = queueArgs->queue;
 		
-		if(initializeCommon()) {
+		if (q != &s_requestQueue && !queueArgs->isPrio) {
+			if (initializeExtraChannel()) {
+				LOGE("queueRunner: Failed to initialize channel!");
+				at_close();
+				continue;
+			}
+		} else if(initializeCommon()) {
 			LOGE("queueRunner: Failed to initialize channel!");
 			at_close();
 			continue;
 		}
 		
-		if (queueArgs->isPrio == 0) {
+		if (q == &s_requestQueue) {
 			q->closed = 0;
 			if (initializeChannel()) {
 				LOGE("queueRunner: Failed to initialize channel!");
@@ -1834,12 +2551,14 @@ static void *queueRunner(void *param)
 			}
 			at_make_default_channel();
 		} else {
-			q = &s_requestQueuePrio;
+			/* Priority or request class channel. */
 			q->closed = 0;
-			at_set_timeout_msec(1000 * 30); 
+			if (queueArgs->isPrio)
+				at_set_timeout_msec(1000 * 30); 
 		}
 		
-		if (queueArgs->hasPrio == 0 || queueArgs->isPrio)
+		if ((q == &s_requestQueue && queueArgs->hasPrio == 0) ||
+		    queueArgs->isPrio)
 			if (initializePrioChannel()) {
 				LOGE("queueRunner: Failed to initialize channel!");
 				at_close();
@@ -1847,13 +2566,15 @@ static void *queueRunner(void *param)
 			}
 		
 		LOGE("queueRunner: Looping the requestQueue!");
+		memset(&q->stats, 0, sizeof(q->stats));
 		for (;;) {
 			RILRequest *r;
-			RILEvent *e;
-			struct timeval tv;
-			struct timespec ts;
-			
-			memset(&ts, 0, sizeof(ts));
+			RILRequest *done = NULL;
+			RILRequest *doneTail = NULL;
+			RILEvent events[RIL_EVENT_BATCH_MAX];
+			unsigned int nevents;
+			unsigned int nrequests;
+			unsigned int i;
 			
 			pthread_mutex_lock(&q->queueMutex);
 			
@@ -1864,15 +2585,15 @@ static void *queueRunner(void *param)
 			}
 			
 			while (q->closed == 0 && q->requestList == NULL && 
-				q->eventList == NULL) {
+				q->eventCount == 0) {
 				pthread_cond_wait(&q->cond,
 						&q->queueMutex);
 			}
 			
-			/* eventList is prioritized, smallest abstime first. */
-			if (q->closed == 0 && q->requestList == NULL && q->eventList) {
+			/* eventHeap is prioritized, smallest abstime first. */
+			if (q->closed == 0 && q->requestList == NULL && q->eventCount) {
 				int err = 0;
-				err = pthread_cond_timedwait(&q->cond, &q->queueMutex, &q->eventList->abstime);
+				err = eventTimedWait(q, &q->eventHeap[0].abstime);
 				if (err && err != ETIMEDOUT)
 					LOGE("queueRunner: timedwait returned unexpected error: %s",
 						strerror(err));
@@ -1883,41 +2604,94 @@ static void *queueRunner(void *param)
 				continue; /* Catch the closed bit at the top of the loop. */
 			}
 			
-			e = NULL;
-			r = NULL;
-			
-			gettimeofday(&tv, NULL);
+			/* Detach everything that is due in one go, and run it
+			   without holding the queue lock. */
+			nevents = eventDetachDue(q, events);
 			
-			/* Saves a macro, uses some stack and clock cycles.
-			   TODO Might want to change this. */
-			ts.tv_sec = tv.tv_sec;
-			ts.tv_nsec = tv.tv_usec * 1000;
+			r = q->requestList;
+			q->requestList = NULL;
+			q->requestTail = NULL;
 			
-			if (q->eventList != NULL &&
-				timespec_cmp(q->eventList->abstime, ts, < )) {
-				e = q->eventList;
-				q->eventList = e->next;
-			}
-			
-			if (q->requestList != NULL) {
-				r = q->requestList;
-				q->requestList = r->next;
-			}
+			if ((unsigned int) q->eventCount > q->stats.maxEventDepth)
+				q->stats.maxEventDepth = q->eventCount;
 			
 			pthread_mutex_unlock(&q->queueMutex);
 			
-			if (e) {
-				e->eventCallback(e->param);
-				free(e);
-			}
+			for (i = 0; i < nevents; i++)
+				events[i].eventCallback(events[i].param);
 			
-			if (r) {
+			nrequests = 0;
+			while (r) {
+				RILRequest *next = r->next;
+				
 				processRequest(r->request, r->data, r->datalen, r->token);
 				freeRequestData(r->request, r->data, r->datalen);
-				free(r);
+				r->next = done;
+				done = r;
+				if (doneTail == NULL)
+					doneTail = r;
+				r = next;
+				nrequests++;
+				
+				/* Unlocked peek, the flag is rechecked under the lock. A
+				   stale read only delays the hand-back by one request. */
+				if (r && q->closed)
+					break;
+				
+				/* Timeouts that fell due during the request run before
+				   the next one rather than after the whole batch. */
+				if (r) {
+					unsigned int n;
+					
+					pthread_mutex_lock(&q->queueMutex);
+					n = eventDetachDue(q, events);
+					pthread_mutex_unlock(&q->queueMutex);
+					
+					for (i = 0; i < n; i++)
+						events[i].eventCallback(events[i].param);
+					nevents += n;
+				}
 			}
+			
+			/* Recycle the finished nodes and hand back any requests left
+			   over by a channel close, both in one lock hold. */
+			if (done || r) {
+				pthread_mutex_lock(&q->queueMutex);
+				if (done) {
+					doneTail->next = q->freeList;
+					q->freeList = done;
+				}
+				if (r) {
+					RILRequest *tail = r;
+					
+					while (tail->next != NULL)
+						tail = tail->next;
+					tail->next = q->requestList;
+					q->requestList = r;
+					if (q->requestTail == NULL)
+						q->requestTail = tail;
+				}
+				pthread_mutex_unlock(&q->queueMutex);
+			}
+			
+			q->stats.wakeups++;
+			q->stats.events += nevents;
+			q->stats.requests += nrequests;
+			if (nevents > q->stats.maxEventBatch)
+				q->stats.maxEventBatch = nevents;
+			if (nrequests > q->stats.maxRequestBatch)
+				q->stats.maxRequestBatch = nrequests;
+			if (nevents + nrequests > 1)
+				LOGD("queueRunner: Batch of %u events and %u requests",
+					nevents, nrequests);
 		}
 		
+		LOGI("queueRunner: %u wakeups ran %u events and %u requests, "
+			"max batch %u events/%u requests, max pending events %u",
+			q->stats.wakeups, q->stats.events, q->stats.requests,
+			q->stats.maxEventBatch, q->stats.maxRequestBatch,
+			q->stats.maxEventDepth);
+		
 		at_close();
 		LOGE("queueRunner: Re-opening after close");
 	}
@@ -1926,6 +2700,43 @@ static void *queueRunner(void *param)
 
 pthread_t s_tid_queueRunner;
 pthread_t s_tid_queueRunnerPrio;
+pthread_t s_tid_queueRunnerExtra[RIL_MAX_EXTRA_CHANNELS];
+
+/**
+ * Parse a "-c <class>[,<class>...]:<device>" argument and give the
+ * classes to extra channel n.
+ *
+ * Returns the device path, or NULL if the argument is malformed.
+ */
+static const char *parseChannelArg(char *arg, int n)
+{
+    char *device;
+    char *name;
+    char *next;
+    int i;
+
+    device = strchr(arg, ':');
+    if (device == NULL || device == arg || device[1] == '\0')
+        return NULL;
+    *device++ = '\0';
+
+    for (name = arg; name != NULL; name = next) {
+        next = strchr(name, ',');
+        if (next != NULL)
+            *next++ = '\0';
+
+        for (i = 0; i < REQUEST_CLASS_COUNT; i++)
+            if (strcmp(name, requestClassNames[i]) == 0)
+                break;
+        if (i == REQUEST_CLASS_COUNT) {
+            LOGE("parseChannelArg: Unknown request class %s", name);
+            return NULL;
+        }
+        s_requestClassQueues[i] = &s_requestQueueExtra[n];
+    }
+
+    return device;
+}
 
 void dummyFunction(void *args)
 {
@@ -1940,15 +2751,18 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
     char *loophost = NULL;
     const char *device_path = NULL;
     const char *priodevice_path = NULL;
+    const char *extradevice_paths[RIL_MAX_EXTRA_CHANNELS];
+    int extraChannels = 0;
     struct queueArgs *queueArgs;
     struct queueArgs *prioQueueArgs;
     pthread_attr_t attr;
+    int i;
 
     s_rilenv = env;
 
     LOGI("RIL_Init: entering...");
 
-    while (-1 != (opt = getopt(argc, argv, "z:i:p:d:s:x:"))) {
+    while (-1 != (opt = getopt(argc, argv, "z:i:p:d:s:x:c:"))) {
         switch (opt) {
             case 'z':
                 loophost = optarg;
@@ -1979,6 +2793,24 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
                 priodevice_path = optarg;
                 LOGI("RIL_Init: Opening priority tty device %s\n", priodevice_path);
                 break;
+
+            case 'c':
+                if (extraChannels == RIL_MAX_EXTRA_CHANNELS) {
+                    LOGE("RIL_Init: Too many channels, max %d -c options",
+                         RIL_MAX_EXTRA_CHANNELS);
+                    usage(argv[0]);
+                    return NULL;
+                }
+                extradevice_paths[extraChannels] =
+                    parseChannelArg(optarg, extraChannels);
+                if (extradevice_paths[extraChannels] == NULL) {
+                    usage(argv[0]);
+                    return NULL;
+                }
+                LOGI("RIL_Init: Opening request class tty device %s\n",
+                     extradevice_paths[extraChannels]);
+                extraChannels++;
+                break;
             default:
                 usage(argv[0]);
                 return NULL;
@@ -1989,6 +2821,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
         LOGI("RIL_Init: Network interface was not supplied, falling back on usb0!");
         ril_iface = strdup("usb0\0");
     }
+    initPDPContexts(ril_iface);
 
     if (port < 0 && device_path == NULL) {
         usage(argv[0]);
@@ -2001,6 +2834,9 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
     queueArgs->device_path = device_path;
     queueArgs->port = port;
     queueArgs->loophost = loophost;
+    queueArgs->queue = &s_requestQueue;
+
+    registerUnsolHandlers();
 
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -2009,6 +2845,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
         prioQueueArgs = malloc(sizeof(struct queueArgs));
         memset(prioQueueArgs, 0, sizeof(struct queueArgs));
         prioQueueArgs->device_path = priodevice_path;
+        prioQueueArgs->queue = &s_requestQueuePrio;
         prioQueueArgs->isPrio = 1;
         prioQueueArgs->hasPrio = 1;
         queueArgs->hasPrio = 1;
@@ -2018,6 +2855,19 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
         pthread_create(&s_tid_queueRunnerPrio, &attr, queueRunner, prioQueueArgs);
     }
 
+    for (i = 0; i < extraChannels; i++) {
+        struct queueArgs *extraQueueArgs = malloc(sizeof(struct queueArgs));
+        memset(extraQueueArgs, 0, sizeof(struct queueArgs));
+        extraQueueArgs->device_path = extradevice_paths[i];
+        extraQueueArgs->queue = &s_requestQueueExtra[i];
+        extraQueueArgs->hasPrio = queueArgs->hasPrio;
+
+        s_requestQueueExtra[i].enabled = 1;
+
+        pthread_create(&s_tid_queueRunnerExtra[i], &attr, queueRunner,
+                       extraQueueArgs);
+    }
+
     pthread_create(&s_tid_queueRunner, &attr, queueRunner, queueArgs);
     
     return &s_callbacks;
@@ -38,14 +38,22 @@ char* ril_iface;
 
 const struct RIL_Env *s_rilenv;
 
-#define RIL_onRequestComplete(t, e, response, responselen) s_rilenv->OnRequestComplete(t,e, response, responselen)
+/* Completions go through the response cache, see u300-ril-cache.c. */
+void requestCacheComplete(RIL_Token t, RIL_Errno e, void *response,
+                          size_t responselen);
+#define RIL_onRequestComplete(t, e, response, responselen) requestCacheComplete(t, e, response, responselen)
 #define RIL_onUnsolicitedResponse(a,b,c) s_rilenv->OnUnsolicitedResponse(a,b,c)
 
 void enqueueRILEvent(int isPrio, void (*callback) (void *param), 
                      void *param, const struct timeval *relativeTime);
+void enqueueRILEventLatest(int isPrio, void (*callback) (void *param),
+                           void *param, const struct timeval *relativeTime);
+void cancelRILEvent(void (*callback) (void *param), void *param);
+int getRequestEventQueue(int request);
 
 #define RIL_EVENT_QUEUE_NORMAL 0
 #define RIL_EVENT_QUEUE_PRIO 1
 #define RIL_EVENT_QUEUE_ALL 2
+#define RIL_EVENT_QUEUE_EXTRA 3    /* + n, request class channel n */
 
 #endif